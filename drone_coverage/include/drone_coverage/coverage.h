@@ -21,6 +21,7 @@
 #define COVERAGE_HEADER
 
 #include "drone_coverage/graph_utils.h"
+#include "drone_coverage/map_grid.h"
 
 #include <iostream>
 #include <vector>
@@ -55,8 +56,8 @@ private:
   ros::Publisher _vis_pub;
   ros::Publisher _waypoints_pub;
 
-  // The pre-loaded octomap and the collection of 3d points
-  octomap::OcTree* _octomap;
+  // The pre-loaded map and the collection of 3d points
+  MapGrid _map;
   octomap::OcTree* _covered;
   double _octomap_resolution;
 
@@ -101,6 +102,9 @@ private:
 
   // Callbacks
   void octomapCallback(const octomap_msgs::OctomapConstPtr& msg);
+  // Build the map grid from a deserialized octree, which is deleted, and initialize from it
+  bool loadOctomap(octomap::AbstractOcTree* abstract);
+  void initializeFromMap();
   void ogmCallback(const nav_msgs::OccupancyGridConstPtr& msg);
 
 public:
@@ -114,7 +118,7 @@ public:
 
   void calculateOrthogonalCoverage();
   void calculateCircularCoverage();
-  float evaluateCoverage(octomap::OcTree* octomap, octomap::OcTree* covered);
+  float evaluateCoverage(const MapGrid& map, octomap::OcTree* covered);
   float calculateOccupiedVolume(octomap::OcTree* octomap);
 
   void findNeighbors(int root);
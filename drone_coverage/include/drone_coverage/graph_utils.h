@@ -36,6 +36,8 @@
 #include <boost/graph/dijkstra_shortest_paths.hpp>
 #include <boost/graph/astar_search.hpp>
 
+#include "drone_coverage/map_grid.h"
+
 namespace drone_coverage
 {
 // Boost Graph typedefs
@@ -53,7 +55,7 @@ typedef std::pair<double, double> Point_xy;
 // Functions
 Graph generateGraph(ros::NodeHandle nh, std::vector<Point_xy> points);
 std::vector<Point_xy> calculateOptimalPath(ros::NodeHandle nh, Graph graph, std::vector<Point_xy> points,
-                                           octomap::OcTree* octomap);
+                                           const MapGrid& map);
 std::vector<Point_xy> reorderPoints(std::vector<Point_xy> points, std::vector<int> order);
 double calculateCost(Graph graph, std::vector<int> order, std::vector<vertex_descriptor> p, std::vector<double> d);
 
@@ -61,7 +63,7 @@ double getRandomNumber(double i, double j);
 double getProbability(double difference, double temperature);
 std::vector<int> getNextOrder(std::vector<int> order, int first_index, int second_index);
 
-bool checkIfVisible(const octomap::point3d view_point, const octomap::point3d point_to_test, octomap::OcTree* octomap);
+bool checkIfVisible(const octomap::point3d view_point, const octomap::point3d point_to_test, const MapGrid& map);
 
 double distanceXY(const Point_xy i, const Point_xy j);
 
@@ -0,0 +1,93 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MAP_GRID_HEADER
+#define MAP_GRID_HEADER
+
+#include <string>
+
+#include <ros/ros.h>
+
+#include <octomap/octomap.h>
+
+#include <particle_filter/MapCache.h>
+#include <particle_filter/SharedMap.h>
+
+namespace drone_coverage
+{
+/**
+ * Read-only occupancy of the map for the coverage queries, on particle_filter's dense grid (MapCache).
+ * With the shared map the grid is queried in place in the shared memory, so there is no private copy of the map.
+ * Otherwise the grid is built once from the octree (map file or octomap_server), and the octree is released.
+ * Unknown cells are treated as free, as octomap's castRay with ignoreUnknown.
+ */
+class MapGrid
+{
+private:
+  SharedMap _shared_map;
+  MapCache _built;
+  const MapCache* _cache;
+
+  // MapCache::CellState of a cell, UNKNOWN outside of the grid
+  uint8_t cellState(long x, long y, long z) const;
+  // Occupied cell with a free or unknown 6-neighbour
+  bool isSurfaceCell(long x, long y, long z) const;
+
+public:
+  MapGrid();
+
+  // Attach to the map that particle_filter's map_publisher keeps in shared memory, waiting until there is one
+  bool attachShared(ros::NodeHandle nh, const std::string& name);
+  // Build the grid from a ColorOcTree or an OcTree, the tree is deleted in any case
+  bool build(octomap::AbstractOcTree* tree);
+
+  bool isLoaded() const
+  {
+    return _cache != NULL;
+  }
+
+  double getResolution() const;
+  void getMetricMin(double& x, double& y, double& z) const;
+  void getMetricMax(double& x, double& y, double& z) const;
+
+  bool isOccupied(const octomap::point3d& point) const;
+
+  /**
+   * Cast a ray to the first occupied cell within max_range
+   * @param end center of the occupied cell, or the end of the ray if there is none
+   */
+  bool castRay(const octomap::point3d& origin, const octomap::point3d& direction, octomap::point3d& end,
+               double max_range) const;
+
+  // True if no occupied cell lies between the two points, except for the cell of point_to_test
+  bool isVisible(const octomap::point3d& view_point, const octomap::point3d& point_to_test) const;
+
+  // Normal of the surface at an occupied point, from a plane fit to the nearby surface cells
+  bool getNormal(const octomap::point3d& point, octomap::point3d& normal) const;
+
+  /**
+   * Volume of the occupied cells with their center between min_z and max_z. A cell is left out when its next
+   * neighbour along x or y is occupied and the one after it is unknown, that is probably noise of the mapping.
+   */
+  float occupiedVolume(double min_z, double max_z) const;
+};
+
+}  // namespace drone_coverage
+
+#endif
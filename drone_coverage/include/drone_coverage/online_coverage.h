@@ -26,6 +26,7 @@
 #include <ros/ros.h>
 
 #include "drone_gazebo/Float64Stamped.h"
+#include "drone_coverage/map_grid.h"
 
 #include <octomap_msgs/Octomap.h>
 #include <octomap/octomap.h>
@@ -52,8 +53,8 @@ private:
   ros::Publisher _percentage_pub;
   ros::Publisher _volume_pub;
 
-  // The pre-loaded octomap and the collection of 3d points
-  octomap::OcTree* _octomap;
+  // The pre-loaded map and the covered surface
+  MapGrid _map;
   octomap::ColorOcTree* _covered;
   double _octomap_resolution;
   float _octomap_volume;
@@ -74,6 +75,9 @@ private:
 
   // Callbacks
   void octomapCallback(const octomap_msgs::OctomapConstPtr& msg);
+  // Build the map grid from a deserialized octree, which is deleted, and initialize from it
+  bool loadOctomap(octomap::AbstractOcTree* abstract);
+  void initializeFromMap();
   void poseCallback(const geometry_msgs::PoseStampedConstPtr& msg);
 
 public:
@@ -84,7 +88,6 @@ public:
   void calculateCircularCoverage(const geometry_msgs::Pose);
 
   float calculateOccupiedVolume(octomap::ColorOcTree* octomap);
-  float calculateOccupiedVolume(octomap::OcTree* octomap);
   void publishCoveredSurface();
   void publishPercentage();
 };
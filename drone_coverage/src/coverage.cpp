@@ -31,7 +31,23 @@ Coverage::Coverage()
 
   _ogm = new nav_msgs::OccupancyGrid();
 
-  _map_sub = _nh.subscribe<octomap_msgs::Octomap>("/octomap_binary", 1, &Coverage::octomapCallback, this);
+  // Use the shared map or read the map file directly if given, otherwise wait for octomap_server
+  std::string map_file, shared_map_name;
+  bool shared_map;
+  _nh.param<std::string>("/map_file", map_file, "");
+  _nh.param<bool>("/shared_map/enabled", shared_map, false);
+  _nh.param<std::string>("/shared_map/name", shared_map_name, "/drone_map");
+  if (shared_map)
+  {
+    if (_map.attachShared(_nh, shared_map_name))
+      initializeFromMap();
+    else
+      ROS_ERROR("Could not attach to the shared map %s\n", shared_map_name.c_str());
+  }
+  else if (map_file.empty())
+    _map_sub = _nh.subscribe<octomap_msgs::Octomap>("/octomap_binary", 1, &Coverage::octomapCallback, this);
+  else if (!loadOctomap(MapCache::readMapFile(map_file)))
+    ROS_ERROR("Could not read the map from %s\n", map_file.c_str());
   _ogm_sub = _nh.subscribe<nav_msgs::OccupancyGrid>("/projected_map", 1, &Coverage::ogmCallback, this);
 
   _covered_pub = _nh.advertise<octomap_msgs::Octomap>("/covered_surface", 1);
@@ -108,7 +124,7 @@ Coverage::Coverage()
     calculateCircularCoverage();
 
   // Find the covered surface of the waypoints left after post process
-  ROS_INFO("%f%% of the surface will be covered\n", evaluateCoverage(_octomap, _covered));
+  ROS_INFO("%f%% of the surface will be covered\n", evaluateCoverage(_map, _covered));
 
   // Publish the points as an Octomap
   publishCoveredSurface();
@@ -119,7 +135,7 @@ Coverage::Coverage()
   _graph = generateGraph(_nh, _xy_points);
 
   // Apply a hill-climbing algorithm to find the best combination of the waypoints
-  _xy_points = calculateOptimalPath(_nh, _graph, _xy_points, _octomap);
+  _xy_points = calculateOptimalPath(_nh, _graph, _xy_points, _map);
 
   // Go back from Point_xy to Pose6D elements
   std::string method;
@@ -140,8 +156,6 @@ Coverage::Coverage()
 
 Coverage::~Coverage()
 {
-  if (_octomap != NULL)
-    delete _octomap;
   if (_covered != NULL)
     delete _covered;
   if (_ogm != NULL)
@@ -151,32 +165,34 @@ Coverage::~Coverage()
 void Coverage::octomapCallback(const octomap_msgs::OctomapConstPtr& msg)
 {
   // Load octomap msg
-  octomap::AbstractOcTree* abstract = octomap_msgs::msgToMap(*msg);
-  if (abstract)
-  {
-    octomap::ColorOcTree* coloroctree = dynamic_cast<octomap::ColorOcTree*>(abstract);
-    _octomap = reinterpret_cast<octomap::OcTree*>(coloroctree);
+  loadOctomap(octomap_msgs::msgToMap(*msg));
+}
 
-    if (_octomap == NULL)
-    {
-      ROS_WARN("Octomap message does not contain an OcTree\n");
-      return;
-    }
-    else
-    {
-      ROS_INFO("Octomap successfully loaded\n");
-      _octomap->expand();  // bbx work currently only with expanded tree
-    }
-  }
-  else
+bool Coverage::loadOctomap(octomap::AbstractOcTree* abstract)
+{
+  if (!abstract)
   {
     ROS_WARN("Could not deserialize message to OcTree");
-    return;
+    return false;
   }
 
-  _octomap->getMetricMin(_min_bounds[0], _min_bounds[1], _min_bounds[2]);
-  _octomap->getMetricMax(_max_bounds[0], _max_bounds[1], _max_bounds[2]);
-  _octomap_resolution = _octomap->getResolution();
+  // Only the occupancy grid is kept, the queries do not need the tree
+  if (!_map.build(abstract))
+  {
+    ROS_WARN("Octomap message does not contain an OcTree\n");
+    return false;
+  }
+  ROS_INFO("Octomap successfully loaded\n");
+
+  initializeFromMap();
+  return true;
+}
+
+void Coverage::initializeFromMap()
+{
+  _map.getMetricMin(_min_bounds[0], _min_bounds[1], _min_bounds[2]);
+  _map.getMetricMax(_max_bounds[0], _max_bounds[1], _max_bounds[2]);
+  _octomap_resolution = _map.getResolution();
 
   _octomap_loaded = 1;
 
@@ -217,8 +233,7 @@ void Coverage::calculateWaypoints()
         // *excluded* /
 
         // Check if is occupied node in octomap
-        octomap::OcTreeNode* node = _octomap->search(_sensor_position);
-        if (node != NULL && _octomap->isNodeOccupied(node))
+        if (_map.isOccupied(_sensor_position))
         {
           // Next point in x
           _sensor_position.x() = proceedOneStep(_sensor_position.x());
@@ -230,7 +245,7 @@ void Coverage::calculateWaypoints()
         for (double safe_check = -M_PI; safe_check <= M_PI; safe_check += M_PI / 8)
         {
           octomap::point3d direction(1, 1, 0);  // combination of x and y
-          if (_octomap->castRay(_sensor_position, direction.rotate_IP(0, 0, safe_check), wall_point, true, 2))
+          if (_map.castRay(_sensor_position, direction.rotate_IP(0, 0, safe_check), wall_point, 2))
           {
             if (_sensor_position.distance(wall_point) < _uav_safety_offset)
             {
@@ -393,8 +408,8 @@ void Coverage::calculateOrthogonalCoverage()
         octomap::point3d direction(_rfid_direction_x, _rfid_direction_y, _rfid_direction_z);
 
         // Get every point on the direction vector that belongs to the FOV
-        bool ray_success = _octomap->castRay(_points.at(i).trans(), direction.rotate_IP(0, vertical, horizontal),
-                                             wall_point, true, _rfid_range);
+        bool ray_success =
+            _map.castRay(_points.at(i).trans(), direction.rotate_IP(0, vertical, horizontal), wall_point, _rfid_range);
 
         // Ground elimination
         if (wall_point.z() < _min_obstacle_height || wall_point.z() > _max_obstacle_height)
@@ -430,8 +445,8 @@ void Coverage::calculateCircularCoverage()
         octomap::point3d direction(_rfid_direction_x, _rfid_direction_y, _rfid_direction_z);
 
         // Get every point on the direction vector that belongs to the FOV
-        bool ray_success = _octomap->castRay(_points.at(i).trans(), direction.rotate_IP(0, vertical, horizontal),
-                                             wall_point, true, _rfid_range);
+        bool ray_success =
+            _map.castRay(_points.at(i).trans(), direction.rotate_IP(0, vertical, horizontal), wall_point, _rfid_range);
 
         // Make the coverage circular, cut the points that are larger than the range==radius
         if (_points.at(i).trans().distance(wall_point) > _rfid_range)
@@ -451,9 +466,9 @@ void Coverage::calculateCircularCoverage()
   }
 }
 
-float Coverage::evaluateCoverage(octomap::OcTree* octomap, octomap::OcTree* covered)
+float Coverage::evaluateCoverage(const MapGrid& map, octomap::OcTree* covered)
 {
-  float octomap_volume = calculateOccupiedVolume(octomap);
+  float octomap_volume = map.occupiedVolume(_min_obstacle_height, _max_obstacle_height);
   ROS_INFO("octomap volume %f [m^3]\n", octomap_volume);
   float covered_volume = calculateOccupiedVolume(covered);
   ROS_INFO("covered volume %f [m^3]\n", covered_volume);
@@ -534,7 +549,7 @@ void Coverage::findNeighbors(int root)
       if (distance < 0.75 * _rfid_range)
       {
         // Check visibility
-        if (checkIfVisible(_points.at(root).trans(), _points.at(i).trans(), _octomap))
+        if (checkIfVisible(_points.at(root).trans(), _points.at(i).trans(), _map))
         {
           _discovered_nodes.at(i) = 1;
           // Call the funcion recursively
@@ -573,8 +588,7 @@ bool Coverage::findBestYaw(octomap::point3d sensor_position, double& best_yaw)
 
     // Find the normal vector on the wall
     // Get every point on the direction vector
-    bool ray_success =
-        _octomap->castRay(sensor_position, direction.rotate_IP(0, 0, yaw), wall_point, true, _rfid_range);
+    bool ray_success = _map.castRay(sensor_position, direction.rotate_IP(0, 0, yaw), wall_point, _rfid_range);
 
     if (ray_success)
     {
@@ -598,43 +612,14 @@ bool Coverage::findBestYaw(octomap::point3d sensor_position, double& best_yaw)
 double Coverage::findCoverage(const octomap::point3d& wall_point, const octomap::point3d& direction)
 {
   double coverage;
-  std::vector<octomap::point3d> normals;
-  octomap::point3d normal = direction;
+  octomap::point3d normal;
 
-  if (_octomap->getNormals(wall_point, normals, false))
+  // The normal of the surface from the occupied cells around the wall point
+  if (_map.getNormal(wall_point, normal))
   {
-    ROS_DEBUG("MC algorithm gives %zu normals in voxel at (%f, %f, %f)\n", normals.size(), wall_point.x(),
+    ROS_DEBUG("Normal (%f, %f, %f) in voxel at (%f, %f, %f)\n", normal.x(), normal.y(), normal.z(), wall_point.x(),
               wall_point.y(), wall_point.z());
-    // There is a chance of having zero normal vectors. This usually happens in a surface.
-    // To deal with it, we suppose that the nearby nodes are on the same surface, and we try to find the normal vector
-    // of a neighbor node
-    // Starting with a small bounding box and expanding, as we are not able to find any normal vectors
-    while (normals.size() == 0)
-    {
-      octomap::point3d offset_to_check(1, 1, 1);
-      for (octomap::OcTree::leaf_bbx_iterator
-               it = _octomap->begin_leafs_bbx(wall_point - offset_to_check, wall_point + offset_to_check),
-               end = _octomap->end_leafs_bbx();
-           it != end; ++it)
-      {
-        octomap::point3d new_wall_point = it.getCoordinate();
-        _octomap->getNormals(new_wall_point, normals, false);
-        if (normals.size() == 0)
-          offset_to_check *= 2;
-        else
-          break;
-      }
-    }
-
-    // Find the mean
-    for (unsigned i = 0; i < normals.size(); ++i)
-    {
-      normal += normals[i];
-    }
-    // Normalize it
-    normal /= normals.size();
-    octomap::point3d unit_vector = normal.normalized();
-    coverage = unit_vector.dot(direction.normalized());
+    coverage = normal.normalized().dot(direction.normalized());
   }
   else
   {
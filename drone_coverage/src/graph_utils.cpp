@@ -66,7 +66,7 @@ Graph generateGraph(ros::NodeHandle nh, std::vector<Point_xy> points)
 }
 
 std::vector<Point_xy> calculateOptimalPath(ros::NodeHandle nh, Graph graph, std::vector<Point_xy> points,
-                                           octomap::OcTree* octomap)
+                                           const MapGrid& map)
 {
   ROS_INFO("Calculating the optimal path....\n");
   // Better use int vector, than Pose6D
@@ -126,7 +126,7 @@ std::vector<Point_xy> calculateOptimalPath(ros::NodeHandle nh, Graph graph, std:
         octomath::Vector3 view_point(points.at(current_node).first, points.at(current_node).second, 1);
         octomath::Vector3 point_to_test(points.at(current_node + 1).first, points.at(current_node + 1).second, 1);
 
-        if (near_distance <= desired_distance && checkIfVisible(view_point, point_to_test, octomap))
+        if (near_distance <= desired_distance && checkIfVisible(view_point, point_to_test, map))
         {
           current_node = current_node + 1;
           continue;
@@ -144,7 +144,7 @@ std::vector<Point_xy> calculateOptimalPath(ros::NodeHandle nh, Graph graph, std:
         octomath::Vector3 view_point(points.at(current_node).first, points.at(current_node).second, 1);
         octomath::Vector3 point_to_test(points.at(current_node - 1).first, points.at(current_node - 1).second, 1);
 
-        if (near_distance <= desired_distance && checkIfVisible(view_point, point_to_test, octomap))
+        if (near_distance <= desired_distance && checkIfVisible(view_point, point_to_test, map))
         {
           current_node = current_node - 1;
           continue;
@@ -172,7 +172,7 @@ std::vector<Point_xy> calculateOptimalPath(ros::NodeHandle nh, Graph graph, std:
         octomath::Vector3 view_point(points.at(current_node).first, points.at(current_node).second, 1);
         octomath::Vector3 point_to_test(points.at(random_node).first, points.at(random_node).second, 1);
 
-        if (new_distance < distance && checkIfVisible(view_point, point_to_test, octomap))
+        if (new_distance < distance && checkIfVisible(view_point, point_to_test, map))
         {
           distance = new_distance;
           next_node = random_node;
@@ -252,28 +252,10 @@ std::vector<int> getNextOrder(std::vector<int> order, int first_index, int secon
   return order;
 }
 
-bool checkIfVisible(const octomap::point3d view_point, const octomap::point3d point_to_test, octomap::OcTree* octomap)
+bool checkIfVisible(const octomap::point3d view_point, const octomap::point3d point_to_test, const MapGrid& map)
 {
-  // Get all nodes in a line
-  octomap::KeyRay key_ray;
-
-  octomap->computeRayKeys(view_point, point_to_test, key_ray);
-
-  const octomap::OcTreeKey& point_to_test_key = octomap->coordToKey(point_to_test);
-
-  // Now check if there are any unknown or occupied nodes in the ray,
-  // except for the point_to_test key.
-  for (octomap::OcTreeKey key : key_ray)
-  {
-    if (key != point_to_test_key)
-    {
-      octomap::OcTreeNode* node = octomap->search(key);
-
-      if (node != NULL && octomap->isNodeOccupied(node))
-        return false;
-    }
-  }
-  return true;
+  // No occupied node on the line, except for the one of point_to_test
+  return map.isVisible(view_point, point_to_test);
 }
 
 }  // namespace drone_coverage
@@ -0,0 +1,218 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+
+#include <Eigen/Eigenvalues>
+
+#include "drone_coverage/map_grid.h"
+
+namespace drone_coverage
+{
+// Truncation of the distance field of a grid built here, it only lets the rays skip free space
+const float MAX_DISTANCE = 2.0;
+
+MapGrid::MapGrid() : _cache(NULL)
+{
+}
+
+bool MapGrid::attachShared(ros::NodeHandle nh, const std::string& name)
+{
+  std::string error;
+  while (nh.ok() && !_shared_map.attach(name, error))
+  {
+    ROS_INFO_ONCE("Waiting for the shared map %s.......\n", name.c_str());
+    ros::Duration(0.1).sleep();
+  }
+  if (!_shared_map.cache().isValid())
+    return false;
+
+  _cache = &_shared_map.cache();
+  ROS_INFO("Using generation %lu of the shared map %s in place\n", (unsigned long)_shared_map.generation(),
+           name.c_str());
+  return true;
+}
+
+bool MapGrid::build(octomap::AbstractOcTree* tree)
+{
+  std::string error = "no octree";
+  bool built = false;
+  if (octomap::ColorOcTree* color_tree = dynamic_cast<octomap::ColorOcTree*>(tree))
+    built = _built.build(*color_tree, 0, MAX_DISTANCE, "", error);
+  else if (octomap::OcTree* occupancy_tree = dynamic_cast<octomap::OcTree*>(tree))
+    built = _built.build(*occupancy_tree, 0, MAX_DISTANCE, "", error);
+  else if (tree)
+    error = tree->getTreeType() + " is not an occupancy octree";
+  delete tree;
+
+  if (!built)
+  {
+    ROS_WARN("Could not build the map grid: %s\n", error.c_str());
+    return false;
+  }
+  _cache = &_built;
+  ROS_INFO("Map grid of %u x %u x %u cells, %.2f MB\n", _built.sizeX(), _built.sizeY(), _built.sizeZ(),
+           _built.byteSize() / 1048576.0);
+  return true;
+}
+
+double MapGrid::getResolution() const
+{
+  return _cache->resolution();
+}
+
+void MapGrid::getMetricMin(double& x, double& y, double& z) const
+{
+  x = _cache->origin(0);
+  y = _cache->origin(1);
+  z = _cache->origin(2);
+}
+
+void MapGrid::getMetricMax(double& x, double& y, double& z) const
+{
+  x = _cache->origin(0) + _cache->size(0) * _cache->resolution();
+  y = _cache->origin(1) + _cache->size(1) * _cache->resolution();
+  z = _cache->origin(2) + _cache->size(2) * _cache->resolution();
+}
+
+uint8_t MapGrid::cellState(long x, long y, long z) const
+{
+  if (x < 0 || y < 0 || z < 0 || x >= long(_cache->sizeX()) || y >= long(_cache->sizeY()) ||
+      z >= long(_cache->sizeZ()))
+    return MapCache::UNKNOWN;
+  return _cache->cellState(_cache->index(x, y, z));
+}
+
+bool MapGrid::isSurfaceCell(long x, long y, long z) const
+{
+  if (cellState(x, y, z) != MapCache::OCCUPIED)
+    return false;
+  return cellState(x - 1, y, z) != MapCache::OCCUPIED || cellState(x + 1, y, z) != MapCache::OCCUPIED ||
+         cellState(x, y - 1, z) != MapCache::OCCUPIED || cellState(x, y + 1, z) != MapCache::OCCUPIED ||
+         cellState(x, y, z - 1) != MapCache::OCCUPIED || cellState(x, y, z + 1) != MapCache::OCCUPIED;
+}
+
+bool MapGrid::isOccupied(const octomap::point3d& point) const
+{
+  uint32_t x, y, z;
+  return _cache->worldToCell(point.x(), point.y(), point.z(), x, y, z) &&
+         _cache->cellState(_cache->index(x, y, z)) == MapCache::OCCUPIED;
+}
+
+bool MapGrid::castRay(const octomap::point3d& origin, const octomap::point3d& direction, octomap::point3d& end,
+                      double max_range) const
+{
+  float range;
+  uint32_t cell[3];
+  if (_cache->castRay(origin.x(), origin.y(), origin.z(), direction.x(), direction.y(), direction.z(), max_range,
+                      range, cell))
+  {
+    double x, y, z;
+    _cache->cellToWorld(cell[0], cell[1], cell[2], x, y, z);
+    end = octomap::point3d(x, y, z);
+    return true;
+  }
+
+  end = origin + direction.normalized() * max_range;
+  return false;
+}
+
+bool MapGrid::isVisible(const octomap::point3d& view_point, const octomap::point3d& point_to_test) const
+{
+  // The ray stops at the cell of point_to_test, that one may be occupied
+  octomap::point3d direction = point_to_test - view_point;
+  float range;
+  uint32_t cell[3], target[3];
+  if (!_cache->castRay(view_point.x(), view_point.y(), view_point.z(), direction.x(), direction.y(), direction.z(),
+                       direction.norm(), range, cell))
+    return true;
+  return _cache->worldToCell(point_to_test.x(), point_to_test.y(), point_to_test.z(), target[0], target[1],
+                             target[2]) &&
+         std::equal(cell, cell + 3, target);
+}
+
+bool MapGrid::getNormal(const octomap::point3d& point, octomap::point3d& normal) const
+{
+  uint32_t cell[3];
+  if (!_cache->worldToCell(point.x(), point.y(), point.z(), cell[0], cell[1], cell[2]) ||
+      _cache->cellState(_cache->index(cell[0], cell[1], cell[2])) != MapCache::OCCUPIED)
+    return false;
+
+  // The normal is the direction of least spread of the surface cells around the point, the neighbourhood grows
+  // until they span a plane
+  for (long radius = 2; radius <= 4; radius++)
+  {
+    Eigen::Vector3d sum = Eigen::Vector3d::Zero();
+    Eigen::Matrix3d products = Eigen::Matrix3d::Zero();
+    int count = 0;
+    for (long dz = -radius; dz <= radius; dz++)
+      for (long dy = -radius; dy <= radius; dy++)
+        for (long dx = -radius; dx <= radius; dx++)
+        {
+          if (!isSurfaceCell(cell[0] + dx, cell[1] + dy, cell[2] + dz))
+            continue;
+          Eigen::Vector3d offset(dx, dy, dz);
+          sum += offset;
+          products += offset * offset.transpose();
+          count++;
+        }
+    if (count < 3)
+      continue;
+
+    Eigen::Vector3d mean = sum / count;
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(products / count - mean * mean.transpose());
+    // Cells along a line do not define a plane
+    if (solver.eigenvalues()(1) < 0.01)
+      continue;
+
+    Eigen::Vector3d least = solver.eigenvectors().col(0);
+    normal = octomap::point3d(least.x(), least.y(), least.z());
+    return true;
+  }
+  return false;
+}
+
+float MapGrid::occupiedVolume(double min_z, double max_z) const
+{
+  const double resolution = _cache->resolution();
+  const float cell_volume = resolution * resolution * resolution;
+  float vol_occ = 0;
+  for (long z = 0; z < long(_cache->sizeZ()); z++)
+  {
+    double center_z = _cache->origin(2) + (z + 0.5) * resolution;
+    if (center_z < min_z || center_z > max_z)
+      continue;
+
+    for (long y = 0; y < long(_cache->sizeY()); y++)
+      for (long x = 0; x < long(_cache->sizeX()); x++)
+      {
+        if (_cache->cellState(_cache->index(x, y, z)) != MapCache::OCCUPIED)
+          continue;
+
+        // [1] -> [2] -> [3] along x, then y: if [2] is occupied and [3] unknown, [1] is probably noise
+        bool exclude = (cellState(x + 1, y, z) == MapCache::OCCUPIED && cellState(x + 2, y, z) == MapCache::UNKNOWN) ||
+                       (cellState(x, y + 1, z) == MapCache::OCCUPIED && cellState(x, y + 2, z) == MapCache::UNKNOWN);
+        if (!exclude)
+          vol_occ += cell_volume;
+      }
+  }
+  return vol_occ;
+}
+
+}  // namespace drone_coverage
@@ -25,8 +25,8 @@ OnlineCoverage::OnlineCoverage()
 {
   ROS_INFO("Coverage object created\n");
   _octomap_loaded = 0;
+  _covered = NULL;
 
-  _map_sub = _nh.subscribe<octomap_msgs::Octomap>("/octomap_binary", 1, &OnlineCoverage::octomapCallback, this);
   _pose_sub = _nh.subscribe("/amcl_pose", 1000, &OnlineCoverage::poseCallback, this);
 
   _covered_pub = _nh.advertise<octomap_msgs::Octomap>("/octomap_covered", 1000);
@@ -48,12 +48,29 @@ OnlineCoverage::OnlineCoverage()
   // Adjust values
   _rfid_hfov = (_rfid_hfov / 180.0) * M_PI;
   _rfid_vfov = (_rfid_vfov / 180.0) * M_PI;
+
+  // After the obstacle heights, they bound the volume of the map.
+  // Use the shared map or read the map file directly if given, otherwise wait for octomap_server
+  std::string map_file, shared_map_name;
+  bool shared_map;
+  _nh.param<std::string>("/map_file", map_file, "");
+  _nh.param<bool>("/shared_map/enabled", shared_map, false);
+  _nh.param<std::string>("/shared_map/name", shared_map_name, "/drone_map");
+  if (shared_map)
+  {
+    if (_map.attachShared(_nh, shared_map_name))
+      initializeFromMap();
+    else
+      ROS_ERROR("Could not attach to the shared map %s\n", shared_map_name.c_str());
+  }
+  else if (map_file.empty())
+    _map_sub = _nh.subscribe<octomap_msgs::Octomap>("/octomap_binary", 1, &OnlineCoverage::octomapCallback, this);
+  else if (!loadOctomap(MapCache::readMapFile(map_file)))
+    ROS_ERROR("Could not read the map from %s\n", map_file.c_str());
 }
 
 OnlineCoverage::~OnlineCoverage()
 {
-  if (_octomap != NULL)
-    delete _octomap;
   if (_covered != NULL)
     delete _covered;
 }
@@ -61,31 +78,33 @@ OnlineCoverage::~OnlineCoverage()
 void OnlineCoverage::octomapCallback(const octomap_msgs::OctomapConstPtr& msg)
 {
   // Load octomap msg
-  octomap::AbstractOcTree* abstract = octomap_msgs::msgToMap(*msg);
-  if (abstract)
-  {
-    octomap::ColorOcTree* coloroctree = dynamic_cast<octomap::ColorOcTree*>(abstract);
-    _octomap = reinterpret_cast<octomap::OcTree*>(coloroctree);
+  loadOctomap(octomap_msgs::msgToMap(*msg));
+}
 
-    if (_octomap == NULL)
-    {
-      ROS_WARN("Octomap message does not contain an OcTree\n");
-      return;
-    }
-    else
-    {
-      ROS_INFO("Octomap successfully loaded\n");
-      _octomap->expand();  // bbx work currently only with expanded tree
-    }
-  }
-  else
+bool OnlineCoverage::loadOctomap(octomap::AbstractOcTree* abstract)
+{
+  if (!abstract)
   {
     ROS_WARN("Could not deserialize message to OcTree");
-    return;
+    return false;
+  }
+
+  // Only the occupancy grid is kept, the queries do not need the tree
+  if (!_map.build(abstract))
+  {
+    ROS_WARN("Octomap message does not contain an OcTree\n");
+    return false;
   }
+  ROS_INFO("Octomap successfully loaded\n");
 
-  _octomap_resolution = _octomap->getResolution();
-  _octomap_volume = calculateOccupiedVolume(_octomap);
+  initializeFromMap();
+  return true;
+}
+
+void OnlineCoverage::initializeFromMap()
+{
+  _octomap_resolution = _map.getResolution();
+  _octomap_volume = _map.occupiedVolume(_min_obstacle_height, _max_obstacle_height);
 
   // Now that we have the resolution we can initialize the new octomap
   _covered = new octomap::ColorOcTree(_octomap_resolution);
@@ -124,7 +143,7 @@ void OnlineCoverage::calculateOrthogonalCoverage(const geometry_msgs::Pose pose)
       // direction at which we are facing the point
       octomap::point3d direction(_rfid_direction_x, _rfid_direction_y, _rfid_direction_z);
 
-      if (_octomap->castRay(position, direction.rotate_IP(0, vertical, horizontal), wall_point, true, _rfid_range))
+      if (_map.castRay(position, direction.rotate_IP(0, vertical, horizontal), wall_point, _rfid_range))
       {
         // Ground elimination
         if (wall_point.z() < _min_obstacle_height || wall_point.z() > _max_obstacle_height)
@@ -158,7 +177,7 @@ void OnlineCoverage::calculateCircularCoverage(const geometry_msgs::Pose pose)
       // direction at which we are facing the point
       octomap::point3d direction(_rfid_direction_x, _rfid_direction_y, _rfid_direction_z);
 
-      if (_octomap->castRay(position, direction.rotate_IP(0, vertical, horizontal), wall_point, true, _rfid_range))
+      if (_map.castRay(position, direction.rotate_IP(0, vertical, horizontal), wall_point, _rfid_range))
       {
         // Ground elimination
         if (wall_point.z() < _min_obstacle_height || wall_point.z() > _max_obstacle_height)
@@ -218,59 +237,6 @@ float OnlineCoverage::calculateOccupiedVolume(octomap::ColorOcTree* octomap)
   return vol_occ;
 }
 
-float OnlineCoverage::calculateOccupiedVolume(octomap::OcTree* octomap)
-{
-  float vol_occ = 0;
-  double bbxMinX, bbxMinY, bbxMinZ, bbxMaxX, bbxMaxY, bbxMaxZ;
-  octomap->getMetricMax(bbxMaxX, bbxMaxY, bbxMaxZ);
-  octomap->getMetricMin(bbxMinX, bbxMinY, bbxMinZ);
-
-  octomap::point3d min(bbxMinX, bbxMinY, bbxMinZ);
-  octomap::point3d max(bbxMaxX, bbxMaxY, bbxMaxZ);
-
-  if (octomap)
-  {  // can be NULL
-    for (octomap::OcTree::leaf_bbx_iterator it = octomap->begin_leafs_bbx(min, max), end = octomap->end_leafs_bbx();
-         it != end; ++it)
-    {
-      bool exclude = 0;  // variable to be set if a node should not be included in volume estimation
-
-      if (it.getCoordinate().z() < _min_obstacle_height || it.getCoordinate().z() > _max_obstacle_height)
-        continue;
-
-      if (octomap->isNodeOccupied(*it))
-      // occupied leaf node
-      {
-        // i: 0 checking for x-axis neighbors
-        // i: 1 checking for y-axis neighbors
-        // [1] -> [2]] -> [3] ---> if all nodes are occupied it is probably an obstacle
-        // if the [3] is unknown, it is probably noise from the octomap
-        octomap::OcTreeKey key = it.getKey();
-        for (int i = 0; i <= 1; i++)
-        {
-          octomap::OcTreeKey first_neighbor_key = key;
-          first_neighbor_key[i] += 1;
-          octomap::OcTreeNode* first_node = octomap->search(first_neighbor_key);
-          if (first_node != NULL && octomap->isNodeOccupied(first_node))
-          {
-            octomap::OcTreeKey second_neighbor_key = key;
-            second_neighbor_key[i] += 2;
-            octomap::OcTreeNode* second_node = octomap->search(second_neighbor_key);
-            if (second_node == NULL)
-            {
-              exclude = 1;
-              break;
-            }
-          }
-        }
-        if (!exclude)
-          vol_occ += it.getSize() * it.getSize() * it.getSize();
-      }
-    }
-  }
-  return vol_occ;
-}
-
 void OnlineCoverage::publishPercentage()
 {
   float covered_volume = calculateOccupiedVolume(_covered);
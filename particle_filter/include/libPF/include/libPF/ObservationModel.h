@@ -47,6 +47,15 @@ class ObservationModel {
      */
     virtual double measure(const StateType& state) const = 0;
 
+    /**
+     * Likelihood of the last measurement, that the filter averages over time to detect a failure of the
+     * localization (see ParticleFilter::setRecovery()). Models whose weights are products of a varying number
+     * of factors (e.g. beams) should return a likelihood per factor, so that the averages stay comparable.
+     * @param meanWeight mean of the weights returned by measure() for the last measurement.
+     * @return the likelihood, meanWeight by default.
+     */
+    virtual double measurementLikelihood(double meanWeight) const;
+
   private:
 
 };
@@ -55,6 +64,11 @@ template <class StateType>
 ObservationModel<StateType>::~ObservationModel() {
 }
 
+template <class StateType>
+double ObservationModel<StateType>::measurementLikelihood(double meanWeight) const {
+    return meanWeight;
+}
+
 } // end of namespace
 #endif
 
@@ -1,5 +1,7 @@
 #ifndef PARTICLEFILTER_H
 #define PARTICLEFILTER_H  
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <ctime> // for time measurement
 #include <cassert>
@@ -187,6 +189,14 @@ class ParticleFilter {
      */
     unsigned int numParticles() const;
 
+    /**
+     * Changes the number of particles. Removed particles are the last ones, i.e. the lightest ones after a
+     * measurement. Added particles are copies of the first ones, every copy gets an equal share of the weight
+     * of its original. The weights are normalized afterwards.
+     * @param numParticles New number of particles, has to be greater than 0.
+     */
+    void setNumParticles(unsigned int numParticles);
+
     /**
      * @param os new observation model
      */
@@ -250,6 +260,50 @@ class ParticleFilter {
      */
     void drawAllFromDistribution(const StateDistribution<StateType>& distribution);
 
+    /**
+     * Enables the recovery of augmented MCL: measure() keeps a long-term (slow) and a short-term (fast)
+     * exponential average of the measurement likelihood (see ObservationModel::measurementLikelihood()).
+     * When the short-term average falls below the long-term one, e.g. after a kidnapping or a divergence,
+     * resample() replaces max(0, 1 - fast / slow) of the particles by states drawn from the distribution.
+     * A resampling is then done even if the number of effective particles is high (except with
+     * RESAMPLE_NEVER).
+     * @param alphaSlow decay rate of the long-term average, 0 < alphaSlow << alphaFast.
+     * @param alphaFast decay rate of the short-term average, alphaFast <= 1.
+     * @param distribution distribution to draw the injected particles from (e.g. uniform over the map), NULL
+     *        to disable the recovery. Be sure that it is valid while the recovery is enabled!
+     */
+    void setRecovery(double alphaSlow, double alphaFast, const StateDistribution<StateType>* distribution);
+
+    /**
+     * Forgets the likelihood averages, e.g. when the particles were drawn again. drawAllFromDistribution()
+     * calls it.
+     */
+    void resetLikelihoodAverages();
+
+    /**
+     * @return Number of particles that the next resampling will draw from the recovery distribution.
+     */
+    unsigned int getNumRecoveryParticles() const;
+
+    /**
+     * @return Number of particles drawn from the recovery distribution by the last resampling.
+     */
+    unsigned int getNumInjectedParticles() const;
+
+    /**
+     * @return Long-term and short-term averages of the measurement likelihood, 0 before the first measurement.
+     */
+    double getSlowLikelihoodAverage() const;
+    double getFastLikelihoodAverage() const;
+
+    /**
+     * @return Wall time (s) of the stages of the last filter() call: resampling (0 if none), drift and
+     * diffusion, measurement (including sorting and normalization).
+     */
+    double getResampleTime() const;
+    double getMotionTime() const;
+    double getMeasureTime() const;
+
     /**
      * Resets the filter timer. Call this function after pausing the filter
      * to avoid a drift step with a high delta t.
@@ -297,6 +351,13 @@ class ParticleFilter {
      * @return Pointer to the state of particle at index particleNo.
      */
     const StateType& getState(unsigned int particleNo) const;
+
+    /**
+     * Replaces the state of the particle with given index, its weight is kept.
+     * @param particleNo Index of particle
+     * @param state New state of the particle
+     */
+    void setState(unsigned int particleNo, const StateType& state);
   
     /**
      * Returns the "mean" state, i.e. the sum of the weighted states. You can use this only if you implemented operator*(double) and
@@ -321,6 +382,8 @@ class ParticleFilter {
      * The higher the weight of a particle, the more particles are drawn (copied) from this particle.
      * The weight remains untouched, because measure() will be called afterwards.
      * This method only works on a sorted m_CurrentList, therefore sort() is called first.
+     * With the recovery enabled (see setRecovery()), the last particles (the copies of the lightest ones) are
+     * then replaced by states drawn from the recovery distribution.
      */
     void resample();
 
@@ -338,7 +401,8 @@ class ParticleFilter {
     void diffuse(double dt);
 
     /**
-     * This method assigns weights to the particles using the observation model of the particle filter.
+     * This method assigns weights to the particles using the observation model of the particle filter,
+     * and updates the averages of the measurement likelihood.
      */
     virtual void measure();
 
@@ -402,6 +466,20 @@ class ParticleFilter {
     // Stores which resampling mode is set, default is ResamplingMode::RESAMPLE_NEFF
     ResamplingMode m_ResamplingMode;
 
+    // Recovery (augmented MCL): distribution of the injected particles (NULL if disabled), decay rates and
+    // averages of the measurement likelihood (0 : no measurement yet)
+    const StateDistribution<StateType>* m_RecoveryDistribution;
+    double m_AlphaSlow;
+    double m_AlphaFast;
+    double m_SlowLikelihood;
+    double m_FastLikelihood;
+    unsigned int m_NumInjected;
+
+    // Wall time of the stages of the last filter() call
+    double m_ResampleTime;
+    double m_MotionTime;
+    double m_MeasureTime;
+
 
 };
 
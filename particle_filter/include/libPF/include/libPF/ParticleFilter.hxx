@@ -9,7 +9,16 @@ ParticleFilter<StateType>::ParticleFilter(unsigned int numParticles, Observation
     m_MovementModel(ms),
     m_ResamplingStrategy(&m_DefaultResamplingStrategy),
     m_FirstRun(true),
-    m_ResamplingMode(RESAMPLE_NEFF)
+    m_ResamplingMode(RESAMPLE_NEFF),
+    m_RecoveryDistribution(NULL),
+    m_AlphaSlow(0.0),
+    m_AlphaFast(0.0),
+    m_SlowLikelihood(0.0),
+    m_FastLikelihood(0.0),
+    m_NumInjected(0),
+    m_ResampleTime(0.0),
+    m_MotionTime(0.0),
+    m_MeasureTime(0.0)
 {
 
   assert(numParticles > 0);
@@ -47,6 +56,37 @@ unsigned int ParticleFilter<StateType>::numParticles() const {
   return m_NumParticles;
 }
 
+template <class StateType>
+void ParticleFilter<StateType>::setNumParticles(unsigned int numParticles) {
+  assert(numParticles > 0);
+  unsigned int oldNum = m_NumParticles;
+  if (numParticles == oldNum) {
+    return;
+  }
+  for (unsigned int i = numParticles; i < oldNum; i++) {
+    delete m_CurrentList[i];
+    delete m_LastList[i];
+  }
+  m_CurrentList.resize(numParticles);
+  m_LastList.resize(numParticles);
+  // added particle i copies particle i % oldNum: the first ones have one more copy
+  for (unsigned int i = oldNum; i < numParticles; i++) {
+    m_CurrentList[i] = new Particle<StateType>(m_CurrentList[i % oldNum]->getState(), 0.0);
+    m_LastList[i] = new Particle<StateType>(StateType(), 0.0);
+  }
+  if (numParticles > oldNum) {
+    for (unsigned int i = 0; i < oldNum; i++) {
+      unsigned int copies = numParticles / oldNum + (i < numParticles % oldNum ? 1 : 0);
+      double weight = m_CurrentList[i]->getWeight() / copies;
+      for (unsigned int j = i; j < numParticles; j += oldNum) {
+        m_CurrentList[j]->setWeight(weight);
+      }
+    }
+  }
+  m_NumParticles = numParticles;
+  normalize();
+}
+
 template <class StateType>
 void ParticleFilter<StateType>::setObservationModel(ObservationModel<StateType>* os) {
     m_ObservationModel = os;
@@ -103,6 +143,59 @@ void ParticleFilter<StateType>::drawAllFromDistribution(const StateDistribution<
     {
         (*iter)->setState(distribution.draw());
     }
+    resetLikelihoodAverages();
+}
+
+template <class StateType>
+void ParticleFilter<StateType>::setRecovery(double alphaSlow, double alphaFast, const StateDistribution<StateType>* distribution) {
+    m_AlphaSlow = alphaSlow;
+    m_AlphaFast = alphaFast;
+    m_RecoveryDistribution = distribution;
+}
+
+template <class StateType>
+void ParticleFilter<StateType>::resetLikelihoodAverages() {
+    m_SlowLikelihood = 0.0;
+    m_FastLikelihood = 0.0;
+}
+
+template <class StateType>
+unsigned int ParticleFilter<StateType>::getNumRecoveryParticles() const {
+    if (m_RecoveryDistribution == NULL || m_SlowLikelihood <= 0.0) {
+        return 0;
+    }
+    double ratio = std::max(0.0, 1.0 - m_FastLikelihood / m_SlowLikelihood);
+    return std::min(static_cast<unsigned int>(ratio * m_NumParticles + 0.5), m_NumParticles);
+}
+
+template <class StateType>
+unsigned int ParticleFilter<StateType>::getNumInjectedParticles() const {
+    return m_NumInjected;
+}
+
+template <class StateType>
+double ParticleFilter<StateType>::getSlowLikelihoodAverage() const {
+    return m_SlowLikelihood;
+}
+
+template <class StateType>
+double ParticleFilter<StateType>::getFastLikelihoodAverage() const {
+    return m_FastLikelihood;
+}
+
+template <class StateType>
+double ParticleFilter<StateType>::getResampleTime() const {
+    return m_ResampleTime;
+}
+
+template <class StateType>
+double ParticleFilter<StateType>::getMotionTime() const {
+    return m_MotionTime;
+}
+
+template <class StateType>
+double ParticleFilter<StateType>::getMeasureTime() const {
+    return m_MeasureTime;
 }
 
 template <class StateType>
@@ -112,8 +205,12 @@ void ParticleFilter<StateType>::resetTimer() {
 
 template <class StateType>
 void ParticleFilter<StateType>::filter(double dt) {
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+    m_NumInjected = 0;
     if (m_ResamplingMode == RESAMPLE_NEFF) {
-        if (getNumEffectiveParticles() < m_NumParticles / 2) {
+        // particles to inject also need a resampling
+        if (getNumEffectiveParticles() < m_NumParticles / 2 || getNumRecoveryParticles() > 0) {
             resample();
         }
     } else if (m_ResamplingMode == RESAMPLE_ALWAYS) {
@@ -131,9 +228,14 @@ void ParticleFilter<StateType>::filter(double dt) {
         dt = ((double)currentTime - (double)m_LastDriftTime) / CLOCKS_PER_SEC;
         m_LastDriftTime = currentTime;
     }
+    Clock::time_point resampled = Clock::now();
     drift(dt);
     diffuse(dt);
+    Clock::time_point moved = Clock::now();
     measure();
+    m_ResampleTime = std::chrono::duration<double>(resampled - start).count();
+    m_MotionTime = std::chrono::duration<double>(moved - resampled).count();
+    m_MeasureTime = std::chrono::duration<double>(Clock::now() - moved).count();
 }
 
 template <class StateType>
@@ -148,6 +250,12 @@ const StateType& ParticleFilter<StateType>::getState(unsigned int particleNo) co
     return m_CurrentList[particleNo]->getState();
 }
 
+template <class StateType>
+void ParticleFilter<StateType>::setState(unsigned int particleNo, const StateType& state) {
+    assert(particleNo < m_NumParticles);
+    m_CurrentList[particleNo]->setState(state);
+}
+
 template <class StateType>
 double ParticleFilter<StateType>::getWeight(unsigned int particleNo) const {
     assert(particleNo < m_NumParticles);
@@ -167,8 +275,9 @@ void ParticleFilter<StateType>::normalize() {
     for (iter = m_CurrentList.begin(); iter != m_CurrentList.end(); ++iter) {
         weightSum += (*iter)->getWeight();
     }
-    // only normalize if weightSum is big enough to devide
-    if (weightSum > m_NumParticles * std::numeric_limits<double>::epsilon()) {
+    // only normalize if weightSum is big enough to devide (the weights of a lost filter can be tiny but still
+    // have to be normalized, resampling relies on it)
+    if (weightSum > std::numeric_limits<double>::min()) {
         double factor = 1.0 / weightSum;
         for (iter = m_CurrentList.begin(); iter != m_CurrentList.end(); ++iter) {
             double newWeight = (*iter)->getWeight() * factor;
@@ -185,6 +294,12 @@ void ParticleFilter<StateType>::resample() {
   m_CurrentList.swap(m_LastList);
   // call resampling strategy
   m_ResamplingStrategy->resample(m_LastList, m_CurrentList);
+
+  // the last particles are the copies of the lightest ones
+  m_NumInjected = getNumRecoveryParticles();
+  for (unsigned int i = m_NumParticles - m_NumInjected; i < m_NumParticles; i++) {
+    m_CurrentList[i]->setState(m_RecoveryDistribution->draw());
+  }
 }
 
 
@@ -204,10 +319,23 @@ void ParticleFilter<StateType>::diffuse(double dt) {
 
 template <class StateType>
 void ParticleFilter<StateType>::measure() {
+  double weightSum = 0.0;
   for (unsigned int i = 0; i < m_NumParticles; i++) {
     // apply observation model
     double weight = m_ObservationModel->measure(m_CurrentList[i]->getState());
     m_CurrentList[i]->setWeight(weight);
+    weightSum += weight;
+  }
+  if (m_RecoveryDistribution != NULL) {
+    double likelihood = m_ObservationModel->measurementLikelihood(weightSum / m_NumParticles);
+    // the first measurement starts both averages
+    if (m_SlowLikelihood <= 0.0) {
+      m_SlowLikelihood = likelihood;
+      m_FastLikelihood = likelihood;
+    } else {
+      m_SlowLikelihood += m_AlphaSlow * (likelihood - m_SlowLikelihood);
+      m_FastLikelihood += m_AlphaFast * (likelihood - m_FastLikelihood);
+    }
   }
   // after measurement we have to re-sort and normalize the particles
   sort();
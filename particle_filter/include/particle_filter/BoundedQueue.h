@@ -0,0 +1,116 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+/**
+ * @class BoundedQueue
+ * @brief Queue between two threads that never blocks the producer: when it is full, the oldest item is dropped.
+ *
+ * With a capacity of 1 the consumer always gets the latest item.
+ */
+template <class T>
+class BoundedQueue
+{
+public:
+  explicit BoundedQueue(std::size_t capacity) : _capacity(std::max<std::size_t>(capacity, 1)), _closed(false)
+  {
+  }
+
+  /**
+   * Add an item, dropping the oldest one if the queue is full
+   * @return false if an item was dropped
+   */
+  bool push(const T& item)
+  {
+    bool dropped = false;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_items.size() >= _capacity)
+      {
+        _items.pop_front();
+        dropped = true;
+      }
+      _items.push_back(item);
+    }
+    _condition.notify_one();
+    return !dropped;
+  }
+
+  /**
+   * Wait for an item
+   * @return false once the queue is closed
+   */
+  bool pop(T& item)
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _condition.wait(lock, [this] { return _closed || !_items.empty(); });
+    if (_closed)
+      return false;
+    item = _items.front();
+    _items.pop_front();
+    return true;
+  }
+
+  /**
+   * Take an item without waiting
+   * @return false if the queue is empty or closed
+   */
+  bool tryPop(T& item)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_closed || _items.empty())
+      return false;
+    item = _items.front();
+    _items.pop_front();
+    return true;
+  }
+
+  // Wake up and stop the consumers
+  void close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _closed = true;
+    }
+    _condition.notify_all();
+  }
+
+  std::size_t size() const
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _items.size();
+  }
+
+private:
+  std::size_t _capacity;
+  bool _closed;
+  std::deque<T> _items;
+  mutable std::mutex _mutex;
+  std::condition_variable _condition;
+};
+
+#endif
@@ -0,0 +1,118 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DEADLINECONTROLLER_H
+#define DEADLINECONTROLLER_H
+
+#include <stdint.h>
+
+/**
+ * @class DeadlineController
+ * @brief Chooses the beams and the particles of the filter steps so that they end within a deadline.
+ *
+ * The step time is modelled as overhead + particles * (particleCost + beams * beamCost), the costs being averaged
+ * from the measured stage times of the previous steps (the larger of the average and the last step, so that a slow
+ * step is reacted to at once). The overhead, the part of the step that does not depend on the particles
+ * (preparation, recovery, publishing), is only averaged and taken off the budget: a spike of it is not blamed on
+ * the particles. Beams are given up first, down to minBeams, then particles, down to minParticles; they come back
+ * in the reverse order, and more slowly than they go.
+ */
+class DeadlineController
+{
+public:
+  struct Parameters
+  {
+    // Step time budget (s), and the fraction of it that the settings aim at
+    double deadline;
+    double targetRatio;
+    unsigned int minBeams;
+    unsigned int minParticles;
+    unsigned int maxParticles;
+    // Weight of the last step in the averaged costs, in (0, 1]
+    double smoothing;
+
+    // Defaults of the node parameters
+    Parameters();
+  };
+
+  // Measured filter step
+  struct Step
+  {
+    double stepTime;
+    // Parts of stepTime spent measuring the particles (raycasting), and resampling and moving them
+    double measureTime;
+    double particleTime;
+    unsigned int particles;
+    // Beams evaluated, and beams of the observation
+    unsigned int beams;
+    unsigned int availableBeams;
+  };
+
+  explicit DeadlineController(const Parameters& params);
+
+  /**
+   * Account for a step and choose the settings of the next one
+   * @return true if the settings changed
+   */
+  bool update(const Step& step);
+
+  const Parameters& getParameters() const
+  {
+    return _params;
+  }
+
+  // Beam budget of the next step, 0 : all the beams
+  unsigned int beams() const;
+  unsigned int particles() const
+  {
+    return _particles;
+  }
+
+  // Step time predicted for the settings (s)
+  double predictedStepTime() const
+  {
+    return _predicted;
+  }
+
+  uint64_t steps() const
+  {
+    return _steps;
+  }
+  // Steps longer than the deadline
+  uint64_t misses() const
+  {
+    return _misses;
+  }
+
+private:
+  Parameters _params;
+  unsigned int _beams;
+  unsigned int _particles;
+  unsigned int _availableBeams;
+  // Averaged time per particle outside of the measurement, and per beam of a particle (s), 0 before a step
+  double _particleCost;
+  double _beamCost;
+  // Averaged time of the step outside of the particle filter (s)
+  double _overhead;
+  double _predicted;
+  uint64_t _steps;
+  uint64_t _misses;
+};
+
+#endif
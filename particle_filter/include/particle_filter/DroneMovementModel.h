@@ -22,45 +22,41 @@
 
 #include <libPF/MovementModel.h>
 
-#include "particle_filter/DroneState.h"
-
-#include <geometry_msgs/PoseStamped.h>
-#include <geometry_msgs/TransformStamped.h>
-#include <nav_msgs/Odometry.h>
-
-#include <tf2_ros/transform_listener.h>
-#include <tf2_ros/transform_broadcaster.h>
-#include <tf2/LinearMath/Transform.h>
-#include <tf2_geometry_msgs/tf2_geometry_msgs.h>
-#include <tf2_ros/message_filter.h>
-#include <tf2/LinearMath/Matrix3x3.h>
+#include <Eigen/Geometry>
 
-#include <tf/transform_listener.h>
-#include <tf/transform_datatypes.h>
-
-// Message Filters
-#include <message_filters/subscriber.h>
+#include "particle_filter/DroneState.h"
 
-class RandomNumberGenerator;
+namespace libPF
+{
+class RandomNumberGenerationStrategy;
+}
 
 /**
  * @class DroneMovementModel
  *
  * @brief Test class for ParticleFilter.
  *
- * This movement model propagates a drone state according to the translation and
- * rotation speed.
+ * This movement model propagates a drone state with the odometry motion of its base, and diffuses it with a
+ * gaussian noise.
  *
  * @author Stephan Wirth
  */
 class DroneMovementModel : public libPF::MovementModel<DroneState>
 {
 public:
+  // Standard deviations of the diffusion, per second
+  struct Parameters
+  {
+    double xStdDev, yStdDev, zStdDev;
+    double rollStdDev, pitchStdDev, yawStdDev;
+    // 4-DOF mode: only x, y, z and yaw are estimated, roll and pitch are those of setOdomPoses()/setAttitude()
+    bool fourDof;
+  };
+
   /**
    * Constructor
    */
-  DroneMovementModel(ros::NodeHandle* nh, tf2_ros::Buffer* tfBuffer, const std::string& worldFrameID,
-                     const std::string& baseFootprintID, const std::string& baseLinkID);
+  explicit DroneMovementModel(const Parameters& params);
 
   /**
    * Destructor
@@ -68,7 +64,7 @@ public:
   ~DroneMovementModel();
 
   /**
-   * The drift method propagates the car using its speed.
+   * The drift method moves the state by the odometry motion of setOdomTransform().
    * @param state Pointer to the state that has to be manipulated.
    */
   void drift(DroneState& state, double dt) const;
@@ -80,6 +76,21 @@ public:
    */
   void diffuse(DroneState& state, double dt) const;
 
+  /**
+   * Odometry motion of the base since the last step (last odometry pose ^-1 * current odometry pose), applied
+   * to every particle in its own frame by drift()
+   */
+  void setOdomTransform(const Eigen::Isometry3d& odomTransform);
+
+  /**
+   * Odometry poses of the last and the current step. In 4-DOF mode, drift() moves every particle by the motion
+   * in the heading frame (yaw only) of the last pose and gives it the roll and pitch of the current pose.
+   */
+  void setOdomPoses(const Eigen::Isometry3d& lastOdomPose, const Eigen::Isometry3d& odomPose);
+
+  // 4-DOF mode: roll and pitch given to the particles by drift(), e.g. from the IMU
+  void setAttitude(double roll, double pitch);
+
   // param d new standard deviation for the diffusion of x
   void setXStdDev(double d);
 
@@ -116,47 +127,20 @@ public:
   // param return the standard deviation for the diffusion of yaw
   double getYawStdDev() const;
 
-  // param odom new odometry pose
-  void setLastOdomPose(geometry_msgs::PoseStamped& odomPose);
-
-  // Reset movement model
-  void reset();
-
-  /// get the last stored odomPose
-  /// returns false when there is no valid previous pose stored
-  geometry_msgs::PoseStamped getLastOdomPose() const;
-
-  // param currentPose, the current pose that the transform will be applied
-  geometry_msgs::TransformStamped computeOdomTransform(geometry_msgs::PoseStamped& currentPose) const;
-
-  // param odomTransform, the transform will be applied to statePose
-  void applyOdomTransform(geometry_msgs::TransformStamped& odomTransform, geometry_msgs::Pose& statePose) const;
-
-  /// look up the odom pose at a certain time through tf
-  bool lookupOdomPose(ros::Time const& t, geometry_msgs::PoseStamped& pose) const;
-
-  /// looks up the odometry pose at time t and then calls computeOdomTransform()
-  bool lookupOdomTransform(const ros::Time& t, geometry_msgs::TransformStamped& odomTransform) const;
-
-  //  Find the transform between base->target in TF Frame tree
-  bool lookupTargetToBaseTransform(std::string const& targetFrame, ros::Time const& t,
-                                   geometry_msgs::TransformStamped& localTransform) const;
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 
 protected:
 private:
   /// Stores the random number generator
   libPF::RandomNumberGenerationStrategy* m_RNG;
 
-  bool _odometryReceived;
+  Eigen::Isometry3d _odomTransform;
 
-  std::string _worldFrameID;
-  std::string _baseFootprintFrameID;
-  std::string _baseLinkFrameID;
-
-  tf2_ros::Buffer* _tfBuffer;
-  tf2_ros::TransformListener* _tfListener;
-
-  geometry_msgs::PoseStamped _lastOdomPose;
+  bool _fourDof;
+  // 4-DOF motion: translation in the heading frame, yaw change, and the attitude after it
+  Eigen::Vector3d _headingMotion;
+  double _yawMotion;
+  double _roll, _pitch;
 
   // Store the standard deviations of the model
   double _XStdDev;
@@ -165,14 +149,6 @@ private:
   double _RollStdDev;
   double _PitchStdDev;
   double _YawStdDev;
-
-  // Initial position which will be used as the center of the Gaussian Distribution
-  double _xMean;
-  double _yMean;
-  double _zMean;
-  double _rollMean;
-  double _pitchMean;
-  double _yawMean;
 };
 
 #endif
@@ -21,20 +21,40 @@
 #define DRONEOBSERVATIONMODEL_H
 
 #include <vector>
+#include <unordered_map>
 #include <libPF/ObservationModel.h>
 
-#include "particle_filter/DroneState.h"
-#include <particle_filter/MapModel.h>
-
-#include <tf2/LinearMath/Transform.h>
-#include <tf2_eigen/tf2_eigen.h>
-#include <tf2_geometry_msgs/tf2_geometry_msgs.h>
+#include <Eigen/Geometry>
 
-#include <tf/transform_datatypes.h>
+#include "particle_filter/DroneState.h"
+#include "particle_filter/MapView.h"
+#include "particle_filter/Observation.h"
 
-#include <pcl/point_cloud.h>
-#include <pcl/common/transforms.h>
-#include <pcl/point_types.h>
+/**
+ * Counters of the last measurement update, reset in setObservedMeasurements()
+ */
+struct ObservationStats
+{
+  unsigned int particlesMeasured;
+  // Particles that were abandoned before all beams were evaluated
+  unsigned int particlesTerminated;
+  unsigned int raycastsPerformed;
+  unsigned int raycastsSkipped;
+  // Largest upper bound of weight(terminated) / weight(best) that was accepted
+  double maxDiscardedWeightRatio;
+  // Sum of these bounds, i.e. the approximated weight mass relative to the best particle
+  double discardedWeightBound;
+  // Particles whose weight was taken from the pose bin cache
+  unsigned int cacheHits;
+  // Sum of the log-likelihoods of the measured particles, and beams of the observation (max range included)
+  double logLikelihoodSum;
+  unsigned int beamsObserved;
+  // Largest log-likelihood, and sum of the likelihoods relative to it, that do not underflow
+  double maxLogLikelihood;
+  double relativeLikelihoodSum;
+  // Particles whose height was too far from the measured one to be raycasted
+  unsigned int particlesGated;
+};
 
 /**
  * @class DroneObservationModel
@@ -50,10 +70,32 @@
 class DroneObservationModel : public libPF::ObservationModel<DroneState>
 {
 public:
-  /**
-   * empty
-   */
-  DroneObservationModel(ros::NodeHandle* nh, std::shared_ptr<MapModel> _mapModel);
+  struct Parameters
+  {
+    // Beam model mixture (Probabilistic Robotics, 6.3)
+    double zHit, zShort, zRand, zMax;
+    double sigmaHit, lambdaShort;
+    double minRange, maxRange;
+
+    // Stop raycasting a particle once its weight cannot reach earlyTerminationRatio (in (0, 1)) times the weight
+    // of the best particle of the update
+    bool earlyTermination;
+    double earlyTerminationRatio;
+
+    // Particles in the same pose bin (m, rad) share one weight evaluation per observation
+    bool weightCache;
+    double cacheXYZBin, cacheAngleBin;
+
+    // Height sensor: Gaussian likelihood (sigma, m) of the measured height against the height field of the map,
+    // particles further than heightGate (m) from it are not raycasted
+    bool heightGating;
+    double heightSigma, heightGate;
+
+    // Defaults of the node parameters
+    Parameters();
+  };
+
+  DroneObservationModel(const Parameters& params, const MapView& map);
 
   /**
    * empty
@@ -67,18 +109,87 @@ public:
    */
   double measure(const DroneState& state) const;
 
-  void setMap(const std::shared_ptr<octomap::ColorOcTree>& map);
+  // Mean likelihood of the particles per beam (geometric mean over the beams), for the recovery of the filter
+  double measurementLikelihood(double meanWeight) const;
 
-  void setBaseToSensorTransform(const tf2::Transform& baseToSensorTF);
+  void setMap(const MapView& map);
 
-  void setObservedMeasurements(pcl::PointCloud<pcl::PointXYZ> const& observed, std::vector<float> const& ranges);
+  // Beams and sensor transforms of the next measurement update
+  void setObservedMeasurements(const Observation& observation);
+
+  // Evaluate at most this many beams of the next observations (0 : all), a prefix of the coarse to fine order
+  void setMaxBeams(unsigned int maxBeams);
+
+  const ObservationStats& getStats() const;
 
 protected:
 private:
-  std::shared_ptr<octomap::ColorOcTree> _map;
-  tf2::Transform _baseToSensorTransform;
-  std::vector<float> _observedRanges;
-  pcl::PointCloud<pcl::PointXYZ> _observedMeasurement;
+  /**
+   * One observed beam with the terms of the mixture model that depend only on the observed range
+   */
+  struct ObservedBeam
+  {
+    // Endpoint in the frame of its sensor
+    float x, y, z;
+    unsigned int sensor;
+    float range;
+    // z_short + z_rand part, the same for every particle
+    double constant;
+  };
+
+  // Order the beams so that every prefix spreads over the whole field of view
+  void computeBeamOrder(const Observation& observation, std::vector<unsigned int>& order) const;
+
+  // Tabulate the z_hit Gaussian over the quantized range error
+  void computeHitTable();
+
+  // z_hit part of the model for a range error z
+  inline double hitProbability(float z) const;
+
+  // Raycast all the beams for a state and return the log of its weight
+  double computeLogWeight(const DroneState& state) const;
+
+  /**
+   * Log-likelihood of the measured height for a state, 0 without a height measurement or a surface below it
+   * @return false if the height is outside the gate and the beams should not be raycasted
+   */
+  bool heightLogLikelihood(const DroneState& state, double& logLikelihood) const;
+
+  /**
+   * Discretized pose, particles that fall in the same bin share one weight evaluation per scan
+   */
+  struct PoseBin
+  {
+    int x, y, z;
+    int roll, pitch, yaw;
+
+    bool operator==(const PoseBin& other) const
+    {
+      return x == other.x && y == other.y && z == other.z && roll == other.roll && pitch == other.pitch &&
+             yaw == other.yaw;
+    }
+  };
+
+  struct PoseBinHash
+  {
+    std::size_t operator()(const PoseBin& bin) const
+    {
+      std::size_t h = bin.x;
+      h = h * 73856093u ^ bin.y;
+      h = h * 19349663u ^ bin.z;
+      h = h * 83492791u ^ bin.yaw;
+      h = h * 2654435761u ^ bin.roll;
+      h = h * 2654435761u ^ bin.pitch;
+      return h;
+    }
+  };
+
+  PoseBin poseBin(const DroneState& state) const;
+
+  MapView _map;
+  SensorTransforms _baseToSensorTransforms;
+  // Sensor poses of the particle being measured
+  mutable SensorTransforms _sensorPoses;
 
   double _ZHit;
   double _ZShort;
@@ -88,6 +199,45 @@ private:
   double _LambdaShort;
   double _minRange;
   double _maxRange;
+  double _raycastRange;
+
+  // Early termination: stop raycasting a particle once its weight cannot reach
+  // _earlyTerminationRatio times the weight of the best particle of this update
+  bool _earlyTermination;
+  double _earlyTerminationRatio;
+  double _logEarlyTerminationRatio;
+
+  unsigned int _maxBeams;
+  // Beams that need a raycast, in evaluation order
+  std::vector<ObservedBeam> _beams;
+  // Log-likelihood of the max-range readings, the same for every particle
+  double _constantLogWeight;
+  // _remainingLogBound[k] : upper bound of the log-likelihood of the beams _beams[k..end]
+  std::vector<double> _remainingLogBound;
+
+  // z_hit Gaussian sampled every _hitTableStep meters of range error
+  std::vector<double> _hitTable;
+  double _hitTableStep;
+  double _hitTableInvStep;
+
+  // Weight cache (log-weights), emptied with every new observation
+  bool _weightCache;
+  double _cacheXYZBin;
+  double _cacheAngleBin;
+  mutable std::unordered_map<PoseBin, double, PoseBinHash> _weightCacheMap;
+
+  // Height gating, _observedHeight is negative without a height measurement
+  bool _heightGating;
+  double _heightSigma;
+  double _heightGate;
+  double _observedHeight;
+  // Log-likelihood of the height at the gate, and lower bound of the log-likelihood of the beams: the weight of
+  // a gated particle
+  double _gateLogLikelihood;
+  double _minBeamsLogWeight;
+
+  mutable double _bestLogLikelihood;
+  mutable ObservationStats _stats;
 };
 
 #endif
@@ -34,7 +34,7 @@
  * @li <b>velocity</b> the speed with which the drone moves, linear and angular (in m/s)
  */
 
-#include <ros/ros.h>
+#include <Eigen/Geometry>
 
 class DroneState
 {
@@ -64,6 +64,10 @@ public:
   double getYaw() const;
   void setYaw(double y);
 
+  // Pose of the base in the map, rotation of roll about x, then pitch about y, then yaw about z
+  Eigen::Isometry3d getPose() const;
+  void setPose(const Eigen::Isometry3d& pose);
+
 private:
   double x_pos;
   double y_pos;
@@ -22,14 +22,13 @@
 
 #include <iostream>
 #include <memory>
-
-#include <ros/ros.h>
+#include <vector>
 
 #include <libPF/StateDistribution.h>
 #include <libPF/CRandomNumberGenerator.h>
 
 #include "particle_filter/DroneState.h"
-#include "particle_filter/MapModel.h"
+#include "particle_filter/FreeSpaceIndex.h"
 
 namespace libPF
 {
@@ -47,8 +46,12 @@ public:
                          double xMean, double yMean, double zMean, double rollMean, double pitchMean, double yawMean,
                          bool gaussian);
 
-  // Global localization
-  DroneStateDistribution(std::shared_ptr<MapModel> map);
+  /**
+   * Global localization, over the cells of a free space index when it is given and not empty, else over the
+   * bounding box of the map
+   */
+  DroneStateDistribution(const std::shared_ptr<const FreeSpaceIndex>& freeSpace, const double min[3],
+                         const double max[3]);
 
   ~DroneStateDistribution();
 
@@ -58,6 +61,18 @@ public:
 
   void setMean(double x, double y, double z, double r, double p, double yaw);
 
+  // Roll and pitch bounds of the uniform distribution
+  void setAttitude(double rollMin, double rollMax, double pitchMin, double pitchMax);
+
+  // 4-DOF mode: every draw gets this roll and pitch, only x, y, z and yaw are sampled
+  void fixAttitude(double roll, double pitch);
+
+  /**
+   * Gaussian mixture: every draw picks one of the means with a probability proportional to its weight, and
+   * the standard deviations of setStdDev()
+   */
+  void setMeans(const std::vector<DroneState>& means, const std::vector<double>& weights);
+
   const DroneState draw() const;
 
 private:
@@ -65,7 +80,12 @@ private:
   double _XStdDev, _YStdDev, _ZStdDev, _RollStdDev, _PitchStdDev, _YawStdDev;
   double _xMean, _yMean, _zMean, _rollMean, _pitchMean, _yawMean;
   bool _uniform;
-  std::shared_ptr<octomap::ColorOcTree> _map;
+  bool _fixedAttitude;
+  double _fixedRoll, _fixedPitch;
+  std::shared_ptr<const FreeSpaceIndex> _freeSpace;
+  std::vector<DroneState> _means;
+  // Cumulative weights of _means
+  std::vector<double> _meanWeights;
 
   libPF::RandomNumberGenerationStrategy* m_RNG;
 };
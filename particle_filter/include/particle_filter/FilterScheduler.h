@@ -0,0 +1,115 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef FILTERSCHEDULER_H
+#define FILTERSCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+/**
+ * @class FilterScheduler
+ * @brief Thread pool shared by the filters of several drones, that runs their steps earliest deadline first.
+ *
+ * Every worker has its own queue, ordered by deadline. A task goes to the queue of its affinity (e.g. the index
+ * of its drone, so that a drone tends to stay on one core and keep its particles in cache), and a worker whose
+ * queue is empty steals the most urgent task of the others.
+ */
+class FilterScheduler
+{
+public:
+  typedef std::function<void()> Task;
+  typedef std::chrono::steady_clock Clock;
+
+  struct Stats
+  {
+    uint64_t executed;
+    // Tasks run by another worker than the one of their affinity
+    uint64_t stolen;
+    // Tasks started after their deadline
+    uint64_t missedDeadlines;
+  };
+
+  // @param numThreads workers, 0 : one per core
+  explicit FilterScheduler(unsigned int numThreads);
+
+  // Run the queued tasks, then stop the workers
+  ~FilterScheduler();
+
+  void submit(const Task& task, Clock::time_point deadline, unsigned int affinity);
+
+  unsigned int numThreads() const
+  {
+    return _workers.size();
+  }
+
+  Stats getStats() const;
+
+private:
+  struct QueuedTask
+  {
+    Task task;
+    Clock::time_point deadline;
+    // Submission order, between equal deadlines
+    uint64_t sequence;
+
+    // For std::push_heap, which keeps the largest element first
+    bool operator<(const QueuedTask& other) const
+    {
+      return deadline != other.deadline ? deadline > other.deadline : sequence > other.sequence;
+    }
+  };
+
+  struct Worker
+  {
+    std::mutex mutex;
+    std::vector<QueuedTask> heap;
+    std::thread thread;
+  };
+
+  void run(unsigned int index);
+
+  // Take the most urgent task of a worker, or of the others if it has none
+  bool take(unsigned int index, QueuedTask& task, bool& stolen);
+  static bool pop(Worker& worker, QueuedTask& task);
+  // Deadline of the most urgent task of a worker, false if it has none
+  static bool front(Worker& worker, Clock::time_point& deadline);
+
+  std::vector<std::unique_ptr<Worker> > _workers;
+  std::atomic<uint64_t> _sequence;
+
+  // Workers without tasks sleep until a task is submitted
+  std::mutex _sleepMutex;
+  std::condition_variable _wakeUp;
+  std::atomic<std::size_t> _queued;
+  bool _stop;
+
+  std::atomic<uint64_t> _executed;
+  std::atomic<uint64_t> _stolen;
+  std::atomic<uint64_t> _missedDeadlines;
+};
+
+#endif
@@ -0,0 +1,77 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef FREESPACEINDEX_H
+#define FREESPACEINDEX_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "particle_filter/MapCache.h"
+
+/**
+ * @class FreeSpaceIndex
+ * @brief The cells of a MapCache where the drone can be: free, at least a radius away from any obstacle and
+ * within a height band above the surface below them.
+ *
+ * Cells are stored as runs of consecutive indices, so that the n-th cell is found with a binary search and
+ * uniform sampling over the feasible space is a uniform draw of n.
+ */
+class FreeSpaceIndex
+{
+public:
+  /**
+   * @param radius minimum distance to the obstacles (m), at most the distance field truncation of the cache
+   * @param minHeight, maxHeight height band above the nearest occupied cell below (m), cells without one are
+   * excluded
+   */
+  FreeSpaceIndex(const MapCache& cache, double radius, double minHeight, double maxHeight);
+
+  // Number of cells
+  uint64_t size() const
+  {
+    return _numCells;
+  }
+
+  double resolution() const
+  {
+    return _resolution;
+  }
+
+  // Metric center of the n-th cell
+  void cellCenter(uint64_t rank, double& x, double& y, double& z) const;
+
+private:
+  // Cells with consecutive indices, firstRank is the number of cells in all previous runs
+  struct Run
+  {
+    uint64_t firstRank;
+    // 64 bit cell indices, grids can have more than 2^32 cells
+    uint64_t start;
+    uint64_t length;
+  };
+
+  std::vector<Run> _runs;
+  uint64_t _numCells;
+  double _resolution;
+  double _origin[3];
+  uint32_t _size[3];
+};
+
+#endif
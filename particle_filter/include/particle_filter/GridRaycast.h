@@ -0,0 +1,124 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef GRIDRAYCAST_H
+#define GRIDRAYCAST_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+
+namespace grid_raycast
+{
+/**
+ * Cast a ray through a regular grid until it meets an occupied cell, as octomap's castRay with ignoreUnknown.
+ *
+ * GRID provides resolution(), origin(axis) (metric minimum corner), size(axis) (cells) and
+ *   bool probe(const int cell[3], double& freeCells, int& emptyBlockBits) const
+ * which returns true for an occupied cell. Otherwise freeCells is a lower bound of the distance (in cells)
+ * from the cell center to the nearest occupied cell center, and emptyBlockBits > 0 tells that the aligned block
+ * of 2^emptyBlockBits cells containing the cell has no occupied cell. Both are used to skip free space.
+ *
+ * @param range distance from the origin to the center of the occupied cell
+ * @param hitCell if not NULL, set to the occupied cell
+ * @return false if there is no occupied cell within maxRange
+ */
+template <class GRID>
+bool castRay(const GRID& grid, float originX, float originY, float originZ, float directionX, float directionY,
+             float directionZ, float maxRange, float& range, int* hitCell = NULL)
+{
+  double norm = std::sqrt(directionX * directionX + directionY * directionY + directionZ * directionZ);
+  if (norm == 0)
+    return false;
+
+  // Everything in cell units, relative to the minimum corner of the grid
+  const double resolution = grid.resolution();
+  const double invResolution = 1.0 / resolution;
+  const double origin[3] = { (originX - grid.origin(0)) * invResolution, (originY - grid.origin(1)) * invResolution,
+                             (originZ - grid.origin(2)) * invResolution };
+  const double direction[3] = { directionX / norm, directionY / norm, directionZ / norm };
+  const int size[3] = { int(grid.size(0)), int(grid.size(1)), int(grid.size(2)) };
+
+  // Clip the ray to the grid
+  double t = 0;
+  double tEnd = maxRange * invResolution;
+  double invDirection[3];
+  for (int i = 0; i < 3; i++)
+  {
+    if (direction[i] == 0)
+    {
+      invDirection[i] = std::numeric_limits<double>::infinity();
+      if (origin[i] < 0 || origin[i] >= size[i])
+        return false;
+      continue;
+    }
+    invDirection[i] = 1.0 / direction[i];
+    double t0 = -origin[i] * invDirection[i];
+    double t1 = (size[i] - origin[i]) * invDirection[i];
+    t = std::max(t, std::min(t0, t1));
+    tEnd = std::min(tEnd, std::max(t0, t1));
+  }
+
+  // A jump of the distance to the nearest occupied cell center, minus a cell diagonal, can not skip an occupied cell
+  const double skipMargin = std::sqrt(3.0) + 0.01;
+
+  while (t < tEnd)
+  {
+    int cell[3];
+    for (int i = 0; i < 3; i++)
+      cell[i] = std::min(std::max(int(std::floor(origin[i] + t * direction[i])), 0), size[i] - 1);
+
+    double freeCells = 0;
+    int emptyBlockBits = 0;
+    if (grid.probe(cell, freeCells, emptyBlockBits))
+    {
+      double dx = cell[0] + 0.5 - origin[0];
+      double dy = cell[1] + 0.5 - origin[1];
+      double dz = cell[2] + 0.5 - origin[2];
+      range = std::sqrt(dx * dx + dy * dy + dz * dz) * resolution;
+      if (hitCell)
+        std::copy(cell, cell + 3, hitCell);
+      return true;
+    }
+
+    double skip = freeCells - skipMargin;
+    if (skip > 1.0 && emptyBlockBits == 0)
+    {
+      t += skip;
+      continue;
+    }
+
+    // Step to the next cell, or out of the empty block, along the ray
+    double tNext = std::numeric_limits<double>::infinity();
+    for (int i = 0; i < 3; i++)
+    {
+      int low = (cell[i] >> emptyBlockBits) << emptyBlockBits;
+      if (direction[i] > 0)
+        tNext = std::min(tNext, (low + (1 << emptyBlockBits) - origin[i]) * invDirection[i]);
+      else if (direction[i] < 0)
+        tNext = std::min(tNext, (low - origin[i]) * invDirection[i]);
+    }
+    t = std::max(tNext, t + std::max(skip, 0.0)) + 1e-6;
+  }
+  return false;
+}
+}  // namespace grid_raycast
+
+#endif
@@ -0,0 +1,77 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef HEIGHTFIELD_H
+#define HEIGHTFIELD_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "particle_filter/MapCache.h"
+
+/**
+ * @class HeightField
+ * @brief Height of every free cell of a MapCache above the nearest occupied cell below it, i.e. what a downward
+ * height sensor measures there. One byte per cell.
+ */
+class HeightField
+{
+public:
+  explicit HeightField(const MapCache& cache);
+
+  /**
+   * Height of a point above the top of the surface below it (m)
+   * @return false outside of the grid, in an occupied cell, or without a surface within 254 cells below
+   */
+  bool heightAt(double x, double y, double z, double& height) const
+  {
+    double fx = (x - _origin[0]) * _invResolution;
+    double fy = (y - _origin[1]) * _invResolution;
+    double fz = (z - _origin[2]) * _invResolution;
+    if (fx < 0 || fy < 0 || fz < 0 || fx >= _size[0] || fy >= _size[1] || fz >= _size[2])
+      return false;
+    uint32_t ix = uint32_t(fx), iy = uint32_t(fy), iz = uint32_t(fz);
+    uint8_t cells = _cells[(std::size_t(iz) * _size[1] + iy) * _size[0] + ix];
+    if (cells == 0 || cells == NO_SURFACE)
+      return false;
+    // The surface is the top of the cell `cells` layers below
+    height = (fz - (int(iz) - cells + 1)) * _resolution;
+    return true;
+  }
+
+  std::size_t byteSize() const
+  {
+    return _cells.size();
+  }
+
+private:
+  enum
+  {
+    NO_SURFACE = 255
+  };
+
+  // Layers between every cell and the occupied cell below it (0 : occupied, NO_SURFACE : none or too far)
+  std::vector<uint8_t> _cells;
+  double _resolution;
+  double _invResolution;
+  double _origin[3];
+  uint32_t _size[3];
+};
+
+#endif
@@ -0,0 +1,80 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef LATESTVALUE_H
+#define LATESTVALUE_H
+
+#include <atomic>
+
+/**
+ * @class LatestValue
+ * @brief Latest value passed from one writer thread to one reader thread without locks (triple buffer).
+ *
+ * Neither side ever waits: the writer fills its own buffer and swaps it with the middle one, the reader takes
+ * the middle one when it holds a newer value. The reader always gets a complete value, the last one written.
+ */
+template <class T>
+class LatestValue
+{
+public:
+  LatestValue() : _middle(1), _back(0), _front(2), _hasValue(false)
+  {
+  }
+
+  // Writer thread
+  void write(const T& value)
+  {
+    _buffers[_back] = value;
+    _back = _middle.exchange(_back | FRESH, std::memory_order_acq_rel) & INDEX;
+  }
+
+  /**
+   * Reader thread
+   * @return false if nothing was written yet
+   */
+  bool read(T& value)
+  {
+    if (_middle.load(std::memory_order_relaxed) & FRESH)
+    {
+      _front = _middle.exchange(_front, std::memory_order_acq_rel) & INDEX;
+      _hasValue = true;
+    }
+    if (!_hasValue)
+      return false;
+    value = _buffers[_front];
+    return true;
+  }
+
+private:
+  enum
+  {
+    INDEX = 3,
+    // The middle buffer was written since the reader last took it
+    FRESH = 4
+  };
+
+  T _buffers[3];
+  std::atomic<unsigned int> _middle;
+  // Owned by the writer and by the reader
+  unsigned int _back;
+  unsigned int _front;
+  bool _hasValue;
+};
+
+#endif
@@ -0,0 +1,374 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MAPCACHE_H
+#define MAPCACHE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <octomap/OcTree.h>
+#include <octomap/ColorOcTree.h>
+
+/**
+ * @class MapCache
+ * @brief Structures derived from an OctoMap, stored in a binary file next to the map and memory mapped.
+ *
+ * The cache holds a dense occupancy grid over the metric bounding box of the map, a truncated Euclidean
+ * distance field to the nearest occupied cell and an index of the free cells (as runs of consecutive cells).
+ * Everything is addressed by offsets from the start of the file, so the same bytes can be mapped anywhere.
+ */
+class MapCache
+{
+public:
+  static const uint32_t VERSION = 3;
+
+  enum CellState
+  {
+    UNKNOWN = 0,
+    FREE = 1,
+    OCCUPIED = 2
+  };
+
+  // New state of one cell
+  struct CellChange
+  {
+    std::size_t index;
+    uint8_t state;
+  };
+
+  /**
+   * File header, the sections follow at the given offsets
+   */
+  struct Header
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    // FNV-1a of the source map file, the cache is stale when it differs
+    uint64_t sourceChecksum;
+    // FNV-1a of everything after the header
+    uint64_t dataChecksum;
+    uint64_t fileSize;
+
+    double resolution;
+    // Metric position of the minimum corner of cell (0, 0, 0)
+    double origin[3];
+    uint32_t size[3];
+    // Distances are clamped to this value (m)
+    float maxDistance;
+
+    uint64_t occupancyOffset;
+    uint64_t distanceOffset;
+  };
+
+  MapCache();
+  ~MapCache();
+
+  MapCache(const MapCache&) = delete;
+  MapCache& operator=(const MapCache&) = delete;
+
+  // Default location of the cache of a map file
+  static std::string cachePathFor(const std::string& mapFile);
+
+  /**
+   * Read the octree of a map file: a .bt file (occupancy only) as a ColorOcTree with the default color, any
+   * other file with AbstractOcTree::read
+   * @return NULL if the file can not be read
+   */
+  static octomap::AbstractOcTree* readMapFile(const std::string& mapFile);
+
+  // FNV-1a 64 bit checksum of a file, false if it can not be read
+  static bool checksumFile(const std::string& path, uint64_t& checksum);
+
+  // FNV-1a 64 bit checksum of a memory block, continuing from seed
+  static uint64_t checksum(const void* data, std::size_t size, uint64_t seed = 14695981039346656037ULL);
+
+  /**
+   * Memory map an existing cache file.
+   * @param verify also check the data checksum, which touches every page of the file
+   * @return false if the file is missing, was built from another map, or is of another version
+   */
+  bool open(const std::string& cachePath, uint64_t sourceChecksum, float maxDistance, bool verify,
+            std::string& error);
+
+  /**
+   * View a cache that is already in memory (e.g. shared memory), without taking ownership of it.
+   * The memory must stay valid until the cache is released or destroyed.
+   */
+  bool attach(const void* data, std::size_t size, bool verify, std::string& error);
+
+  // Unmap or free the data, the cache is invalid afterwards
+  void release();
+
+  // Grid over the metric bounding box of a tree, at its resolution
+  template <class TREE>
+  static void gridOf(const TREE& tree, double origin[3], uint32_t size[3]);
+
+  /**
+   * Occupancy of the block of cells [first, first + size) of the grid at origin, from the leafs of a tree
+   * @param occupancy resized to the block, stored x first
+   */
+  template <class TREE>
+  static void rasterize(const TREE& tree, const double origin[3], double resolution, const int first[3],
+                        const uint32_t size[3], std::vector<uint8_t>& occupancy);
+
+  /**
+   * Truncated Euclidean distance (mm) from every cell of a block to the nearest occupied cell of the block
+   * @param size cells of the block along x, y, z, stored x first
+   */
+  static void computeDistanceField(const uint8_t* occupancy, const uint32_t size[3], double resolution,
+                                   float maxDistance, uint16_t* distance);
+
+  /**
+   * Build the derived structures from an octree, keep them in memory and try to write them to cachePath
+   * (nothing is written if it is empty).
+   * @return false if writing the file failed, the structures are still usable
+   */
+  bool build(const octomap::OcTree& tree, uint64_t sourceChecksum, float maxDistance, const std::string& cachePath,
+             std::string& error);
+  bool build(const octomap::ColorOcTree& tree, uint64_t sourceChecksum, float maxDistance,
+             const std::string& cachePath, std::string& error);
+
+  /**
+   * Set the state of some cells, then update the distance field around them, in place.
+   * Only the region within maxDistance of the changes is recomputed. A mapped file is turned into a private
+   * copy-on-write mapping and attached memory is copied first. The data checksum is not maintained.
+   * @return number of cells whose state changed
+   */
+  std::size_t applyChanges(const std::vector<CellChange>& changes);
+
+  bool isValid() const
+  {
+    return _header != NULL;
+  }
+
+  // True if the data lives in a memory mapped file rather than in a private buffer
+  bool isMapped() const
+  {
+    return _mapped != NULL;
+  }
+
+  // The whole cache, byteSize() bytes that can be copied or written as they are
+  const void* data() const
+  {
+    return _data;
+  }
+
+  std::size_t byteSize() const
+  {
+    return _header ? _header->fileSize : 0;
+  }
+
+  const Header& header() const
+  {
+    return *_header;
+  }
+
+  double resolution() const
+  {
+    return _header->resolution;
+  }
+
+  uint32_t sizeX() const
+  {
+    return _header->size[0];
+  }
+  uint32_t sizeY() const
+  {
+    return _header->size[1];
+  }
+  uint32_t sizeZ() const
+  {
+    return _header->size[2];
+  }
+
+  std::size_t numCells() const
+  {
+    return std::size_t(_header->size[0]) * _header->size[1] * _header->size[2];
+  }
+
+  std::size_t index(uint32_t ix, uint32_t iy, uint32_t iz) const
+  {
+    return (std::size_t(iz) * _header->size[1] + iy) * _header->size[0] + ix;
+  }
+
+  // Cell of a metric point, false if outside of the grid
+  bool worldToCell(double x, double y, double z, uint32_t& ix, uint32_t& iy, uint32_t& iz) const
+  {
+    double fx = (x - _header->origin[0]) / _header->resolution;
+    double fy = (y - _header->origin[1]) / _header->resolution;
+    double fz = (z - _header->origin[2]) / _header->resolution;
+    if (fx < 0 || fy < 0 || fz < 0 || fx >= _header->size[0] || fy >= _header->size[1] || fz >= _header->size[2])
+      return false;
+    ix = uint32_t(fx);
+    iy = uint32_t(fy);
+    iz = uint32_t(fz);
+    return true;
+  }
+
+  // Metric center of a cell
+  void cellToWorld(uint32_t ix, uint32_t iy, uint32_t iz, double& x, double& y, double& z) const
+  {
+    x = _header->origin[0] + (ix + 0.5) * _header->resolution;
+    y = _header->origin[1] + (iy + 0.5) * _header->resolution;
+    z = _header->origin[2] + (iz + 0.5) * _header->resolution;
+  }
+
+  void indexToCell(std::size_t idx, uint32_t& ix, uint32_t& iy, uint32_t& iz) const
+  {
+    ix = idx % _header->size[0];
+    idx /= _header->size[0];
+    iy = idx % _header->size[1];
+    iz = idx / _header->size[1];
+  }
+
+  const uint8_t* occupancy() const
+  {
+    return _data + _header->occupancyOffset;
+  }
+
+  // Distance to the nearest occupied cell in millimeters, clamped to maxDistance
+  const uint16_t* distanceField() const
+  {
+    return reinterpret_cast<const uint16_t*>(_data + _header->distanceOffset);
+  }
+
+  uint8_t cellState(std::size_t idx) const
+  {
+    return occupancy()[idx];
+  }
+
+  // Distance in meters
+  float distance(std::size_t idx) const
+  {
+    return distanceField()[idx] * 0.001f;
+  }
+
+  // Grid interface of grid_raycast::castRay
+  double origin(int axis) const
+  {
+    return _header->origin[axis];
+  }
+  uint32_t size(int axis) const
+  {
+    return _header->size[axis];
+  }
+  bool probe(const int cell[3], double& freeCells, int& /* emptyBlockBits */) const
+  {
+    std::size_t idx = index(cell[0], cell[1], cell[2]);
+    if (occupancy()[idx] == OCCUPIED)
+      return true;
+    freeCells = distanceField()[idx] * 0.001 / _header->resolution;
+    return false;
+  }
+
+  /**
+   * Cast a ray through the grid until it meets an occupied cell, unknown cells are traversed
+   * (octomap's castRay with ignoreUnknown). Free space is skipped with the distance field.
+   * @param range distance from the origin to the center of the occupied cell
+   * @return false if there is no occupied cell within maxRange
+   */
+  bool castRay(float originX, float originY, float originZ, float directionX, float directionY, float directionZ,
+               float maxRange, float& range) const;
+  // Same, with the occupied cell that was hit
+  bool castRay(float originX, float originY, float originZ, float directionX, float directionY, float directionZ,
+               float maxRange, float& range, uint32_t cell[3]) const;
+
+private:
+  // Fill a buffer with the cache of a grid whose occupancy has been set
+  void finalize(std::vector<uint8_t>& occupancy, uint32_t sizeX, uint32_t sizeY, uint32_t sizeZ, double resolution,
+                const double origin[3], uint64_t sourceChecksum, float maxDistance);
+
+  bool write(const std::string& cachePath, std::string& error) const;
+
+  // Make the bytes writable in place, false if that failed
+  bool makeWritable();
+
+  // Recompute the distance field of the cells [low, high), from the obstacles within maxDistance of them
+  void updateDistanceField(const uint32_t low[3], const uint32_t high[3]);
+
+  // Check the header of a cache in memory, and its data checksum if verify is set
+  static bool validate(const uint8_t* data, std::size_t size, bool verify, std::string& error);
+
+  template <class TREE>
+  bool buildFromTree(const TREE& tree, uint64_t sourceChecksum, float maxDistance, const std::string& cachePath,
+                     std::string& error);
+
+  // Either _mapped (memory mapped file), _buffer or attached memory holds the bytes
+  void* _mapped;
+  std::size_t _mappedSize;
+  std::vector<uint8_t> _buffer;
+
+  const uint8_t* _data;
+  const Header* _header;
+};
+
+template <class TREE>
+void MapCache::gridOf(const TREE& tree, double origin[3], uint32_t size[3])
+{
+  double max[3];
+  tree.getMetricMin(origin[0], origin[1], origin[2]);
+  tree.getMetricMax(max[0], max[1], max[2]);
+  for (int i = 0; i < 3; i++)
+    size[i] = std::max(1, int(std::ceil((max[i] - origin[i]) / tree.getResolution() - 1e-6)));
+}
+
+template <class TREE>
+void MapCache::rasterize(const TREE& tree, const double origin[3], double resolution, const int first[3],
+                         const uint32_t size[3], std::vector<uint8_t>& occupancy)
+{
+  occupancy.assign(std::size_t(size[0]) * size[1] * size[2], UNKNOWN);
+
+  // Only the leafs that overlap the block, shrunk a bit so that the neighbouring cells are left out
+  const double margin = 0.25 * resolution;
+  octomap::point3d bbxMin(origin[0] + first[0] * resolution + margin, origin[1] + first[1] * resolution + margin,
+                          origin[2] + first[2] * resolution + margin);
+  octomap::point3d bbxMax(origin[0] + (first[0] + size[0]) * resolution - margin,
+                          origin[1] + (first[1] + size[1]) * resolution - margin,
+                          origin[2] + (first[2] + size[2]) * resolution - margin);
+
+  // Leafs above the maximum depth cover a block of cells
+  for (typename TREE::leaf_bbx_iterator it = tree.begin_leafs_bbx(bbxMin, bbxMax), end = tree.end_leafs_bbx();
+       it != end; ++it)
+  {
+    double half = it.getSize() / 2.0;
+    int cells = std::max(1, int(it.getSize() / resolution + 0.5));
+    int leafFirst[3] = { int(std::floor((it.getX() - half - origin[0]) / resolution + 0.5)) - first[0],
+                         int(std::floor((it.getY() - half - origin[1]) / resolution + 0.5)) - first[1],
+                         int(std::floor((it.getZ() - half - origin[2]) / resolution + 0.5)) - first[2] };
+    uint8_t state = tree.isNodeOccupied(*it) ? OCCUPIED : FREE;
+
+    for (int z = std::max(0, leafFirst[2]); z < std::min(int(size[2]), leafFirst[2] + cells); z++)
+      for (int y = std::max(0, leafFirst[1]); y < std::min(int(size[1]), leafFirst[1] + cells); y++)
+        for (int x = std::max(0, leafFirst[0]); x < std::min(int(size[0]), leafFirst[0] + cells); x++)
+        {
+          uint8_t& cell = occupancy[(std::size_t(z) * size[1] + y) * size[0] + x];
+          // An occupied leaf always wins over a free one
+          if (cell != OCCUPIED)
+            cell = state;
+        }
+  }
+}
+
+#endif
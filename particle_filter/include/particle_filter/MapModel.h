@@ -20,6 +20,10 @@
 #ifndef MAPMODEL_H_
 #define MAPMODEL_H_
 
+#include <atomic>
+#include <mutex>
+#include <vector>
+
 #include <ros/ros.h>
 
 #include <octomap/octomap_types.h>
@@ -30,35 +34,179 @@
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
 
+#include "particle_filter/FreeSpaceIndex.h"
+#include "particle_filter/HeightField.h"
+#include "particle_filter/MapView.h"
+#include "particle_filter/MapCache.h"
+#include "particle_filter/Relocalizer.h"
+#include "particle_filter/SharedMap.h"
+#include "particle_filter/TiledMap.h"
+
 class MapModel
 {
 public:
   MapModel(ros::NodeHandle* nh);
   ~MapModel();
 
-  // Return the map of the current model
+  // Return the color map of the current model, only kept for visualization (NULL otherwise)
   std::shared_ptr<octomap::ColorOcTree> getMap() const;
 
-  // Check if a point is occupied in the octomap
+  // Colorless octree used for localization when there is no map cache, NULL otherwise
+  std::shared_ptr<octomap::OcTree> getOccupancyTree() const;
+
+  // Check if a point is occupied in the map
   bool isOccupied(const octomap::point3d& point) const;
 
   // Check if a node is occupied in the octomap
   bool isOccupied(octomap::OcTreeNode* node) const;
 
+  // Dense grid, distance field and free space index of the map, NULL if they are not available
+  std::shared_ptr<const MapCache> getCache() const;
+
+  /**
+   * Cells where the drone can be (/global_localization parameters), built on the first call and again after
+   * the map changed. NULL without a map cache. Thread safe, but not with applyMapUpdates().
+   */
+  std::shared_ptr<const FreeSpaceIndex> getFreeSpace();
+
+  /**
+   * Height of the free cells above the surface, for the height sensor, built on the first call and again after
+   * the map changed. NULL without a map cache. Thread safe, but not with applyMapUpdates().
+   */
+  std::shared_ptr<const HeightField> getHeightField();
+
+  /**
+   * Relocalizer of the map cache, built on the first call, again after the map changed or for other parameters.
+   * NULL without a map cache. Thread safe, but not with applyMapUpdates().
+   */
+  std::shared_ptr<const Relocalizer> getRelocalizer(double sigma, unsigned int levels);
+
+  // Tiles of the map paged in from disk (/map_tiles/enabled), NULL if they are not used
+  std::shared_ptr<const TiledMap> getTiledMap() const;
+
+  // What the observation model raycasts in
+  MapView getView() const;
+
+  // Bytes held by the map: octrees, cache (mapped or shared) and loaded tiles
+  std::size_t memoryUsage() const;
+
+  /**
+   * Page in the tiles around a bounding box (e.g. of the particles) before it is used: the box grown by
+   * /map_tiles/window_margin is loaded now, the same box moved by velocity * /map_tiles/prefetch_time in the
+   * background. Does nothing without tiles.
+   * @param window window to load, for a map shared by several filters (NULL : the window of the map)
+   */
+  void focus(const double min[3], const double max[3], const double velocity[3], TiledMap::Window* window = NULL);
+
+  /**
+   * Queue changed voxels, e.g. the changes published by octomap_server (track_changes), with the occupancy
+   * probability as intensity. They are applied by applyMapUpdates(). Thread safe.
+   */
+  void queueMapChanges(const pcl::PointCloud<pcl::PointXYZI>& changes);
+
+  /**
+   * Apply the queued changes in place (grid and distance field around them, or octree), or switch to the
+   * latest generation of the shared map. Call it between filter steps.
+   * @return true if the map changed, the users of getCache() / getOccupancyTree() must then get them again
+   */
+  bool applyMapUpdates();
+
+  // True if applyMapUpdates() has something to do. Thread safe, but not with applyMapUpdates().
+  bool updatePending();
+
+  // Number of times the map changed, for the users that did not call applyMapUpdates() themselves
+  uint64_t getVersion() const
+  {
+    return _version;
+  }
+
+  // Metric bounding box of the map
+  void getMetricMin(double& x, double& y, double& z) const;
+  void getMetricMax(double& x, double& y, double& z) const;
+
 protected:
+  /**
+   * Open the cache next to mapFile with the /map_cache parameters, or build it from _map if build is set
+   * @return false if there is no cache
+   */
+  bool loadCache(ros::NodeHandle* nh, const std::string& mapFile, bool build);
+
+  // Same for the tiles, with the /map_tiles parameters
+  bool loadTiles(ros::NodeHandle* nh, const std::string& mapFile, bool build);
+
+  // Copy of the occupancy of a color tree, without the colors
+  static octomap::OcTree* stripColor(const octomap::ColorOcTree& colorTree);
+
+  // New state (MapCache::CellState) of the map cell at a point
+  struct MapChange
+  {
+    octomap::point3d point;
+    uint8_t state;
+  };
+
+  // Set the state of the leafs of a tree at the changes
+  template <class TREE>
+  static void applyToTree(TREE& tree, const std::vector<MapChange>& changes);
+
   std::shared_ptr<octomap::ColorOcTree> _map;
+  std::shared_ptr<octomap::OcTree> _octree;
+  std::shared_ptr<const MapCache> _cache;
+  // The same cache when it belongs to this model and can be updated
+  std::shared_ptr<MapCache> _writableCache;
+  std::shared_ptr<SharedMap> _sharedMap;
+  std::string _sharedMapName;
+  std::shared_ptr<TiledMap> _tiles;
+  double _tileWindowMargin;
+  double _tilePrefetchTime;
+  double _occupancyThresholdLog;
   double _motionObstacleDist;
+
+  std::shared_ptr<const FreeSpaceIndex> _freeSpace;
+  double _uavRadius;
+  double _minFlightHeight;
+  double _maxFlightHeight;
+
+  std::shared_ptr<const HeightField> _heights;
+
+  std::shared_ptr<const Relocalizer> _relocalizer;
+  double _relocalizerSigma;
+  unsigned int _relocalizerLevels;
+
+  // Held while the structures derived from the cache are built, the filters of several drones share them
+  std::mutex _derivedMutex;
+
+  std::mutex _changesMutex;
+  std::vector<MapChange> _pendingChanges;
+  std::atomic<uint64_t> _version;
 };
 
 class OccupancyMap : public MapModel
 {
 public:
-  OccupancyMap(ros::NodeHandle* nh);
+  /**
+   * Load the map from /map_file, from octomap_server, or attach to the shared map (/shared_map/enabled).
+   * Localization uses the map tiles or the map cache (or a colorless octree without them), the color tree is
+   * released. When they were already built from /map_file, the map file itself is not parsed.
+   * @param useSharedMap false to ignore /shared_map/enabled, for the publisher of the shared map itself
+   * @param keepColorTree keep the ColorOcTree, for visualization or to publish it
+   */
+  OccupancyMap(ros::NodeHandle* nh, bool useSharedMap = true, bool keepColorTree = false);
   virtual ~OccupancyMap();
 
   bool isOccupied(octomap::OcTreeNode* node) const;
 
+  // Empty if the color tree was not kept
   pcl::PointCloud<pcl::PointXYZRGBA> toPCL();
+
+private:
+  // Read the octree from a .bt or .ot file, false on failure
+  bool readMapFile(const std::string& mapFile);
+
+  // Get the octree from octomap_server, retrying until it answers
+  void requestMap(ros::NodeHandle* nh);
+
+  // Use the map published in shared memory, waiting until there is one
+  void attachSharedMap(ros::NodeHandle* nh);
 };
 
 #endif
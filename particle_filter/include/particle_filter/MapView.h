@@ -0,0 +1,69 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MAPVIEW_H
+#define MAPVIEW_H
+
+#include <memory>
+
+#include <octomap/OcTree.h>
+
+#include "particle_filter/HeightField.h"
+#include "particle_filter/MapCache.h"
+#include "particle_filter/TiledMap.h"
+
+/**
+ * The map the filter raycasts in: the flat grid, else its tiles, else an occupancy octree
+ */
+struct MapView
+{
+  std::shared_ptr<const MapCache> grid;
+  std::shared_ptr<const TiledMap> tiles;
+  // Window of the tiles of this filter, when the tiles are shared (else the window of the map is used)
+  std::shared_ptr<const TiledMap::Window> tileWindow;
+  std::shared_ptr<octomap::OcTree> octree;
+  // Height above the surface, for the height sensor (optional, with the grid)
+  std::shared_ptr<const HeightField> heights;
+
+  bool empty() const
+  {
+    return !grid && !tiles && !octree;
+  }
+
+  /**
+   * Distance to the first occupied cell along a direction
+   * @return false if there is none within maxRange
+   */
+  bool castRay(float ox, float oy, float oz, float dx, float dy, float dz, float maxRange, float& range) const
+  {
+    if (grid)
+      return grid->castRay(ox, oy, oz, dx, dy, dz, maxRange, range);
+    if (tiles)
+      return tiles->castRay(ox, oy, oz, dx, dy, dz, maxRange, range, tileWindow.get());
+
+    octomap::point3d origin(ox, oy, oz);
+    octomap::point3d end;
+    if (!octree->castRay(origin, octomap::point3d(dx, dy, dz), end, true, maxRange))
+      return false;
+    range = (origin - end).norm();
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,118 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <initializer_list>
+#include <ostream>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace pf
+{
+/**
+ * @class Histogram
+ * @brief Counts of values in fixed buckets, updated from any thread without locks or allocations
+ */
+class Histogram
+{
+public:
+  static const unsigned int MAX_BUCKETS = 16;
+
+  // Upper bounds of the buckets, increasing. Values above the last one go to the +Inf bucket
+  Histogram(std::initializer_list<double> bounds);
+
+  void observe(double value);
+
+  uint64_t count() const
+  {
+    return _count.load(std::memory_order_relaxed);
+  }
+
+  double sum() const
+  {
+    return _sumMicro.load(std::memory_order_relaxed) * 1e-6;
+  }
+
+  // Value below which a fraction q of the observations are, the upper bound of its bucket
+  double quantile(double q) const;
+
+  // Prometheus text format, cumulative buckets. labels: added to every sample, e.g. drone="drone1"
+  void writePrometheus(std::ostream& out, const std::string& name, const std::string& help,
+                       const std::string& labels = "") const;
+
+private:
+  double _bounds[MAX_BUCKETS];
+  unsigned int _numBounds;
+  std::atomic<uint64_t> _buckets[MAX_BUCKETS + 1];
+  std::atomic<uint64_t> _count;
+  // Sum in millionths, so that it can be added atomically
+  std::atomic<uint64_t> _sumMicro;
+};
+
+/**
+ * Metrics of the localization node. Counters and gauges are atomics, so every thread updates them without
+ * locking; they are read by the exporter at its own rate.
+ */
+struct Metrics
+{
+  Metrics();
+
+  // Scan pipeline
+  std::atomic<uint64_t> scansReceived;
+  // Replaced by a newer scan before they were prepared, or filtered
+  std::atomic<uint64_t> scansDropped;
+  std::atomic<uint64_t> preparedScansDropped;
+  std::atomic<uint64_t> scansFiltered;
+  std::atomic<uint64_t> raycasts;
+  std::atomic<uint64_t> relocalizations;
+  // Drawn over the free space by the recovery
+  std::atomic<uint64_t> particlesInjected;
+  // Estimates refined by scan registration, and refinements rejected
+  std::atomic<uint64_t> estimatesRefined;
+  std::atomic<uint64_t> refinementsRejected;
+  // Filter steps longer than /real_time/deadline
+  std::atomic<uint64_t> deadlineMisses;
+
+  // Last filter step
+  std::atomic<double> effectiveParticles;
+  std::atomic<double> particles;
+  std::atomic<double> beamsUsed;
+  std::atomic<double> mapBytes;
+
+  // Reception of a scan to the start of its filter step, scan stamp to the publication of its pose,
+  // and duration of the filter step (s)
+  Histogram queueLatency;
+  Histogram poseLatency;
+  Histogram filterStepTime;
+
+  // Name and value of every metric, for diagnostics
+  std::vector<std::pair<std::string, std::string> > values(double raycastsPerSecond) const;
+
+  // labels: added to every sample, e.g. drone="drone1"
+  void writePrometheus(std::ostream& out, double raycastsPerSecond, const std::string& labels = "") const;
+};
+
+}  // namespace pf
+
+#endif
@@ -0,0 +1,90 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef OBSERVATION_H
+#define OBSERVATION_H
+
+#include <vector>
+
+#include <Eigen/Geometry>
+#include <Eigen/StdVector>
+
+// Pose of every sensor in the base frame
+typedef std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d> > SensorTransforms;
+
+/**
+ * Beams of one observation, of a laser scan or of several range sensors, as measured by DroneObservationModel
+ */
+struct Observation
+{
+  // Beam endpoint, in the frame of its sensor (points) or of the base (endpointsInBase)
+  struct Point
+  {
+    float x, y, z;
+  };
+
+  std::vector<Point> points;
+  std::vector<float> ranges;
+  // Sensor of every beam, empty when there is a single sensor
+  std::vector<unsigned int> sensors;
+  SensorTransforms baseToSensor;
+  // Height of the base above the surface below it, from the height sensor (m), negative when there is none
+  float height;
+
+  Observation() : height(-1.0f)
+  {
+  }
+
+  void clear()
+  {
+    points.clear();
+    ranges.clear();
+    sensors.clear();
+    height = -1.0f;
+  }
+
+  unsigned int sensor(std::size_t beam) const
+  {
+    return sensors.empty() ? 0 : sensors[beam];
+  }
+
+  // Endpoint of a beam in the base frame
+  Eigen::Vector3d pointInBase(std::size_t beam) const
+  {
+    const Point& p = points[beam];
+    return baseToSensor[sensor(beam)] * Eigen::Vector3d(p.x, p.y, p.z);
+  }
+
+  // Endpoints in the base frame of the beams shorter than maxRange (the others hit nothing), for the scan matching
+  void endpointsInBase(float maxRange, std::vector<Point>& endpoints) const
+  {
+    endpoints.clear();
+    endpoints.reserve(points.size());
+    for (std::size_t i = 0; i < points.size(); i++)
+    {
+      if (ranges[i] >= maxRange)
+        continue;
+      Eigen::Vector3d p = pointInBase(i);
+      Point endpoint = { float(p.x()), float(p.y()), float(p.z()) };
+      endpoints.push_back(endpoint);
+    }
+  }
+};
+
+#endif
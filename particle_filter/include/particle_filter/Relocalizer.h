@@ -0,0 +1,99 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef RELOCALIZER_H
+#define RELOCALIZER_H
+
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+#include "particle_filter/MapCache.h"
+#include "particle_filter/Observation.h"
+
+/**
+ * @class Relocalizer
+ * @brief Global search of the pose (x, y, z, yaw) that best explains a scan, for kidnapped robot recovery.
+ *
+ * A likelihood grid is derived from the distance field of a MapCache, then a pyramid of it where the cell of
+ * level k holds the maximum of the 2^k x 2^k x 2^k cells above it. The score of a scan at level k is thus an
+ * upper bound of its score at every translation of the block, and a branch and bound search only descends into
+ * the blocks that can still beat the hypotheses found so far. The top level blocks of every yaw are shared
+ * between threads.
+ */
+class Relocalizer
+{
+public:
+  struct Hypothesis
+  {
+    double x, y, z, yaw;
+    // Mean likelihood of the points, in [0, 1]
+    float score;
+  };
+
+  struct Parameters
+  {
+    double roll, pitch;
+    double yawStep;
+    // Hypotheses below this score are not considered
+    double minScore;
+    unsigned int maxHypotheses;
+    // Hypotheses closer than this are the same one (m, rad)
+    double minSeparation;
+    double minYawSeparation;
+    unsigned int numThreads;
+  };
+
+  /**
+   * @param sigma standard deviation of the likelihood of a point at a distance from an obstacle (m)
+   * @param levels pyramid levels above the grid, the search starts with blocks of 2^levels cells
+   */
+  Relocalizer(const std::shared_ptr<const MapCache>& cache, double sigma, unsigned int levels);
+
+  // Best hypotheses, best first
+  std::vector<Hypothesis> search(const std::vector<Observation::Point>& points, const Parameters& params) const;
+
+  // Memory of the pyramid
+  std::size_t byteSize() const;
+
+private:
+  struct Candidate
+  {
+    int cell[3];
+    unsigned int yaw;
+    unsigned int score;
+  };
+
+  // Sum of the likelihoods of the points (in cells from the translation) at a level
+  unsigned int score(unsigned int level, const int cell[3], const std::vector<int>& offsets) const;
+
+  void descend(unsigned int level, const Candidate& candidate, const std::vector<int>& offsets,
+               unsigned int minScore, const Parameters& params, std::vector<Candidate>& best) const;
+
+  // Keep the best candidates that are apart from each other, at most params.maxHypotheses
+  void insert(const Candidate& candidate, const Parameters& params, std::vector<Candidate>& best) const;
+
+  unsigned int threshold(const std::vector<Candidate>& best, unsigned int minScore, const Parameters& params) const;
+
+  std::shared_ptr<const MapCache> _cache;
+  int _size[3];
+  std::vector<std::vector<uint8_t> > _levels;
+};
+
+#endif
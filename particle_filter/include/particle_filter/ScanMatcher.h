@@ -0,0 +1,101 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SCANMATCHER_H
+#define SCANMATCHER_H
+
+#include <memory>
+#include <vector>
+
+#include "particle_filter/MapCache.h"
+#include "particle_filter/Observation.h"
+
+/**
+ * @class ScanMatcher
+ * @brief Local refinement of a pose (x, y, z, yaw) by registration of the scan endpoints to the distance field
+ * of a MapCache.
+ *
+ * Gauss-Newton on the squared distances of the endpoints to the nearest obstacle, trilinearly interpolated, with
+ * Huber weights. A Gaussian prior on the initial pose keeps the directions the scan does not constrain where they
+ * were. Roll and pitch are not refined, nor is the height unless asked: the endpoints of a planar scan are pulled
+ * towards the floor or the ceiling, which are obstacles of the distance field too.
+ */
+class ScanMatcher
+{
+public:
+  struct Pose
+  {
+    double x, y, z, yaw;
+  };
+
+  struct Parameters
+  {
+    unsigned int maxIterations;
+    bool refineHeight;
+    // Standard deviation of the distance of an endpoint to the map (m), and distance above which its weight
+    // decreases (Huber)
+    double sigma;
+    double huberDistance;
+    // Endpoints further than this from an obstacle are outliers (m)
+    double maxDistance;
+    // Prior on the initial pose (m, rad)
+    double priorXYZStdDev;
+    double priorYawStdDev;
+    // The refinement is rejected when fewer endpoints are used or when it moves the pose further (m, rad)
+    double minInlierRatio;
+    double maxCorrection;
+    double maxYawCorrection;
+
+    // Defaults of the node parameters
+    Parameters();
+  };
+
+  struct Result
+  {
+    Pose pose;
+    unsigned int iterations;
+    // Endpoints used at the returned pose, and their RMS distance to the map (m)
+    unsigned int inliers;
+    double rmsDistance;
+    // The last step was below a millimeter and a milliradian
+    bool converged;
+  };
+
+  explicit ScanMatcher(const std::shared_ptr<const MapCache>& cache);
+
+  /**
+   * Refine a pose
+   * @return false if the refinement was rejected, result then holds the rejected pose
+   */
+  bool refine(const std::vector<Observation::Point>& points, double roll, double pitch, const Pose& initial,
+              const Parameters& params, Result& result) const;
+
+private:
+  /**
+   * Distance of a metric point to the nearest obstacle (m) and its gradient
+   * @return false outside of the grid or where the distance field is truncated
+   */
+  bool distance(double x, double y, double z, double& d, double gradient[3]) const;
+
+  std::shared_ptr<const MapCache> _cache;
+  // Value of the truncated cells of the distance field (mm)
+  uint16_t _truncated;
+};
+
+#endif
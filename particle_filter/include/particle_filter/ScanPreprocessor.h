@@ -0,0 +1,92 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SCANPREPROCESSOR_H
+#define SCANPREPROCESSOR_H
+
+#include <vector>
+
+#include "particle_filter/Observation.h"
+
+/**
+ * @class ScanPreprocessor
+ * @brief Turns sensor readings into the beams of an Observation: range filtering and beam selection.
+ *
+ * Its buffers keep their capacity between scans, so once they have grown to the scan size nothing is allocated.
+ * Not thread safe.
+ */
+class ScanPreprocessor
+{
+public:
+  struct Parameters
+  {
+    // Readings outside of [minRange, maxRange] are discarded
+    double minRange, maxRange;
+    // Beams kept from a scan (0 : no limit), and distance under which beam endpoints are redundant
+    unsigned int maxBeams;
+    double sampleDistance;
+  };
+
+  // Planar laser scan, the ranges are not copied
+  struct LaserScan
+  {
+    float angleMin, angleIncrement;
+    float rangeMin;
+    const float* ranges;
+    unsigned int numRanges;
+  };
+
+  explicit ScanPreprocessor(const Parameters& params);
+
+  const Parameters& parameters() const
+  {
+    return _params;
+  }
+
+  /**
+   * Replace the beams of an observation with the selected ones of a laser scan, in the laser frame
+   * @return beams in the valid range, before the selection
+   */
+  unsigned int prepareLaserScan(const LaserScan& scan, Observation& observation);
+
+  /**
+   * Add the reading of a range sensor, which measures along the x axis of its frame
+   * @return false if it is out of range
+   */
+  bool addRange(float range, float rangeMin, float rangeMax, unsigned int sensor, Observation& observation) const;
+
+private:
+  // Greedy farthest point selection over the valid beams, up to maxBeams
+  void selectBeams(Observation& observation);
+
+  Parameters _params;
+
+  // Valid beams of the last scan, and their distance to the selected ones
+  std::vector<Observation::Point> _validBeams;
+  std::vector<float> _validRanges;
+  std::vector<float> _beamMinSqDist;
+
+  // Direction of every beam, for the scan configuration they were computed for
+  std::vector<float> _beamCos;
+  std::vector<float> _beamSin;
+  float _beamTableAngleMin;
+  float _beamTableIncrement;
+};
+
+#endif
@@ -0,0 +1,128 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SHAREDMAP_H
+#define SHAREDMAP_H
+
+#include <atomic>
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+
+#include "particle_filter/MapCache.h"
+
+/**
+ * Map published in POSIX shared memory.
+ *
+ * Every generation of the map lives in its own read-only segment "<name>.<generation>", holding the MapCache
+ * bytes, which the clients query in place. The small control segment "<name>" holds the current generation.
+ * A new generation is completely written before it is advertised, and an old one stays valid for the clients
+ * that still map it, so readers never need a lock.
+ */
+namespace shared_map
+{
+struct Control
+{
+  char magic[8];
+  // 0 while no publisher is running
+  std::atomic<uint64_t> generation;
+  // Last generation ever published, so that generations keep increasing across publisher restarts
+  std::atomic<uint64_t> lastGeneration;
+};
+
+struct SegmentHeader
+{
+  char magic[8];
+  uint64_t generation;
+  uint64_t size;
+  uint64_t cacheOffset;
+  uint64_t cacheSize;
+};
+
+// Name of the segment of a generation
+std::string segmentName(const std::string& name, uint64_t generation);
+}
+
+/**
+ * @class SharedMapPublisher
+ * @brief Owns the shared memory segments of a map, they are removed when it is destroyed
+ */
+class SharedMapPublisher
+{
+public:
+  explicit SharedMapPublisher(const std::string& name);
+  ~SharedMapPublisher();
+
+  // Write a new generation of the map and advertise it
+  bool publish(const MapCache& cache, std::string& error);
+
+  uint64_t generation() const
+  {
+    return _generation;
+  }
+
+private:
+  bool createControl(std::string& error);
+
+  std::string _name;
+  shared_map::Control* _control;
+  uint64_t _generation;
+};
+
+/**
+ * @class SharedMap
+ * @brief Read-only view of the current generation of a shared map
+ */
+class SharedMap
+{
+public:
+  SharedMap();
+  ~SharedMap();
+
+  /**
+   * Map the current generation published under name (again, if already attached)
+   * @return false if no map has been published yet
+   */
+  bool attach(const std::string& name, std::string& error);
+
+  // True when a newer generation than the attached one has been published
+  bool updateAvailable() const;
+
+  uint64_t generation() const
+  {
+    return _generation;
+  }
+
+  // The cache, it points straight into the shared memory
+  const MapCache& cache() const
+  {
+    return _cache;
+  }
+
+private:
+  void detach();
+
+  const shared_map::Control* _control;
+  void* _segment;
+  std::size_t _segmentSize;
+  uint64_t _generation;
+  MapCache _cache;
+};
+
+#endif
@@ -0,0 +1,41 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef STATEESTIMATE_H
+#define STATEESTIMATE_H
+
+#include <libPF/ParticleFilter.h>
+
+#include "particle_filter/DroneState.h"
+
+/**
+ * 4-DOF estimate: weighted mean of x, y, z and of the yaw (on the circle, so that it does not break at +-pi) of
+ * the best x% of the particles, which must be sorted by weight (as after a filter step). If x <= 0, the state of
+ * the best particle is returned. Roll and pitch, shared by all the particles, are those of the best one.
+ */
+DroneState estimateFourDof(const libPF::ParticleFilter<DroneState>& pf, double percentage);
+
+/**
+ * Move all the particles rigidly by a fraction (gain in [0, 1]) of the correction from an estimate to a better
+ * one: translation of x, y, z and rotation of the yaw around the estimate. The weights are kept.
+ */
+void moveParticles(libPF::ParticleFilter<DroneState>& pf, const DroneState& estimate, const DroneState& corrected,
+                   double gain);
+
+#endif
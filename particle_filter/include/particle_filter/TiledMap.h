@@ -0,0 +1,288 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef TILEDMAP_H
+#define TILEDMAP_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <octomap/OcTree.h>
+#include <octomap/ColorOcTree.h>
+
+#include "particle_filter/MapCache.h"
+
+/**
+ * @class TiledMap
+ * @brief The grid and distance field of a MapCache, split in cubic tiles that are read from disk on demand.
+ *
+ * The tiles file (next to the map) holds an index and, for every tile that is not uniformly free or unknown,
+ * its occupancy and distance field. Tiles are kept in an LRU cache of bounded size. The window set by
+ * setWindow() is loaded before it is used and stays in memory; prefetch() loads tiles in a background thread.
+ * Memory thus depends on the neighbourhood of the drone, not on the size of the map. Drones sharing the map
+ * each keep their own Window, so that their lookups inside of it do not take the lock of the cache.
+ *
+ * The distance field of a tile is computed on the tile grown by half a tile on every side, so it is truncated
+ * at the smaller of maxDistance and half a tile: still a lower bound, which is all raycasting needs.
+ */
+class TiledMap
+{
+public:
+  static const uint32_t VERSION = 1;
+
+  enum TileState
+  {
+    // Uniform tiles are not stored
+    TILE_UNKNOWN = MapCache::UNKNOWN,
+    TILE_FREE = MapCache::FREE,
+    TILE_STORED = 3
+  };
+
+  struct Header
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    // FNV-1a of the source map file
+    uint64_t sourceChecksum;
+    // FNV-1a of the index
+    uint64_t indexChecksum;
+    uint64_t fileSize;
+
+    double resolution;
+    double origin[3];
+    uint32_t size[3];
+    // Tiles have 2^tileBits cells along every axis
+    uint32_t tileBits;
+    uint32_t numTiles[3];
+    // Requested truncation, and the one of the tiles (m)
+    float maxDistance;
+    float tileMaxDistance;
+
+    uint64_t indexOffset;
+  };
+
+  struct TileEntry
+  {
+    uint64_t offset;
+    // Low half of the FNV-1a of the tile
+    uint32_t checksum;
+    uint32_t state;
+  };
+
+  // Cells of a tile, x first: occupancy then distance field (mm)
+  struct Tile
+  {
+    uint32_t index;
+    std::vector<uint8_t> bytes;
+
+    const uint8_t* occupancy() const
+    {
+      return &bytes[0];
+    }
+    const uint16_t* distance(std::size_t numCells) const
+    {
+      return reinterpret_cast<const uint16_t*>(&bytes[numCells]);
+    }
+  };
+
+  // Tiles overlapping a box, read without locking. Only its user may change it (setWindow), between lookups.
+  class Window
+  {
+  public:
+    Window()
+    {
+      std::fill(_first, _first + 3, 0);
+      std::fill(_size, _size + 3, 0);
+    }
+
+    // Tiles kept in memory by the window
+    std::size_t numTiles() const
+    {
+      return _pins.size();
+    }
+
+  private:
+    friend class TiledMap;
+
+    // Tiles [_first, _first + _size), NULL for uniform ones, kept alive by _pins
+    uint32_t _first[3];
+    uint32_t _size[3];
+    std::vector<const Tile*> _tiles;
+    std::vector<std::shared_ptr<const Tile> > _pins;
+  };
+
+  struct Stats
+  {
+    // Tiles read synchronously (window or lookups outside of it) and by the prefetch thread
+    uint64_t loads;
+    uint64_t prefetched;
+    // Lookups (window or outside of it) served from memory
+    uint64_t hits;
+    uint64_t evictions;
+    uint64_t checksumErrors;
+    unsigned int residentTiles;
+    unsigned int windowTiles;
+  };
+
+  TiledMap();
+  ~TiledMap();
+
+  TiledMap(const TiledMap&) = delete;
+  TiledMap& operator=(const TiledMap&) = delete;
+
+  // Default location of the tiles of a map file
+  static std::string tilesPathFor(const std::string& mapFile);
+
+  /**
+   * Open a tiles file, reading only its header and index
+   * @param maxTiles capacity of the LRU cache, in tiles
+   * @return false if the file is missing or was built from another map or with other parameters
+   */
+  bool open(const std::string& tilesPath, uint64_t sourceChecksum, float maxDistance, uint32_t tileBits,
+            unsigned int maxTiles, std::string& error);
+
+  /**
+   * Write the tiles of an octree to tilesPath, one tile at a time (the whole grid is never in memory)
+   */
+  static bool build(const octomap::OcTree& tree, uint64_t sourceChecksum, float maxDistance, uint32_t tileBits,
+                    const std::string& tilesPath, std::string& error);
+  static bool build(const octomap::ColorOcTree& tree, uint64_t sourceChecksum, float maxDistance,
+                    uint32_t tileBits, const std::string& tilesPath, std::string& error);
+
+  bool isValid() const
+  {
+    return _fd >= 0;
+  }
+
+  const Header& header() const
+  {
+    return _header;
+  }
+
+  /**
+   * Load the tiles overlapping a metric box and keep them until the next window. Raycasting inside the
+   * window only reads memory; tiles outside of it are loaded synchronously when they are needed.
+   */
+  void setWindow(const double min[3], const double max[3]);
+  // Same for the window of one user of a shared map, thread safe
+  void setWindow(Window& window, const double min[3], const double max[3]) const;
+
+  // Queue the tiles overlapping a metric box for the background thread, replacing the previous request
+  void prefetch(const double min[3], const double max[3]);
+  // Same for the window of one user of a shared map: the requests of the windows are loaded in turn. Thread safe.
+  void prefetch(const Window& window, const double min[3], const double max[3]);
+
+  // State of the cell of a metric point, UNKNOWN outside of the grid
+  uint8_t cellState(double x, double y, double z) const;
+
+  Stats getStats() const;
+
+  // Memory held by the loaded tiles
+  std::size_t residentBytes() const;
+
+  // Grid interface of grid_raycast::castRay
+  double resolution() const
+  {
+    return _header.resolution;
+  }
+  double origin(int axis) const
+  {
+    return _header.origin[axis];
+  }
+  uint32_t size(int axis) const
+  {
+    return _header.size[axis];
+  }
+  bool probe(const int cell[3], double& freeCells, int& emptyBlockBits) const;
+
+  // See MapCache::castRay, looking the tiles up in window if it is given (instead of the window of the map)
+  bool castRay(float originX, float originY, float originZ, float directionX, float directionY, float directionZ,
+               float maxRange, float& range, const Window* window = NULL) const;
+
+private:
+  typedef std::shared_ptr<const Tile> TilePtr;
+
+  // Grid interface of grid_raycast::castRay over another window
+  struct WindowGrid;
+
+  bool probe(const Window& window, const int cell[3], double& freeCells, int& emptyBlockBits) const;
+
+  template <class TREE>
+  static bool buildFromTree(const TREE& tree, uint64_t sourceChecksum, float maxDistance, uint32_t tileBits,
+                            const std::string& tilesPath, std::string& error);
+
+  void close();
+
+  uint32_t tileIndex(uint32_t tx, uint32_t ty, uint32_t tz) const
+  {
+    return (tz * _header.numTiles[1] + ty) * _header.numTiles[0] + tx;
+  }
+
+  // Tile range [first, last] overlapping a metric box, false if it misses the grid
+  bool tileRange(const double min[3], const double max[3], uint32_t first[3], uint32_t last[3]) const;
+
+  // Load the window of a metric box into window (empty), false if it is the current one
+  bool loadWindow(const Window& current, const double min[3], const double max[3], Window& window) const;
+
+  // Read a tile from the file, NULL if it is corrupted
+  TilePtr readTile(uint32_t index) const;
+
+  // Tile from the cache, read (and cached) if needed. NULL for uniform tiles
+  TilePtr getTile(uint32_t index, bool prefetching) const;
+
+  // Add a tile to the cache as the most recent one, evicting the oldest ones. _mutex must be held
+  void insertTile(uint32_t index, const TilePtr& tile) const;
+
+  void prefetchLoop();
+
+  int _fd;
+  Header _header;
+  std::vector<TileEntry> _index;
+  std::size_t _tileCells;
+  unsigned int _maxTiles;
+
+  // LRU cache, most recent first
+  mutable std::mutex _mutex;
+  mutable std::list<uint32_t> _lru;
+  mutable std::unordered_map<uint32_t, std::pair<TilePtr, std::list<uint32_t>::iterator> > _resident;
+  mutable Stats _stats;
+
+  Window _window;
+
+  // Background loading
+  std::thread _prefetchThread;
+  std::condition_variable _prefetchCondition;
+  // Tiles to load for every window, and the window served last
+  std::map<const Window*, std::deque<uint32_t> > _prefetchRequests;
+  const Window* _lastPrefetched;
+  bool _stopPrefetch;
+};
+
+#endif
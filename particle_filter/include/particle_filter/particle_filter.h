@@ -23,11 +23,22 @@
 // System headers
 #include <iostream>
 #include <iomanip>
+#include <fstream>
+#include <cstdio>
 #include <vector>
 #include <string>
 #include <memory>
+#include <limits>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
 
 #include <boost/bind.hpp>
+#include <boost/thread/shared_mutex.hpp>
 
 // ROS headers
 #include <ros/ros.h>
@@ -51,6 +62,11 @@
 
 // ROS messages
 #include <sensor_msgs/LaserScan.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <sensor_msgs/Range.h>
+#include <sensor_msgs/Imu.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
+#include <drone_gazebo/Float64Stamped.h>
 #include <nav_msgs/Odometry.h>
 #include <geometry_msgs/PoseArray.h>
 #include <geometry_msgs/PoseWithCovarianceStamped.h>
@@ -63,21 +79,48 @@
 // PCL PointCloud
 #include <pcl_conversions/pcl_conversions.h>
 #include <pcl_ros/point_cloud.h>
-#include <pcl/keypoints/uniform_sampling.h>
 
 // Project headers
 #include "particle_filter/DroneObservationModel.h"
 #include "particle_filter/DroneMovementModel.h"
 #include "particle_filter/DroneStateDistribution.h"
+#include "particle_filter/FilterScheduler.h"
 #include "particle_filter/MapModel.h"
+#include "particle_filter/ScanPreprocessor.h"
+#include "particle_filter/BoundedQueue.h"
+#include "particle_filter/DeadlineController.h"
+#include "particle_filter/LatestValue.h"
+#include "particle_filter/ParticleCloud.h"
+#include "particle_filter/Relocalizer.h"
+#include "particle_filter/ScanMatcher.h"
+#include "particle_filter/Metrics.h"
+#include "particle_filter/StateEstimate.h"
 
 namespace pf
 {
 class Particles
 {
+public:
+  /**
+   * What the filters of several drones in one process share. A NULL member is created by each filter: its own
+   * map, TF listener, and prepare, filter and publish threads instead of the scheduler. mapMutex goes with map.
+   */
+  struct SharedResources
+  {
+    std::shared_ptr<MapModel> map;
+    // Held shared by the steps that use the map, exclusively while it is updated
+    std::shared_ptr<boost::shared_mutex> mapMutex;
+    std::shared_ptr<tf2_ros::Buffer> tfBuffer;
+    std::shared_ptr<FilterScheduler> scheduler;
+  };
+
 protected:
   // Models related
   ros::NodeHandle _nh;
+  // Namespace of the drone ("/drone1"), empty for a single drone
+  std::string _ns;
+  // Index of the drone, for the worker affinity of its steps
+  unsigned int _index;
   std::shared_ptr<libPF::ObservationModel<DroneState> > _om;
   DroneMovementModel* _mm;
   std::shared_ptr<MapModel> _mapModel;
@@ -86,6 +129,10 @@ protected:
 
   // Pub - Sub
   ros::Subscriber _truth_sub;
+  ros::Subscriber _mapChangesSub;
+  std::vector<ros::Subscriber> _rangeSubs;
+  ros::Subscriber _imuSub;
+  ros::Subscriber _odomSub;
 
   message_filters::Subscriber<sensor_msgs::LaserScan>* _scanListener;
   tf2_ros::MessageFilter<sensor_msgs::LaserScan>* _scanFilter;
@@ -95,11 +142,14 @@ protected:
 
   ros::Publisher _particlePublisher;
   ros::Publisher _posePublisher;
+  ros::Publisher _highRatePosePublisher;
   ros::Publisher _poseArrayPublisher;
+  ros::Publisher _compactCloudPublisher;
   ros::Publisher _filteredPointCloudPublisher;
   ros::Publisher _init_pose_pub;
 
   ros::ServiceServer _globalLocalizationService;
+  ros::ServiceServer _relocalizeService;
   ros::ServiceServer _initPoseService;
   ros::ServiceServer _repairPoseService;
 
@@ -110,13 +160,14 @@ protected:
   std::string _baseLinkFrameID;
 
   // TFs
-  tf2_ros::Buffer _tfBuffer;
-  tf2_ros::TransformListener* _tfListener;
+  std::shared_ptr<tf2_ros::Buffer> _tfBuffer;
+  std::unique_ptr<tf2_ros::TransformListener> _tfListener;
   tf2_ros::TransformBroadcaster* _tfBroadcaster;
   tf2::Transform _latestTransform;
+  // Correction of the odometry by the last estimate (map -> world), from the publish thread to the odometry callback
+  LatestValue<tf2::Transform> _odomCorrection;
 
   // Pose
-  geometry_msgs::PoseArray _poseArray;
   geometry_msgs::Pose _lastLocalizedPose;
   geometry_msgs::PoseWithCovarianceStamped _true_pose;
 
@@ -132,6 +183,8 @@ protected:
   double _observationThresholdTranslation;
   double _observationThresholdRotation;
   double _sensorSampleDist;
+  int _maxBeamsPerScan;
+  bool _publishFilteredCloud;
   double _transformTolerance;
 
   // Particles standard deviation
@@ -142,24 +195,291 @@ protected:
 
   int _percentage_of_particles;
 
+  // Global localization attitude: configured bounds, or the IMU roll and pitch within a tolerance
+  double _globalMaxRoll, _globalMaxPitch;
+  bool _globalUseImu;
+  double _imuAttitudeTolerance;
+  // IMU roll and pitch from the subscriber thread, read under _filterMutex (readImu)
+  LatestValue<std::pair<double, double> > _imuAttitude;
+  // Snapshot of _imuAttitude used by the whole step
+  bool _imuReceived;
+  double _imuRoll, _imuPitch;
+
+  // Relocalization: search of the scan over the whole map, on request (/relocalize) or when the estimate is lost
+  Relocalizer::Parameters _relocalizationParams;
+  double _relocalizationSigma;
+  int _relocalizationLevels;
+  double _relocalizationXYZStdDev, _relocalizationYawStdDev;
+  std::atomic<bool> _relocalizeRequested;
+  bool _autoRelocalization;
+  double _minNeffRatio;
+  double _minBeamLikelihood;
+  int _lostSteps;
+  int _lowQualitySteps;
+
+  // Recovery (augmented MCL, /recovery): particles drawn over the free space when the likelihood drops
+  bool _recovery;
+  double _recoveryAlphaSlow, _recoveryAlphaFast;
+  std::unique_ptr<DroneStateDistribution> _recoveryDistribution;
+
+  // Refinement (/refinement): registration of the scan to the distance field of the map, from the filter estimate
+  bool _refinement;
+  double _refinementFeedback;
+  ScanMatcher::Parameters _refinementParams;
+  std::unique_ptr<ScanMatcher> _scanMatcher;
+  std::vector<Observation::Point> _refinementPoints;
+  // Part of the last correction (x, y, z, yaw) that the particles did not take, added to the published estimates
+  double _refinementOffset[4];
+
+  // Real-time mode (/real_time): beams and particles of the next step chosen from the timings of the previous ones
+  std::unique_ptr<DeadlineController> _deadlineController;
+
+  // Particle cloud output: rate (Hz, 0 : with every estimate), particles kept (0 : all) and how they are chosen
+  ros::Timer _particleCloudTimer;
+  double _particleCloudRate;
+  int _particleCloudMaxParticles;
+  bool _particleCloudTopK;
+  bool _compactParticleCloud;
+  std::vector<unsigned int> _particleCloudIndices;
+
+  // Range filtering and beam selection, only used by the prepare thread
+  std::unique_ptr<ScanPreprocessor> _scanPreprocessor;
+
+  // Odometry pose of the last filter step
+  geometry_msgs::PoseStamped _lastOdomPose;
+  bool _odometryReceived;
+
+  // 4-DOF state: the particles estimate x, y, z and yaw, roll and pitch come from the odometry or the IMU
+  bool _fourDof;
+  bool _attitudeFromImu;
+
+  // Height sensor (/height_gating): recent measurements, matched to the scans by their stamp
+  bool _heightGating;
+  double _heightMaxDelay;
+  ros::Subscriber _heightSub;
+  std::mutex _heightMutex;
+  std::deque<std::pair<ros::Time, double> > _heights;
+
+  /*
+   * Scan pipeline: scanCallback() only queues the scan. The prepare thread looks up odometry and builds the
+   * point cloud of a scan while the filter thread runs the step of the previous one, and the publish thread
+   * sends the estimates. Every queue keeps only the latest items, so the pose lags by at most one step.
+   * With a shared scheduler, one task prepares, filters and publishes a scan instead of the threads.
+   */
+  // Readings of the range sensors within one batch window, indexed like _rangeSensors (NULL if missing)
+  struct RangeBatch
+  {
+    ros::Time first;
+    ros::Time last;
+    unsigned int numReadings;
+    std::vector<sensor_msgs::RangeConstPtr> readings;
+  };
+
+  // A laser scan, or a batch of range readings
+  struct ReceivedScan
+  {
+    sensor_msgs::LaserScanConstPtr msg;
+    std::shared_ptr<RangeBatch> batch;
+    ros::WallTime received;
+  };
+
+  struct PreparedScan
+  {
+    ros::Time stamp;
+    ros::WallTime received;
+    geometry_msgs::PoseStamped odomPose;
+    // Frame of the laser, or the base frame for range sensors
+    std::string frame;
+    Observation observation;
+    // False if a sensor to base transform was not available
+    bool hasSensorTransform;
+  };
+
+  // Range sensor (/range_topics), its transform is looked up once by the prepare thread
+  struct RangeSensor
+  {
+    std::string topic;
+    std::string frame;
+    bool hasTransform;
+    tf2::Transform baseToSensor;
+  };
+
+  std::vector<RangeSensor> _rangeSensors;
+  // Readings closer in time than this are one observation (s)
+  double _rangeBatchWindow;
+  // Batch being filled by rangeCallback
+  std::shared_ptr<RangeBatch> _rangeBatch;
+
+  struct PoseEstimate
+  {
+    ros::Time stamp;
+    // Reception of the scan, zero for estimates that do not come from a scan
+    ros::WallTime received;
+    // Particle cloud to publish with the estimate, empty if none
+    std::vector<DroneState> particles;
+    std::vector<double> weights;
+    DroneState bestState;
+  };
+
+  std::unique_ptr<BoundedQueue<ReceivedScan> > _scanQueue;
+  std::unique_ptr<BoundedQueue<std::shared_ptr<PreparedScan> > > _preparedQueue;
+  std::unique_ptr<BoundedQueue<std::shared_ptr<PoseEstimate> > > _estimateQueue;
+  // Prepared scans given back by the filter thread, so that their buffers are reused
+  std::unique_ptr<BoundedQueue<std::shared_ptr<PreparedScan> > > _recycledScans;
+  std::thread _prepareThread;
+  std::thread _filterThread;
+  std::thread _publishThread;
+
+  // Shared scheduler (NULL : own threads), it runs at most one step of this drone at a time
+  std::shared_ptr<FilterScheduler> _scheduler;
+  // A scan should be filtered within this time of its reception (s), the deadline of its step
+  double _stepDeadline;
+  std::atomic<bool> _stepScheduled;
+  std::atomic<bool> _stopping;
+  // Steps submitted and not returned yet, the destructor waits until there are none
+  std::mutex _stepMutex;
+  std::condition_variable _stepFinished;
+  int _stepsInFlight;
+  // False when the map is shared with other drones
+  bool _ownsMap;
+  std::shared_ptr<boost::shared_mutex> _mapMutex;
+  // Version of the map that the observation model uses
+  uint64_t _mapVersion;
+  // Tiles around the particles of this drone, when the tiled map is shared
+  std::shared_ptr<TiledMap::Window> _tileWindow;
+
+  // Held by the filter thread during a step, and by the callbacks that reset the particles
+  std::mutex _filterMutex;
+  // _latestTransform is written by the publish thread and read by the timer
+  std::mutex _transformMutex;
+
+  // Updated by every thread without locking, exported by _metricsTimer
+  Metrics _metrics;
+  ros::Timer _metricsTimer;
+  ros::Publisher _diagnosticsPublisher;
+  double _metricsRate;
+  std::string _prometheusFile;
+  uint64_t _lastRaycasts;
+  ros::WallTime _lastMetricsTime;
+
   // Functions
-  void publishPoseEstimate(const ros::Time& t);
-  void prepareLaserPointCloud(const sensor_msgs::LaserScanConstPtr& scan, pcl::PointCloud<pcl::PointXYZ>& pc,
-                              std::vector<float>& ranges) const;
+  // Parameter of the drone namespace, else the global one
+  template <class T>
+  void param(const std::string& name, T& value, const T& defaultValue)
+  {
+    if (_ns.empty() || !_nh.getParam(_ns + name, value))
+      _nh.param<T>(name, value, defaultValue);
+  }
+  // Topic (or service) in the drone namespace
+  std::string resolveTopic(const std::string& name) const;
+  // Frame prefixed by the drone namespace, unless it already is
+  std::string resolveFrame(const std::string& frame) const;
+
+  void prepareLoop();
+  void filterLoop();
+  void publishLoop();
+
+  // Odometry, points and transforms of a scan, false if the odometry is not available
+  bool prepareScan(const ReceivedScan& received, PreparedScan& scan);
+
+  // Submit a step to the scheduler, unless one is already waiting or running
+  void scheduleStep();
+  // Prepare and filter the oldest queued scan and publish the estimates, then submit the next step if needed
+  void runScheduledStep();
+
+  // Apply the pending map updates before a step, once no step of the drones that share the map is running
+  void updateMap();
+
+  // One filter step (or drift) for a prepared scan, _mapMutex (shared) and then _filterMutex must be held
+  void filterScan(const PreparedScan& scan);
+
+  // Estimate of the particles (best /percentage_of_particles_to_use), _filterMutex must be held
+  DroneState filterEstimate() const;
+  /**
+   * Register the scan to the map from the filter estimate, move the particles by /refinement/feedback of the
+   * correction and keep the rest for the published estimates, _filterMutex must be held
+   */
+  void refineEstimate(const PreparedScan& scan);
+  // Account for the step time and resize the next step to the deadline, _filterMutex must be held
+  void adaptToDeadline(double stepTime, const ObservationStats& stats, unsigned int availableBeams);
+  // Queue the current estimate for the publish thread, _filterMutex must be held
+  void queuePoseEstimate(const ros::Time& t, const ros::WallTime& received);
+  void publishPoseEstimate(const PoseEstimate& estimate);
+
+  bool hasParticleCloudSubscribers() const;
+  // Copy the particles of the cloud output (decimated), _filterMutex must be held
+  void sampleParticleCloud(std::vector<DroneState>& states, std::vector<double>& weights);
+  void publishParticleCloud(const ros::Time& t, const std::vector<DroneState>& states,
+                            const std::vector<double>& weights);
+  /**
+   * Search the scan over the map and draw the particles around the best poses, _filterMutex must be held and
+   * the IMU snapshot of the step taken (readImu)
+   * @return false if there is no map cache or no pose explains the scan
+   */
+  bool relocalize(const PreparedScan& scan);
+  // Count the steps with a collapsed Neff or likelihood, true when the estimate is considered lost
+  bool isLost(const ObservationStats& stats);
+  // Attitude of the particles drawn over the map: 4-DOF attitude, IMU, or /global_localization bounds
+  void setGlobalAttitude(DroneStateDistribution& distribution) const;
+  // Uniform distribution over the free space of the map, NULL after the map changed
+  void updateRecoveryDistribution();
+
+  // Points, sensors and transforms of a batch of range readings, false if a transform is missing
+  bool prepareRangeBatch(const RangeBatch& batch, PreparedScan& scan);
+  // Hand the current range batch to the pipeline
+  void flushRangeBatch();
+  void publishFilteredCloud(const PreparedScan& scan);
+
+  /// look up the odom pose at a certain time through tf
+  bool lookupOdomPose(const ros::Time& t, geometry_msgs::PoseStamped& odomPose) const;
+  //  Find the transform between base->target in TF Frame tree
+  bool lookupTargetToBaseTransform(const std::string& targetFrame, const ros::Time& t,
+                                   geometry_msgs::TransformStamped& localTransform) const;
+  void setLastOdomPose(const geometry_msgs::PoseStamped& odomPose);
+  // Odometry motion from the last filter step to odomPose, in the base frame, identity before the first step
+  Eigen::Isometry3d computeOdomTransform(const geometry_msgs::PoseStamped& odomPose) const;
+  static Eigen::Isometry3d toEigen(const tf2::Transform& transform);
+  static Eigen::Isometry3d toEigen(const geometry_msgs::Pose& pose);
+  // Take the latest IMU roll and pitch as the snapshot of a step, _filterMutex must be held
+  void readImu();
+  // Roll and pitch of the base in 4-DOF mode: the IMU when it is the source, else the last odometry pose
+  void getAttitude(double& roll, double& pitch) const;
+
+  // Height measurement closest to t within /height_gating/max_delay, negative if there is none
+  float lookupHeight(const ros::Time& t);
+  // What the observation model measures in: the map, with the height field for height gating
+  MapView getMapView();
 
   bool isAboveMotionThreshold(const geometry_msgs::PoseStamped& odomPose) const;
 
+  // Load the map tiles around the particles before a filter step, and prefetch them along the motion
+  void focusMap(const geometry_msgs::PoseStamped& odomPose, double dt);
+
   // Callbacks
   void scanCallback(const sensor_msgs::LaserScan::ConstPtr& msg);
+  void rangeCallback(const sensor_msgs::RangeConstPtr& msg, unsigned int sensor);
   void truePoseCallback(const nav_msgs::OdometryConstPtr& msg);
+  void imuCallback(const sensor_msgs::ImuConstPtr& msg);
+  // High-rate pose: the odometry pose corrected by the last estimate
+  void odomCallback(const nav_msgs::OdometryConstPtr& msg);
+  void heightCallback(const drone_gazebo::Float64StampedConstPtr& msg);
+  void mapChangesCallback(const sensor_msgs::PointCloud2ConstPtr& msg);
   void latestTransformTimerCallback(const ros::TimerEvent& timer_event);
+  void particleCloudTimerCallback(const ros::TimerEvent& timer_event);
+  void metricsTimerCallback(const ros::TimerEvent& timer_event);
   void initialPoseCallback(const geometry_msgs::PoseWithCovarianceStampedConstPtr& msg);
   bool globalLocalizationCallback(std_srvs::Empty::Request& req, std_srvs::Empty::Response& res);
+  bool relocalizeSrvCallback(std_srvs::Empty::Request& req, std_srvs::Empty::Response& res);
   bool initialPoseSrvCallback(std_srvs::Empty::Request& req, std_srvs::Empty::Response& res);
   bool repairPoseSrvCallback(std_srvs::Empty::Request& req, std_srvs::Empty::Response& res);
 
 public:
-  Particles();
+  /**
+   * @param ns namespace of the drone, of its topics, parameters and frames, empty for a single drone
+   * @param index index of the drone among those of the process
+   */
+  explicit Particles(const std::string& ns = "", const SharedResources& shared = SharedResources(),
+                     unsigned int index = 0);
   ~Particles();
 };
 
@@ -0,0 +1,116 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <cmath>
+
+#include "particle_filter/DeadlineController.h"
+
+namespace
+{
+// The observation model folds the beams in chunks of 8
+const unsigned int BEAM_STEP = 8;
+const unsigned int PARTICLE_STEP = 10;
+// Largest increase per step
+const double BEAM_GROWTH = 1.25;
+const double PARTICLE_GROWTH = 1.1;
+}  // namespace
+
+DeadlineController::Parameters::Parameters()
+  : deadline(0.05), targetRatio(0.8), minBeams(16), minParticles(100), maxParticles(500), smoothing(0.2)
+{
+}
+
+DeadlineController::DeadlineController(const Parameters& params)
+  : _params(params)
+  , _beams(0)
+  , _particles(params.maxParticles)
+  , _availableBeams(0)
+  , _particleCost(0.0)
+  , _beamCost(0.0)
+  , _overhead(0.0)
+  , _predicted(0.0)
+  , _steps(0)
+  , _misses(0)
+{
+  _params.minParticles = std::max(1u, std::min(_params.minParticles, _params.maxParticles));
+  _params.smoothing = std::min(std::max(_params.smoothing, 0.01), 1.0);
+}
+
+unsigned int DeadlineController::beams() const
+{
+  return _beams >= _availableBeams ? 0 : _beams;
+}
+
+bool DeadlineController::update(const Step& step)
+{
+  _steps++;
+  if (step.stepTime > _params.deadline)
+    _misses++;
+  if (step.particles == 0 || step.beams == 0)
+    return false;
+
+  double particleCost = step.particleTime / step.particles;
+  double beamCost = step.measureTime / (double(step.particles) * step.beams);
+  double overhead = std::max(step.stepTime - step.particleTime - step.measureTime, 0.0);
+  if (_particleCost <= 0.0 && _beamCost <= 0.0)
+  {
+    _particleCost = particleCost;
+    _beamCost = beamCost;
+    _overhead = overhead;
+  }
+  else
+  {
+    _particleCost += _params.smoothing * (particleCost - _particleCost);
+    _beamCost += _params.smoothing * (beamCost - _beamCost);
+    _overhead += _params.smoothing * (overhead - _overhead);
+  }
+  particleCost = std::max(particleCost, _particleCost);
+  beamCost = std::max(beamCost, _beamCost);
+  if (_beams == 0 || _beams > step.availableBeams)
+    _beams = step.availableBeams;
+  _availableBeams = step.availableBeams;
+
+  // The most particles that fit with the fewest beams, then the most beams that fit with them
+  double budget = std::max(_params.targetRatio * _params.deadline - _overhead, 0.0);
+  unsigned int minBeams = std::min(_params.minBeams, _availableBeams);
+  double particles = budget / std::max(particleCost + beamCost * minBeams, 1e-12);
+  particles = std::min(particles, std::min(double(_params.maxParticles), std::ceil(_particles * PARTICLE_GROWTH)));
+  unsigned int newParticles = std::max(_params.minParticles, unsigned(particles) / PARTICLE_STEP * PARTICLE_STEP);
+  newParticles = std::min(newParticles, _params.maxParticles);
+  // Small changes are not worth resizing the filter, unless the deadline was missed
+  if (newParticles > _particles && newParticles < _particles + std::max(PARTICLE_STEP, _particles / 20))
+    newParticles = _particles;
+  else if (newParticles < _particles && newParticles + std::max(PARTICLE_STEP, _particles / 10) > _particles &&
+           step.stepTime <= _params.deadline)
+    newParticles = _particles;
+
+  double beams = (budget / newParticles - particleCost) / std::max(beamCost, 1e-12);
+  beams = std::min(beams, std::ceil(_beams * BEAM_GROWTH) + BEAM_STEP);
+  unsigned int newBeams = beams <= 0.0 ? 0 : unsigned(std::min(beams, double(_availableBeams)));
+  if (newBeams < _availableBeams)
+    newBeams = newBeams / BEAM_STEP * BEAM_STEP;
+  newBeams = std::max(newBeams, minBeams);
+
+  bool changed = newBeams != _beams || newParticles != _particles;
+  _beams = newBeams;
+  _particles = newParticles;
+  _predicted = _overhead + _particles * (particleCost + beamCost * _beams);
+  return changed;
+}
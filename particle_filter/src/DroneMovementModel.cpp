@@ -17,38 +17,27 @@
 * You should have received a copy of the GNU General Public License
 * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <cmath>
+
 #include <libPF/CRandomNumberGenerator.h>
 #include "particle_filter/DroneMovementModel.h"
 
-using namespace std;
-
-DroneMovementModel::DroneMovementModel(ros::NodeHandle* nh, tf2_ros::Buffer* tfBuffer, const std::string& worldFrameID,
-                                       const std::string& baseFootprintFrameID, const std::string& baseLinkID)
+DroneMovementModel::DroneMovementModel(const Parameters& params)
   : libPF::MovementModel<DroneState>()
-  , _tfBuffer(tfBuffer)
-  , _tfListener(new tf2_ros::TransformListener(*tfBuffer))
-  , _worldFrameID(worldFrameID)
-  , _baseFootprintFrameID(baseFootprintFrameID)
-  , _baseLinkFrameID(baseLinkID)
-  , _odometryReceived(false)
+  , _odomTransform(Eigen::Isometry3d::Identity())
+  , _fourDof(params.fourDof)
+  , _headingMotion(Eigen::Vector3d::Zero())
+  , _yawMotion(0.0)
+  , _roll(0.0)
+  , _pitch(0.0)
+  , _XStdDev(params.xStdDev)
+  , _YStdDev(params.yStdDev)
+  , _ZStdDev(params.zStdDev)
+  , _RollStdDev(params.rollStdDev)
+  , _PitchStdDev(params.pitchStdDev)
+  , _YawStdDev(params.yawStdDev)
 {
   m_RNG = new libPF::CRandomNumberGenerator();
-  nh->param<double>("/movement/x_std_dev", _XStdDev, 0.2);
-  nh->param<double>("/movement/y_std_dev", _YStdDev, 0.2);
-  nh->param<double>("/movement/z_std_dev", _ZStdDev, 0.2);
-  nh->param<double>("/movement/roll_std_dev", _RollStdDev, 0.2);
-  nh->param<double>("/movement/pitch_std_dev", _PitchStdDev, 0.2);
-  nh->param<double>("/movement/yaw_std_dev", _YawStdDev, 0.2);
-
-  nh->param<double>("/x_pos", _xMean, 0);
-  nh->param<double>("/y_pos", _yMean, 0);
-  nh->param<double>("/z_pos", _zMean, 0);
-
-  nh->param<double>("/roll", _rollMean, 0);
-  nh->param<double>("/pitch", _pitchMean, 0);
-  nh->param<double>("/yaw", _yawMean, 0);
-
-  ROS_INFO("Drone movement model has been initialized!\n");
 }
 
 DroneMovementModel::~DroneMovementModel()
@@ -58,41 +47,18 @@ DroneMovementModel::~DroneMovementModel()
 
 void DroneMovementModel::drift(DroneState& state, double dt) const
 {
-  geometry_msgs::Pose currentPose;
-  currentPose.position.x = state.getXPos();
-  currentPose.position.y = state.getYPos();
-  currentPose.position.z = state.getZPos();
-
-  // Convert RPY to quaternion, to apply the odom transform, then roll back
-  tf2::Quaternion currentOrientation;
-  currentOrientation.setRPY(state.getRoll(), state.getPitch(), state.getYaw());
-  // Convert tf::quaternion to std_msgs::quaternion to be accepted in the odom msg
-  currentPose.orientation = tf2::toMsg(currentOrientation.normalize());
-
-  geometry_msgs::TransformStamped odomTransform;
-
-  if (!(lookupOdomTransform(_lastOdomPose.header.stamp + ros::Duration(dt), odomTransform)))
+  if (_fourDof)
   {
-    ROS_WARN("Transform not found! \n");
+    double c = std::cos(state.getYaw()), s = std::sin(state.getYaw());
+    state.setXPos(state.getXPos() + c * _headingMotion.x() - s * _headingMotion.y());
+    state.setYPos(state.getYPos() + s * _headingMotion.x() + c * _headingMotion.y());
+    state.setZPos(state.getZPos() + _headingMotion.z());
+    state.setYaw(state.getYaw() + _yawMotion);
+    state.setRoll(_roll);
+    state.setPitch(_pitch);
+    return;
   }
-
-  applyOdomTransform(odomTransform, currentPose);
-
-  // Set the updated state
-  state.setXPos(currentPose.position.x);
-  state.setYPos(currentPose.position.y);
-  state.setZPos(currentPose.position.z);
-
-  // Set the orientation. Pose has quaternion but we need RPY, convert!
-  tf2::Quaternion newOrientation;
-  tf2::fromMsg(currentPose.orientation, newOrientation);
-
-  double roll, pitch, yaw;
-  tf2::Matrix3x3(newOrientation).getRPY(roll, pitch, yaw);
-
-  state.setRoll(roll);
-  state.setPitch(pitch);
-  state.setYaw(yaw);
+  state.setPose(state.getPose() * _odomTransform);
 }
 
 void DroneMovementModel::diffuse(DroneState& state, double dt) const
@@ -104,8 +70,11 @@ void DroneMovementModel::diffuse(DroneState& state, double dt) const
   state.setYPos(state.getYPos() + (m_RNG->getGaussian(_YStdDev)) * dt);
   state.setZPos(state.getZPos() + (m_RNG->getGaussian(_ZStdDev)) * dt);
 
-  state.setRoll(state.getRoll() + (m_RNG->getGaussian(_RollStdDev)) * dt);
-  state.setPitch(state.getPitch() + (m_RNG->getGaussian(_PitchStdDev)) * dt);
+  if (!_fourDof)
+  {
+    state.setRoll(state.getRoll() + (m_RNG->getGaussian(_RollStdDev)) * dt);
+    state.setPitch(state.getPitch() + (m_RNG->getGaussian(_PitchStdDev)) * dt);
+  }
   state.setYaw(state.getYaw() + (m_RNG->getGaussian(_YawStdDev)) * dt);
 }
 
@@ -169,113 +138,28 @@ double DroneMovementModel::getYawStdDev() const
   return _YawStdDev;
 }
 
-void DroneMovementModel::setLastOdomPose(geometry_msgs::PoseStamped& odomPose)
+void DroneMovementModel::setOdomTransform(const Eigen::Isometry3d& odomTransform)
 {
-  _odometryReceived = true;
-  if (odomPose.header.stamp < _lastOdomPose.header.stamp)
-  {
-    ROS_WARN("Trying to store an OdomPose that is older than the current in the MotionModel, ignoring!");
-  }
-  else
-  {
-    _lastOdomPose = odomPose;
-  }
+  _odomTransform = odomTransform;
 }
 
-void DroneMovementModel::reset()
+void DroneMovementModel::setOdomPoses(const Eigen::Isometry3d& lastOdomPose, const Eigen::Isometry3d& odomPose)
 {
-  _odometryReceived = false;
-}
+  _odomTransform = lastOdomPose.inverse() * odomPose;
 
-geometry_msgs::PoseStamped DroneMovementModel::getLastOdomPose() const
-{
-  return _lastOdomPose;
+  DroneState last, current;
+  last.setPose(lastOdomPose);
+  current.setPose(odomPose);
+  _headingMotion =
+      Eigen::AngleAxisd(-last.getYaw(), Eigen::Vector3d::UnitZ()) * (odomPose.translation() - lastOdomPose.translation());
+  double yawMotion = current.getYaw() - last.getYaw();
+  _yawMotion = std::atan2(std::sin(yawMotion), std::cos(yawMotion));
+  _roll = current.getRoll();
+  _pitch = current.getPitch();
 }
 
-geometry_msgs::TransformStamped DroneMovementModel::computeOdomTransform(geometry_msgs::PoseStamped& currentPose) const
+void DroneMovementModel::setAttitude(double roll, double pitch)
 {
-  tf2::Transform lastOdom;
-  tf2::fromMsg(_lastOdomPose.pose, lastOdom);
-
-  tf2::Transform curPose;
-  tf2::fromMsg(currentPose.pose, curPose);
-
-  geometry_msgs::TransformStamped output;
-
-  if (_odometryReceived)
-  {
-    tf2::convert(lastOdom.inverseTimes(curPose), output.transform);
-    return output;
-  }
-  else
-  {
-    tf2::convert(tf2::Transform::getIdentity(), output.transform);
-    return output;
-  }
-}
-
-void DroneMovementModel::applyOdomTransform(geometry_msgs::TransformStamped& odomTransform,
-                                            geometry_msgs::Pose& statePose) const
-{
-  tf2::Transform odomTF;
-  tf2::fromMsg(odomTransform.transform, odomTF);
-
-  tf2::Transform pose;
-  tf2::fromMsg(statePose, pose);
-
-  tf2::Transform output;
-  output = pose * odomTF;
-
-  tf2::toMsg(output, statePose);
-}
-
-bool DroneMovementModel::lookupOdomPose(ros::Time const& t, geometry_msgs::PoseStamped& odomPose) const
-{
-  geometry_msgs::PoseStamped identity;
-  identity.header.frame_id = _baseFootprintFrameID;
-  identity.header.stamp = t;
-
-  tf2::toMsg(tf2::Transform::getIdentity(), identity.pose);
-  try
-  {
-    _tfBuffer->transform(identity, odomPose, _worldFrameID, ros::Duration(0.1));
-  }
-  catch (tf2::TransformException& e)
-  {
-    ROS_WARN("Failed to compute odom pose, skipping scan (%s)", e.what());
-    return false;
-  }
-  return true;
-}
-
-bool DroneMovementModel::lookupOdomTransform(const ros::Time& t, geometry_msgs::TransformStamped& odomTransform) const
-{
-  geometry_msgs::PoseStamped odomPose;
-
-  if (t <= _lastOdomPose.header.stamp)
-  {
-    ROS_WARN("Looking up OdomTransform that is %f ms older than the lastOdomPose!",
-             (_lastOdomPose.header.stamp - t).toSec() / 1000.0);
-  }
-
-  if (!lookupOdomPose(t, odomPose))
-    return false;
-
-  odomTransform = computeOdomTransform(odomPose);
-  return true;
-}
-
-bool DroneMovementModel::lookupTargetToBaseTransform(std::string const& targetFrame, ros::Time const& t,
-                                                     geometry_msgs::TransformStamped& localTransform) const
-{
-  try
-  {
-    localTransform = _tfBuffer->lookupTransform(targetFrame, _baseLinkFrameID, t);
-  }
-  catch (tf2::TransformException& e)
-  {
-    ROS_WARN("Failed to lookup local transform %s ", e.what());
-    return false;
-  }
-  return true;
+  _roll = roll;
+  _pitch = pitch;
 }
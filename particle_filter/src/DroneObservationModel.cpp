@@ -17,24 +17,89 @@
 * You should have received a copy of the GNU General Public License
 * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include <utility>
+
 #include "particle_filter/DroneObservationModel.h"
-#include "particle_filter/MapModel.h"
 
-DroneObservationModel::DroneObservationModel(ros::NodeHandle* nh, std::shared_ptr<MapModel> _mapModel)
+namespace
+{
+// Wrap an angle to [-pi, pi]
+inline double normalizeAngle(double angle)
+{
+  return std::atan2(std::sin(angle), std::cos(angle));
+}
+}  // namespace
+
+DroneObservationModel::Parameters::Parameters()
+  : zHit(0.5)
+  , zShort(0.05)
+  , zRand(0.5)
+  , zMax(0.05)
+  , sigmaHit(0.2)
+  , lambdaShort(0.1)
+  , minRange(0.01)
+  , maxRange(14)
+  , earlyTermination(false)
+  , earlyTerminationRatio(1e-6)
+  , weightCache(false)
+  , cacheXYZBin(0.05)
+  , cacheAngleBin(2.0 * M_PI / 180.0)
+  , heightGating(false)
+  , heightSigma(0.1)
+  , heightGate(0.5)
+{
+}
+
+DroneObservationModel::DroneObservationModel(const Parameters& params, const MapView& map)
   : libPF::ObservationModel<DroneState>()
+  , _ZHit(params.zHit)
+  , _ZShort(params.zShort)
+  , _ZRand(params.zRand)
+  , _ZMax(params.zMax)
+  , _SigmaHit(params.sigmaHit)
+  , _LambdaShort(params.lambdaShort)
+  , _minRange(params.minRange)
+  , _maxRange(params.maxRange)
+  , _earlyTermination(params.earlyTermination)
+  , _earlyTerminationRatio(params.earlyTerminationRatio)
+  , _maxBeams(0)
+  , _weightCache(params.weightCache)
+  , _cacheXYZBin(params.cacheXYZBin)
+  , _cacheAngleBin(params.cacheAngleBin)
+  , _heightGating(params.heightGating)
+  , _heightSigma(params.heightSigma)
+  , _heightGate(params.heightGate)
+  , _observedHeight(-1.0)
 {
-  _map = _mapModel->getMap();
-  _baseToSensorTransform.setIdentity();
-  nh->param<double>("/laser_z_hit", _ZHit, 0.5);
-  nh->param<double>("/laser_z_short", _ZShort, 0.05);
-  nh->param<double>("/laser_z_rand", _ZRand, 0.5);
-  nh->param<double>("/laser_z_max", _ZMax, 0.05);
-  nh->param<double>("/laser_sigma_hit", _SigmaHit, 0.2);
-  nh->param<double>("/laser_lambda_short", _LambdaShort, 0.1);
-  nh->param<double>("/min_range", _minRange, 0.01);
-  nh->param<double>("/max_range", _maxRange, 14);
+  setMap(map);
+  _baseToSensorTransforms.assign(1, Eigen::Isometry3d::Identity());
+
+  // Invalid settings disable the optimization, the caller reports them
+  if (_earlyTerminationRatio <= 0.0 || _earlyTerminationRatio >= 1.0)
+    _earlyTermination = false;
+  else
+    _logEarlyTerminationRatio = std::log(_earlyTerminationRatio);
+  if (_cacheXYZBin <= 0.0 || _cacheAngleBin <= 0.0)
+    _weightCache = false;
+  if (_heightSigma <= 0.0 || _heightGate <= 0.0)
+    _heightGating = false;
+  else
+    _gateLogLikelihood = -0.5 * (_heightGate / _heightSigma) * (_heightGate / _heightSigma);
+
+  // raycast in OctoMap, we need to cast a little longer than max_range
+  // to correct for particle drifts away from obstacles
+  _raycastRange = 1.5 * _maxRange;
+
+  computeHitTable();
 
-  ROS_INFO("Drone observation model has been created!\n");
+  _constantLogWeight = 0.0;
+  _minBeamsLogWeight = 0.0;
+  _bestLogLikelihood = -std::numeric_limits<double>::infinity();
+  _stats = ObservationStats();
 }
 
 DroneObservationModel::~DroneObservationModel()
@@ -43,115 +108,307 @@ DroneObservationModel::~DroneObservationModel()
 
 double DroneObservationModel::measure(const DroneState& state) const
 {
-  // transform current particle's pose to its sensor frame
-  tf2::Transform particlePose;
-  geometry_msgs::Transform particlePose_g;
-  particlePose_g.translation.x = state.getXPos();
-  particlePose_g.translation.y = state.getYPos();
-  particlePose_g.translation.z = state.getZPos();
+  _stats.particlesMeasured++;
 
-  tf::Quaternion particlePoseOrientation;
-  particlePoseOrientation = tf::createQuaternionFromRPY(state.getRoll(), state.getPitch(), state.getYaw());
-  particlePoseOrientation.normalize();
-  // Convert tf::quaternion to std_msgs::quaternion to be accepted in the odom msg
-  tf::quaternionTFToMsg(particlePoseOrientation, particlePose_g.rotation);
+  double logWeight;
+  if (!_weightCache)
+  {
+    logWeight = computeLogWeight(state);
+  }
+  else
+  {
+    // After resampling many particles are copies of the same ancestor, moved only a few cm by the diffusion
+    std::pair<std::unordered_map<PoseBin, double, PoseBinHash>::iterator, bool> entry =
+        _weightCacheMap.insert(std::make_pair(poseBin(state), 0.0));
+    if (!entry.second)
+    {
+      _stats.cacheHits++;
+    }
+    else
+    {
+      entry.first->second = computeLogWeight(state);
+    }
+    logWeight = entry.first->second;
+  }
 
-  tf2::fromMsg(particlePose_g, particlePose);
+  _stats.logLikelihoodSum += logWeight;
+  if (_stats.particlesMeasured == 1)
+  {
+    _stats.maxLogLikelihood = logWeight;
+    _stats.relativeLikelihoodSum = 1.0;
+  }
+  else if (logWeight > _stats.maxLogLikelihood)
+  {
+    _stats.relativeLikelihoodSum = _stats.relativeLikelihoodSum * std::exp(_stats.maxLogLikelihood - logWeight) + 1.0;
+    _stats.maxLogLikelihood = logWeight;
+  }
+  else
+  {
+    _stats.relativeLikelihoodSum += std::exp(logWeight - _stats.maxLogLikelihood);
+  }
+  return std::exp(logWeight);
+}
 
-  tf2::Transform globalLaserOriginTf = particlePose * _baseToSensorTransform;
+double DroneObservationModel::measurementLikelihood(double meanWeight) const
+{
+  // From the log-likelihoods, since the weights underflow with many beams. The weight is a product over the
+  // beams, whose number changes from scan to scan
+  if (_stats.particlesMeasured == 0 || _stats.beamsObserved == 0)
+    return meanWeight;
+  double logMean = _stats.maxLogLikelihood + std::log(_stats.relativeLikelihoodSum / _stats.particlesMeasured);
+  return std::exp(logMean / _stats.beamsObserved);
+}
 
-  // Raycasting Origin Point
-  octomap::point3d originP(globalLaserOriginTf.getOrigin().getX(), globalLaserOriginTf.getOrigin().getY(),
-                           globalLaserOriginTf.getOrigin().getZ());
+DroneObservationModel::PoseBin DroneObservationModel::poseBin(const DroneState& state) const
+{
+  PoseBin bin;
+  bin.x = static_cast<int>(std::floor(state.getXPos() / _cacheXYZBin));
+  bin.y = static_cast<int>(std::floor(state.getYPos() / _cacheXYZBin));
+  bin.z = static_cast<int>(std::floor(state.getZPos() / _cacheXYZBin));
+  // Angles are wrapped to [-pi, pi) so that equal orientations fall in the same bin
+  bin.roll = static_cast<int>(std::floor(normalizeAngle(state.getRoll()) / _cacheAngleBin));
+  bin.pitch = static_cast<int>(std::floor(normalizeAngle(state.getPitch()) / _cacheAngleBin));
+  bin.yaw = static_cast<int>(std::floor(normalizeAngle(state.getYaw()) / _cacheAngleBin));
+  return bin;
+}
 
-  // Transform Pointcloud
-  Eigen::Matrix4d globalLaserOrigin;
+bool DroneObservationModel::heightLogLikelihood(const DroneState& state, double& logLikelihood) const
+{
+  logLikelihood = 0.0;
+  double expected;
+  if (_observedHeight < 0.0 || !_map.heights ||
+      !_map.heights->heightAt(state.getXPos(), state.getYPos(), state.getZPos(), expected))
+    return true;
 
-  geometry_msgs::Transform transformMsg;
-  transformMsg = tf2::toMsg(globalLaserOriginTf);
-  Eigen::Affine3d tmp = tf2::transformToEigen(transformMsg);
+  // Beyond the gate every height is equally unlikely, so that a wrong measurement cannot zero all the weights
+  double error = (expected - _observedHeight) / _heightSigma;
+  logLikelihood = std::max(-0.5 * error * error, _gateLogLikelihood);
+  return std::abs(expected - _observedHeight) <= _heightGate;
+}
 
-  pcl::PointCloud<pcl::PointXYZ> pcTransformed;
-  pcl::transformPointCloud(_observedMeasurement, pcTransformed, tmp);
+double DroneObservationModel::computeLogWeight(const DroneState& state) const
+{
+  // A table lookup in the height field before any raycast
+  double heightLogWeight = 0.0;
+  if (_heightGating && !heightLogLikelihood(state, heightLogWeight))
+  {
+    _stats.particlesGated++;
+    _stats.raycastsSkipped += _beams.size();
+    return _constantLogWeight + _minBeamsLogWeight + heightLogWeight;
+  }
 
-  pcl::PointCloud<pcl::PointXYZ>::const_iterator pcIter = pcTransformed.begin();
-  std::vector<float>::const_iterator rangesIter = _observedRanges.begin();
+  // Pose of every sensor of the particle, the beam endpoints are transformed one by one as they are evaluated
+  Eigen::Isometry3d particlePose = state.getPose();
+  unsigned int numSensors = _baseToSensorTransforms.size();
+  _sensorPoses.resize(numSensors);
+  for (unsigned int s = 0; s < numSensors; s++)
+    _sensorPoses[s] = particlePose * _baseToSensorTransforms[s];
 
-  double weight = 1.0;
+  // The likelihood is accumulated as a product over a few beams at a time and then folded into log domain,
+  // so that it neither underflows nor needs a log per beam, and can be compared against the best particle
+  static const unsigned int beamsPerChunk = 8;
+  double logWeight = _constantLogWeight + heightLogWeight;
+  double chunkWeight = 1.0;
 
-  for (; pcIter != pcTransformed.end(); pcIter++, rangesIter++)
+  unsigned int numBeams = _beams.size();
+  for (unsigned int k = 0; k < numBeams; k++)
   {
-    // Probability for weight
-    double p = 0.0;
+    const ObservedBeam& beam = _beams[k];
 
-    float obsRange = *rangesIter;
-    float raycastRange;
-    octomap::point3d direction(pcIter->x, pcIter->y, pcIter->z);
-    direction = direction - originP;
+    const Eigen::Isometry3d& sensorPose = _sensorPoses[beam.sensor];
+    Eigen::Vector3d origin = sensorPose.translation();
+    Eigen::Vector3d direction = sensorPose.linear() * Eigen::Vector3d(beam.x, beam.y, beam.z);
 
-    octomap::point3d end;
+    float raycastRange = _raycastRange;
 
-    octomap::ColorOcTreeNode* colorNode;
-    // raycast in OctoMap, we need to cast a little longer than max_range
-    // to correct for particle drifts away from obstacles
-    if (_map->castRay(originP, direction, end, true, 1.5 * _maxRange))
+    _stats.raycastsPerformed++;
+    float hitRange;
+    if (_map.castRay(origin.x(), origin.y(), origin.z(), direction.x(), direction.y(), direction.z(), _raycastRange,
+                     hitRange))
+      raycastRange = hitRange;
+
+    // Particle in occupied space(??)
+    if (raycastRange != 0)
     {
-      ROS_ASSERT(_map->isNodeOccupied(_map->search(end)));
-      colorNode = _map->search(end);
-      raycastRange = (originP - end).norm();
+      //  Probabilistics Robotics page 129
+      // Algorithm beam range finder model
+      // Part 1 (good, but noisy, hit) depends on the particle, the rest was computed with the observation
+      double p = hitProbability(beam.range - raycastRange) + beam.constant;
+      assert(p > 0.0);
+      chunkWeight *= p;
     }
 
-    // Particle in occupied space(??)
-    if (raycastRange == 0)
+    if ((k + 1) % beamsPerChunk != 0 && k + 1 < numBeams)
       continue;
 
-    float z = obsRange - raycastRange;
+    logWeight += std::log(chunkWeight);
+    chunkWeight = 1.0;
 
-    //  Probabilistics Robotics page 129
-    // Algorithm beam range finder model
+    // Even if all the remaining beams were perfect hits, this particle would stay negligible
+    // compared to the best one measured so far: stop raycasting and keep that upper bound
+    if (_earlyTermination && k + 1 < numBeams)
+    {
+      double bound = logWeight + _remainingLogBound[k + 1];
+      if (bound < _bestLogLikelihood + _logEarlyTerminationRatio)
+      {
+        double ratio = std::exp(bound - _bestLogLikelihood);
+        _stats.particlesTerminated++;
+        _stats.raycastsSkipped += numBeams - k - 1;
+        _stats.maxDiscardedWeightRatio = std::max(_stats.maxDiscardedWeightRatio, ratio);
+        _stats.discardedWeightBound += ratio;
+        return bound;
+      }
+    }
+  }
 
-    // Part 1: good, but noisy, hit
-    if (obsRange < _maxRange)
-      p += (_ZHit * exp(-(z * z) / (2 * _SigmaHit * _SigmaHit))) / (std::sqrt(2 * M_PI * _SigmaHit * _SigmaHit));
-    // std::cout << "Part 1 : "
-    // << (_ZHit * exp(-(z * z) / (2 * _SigmaHit * _SigmaHit))) / (std::sqrt(2 * M_PI * _SigmaHit * _SigmaHit))
-    // << std::endl;
+  _bestLogLikelihood = std::max(_bestLogLikelihood, logWeight);
 
-    // Part 2: short reading from unexpected obstacle (e.g., a person)
-    if (obsRange < _maxRange)
-      p += _ZShort * _LambdaShort * exp(-_LambdaShort * obsRange);
-    // std::cout << "Part 2 : " << _ZShort * _LambdaShort * exp(-_LambdaShort * obsRange) << std::endl;
+  return logWeight;
+}
+
+void DroneObservationModel::setMap(const MapView& map)
+{
+  _map = map;
+}
+
+void DroneObservationModel::setObservedMeasurements(const Observation& observation)
+{
+  _baseToSensorTransforms = observation.baseToSensor;
+  if (_baseToSensorTransforms.empty())
+    _baseToSensorTransforms.assign(1, Eigen::Isometry3d::Identity());
+
+  std::vector<unsigned int> order;
+  computeBeamOrder(observation, order);
+  // Every prefix of the order spreads over the whole field of view
+  if (_maxBeams > 0 && order.size() > _maxBeams)
+    order.resize(_maxBeams);
+
+  // Everything that depends only on the observed ranges is computed once per scan
+  double shortCoeff = _ZShort * _LambdaShort;
+  double randTerm = _ZRand * 1.0 / _maxRange;
+  double hitMax = hitProbability(0.0);
+
+  _beams.clear();
+  _beams.reserve(order.size());
+  _constantLogWeight = 0.0;
+  for (unsigned int k = 0; k < order.size(); k++)
+  {
+    unsigned int i = order[k];
+    float obsRange = observation.ranges[i];
 
     // Part 3: Failure to detect obstacle, reported as max-range
-    if (obsRange == _maxRange)
-      p += _ZMax * 1.0;
-    // std::cout << "Part 3 : " << _ZMax * 1.0 << std::endl;
+    // The probability does not depend on the particle, so there is nothing to raycast
+    if (obsRange >= _maxRange)
+    {
+      _constantLogWeight += std::log(_ZMax * 1.0);
+      continue;
+    }
 
+    ObservedBeam beam;
+    beam.x = observation.points[i].x;
+    beam.y = observation.points[i].y;
+    beam.z = observation.points[i].z;
+    beam.sensor = observation.sensor(i);
+    beam.range = obsRange;
+    // Part 2: short reading from unexpected obstacle (e.g., a person)
     // Part 4: Random measurements
-    if (obsRange < _maxRange)
-      p += _ZRand * 1.0 / _maxRange;
-    // std::cout << "Part 4 : " << _ZRand * 1.0 / _maxRange << std::endl;
+    beam.constant = shortCoeff * exp(-_LambdaShort * obsRange) + randTerm;
+    _beams.push_back(beam);
+  }
 
-    ROS_ASSERT(p > 0.0);
-    weight *= p;
+  // The z_hit part is maximum for a perfect hit (z = 0), and at least 0
+  _remainingLogBound.assign(_beams.size() + 1, 0.0);
+  _minBeamsLogWeight = 0.0;
+  for (int k = int(_beams.size()) - 1; k >= 0; k--)
+  {
+    _remainingLogBound[k] = _remainingLogBound[k + 1] + std::log(hitMax + _beams[k].constant);
+    _minBeamsLogWeight += std::log(_beams[k].constant);
   }
-  // std::cout << "Weight : " << weight << std::endl;
-  return weight;
+  _observedHeight = observation.height;
+
+  // New observation, the bound has to be found again. The particles arrive sorted by their previous
+  // weight, so the best ones are measured first and the bound becomes tight early
+  _bestLogLikelihood = -std::numeric_limits<double>::infinity();
+  _stats = ObservationStats();
+  _stats.beamsObserved = order.size();
+  _weightCacheMap.clear();
 }
 
-void DroneObservationModel::setMap(const std::shared_ptr<octomap::ColorOcTree>& map)
+void DroneObservationModel::setMaxBeams(unsigned int maxBeams)
 {
-  _map = map;
+  _maxBeams = maxBeams;
 }
 
-void DroneObservationModel::setBaseToSensorTransform(const tf2::Transform& baseToSensorTF)
+const ObservationStats& DroneObservationModel::getStats() const
 {
-  _baseToSensorTransform = baseToSensorTF;
+  return _stats;
+}
+
+void DroneObservationModel::computeBeamOrder(const Observation& observation, std::vector<unsigned int>& order) const
+{
+  unsigned int numBeams = observation.points.size();
+
+  // Beams sorted by their azimuth in the sensor frame, or in the base frame when there are several sensors
+  std::vector<std::pair<float, unsigned int> > byAngle(numBeams);
+  for (unsigned int i = 0; i < numBeams; i++)
+  {
+    const Observation::Point& pt = observation.points[i];
+    if (observation.sensors.empty())
+    {
+      byAngle[i] = std::make_pair(std::atan2(pt.y, pt.x), i);
+      continue;
+    }
+    Eigen::Vector3d direction =
+        _baseToSensorTransforms[observation.sensors[i]].linear() * Eigen::Vector3d(pt.x, pt.y, pt.z);
+    byAngle[i] = std::make_pair(std::atan2(direction.y(), direction.x()), i);
+  }
+  std::sort(byAngle.begin(), byAngle.end());
+
+  // Coarse to fine: every 2^n-th beam first, then the ones in between
+  unsigned int stride = 1;
+  while (stride * 2 <= numBeams)
+    stride *= 2;
+
+  order.clear();
+  order.reserve(numBeams);
+  std::vector<bool> taken(numBeams, false);
+  for (; stride >= 1; stride /= 2)
+  {
+    for (unsigned int i = 0; i < numBeams; i += stride)
+    {
+      if (!taken[i])
+      {
+        taken[i] = true;
+        order.push_back(byAngle[i].second);
+      }
+    }
+  }
+}
+
+void DroneObservationModel::computeHitTable()
+{
+  // 32 samples per sigma, up to 8 sigma. Beyond that the Gaussian is far below the z_rand part
+  static const unsigned int samplesPerSigma = 32;
+  static const unsigned int numSigmas = 8;
+
+  _hitTableStep = _SigmaHit / samplesPerSigma;
+  _hitTableInvStep = 1.0 / _hitTableStep;
+
+  double norm = _ZHit / std::sqrt(2 * M_PI * _SigmaHit * _SigmaHit);
+  _hitTable.resize(samplesPerSigma * numSigmas + 1);
+  for (unsigned int i = 0; i < _hitTable.size(); i++)
+  {
+    double z = i * _hitTableStep;
+    _hitTable[i] = norm * exp(-(z * z) / (2 * _SigmaHit * _SigmaHit));
+  }
+  // Outside the table the Gaussian counts as zero
+  _hitTable.back() = 0.0;
 }
 
-void DroneObservationModel::setObservedMeasurements(pcl::PointCloud<pcl::PointXYZ> const& observed,
-                                                    std::vector<float> const& ranges)
+double DroneObservationModel::hitProbability(float z) const
 {
-  _observedMeasurement = observed;
-  _observedRanges = ranges;
+  unsigned int index = static_cast<unsigned int>(std::abs(z) * _hitTableInvStep + 0.5);
+  if (index >= _hitTable.size())
+    return 0.0;
+  return _hitTable[index];
 }
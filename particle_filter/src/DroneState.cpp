@@ -17,6 +17,7 @@
 * You should have received a copy of the GNU General Public License
 * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
 #include <cmath>
 
 #include "particle_filter/DroneState.h"
@@ -128,3 +129,27 @@ void DroneState::setYaw(double y)
 {
   yaw = y;
 }
+
+Eigen::Isometry3d DroneState::getPose() const
+{
+  Eigen::Isometry3d pose;
+  pose.linear() = (Eigen::AngleAxisd(yaw, Eigen::Vector3d::UnitZ()) *
+                   Eigen::AngleAxisd(pitch, Eigen::Vector3d::UnitY()) *
+                   Eigen::AngleAxisd(roll, Eigen::Vector3d::UnitX()))
+                      .toRotationMatrix();
+  pose.translation() = Eigen::Vector3d(x_pos, y_pos, z_pos);
+  return pose;
+}
+
+void DroneState::setPose(const Eigen::Isometry3d& pose)
+{
+  x_pos = pose.translation().x();
+  y_pos = pose.translation().y();
+  z_pos = pose.translation().z();
+
+  // Same convention as tf2::Matrix3x3::getRPY(): pitch in [-pi/2, pi/2]
+  Eigen::Matrix3d r = pose.linear();
+  pitch = std::asin(std::max(-1.0, std::min(1.0, -r(2, 0))));
+  roll = std::atan2(r(2, 1), r(2, 2));
+  yaw = std::atan2(r(1, 0), r(0, 0));
+}
@@ -17,6 +17,7 @@
 * You should have received a copy of the GNU General Public License
 * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
 #include <cmath>
 #include <libPF/CRandomNumberGenerator.h>
 
@@ -41,6 +42,7 @@ DroneStateDistribution::DroneStateDistribution(double xmin, double xmax, double
 {
   m_RNG = new libPF::CRandomNumberGenerator();
   _uniform = true;
+  _fixedAttitude = false;
 }
 
 // Gauss
@@ -63,15 +65,22 @@ DroneStateDistribution::DroneStateDistribution(double xStd, double yStd, double
 
   m_RNG = new libPF::CRandomNumberGenerator();
   _uniform = false;
+  _fixedAttitude = false;
 }
 
-DroneStateDistribution::DroneStateDistribution(std::shared_ptr<MapModel> map)
+DroneStateDistribution::DroneStateDistribution(const std::shared_ptr<const FreeSpaceIndex>& freeSpace,
+                                               const double min[3], const double max[3])
+  : _XMin(min[0])
+  , _XMax(max[0])
+  , _YMin(min[1])
+  , _YMax(max[1])
+  , _ZMin(min[2])
+  , _ZMax(max[2])
+  , _freeSpace(freeSpace)
 {
-  _map = map->getMap();
   m_RNG = new libPF::CRandomNumberGenerator();
-  double zmin, zmax;
-  _map->getMetricMin(_XMin, _YMin, _ZMin);
-  _map->getMetricMax(_XMax, _YMax, _ZMax);
+  if (_freeSpace && _freeSpace->size() == 0)
+    _freeSpace.reset();
   _RollMin = -M_PI;
   _PitchMin = -M_PI;
   _YawMin = -M_PI;
@@ -79,6 +88,7 @@ DroneStateDistribution::DroneStateDistribution(std::shared_ptr<MapModel> map)
   _PitchMax = M_PI;
   _YawMax = M_PI;
   _uniform = true;
+  _fixedAttitude = false;
 }
 
 DroneStateDistribution::~DroneStateDistribution()
@@ -111,6 +121,33 @@ void DroneStateDistribution::setMean(double x, double y, double z, double r, dou
   _yawMean = yaw;
 }
 
+void DroneStateDistribution::setAttitude(double rollMin, double rollMax, double pitchMin, double pitchMax)
+{
+  _RollMin = rollMin;
+  _RollMax = rollMax;
+  _PitchMin = pitchMin;
+  _PitchMax = pitchMax;
+}
+
+void DroneStateDistribution::fixAttitude(double roll, double pitch)
+{
+  _fixedAttitude = true;
+  _fixedRoll = roll;
+  _fixedPitch = pitch;
+}
+
+void DroneStateDistribution::setMeans(const std::vector<DroneState>& means, const std::vector<double>& weights)
+{
+  _means = means;
+  _meanWeights.resize(weights.size());
+  double sum = 0.0;
+  for (std::size_t i = 0; i < weights.size(); i++)
+  {
+    sum += weights[i];
+    _meanWeights[i] = sum;
+  }
+}
+
 const DroneState DroneStateDistribution::DroneStateDistribution::draw() const
 {
   DroneState state;
@@ -122,11 +159,28 @@ const DroneState DroneStateDistribution::DroneStateDistribution::draw() const
      * @param max the maximum value, default is 1.0
      * @return random number between min and max, uniform distributed.
      */
-    state.setXPos(m_RNG->getUniform(_XMin, _XMax));
-    state.setYPos(m_RNG->getUniform(_YMin, _YMax));
-    state.setZPos(m_RNG->getUniform(_ZMin, _ZMax));
-    state.setRoll(m_RNG->getUniform(_RollMin, _RollMax));
-    state.setPitch(m_RNG->getUniform(_PitchMin, _PitchMax));
+    if (_freeSpace)
+    {
+      // A uniform cell of the free space, then a uniform point in it
+      uint64_t rank = std::min(uint64_t(m_RNG->getUniform(0.0, _freeSpace->size())), _freeSpace->size() - 1);
+      double x, y, z;
+      _freeSpace->cellCenter(rank, x, y, z);
+      double halfCell = 0.5 * _freeSpace->resolution();
+      state.setXPos(x + m_RNG->getUniform(-halfCell, halfCell));
+      state.setYPos(y + m_RNG->getUniform(-halfCell, halfCell));
+      state.setZPos(z + m_RNG->getUniform(-halfCell, halfCell));
+    }
+    else
+    {
+      state.setXPos(m_RNG->getUniform(_XMin, _XMax));
+      state.setYPos(m_RNG->getUniform(_YMin, _YMax));
+      state.setZPos(m_RNG->getUniform(_ZMin, _ZMax));
+    }
+    if (!_fixedAttitude)
+    {
+      state.setRoll(m_RNG->getUniform(_RollMin, _RollMax));
+      state.setPitch(m_RNG->getUniform(_PitchMin, _PitchMax));
+    }
     state.setYaw(m_RNG->getUniform(_YawMin, _YawMax));
   }
   else
@@ -136,13 +190,40 @@ const DroneState DroneStateDistribution::DroneStateDistribution::draw() const
     * @param standardDeviation Standard deviation d of the random number to generate.
     * @return N(u, d*d)-distributed random number
     */
-    state.setXPos(m_RNG->getGaussian(_XStdDev) + _xMean);
-    state.setYPos(m_RNG->getGaussian(_YStdDev) + _yMean);
-    state.setZPos(m_RNG->getGaussian(_ZStdDev) + _zMean);
-    state.setRoll(m_RNG->getGaussian(_RollStdDev) + _rollMean);
-    state.setPitch(m_RNG->getGaussian(_PitchStdDev) + _pitchMean);
-    state.setYaw(m_RNG->getGaussian(_YawStdDev) + _yawMean);
+    if (!_means.empty())
+    {
+      std::size_t i = std::upper_bound(_meanWeights.begin(), _meanWeights.end(),
+                                       m_RNG->getUniform(0.0, _meanWeights.back())) -
+                      _meanWeights.begin();
+      const DroneState& mean = _means[std::min(i, _means.size() - 1)];
+      state.setXPos(m_RNG->getGaussian(_XStdDev) + mean.getXPos());
+      state.setYPos(m_RNG->getGaussian(_YStdDev) + mean.getYPos());
+      state.setZPos(m_RNG->getGaussian(_ZStdDev) + mean.getZPos());
+      if (!_fixedAttitude)
+      {
+        state.setRoll(m_RNG->getGaussian(_RollStdDev) + mean.getRoll());
+        state.setPitch(m_RNG->getGaussian(_PitchStdDev) + mean.getPitch());
+      }
+      state.setYaw(m_RNG->getGaussian(_YawStdDev) + mean.getYaw());
+    }
+    else
+    {
+      state.setXPos(m_RNG->getGaussian(_XStdDev) + _xMean);
+      state.setYPos(m_RNG->getGaussian(_YStdDev) + _yMean);
+      state.setZPos(m_RNG->getGaussian(_ZStdDev) + _zMean);
+      if (!_fixedAttitude)
+      {
+        state.setRoll(m_RNG->getGaussian(_RollStdDev) + _rollMean);
+        state.setPitch(m_RNG->getGaussian(_PitchStdDev) + _pitchMean);
+      }
+      state.setYaw(m_RNG->getGaussian(_YawStdDev) + _yawMean);
+    }
   }
 
+  if (_fixedAttitude)
+  {
+    state.setRoll(_fixedRoll);
+    state.setPitch(_fixedPitch);
+  }
   return state;
 }
@@ -0,0 +1,149 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+
+#include "particle_filter/FilterScheduler.h"
+
+FilterScheduler::FilterScheduler(unsigned int numThreads)
+  : _sequence(0), _queued(0), _stop(false), _executed(0), _stolen(0), _missedDeadlines(0)
+{
+  if (numThreads == 0)
+    numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+  for (unsigned int i = 0; i < numThreads; i++)
+    _workers.push_back(std::unique_ptr<Worker>(new Worker()));
+  for (unsigned int i = 0; i < numThreads; i++)
+    _workers[i]->thread = std::thread(&FilterScheduler::run, this, i);
+}
+
+FilterScheduler::~FilterScheduler()
+{
+  {
+    std::lock_guard<std::mutex> lock(_sleepMutex);
+    _stop = true;
+  }
+  _wakeUp.notify_all();
+  for (std::size_t i = 0; i < _workers.size(); i++)
+    _workers[i]->thread.join();
+}
+
+void FilterScheduler::submit(const Task& task, Clock::time_point deadline, unsigned int affinity)
+{
+  // Counted before it is queued, so that a worker taking it at once never makes the count negative
+  {
+    std::lock_guard<std::mutex> lock(_sleepMutex);
+    _queued++;
+  }
+  Worker& worker = *_workers[affinity % _workers.size()];
+  {
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    QueuedTask queued = { task, deadline, _sequence.fetch_add(1, std::memory_order_relaxed) };
+    worker.heap.push_back(queued);
+    std::push_heap(worker.heap.begin(), worker.heap.end());
+  }
+  _wakeUp.notify_one();
+}
+
+FilterScheduler::Stats FilterScheduler::getStats() const
+{
+  Stats stats;
+  stats.executed = _executed.load(std::memory_order_relaxed);
+  stats.stolen = _stolen.load(std::memory_order_relaxed);
+  stats.missedDeadlines = _missedDeadlines.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void FilterScheduler::run(unsigned int index)
+{
+  while (true)
+  {
+    QueuedTask task;
+    bool stolen;
+    if (take(index, task, stolen))
+    {
+      _queued--;
+      if (Clock::now() > task.deadline)
+        _missedDeadlines.fetch_add(1, std::memory_order_relaxed);
+      if (stolen)
+        _stolen.fetch_add(1, std::memory_order_relaxed);
+      task.task();
+      _executed.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+
+    // A task may be counted but not queued yet, or taken by another worker, then this wait returns at once and
+    // the queues are searched again
+    std::unique_lock<std::mutex> lock(_sleepMutex);
+    _wakeUp.wait(lock, [this] { return _stop || _queued > 0; });
+    if (_stop && _queued == 0)
+      return;
+  }
+}
+
+bool FilterScheduler::take(unsigned int index, QueuedTask& task, bool& stolen)
+{
+  stolen = false;
+  if (pop(*_workers[index], task))
+    return true;
+
+  // The most urgent task of the other workers. It may be taken by someone else in the meantime, then the next
+  // one is searched
+  while (true)
+  {
+    std::size_t victim = _workers.size();
+    Clock::time_point earliest = Clock::time_point::max();
+    for (std::size_t i = 0; i < _workers.size(); i++)
+    {
+      Clock::time_point deadline;
+      if (i != index && front(*_workers[i], deadline) && (victim == _workers.size() || deadline < earliest))
+      {
+        victim = i;
+        earliest = deadline;
+      }
+    }
+    if (victim == _workers.size())
+      return false;
+    if (pop(*_workers[victim], task))
+    {
+      stolen = true;
+      return true;
+    }
+  }
+}
+
+bool FilterScheduler::pop(Worker& worker, QueuedTask& task)
+{
+  std::lock_guard<std::mutex> lock(worker.mutex);
+  if (worker.heap.empty())
+    return false;
+  std::pop_heap(worker.heap.begin(), worker.heap.end());
+  task = worker.heap.back();
+  worker.heap.pop_back();
+  return true;
+}
+
+bool FilterScheduler::front(Worker& worker, Clock::time_point& deadline)
+{
+  std::lock_guard<std::mutex> lock(worker.mutex);
+  if (worker.heap.empty())
+    return false;
+  deadline = worker.heap.front().deadline;
+  return true;
+}
@@ -0,0 +1,92 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <cmath>
+
+#include "particle_filter/FreeSpaceIndex.h"
+
+FreeSpaceIndex::FreeSpaceIndex(const MapCache& cache, double radius, double minHeight, double maxHeight)
+  : _numCells(0), _resolution(cache.resolution())
+{
+  for (int i = 0; i < 3; i++)
+  {
+    _origin[i] = cache.header().origin[i];
+    _size[i] = cache.header().size[i];
+  }
+
+  const uint8_t* occupancy = cache.occupancy();
+  const uint16_t* distance = cache.distanceField();
+  uint16_t minDistance = uint16_t(std::min(radius, double(cache.header().maxDistance)) * 1000.0);
+  int minCells = int(std::ceil(minHeight / _resolution));
+  int maxCells = int(std::floor(maxHeight / _resolution));
+
+  // Layer by layer from the bottom, with the last occupied layer of every column
+  std::size_t layerCells = std::size_t(_size[0]) * _size[1];
+  std::vector<int> surface(layerCells, -1);
+
+  std::size_t idx = 0;
+  for (uint32_t iz = 0; iz < _size[2]; iz++)
+  {
+    for (std::size_t column = 0; column < layerCells; column++, idx++)
+    {
+      bool feasible = false;
+      if (occupancy[idx] == MapCache::OCCUPIED)
+      {
+        surface[column] = iz;
+      }
+      else if (occupancy[idx] == MapCache::FREE && distance[idx] >= minDistance && surface[column] >= 0)
+      {
+        int height = int(iz) - surface[column];
+        feasible = height >= minCells && height <= maxCells;
+      }
+      if (!feasible)
+        continue;
+
+      if (!_runs.empty() && _runs.back().start + _runs.back().length == idx)
+      {
+        _runs.back().length++;
+      }
+      else
+      {
+        Run run = { _numCells, idx, 1 };
+        _runs.push_back(run);
+      }
+      _numCells++;
+    }
+  }
+}
+
+void FreeSpaceIndex::cellCenter(uint64_t rank, double& x, double& y, double& z) const
+{
+  // Last run starting at or before rank
+  std::vector<Run>::const_iterator run =
+      std::upper_bound(_runs.begin(), _runs.end(), rank,
+                       [](uint64_t r, const Run& run) { return r < run.firstRank; }) -
+      1;
+  std::size_t idx = run->start + (rank - run->firstRank);
+
+  uint32_t ix = idx % _size[0];
+  idx /= _size[0];
+  uint32_t iy = idx % _size[1];
+  uint32_t iz = idx / _size[1];
+  x = _origin[0] + (ix + 0.5) * _resolution;
+  y = _origin[1] + (iy + 0.5) * _resolution;
+  z = _origin[2] + (iz + 0.5) * _resolution;
+}
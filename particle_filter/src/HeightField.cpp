@@ -0,0 +1,42 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "particle_filter/HeightField.h"
+
+HeightField::HeightField(const MapCache& cache)
+  : _cells(cache.numCells(), NO_SURFACE), _resolution(cache.resolution()), _invResolution(1.0 / cache.resolution())
+{
+  for (int i = 0; i < 3; i++)
+  {
+    _origin[i] = cache.header().origin[i];
+    _size[i] = cache.header().size[i];
+  }
+
+  // Layer by layer from the bottom, counting up from the last occupied cell of every column. Unknown cells
+  // keep the count, as the surface below them is still the last one that was seen
+  const uint8_t* occupancy = cache.occupancy();
+  std::size_t layerCells = std::size_t(_size[0]) * _size[1];
+  for (std::size_t idx = 0; idx < _cells.size(); idx++)
+  {
+    if (occupancy[idx] == MapCache::OCCUPIED)
+      _cells[idx] = 0;
+    else if (idx >= layerCells && _cells[idx - layerCells] < NO_SURFACE - 1)
+      _cells[idx] = _cells[idx - layerCells] + 1;
+  }
+}
@@ -0,0 +1,554 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "particle_filter/MapCache.h"
+#include "particle_filter/GridRaycast.h"
+
+namespace
+{
+const char MAGIC[8] = { 'P', 'F', 'M', 'A', 'P', 'C', 'H', 'E' };
+
+// [offset, offset + count * itemSize) within size bytes, without overflowing
+bool fitsIn(uint64_t offset, uint64_t count, uint64_t itemSize, uint64_t size)
+{
+  return offset <= size && count <= (size - offset) / itemSize;
+}
+
+// Sections start on cache line boundaries
+std::size_t align(std::size_t offset)
+{
+  return (offset + 63) & ~std::size_t(63);
+}
+
+/**
+ * 1D squared Euclidean distance transform (Felzenszwalb & Huttenlocher).
+ * f : input costs, d : output, v, z : scratch of size n and n + 1
+ */
+void distanceTransform1D(const float* f, float* d, int n, int* v, float* z)
+{
+  const float inf = std::numeric_limits<float>::infinity();
+  int k = 0;
+  v[0] = 0;
+  z[0] = -inf;
+  z[1] = inf;
+  for (int q = 1; q < n; q++)
+  {
+    if (f[q] == inf)
+      continue;
+    if (f[v[k]] == inf)
+    {
+      v[k] = q;
+      continue;
+    }
+    float s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2 * q - 2 * v[k]);
+    while (s <= z[k])
+    {
+      k--;
+      s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2 * q - 2 * v[k]);
+    }
+    k++;
+    v[k] = q;
+    z[k] = s;
+    z[k + 1] = inf;
+  }
+
+  k = 0;
+  for (int q = 0; q < n; q++)
+  {
+    while (z[k + 1] < q)
+      k++;
+    if (f[v[k]] == inf)
+      d[q] = inf;
+    else
+      d[q] = (q - v[k]) * (q - v[k]) + f[v[k]];
+  }
+}
+
+/**
+ * Squared distance transform of a 3D grid along one axis, in place
+ */
+void distanceTransformAxis(std::vector<float>& grid, const uint32_t size[3], int axis)
+{
+  std::size_t stride[3] = { 1, size[0], std::size_t(size[0]) * size[1] };
+  int n = size[axis];
+  int a1 = (axis + 1) % 3;
+  int a2 = (axis + 2) % 3;
+
+  std::vector<float> f(n), d(n), z(n + 1);
+  std::vector<int> v(n);
+  for (uint32_t i = 0; i < size[a1]; i++)
+  {
+    for (uint32_t j = 0; j < size[a2]; j++)
+    {
+      std::size_t base = i * stride[a1] + j * stride[a2];
+      for (int q = 0; q < n; q++)
+        f[q] = grid[base + q * stride[axis]];
+      distanceTransform1D(&f[0], &d[0], n, &v[0], &z[0]);
+      for (int q = 0; q < n; q++)
+        grid[base + q * stride[axis]] = d[q];
+    }
+  }
+}
+
+// Bounding box of the cells [low, high] changed in a block
+struct CellBox
+{
+  uint32_t low[3];
+  uint32_t high[3];
+};
+}  // namespace
+
+MapCache::MapCache() : _mapped(NULL), _mappedSize(0), _data(NULL), _header(NULL)
+{
+}
+
+MapCache::~MapCache()
+{
+  release();
+}
+
+void MapCache::release()
+{
+  if (_mapped)
+    munmap(_mapped, _mappedSize);
+  _mapped = NULL;
+  _mappedSize = 0;
+  std::vector<uint8_t>().swap(_buffer);
+  _data = NULL;
+  _header = NULL;
+}
+
+std::string MapCache::cachePathFor(const std::string& mapFile)
+{
+  return mapFile + ".cache";
+}
+
+uint64_t MapCache::checksum(const void* data, std::size_t size, uint64_t seed)
+{
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  uint64_t hash = seed;
+  for (std::size_t i = 0; i < size; i++)
+  {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+octomap::AbstractOcTree* MapCache::readMapFile(const std::string& mapFile)
+{
+  if (mapFile.size() > 3 && mapFile.compare(mapFile.size() - 3, 3, ".bt") == 0)
+  {
+    // Binary trees only hold occupancy, the nodes get a default color
+    std::ifstream file(mapFile.c_str(), std::ios_base::in | std::ios_base::binary);
+    octomap::ColorOcTree* colorTree = new octomap::ColorOcTree(0.1);
+    if (!file.is_open() || !colorTree->readBinary(file))
+    {
+      delete colorTree;
+      return NULL;
+    }
+    return colorTree;
+  }
+
+  return octomap::AbstractOcTree::read(mapFile);
+}
+
+bool MapCache::checksumFile(const std::string& path, uint64_t& result)
+{
+  std::ifstream file(path.c_str(), std::ios::binary);
+  if (!file)
+    return false;
+
+  result = checksum(NULL, 0);
+  std::vector<char> chunk(1 << 16);
+  while (file)
+  {
+    file.read(&chunk[0], chunk.size());
+    result = checksum(&chunk[0], file.gcount(), result);
+  }
+  return true;
+}
+
+bool MapCache::open(const std::string& cachePath, uint64_t sourceChecksum, float maxDistance, bool verify,
+                    std::string& error)
+{
+  release();
+  error.clear();
+
+  int fd = ::open(cachePath.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    error = "cannot open " + cachePath + ": " + std::strerror(errno);
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || std::size_t(st.st_size) < sizeof(Header))
+  {
+    ::close(fd);
+    error = cachePath + " is too small";
+    return false;
+  }
+
+  // A private mapping still shares the pages with the page cache, until applyChanges() writes to them
+  void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED)
+  {
+    error = "cannot map " + cachePath + ": " + std::strerror(errno);
+    return false;
+  }
+
+  const Header* header = static_cast<const Header*>(mapped);
+  if (!validate(static_cast<const uint8_t*>(mapped), st.st_size, verify, error))
+    error = cachePath + ": " + error;
+  else if (header->sourceChecksum != sourceChecksum)
+    error = cachePath + " was built from another map";
+  else if (header->maxDistance != maxDistance)
+    error = cachePath + " was built with another maximum distance";
+
+  if (!error.empty())
+  {
+    munmap(mapped, st.st_size);
+    return false;
+  }
+
+  _mapped = mapped;
+  _mappedSize = st.st_size;
+  _data = static_cast<const uint8_t*>(mapped);
+  _header = header;
+  return true;
+}
+
+bool MapCache::attach(const void* data, std::size_t size, bool verify, std::string& error)
+{
+  release();
+
+  if (!validate(static_cast<const uint8_t*>(data), size, verify, error))
+    return false;
+
+  _data = static_cast<const uint8_t*>(data);
+  _header = reinterpret_cast<const Header*>(data);
+  return true;
+}
+
+bool MapCache::validate(const uint8_t* data, std::size_t size, bool verify, std::string& error)
+{
+  const Header* header = reinterpret_cast<const Header*>(data);
+  if (size < sizeof(Header) || std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      header->version != VERSION || header->headerSize != sizeof(Header) || header->fileSize != size)
+  {
+    error = "not a map cache of version " + std::to_string(VERSION);
+    return false;
+  }
+  // Every section has to lie within the file before anything is read from it
+  uint64_t numCells = header->size[0];
+  for (int i = 1; i < 3 && numCells > 0; i++)
+    numCells = header->size[i] <= std::numeric_limits<uint64_t>::max() / numCells ? numCells * header->size[i]
+                                                                                  : std::numeric_limits<uint64_t>::max();
+  if (!fitsIn(header->occupancyOffset, numCells, 1, size) ||
+      !fitsIn(header->distanceOffset, numCells, sizeof(uint16_t), size) ||
+      header->occupancyOffset < align(sizeof(Header)))
+  {
+    error = "map cache sections beyond the end of the file";
+    return false;
+  }
+  if (verify && checksum(data + align(sizeof(Header)), size - align(sizeof(Header))) != header->dataChecksum)
+  {
+    error = "corrupted map cache";
+    return false;
+  }
+  return true;
+}
+
+bool MapCache::castRay(float originX, float originY, float originZ, float directionX, float directionY,
+                       float directionZ, float maxRange, float& range) const
+{
+  return grid_raycast::castRay(*this, originX, originY, originZ, directionX, directionY, directionZ, maxRange, range);
+}
+
+bool MapCache::castRay(float originX, float originY, float originZ, float directionX, float directionY,
+                       float directionZ, float maxRange, float& range, uint32_t cell[3]) const
+{
+  int hitCell[3];
+  if (!grid_raycast::castRay(*this, originX, originY, originZ, directionX, directionY, directionZ, maxRange, range,
+                             hitCell))
+    return false;
+  std::copy(hitCell, hitCell + 3, cell);
+  return true;
+}
+
+bool MapCache::build(const octomap::OcTree& tree, uint64_t sourceChecksum, float maxDistance,
+                     const std::string& cachePath, std::string& error)
+{
+  return buildFromTree(tree, sourceChecksum, maxDistance, cachePath, error);
+}
+
+bool MapCache::build(const octomap::ColorOcTree& tree, uint64_t sourceChecksum, float maxDistance,
+                     const std::string& cachePath, std::string& error)
+{
+  return buildFromTree(tree, sourceChecksum, maxDistance, cachePath, error);
+}
+
+template <class TREE>
+bool MapCache::buildFromTree(const TREE& tree, uint64_t sourceChecksum, float maxDistance,
+                             const std::string& cachePath, std::string& error)
+{
+  release();
+
+  double resolution = tree.getResolution();
+  double origin[3];
+  uint32_t size[3];
+  gridOf(tree, origin, size);
+
+  std::vector<uint8_t> occupancy;
+  const int first[3] = { 0, 0, 0 };
+  rasterize(tree, origin, resolution, first, size, occupancy);
+
+  finalize(occupancy, size[0], size[1], size[2], resolution, origin, sourceChecksum, maxDistance);
+
+  return write(cachePath, error);
+}
+
+void MapCache::finalize(std::vector<uint8_t>& occupancy, uint32_t sizeX, uint32_t sizeY, uint32_t sizeZ,
+                        double resolution, const double origin[3], uint64_t sourceChecksum, float maxDistance)
+{
+  uint32_t size[3] = { sizeX, sizeY, sizeZ };
+  std::size_t numCells = occupancy.size();
+
+  // Layout
+  std::size_t occupancyOffset = align(sizeof(Header));
+  std::size_t distanceOffset = align(occupancyOffset + numCells);
+  std::size_t fileSize = distanceOffset + numCells * sizeof(uint16_t);
+
+  _buffer.assign(fileSize, 0);
+  Header* header = reinterpret_cast<Header*>(&_buffer[0]);
+  std::memcpy(header->magic, MAGIC, sizeof(MAGIC));
+  header->version = VERSION;
+  header->headerSize = sizeof(Header);
+  header->sourceChecksum = sourceChecksum;
+  header->fileSize = fileSize;
+  header->resolution = resolution;
+  for (int i = 0; i < 3; i++)
+  {
+    header->origin[i] = origin[i];
+    header->size[i] = size[i];
+  }
+  header->maxDistance = maxDistance;
+  header->occupancyOffset = occupancyOffset;
+  header->distanceOffset = distanceOffset;
+
+  std::memcpy(&_buffer[occupancyOffset], &occupancy[0], numCells);
+
+  computeDistanceField(&occupancy[0], size, resolution, maxDistance,
+                       reinterpret_cast<uint16_t*>(&_buffer[distanceOffset]));
+
+  header->dataChecksum = checksum(&_buffer[occupancyOffset], fileSize - occupancyOffset);
+
+  _data = &_buffer[0];
+  _header = header;
+}
+
+void MapCache::computeDistanceField(const uint8_t* occupancy, const uint32_t size[3], double resolution,
+                                    float maxDistance, uint16_t* distance)
+{
+  std::size_t numCells = std::size_t(size[0]) * size[1] * size[2];
+
+  // Exact Euclidean distance transform, separable over the three axes, in squared cells
+  std::vector<float> sqDistance(numCells);
+  for (std::size_t i = 0; i < numCells; i++)
+    sqDistance[i] = occupancy[i] == OCCUPIED ? 0.0f : std::numeric_limits<float>::infinity();
+  for (int axis = 0; axis < 3; axis++)
+    distanceTransformAxis(sqDistance, size, axis);
+
+  float maxMillimeters = std::min(maxDistance * 1000.0f, float(std::numeric_limits<uint16_t>::max()));
+  for (std::size_t i = 0; i < numCells; i++)
+  {
+    float mm = std::sqrt(sqDistance[i]) * resolution * 1000.0f;
+    distance[i] = uint16_t(std::min(mm, maxMillimeters) + 0.5f);
+  }
+}
+
+bool MapCache::write(const std::string& cachePath, std::string& error) const
+{
+  // Maps that did not come from a file are only kept in memory
+  if (cachePath.empty())
+    return true;
+
+  // Write to a temporary file and rename it, so that a reader never maps a half written cache
+  std::string tmpPath = cachePath + ".tmp" + std::to_string(getpid());
+  FILE* file = std::fopen(tmpPath.c_str(), "wb");
+  if (!file)
+  {
+    error = "cannot write " + tmpPath + ": " + std::strerror(errno);
+    return false;
+  }
+
+  bool ok = std::fwrite(_data, 1, _header->fileSize, file) == _header->fileSize;
+  ok = (std::fclose(file) == 0) && ok;
+  if (!ok || std::rename(tmpPath.c_str(), cachePath.c_str()) != 0)
+  {
+    error = "cannot write " + cachePath + ": " + std::strerror(errno);
+    std::remove(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool MapCache::makeWritable()
+{
+  if (!_header)
+    return false;
+
+  if (_mapped)
+    return mprotect(_mapped, _mappedSize, PROT_READ | PROT_WRITE) == 0;
+
+  if (_buffer.empty())
+  {
+    // Attached memory belongs to someone else
+    _buffer.assign(_data, _data + _header->fileSize);
+    _data = &_buffer[0];
+    _header = reinterpret_cast<const Header*>(_data);
+  }
+  return true;
+}
+
+std::size_t MapCache::applyChanges(const std::vector<CellChange>& changes)
+{
+  if (changes.empty() || !makeWritable())
+    return 0;
+
+  // Cells whose obstacle state changed, grouped by blocks of 32^3 cells so that the distance field is
+  // recomputed around each group rather than over the bounding box of all the changes
+  const int blockBits = 5;
+  std::map<uint64_t, CellBox> blocks;
+  uint8_t* occupancy = const_cast<uint8_t*>(this->occupancy());
+  std::size_t changed = 0;
+  for (std::size_t i = 0; i < changes.size(); i++)
+  {
+    const CellChange& change = changes[i];
+    if (change.index >= numCells() || occupancy[change.index] == change.state)
+      continue;
+
+    bool obstacleChanged = (occupancy[change.index] == OCCUPIED) != (change.state == OCCUPIED);
+    occupancy[change.index] = change.state;
+    changed++;
+    if (!obstacleChanged)
+      continue;
+
+    uint32_t cell[3];
+    indexToCell(change.index, cell[0], cell[1], cell[2]);
+    uint64_t key = (uint64_t(cell[2] >> blockBits) << 42) | (uint64_t(cell[1] >> blockBits) << 21) |
+                   (cell[0] >> blockBits);
+    std::map<uint64_t, CellBox>::iterator block = blocks.find(key);
+    if (block == blocks.end())
+    {
+      CellBox box = { { cell[0], cell[1], cell[2] }, { cell[0], cell[1], cell[2] } };
+      blocks[key] = box;
+      continue;
+    }
+    for (int j = 0; j < 3; j++)
+    {
+      block->second.low[j] = std::min(block->second.low[j], cell[j]);
+      block->second.high[j] = std::max(block->second.high[j], cell[j]);
+    }
+  }
+  if (!changed)
+    return 0;
+
+  // Scattered changes: the regions of the blocks overlap, one region around all of them is cheaper
+  const double margin = 4.0 * std::ceil(_header->maxDistance / _header->resolution);
+  double blocksVolume = 0;
+  CellBox all = blocks.empty() ? CellBox() : blocks.begin()->second;
+  for (std::map<uint64_t, CellBox>::const_iterator it = blocks.begin(); it != blocks.end(); ++it)
+  {
+    double volume = 1;
+    for (int j = 0; j < 3; j++)
+    {
+      volume *= it->second.high[j] - it->second.low[j] + 1 + margin;
+      all.low[j] = std::min(all.low[j], it->second.low[j]);
+      all.high[j] = std::max(all.high[j], it->second.high[j]);
+    }
+    blocksVolume += volume;
+  }
+  double allVolume = 1;
+  for (int j = 0; j < 3; j++)
+    allVolume *= all.high[j] - all.low[j] + 1 + margin;
+  if (blocks.size() > 1 && allVolume < blocksVolume)
+  {
+    blocks.clear();
+    blocks[0] = all;
+  }
+
+  for (std::map<uint64_t, CellBox>::const_iterator it = blocks.begin(); it != blocks.end(); ++it)
+  {
+    uint32_t high[3] = { it->second.high[0] + 1, it->second.high[1] + 1, it->second.high[2] + 1 };
+    updateDistanceField(it->second.low, high);
+  }
+  return changed;
+}
+
+void MapCache::updateDistanceField(const uint32_t low[3], const uint32_t high[3])
+{
+  // Distances change within maxDistance of the changed cells, and depend on the obstacles within maxDistance
+  // of those: the field is recomputed on the changes grown twice by maxDistance, and copied back once grown
+  const int margin = int(std::ceil(_header->maxDistance / _header->resolution)) + 1;
+  int regionLow[3], regionHigh[3], blockLow[3];
+  uint32_t blockSize[3];
+  for (int i = 0; i < 3; i++)
+  {
+    int size = _header->size[i];
+    regionLow[i] = std::max(0, int(low[i]) - margin);
+    regionHigh[i] = std::min(size, int(high[i]) + margin);
+    blockLow[i] = std::max(0, int(low[i]) - 2 * margin);
+    blockSize[i] = std::min(size, int(high[i]) + 2 * margin) - blockLow[i];
+  }
+
+  std::vector<uint8_t> block(std::size_t(blockSize[0]) * blockSize[1] * blockSize[2]);
+  for (uint32_t z = 0; z < blockSize[2]; z++)
+    for (uint32_t y = 0; y < blockSize[1]; y++)
+      std::memcpy(&block[(std::size_t(z) * blockSize[1] + y) * blockSize[0]],
+                  occupancy() + index(blockLow[0], blockLow[1] + y, blockLow[2] + z), blockSize[0]);
+
+  std::vector<uint16_t> distance(block.size());
+  computeDistanceField(&block[0], blockSize, _header->resolution, _header->maxDistance, &distance[0]);
+
+  uint16_t* field = const_cast<uint16_t*>(distanceField());
+  int rowLength = regionHigh[0] - regionLow[0];
+  for (int z = regionLow[2]; z < regionHigh[2]; z++)
+    for (int y = regionLow[1]; y < regionHigh[1]; y++)
+      std::memcpy(field + index(regionLow[0], y, z),
+                  &distance[(std::size_t(z - blockLow[2]) * blockSize[1] + y - blockLow[1]) * blockSize[0] +
+                            regionLow[0] - blockLow[0]],
+                  rowLength * sizeof(uint16_t));
+}
@@ -17,11 +17,23 @@
 * You should have received a copy of the GNU General Public License
 * along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <sstream>
+
 #include "particle_filter/MapModel.h"
 
 MapModel::MapModel(ros::NodeHandle* nh)
 {
+  _occupancyThresholdLog = 0.0;
   _motionObstacleDist = 0.2;
+  _tileWindowMargin = 0.0;
+  _tilePrefetchTime = 0.0;
+  _relocalizerSigma = 0.0;
+  _relocalizerLevels = 0;
+  _version = 0;
+
+  nh->param<double>("/global_localization/uav_radius", _uavRadius, 0.3);
+  nh->param<double>("/global_localization/min_height", _minFlightHeight, 0.3);
+  nh->param<double>("/global_localization/max_height", _maxFlightHeight, 3.0);
 }
 
 MapModel::~MapModel()
@@ -33,9 +45,24 @@ std::shared_ptr<octomap::ColorOcTree> MapModel::getMap() const
   return _map;
 }
 
+std::shared_ptr<octomap::OcTree> MapModel::getOccupancyTree() const
+{
+  return _octree;
+}
+
 bool MapModel::isOccupied(const octomap::point3d& point) const
 {
-  octomap::OcTreeNode* ocNode = _map->search(point);
+  if (_tiles)
+    return _tiles->cellState(point.x(), point.y(), point.z()) == MapCache::OCCUPIED;
+
+  if (_cache)
+  {
+    uint32_t ix, iy, iz;
+    return _cache->worldToCell(point.x(), point.y(), point.z(), ix, iy, iz) &&
+           _cache->cellState(_cache->index(ix, iy, iz)) == MapCache::OCCUPIED;
+  }
+
+  octomap::OcTreeNode* ocNode = _octree->search(point);
   if (ocNode)
   {
     return isOccupied(ocNode);
@@ -46,11 +73,496 @@ bool MapModel::isOccupied(const octomap::point3d& point) const
 
 bool MapModel::isOccupied(octomap::OcTreeNode* node) const
 {
-  return _map->isNodeOccupied(node);
+  return node->getLogOdds() >= _occupancyThresholdLog;
+}
+
+void MapModel::getMetricMin(double& x, double& y, double& z) const
+{
+  if (_tiles)
+  {
+    x = _tiles->origin(0);
+    y = _tiles->origin(1);
+    z = _tiles->origin(2);
+  }
+  else if (_cache)
+  {
+    x = _cache->header().origin[0];
+    y = _cache->header().origin[1];
+    z = _cache->header().origin[2];
+  }
+  else
+    _octree->getMetricMin(x, y, z);
+}
+
+void MapModel::getMetricMax(double& x, double& y, double& z) const
+{
+  if (_tiles)
+  {
+    x = _tiles->origin(0) + _tiles->size(0) * _tiles->resolution();
+    y = _tiles->origin(1) + _tiles->size(1) * _tiles->resolution();
+    z = _tiles->origin(2) + _tiles->size(2) * _tiles->resolution();
+  }
+  else if (_cache)
+  {
+    x = _cache->header().origin[0] + _cache->sizeX() * _cache->resolution();
+    y = _cache->header().origin[1] + _cache->sizeY() * _cache->resolution();
+    z = _cache->header().origin[2] + _cache->sizeZ() * _cache->resolution();
+  }
+  else
+    _octree->getMetricMax(x, y, z);
+}
+
+octomap::OcTree* MapModel::stripColor(const octomap::ColorOcTree& colorTree)
+{
+  // The binary format only holds occupancy and is the same for both trees
+  std::stringstream stream;
+  colorTree.writeBinaryData(stream);
+  octomap::OcTree* tree = new octomap::OcTree(colorTree.getResolution());
+  tree->readBinaryData(stream);
+  return tree;
+}
+
+std::shared_ptr<const MapCache> MapModel::getCache() const
+{
+  return _cache;
+}
+
+std::shared_ptr<const FreeSpaceIndex> MapModel::getFreeSpace()
+{
+  std::lock_guard<std::mutex> lock(_derivedMutex);
+  if (!_freeSpace && _cache)
+  {
+    ros::WallTime start = ros::WallTime::now();
+    _freeSpace.reset(new FreeSpaceIndex(*_cache, _uavRadius, _minFlightHeight, _maxFlightHeight));
+    ROS_INFO("Free space index: %lu of %zu cells (radius %.2f m, %.2f - %.2f m above the surface) in %.1f ms",
+             (unsigned long)_freeSpace->size(), _cache->numCells(), _uavRadius, _minFlightHeight, _maxFlightHeight,
+             (ros::WallTime::now() - start).toSec() * 1000.0);
+  }
+  return _freeSpace;
+}
+
+std::shared_ptr<const HeightField> MapModel::getHeightField()
+{
+  std::lock_guard<std::mutex> lock(_derivedMutex);
+  if (!_heights && _cache)
+  {
+    ros::WallTime start = ros::WallTime::now();
+    _heights.reset(new HeightField(*_cache));
+    ROS_INFO("Height field built in %.1f ms", (ros::WallTime::now() - start).toSec() * 1000.0);
+  }
+  return _heights;
+}
+
+std::shared_ptr<const Relocalizer> MapModel::getRelocalizer(double sigma, unsigned int levels)
+{
+  std::lock_guard<std::mutex> lock(_derivedMutex);
+  if (_cache && (!_relocalizer || sigma != _relocalizerSigma || levels != _relocalizerLevels))
+  {
+    ros::WallTime start = ros::WallTime::now();
+    _relocalizer.reset(new Relocalizer(_cache, sigma, levels));
+    _relocalizerSigma = sigma;
+    _relocalizerLevels = levels;
+    ROS_INFO("Relocalization maps built in %.1f ms (%.1f MB)", (ros::WallTime::now() - start).toSec() * 1000.0,
+             _relocalizer->byteSize() / 1048576.0);
+  }
+  return _relocalizer;
+}
+
+std::shared_ptr<const TiledMap> MapModel::getTiledMap() const
+{
+  return _tiles;
+}
+
+MapView MapModel::getView() const
+{
+  MapView view;
+  view.grid = _cache;
+  view.tiles = _tiles;
+  view.octree = _octree;
+  return view;
+}
+
+std::size_t MapModel::memoryUsage() const
+{
+  std::size_t bytes = 0;
+  if (_map)
+    bytes += _map->memoryUsage();
+  if (_octree)
+    bytes += _octree->memoryUsage();
+  if (_cache)
+    bytes += _cache->byteSize();
+  if (_heights)
+    bytes += _heights->byteSize();
+  if (_relocalizer)
+    bytes += _relocalizer->byteSize();
+  if (_tiles)
+    bytes += _tiles->residentBytes();
+  return bytes;
+}
+
+void MapModel::focus(const double min[3], const double max[3], const double velocity[3], TiledMap::Window* window)
+{
+  if (!_tiles)
+    return;
+
+  double windowMin[3], windowMax[3], aheadMin[3], aheadMax[3];
+  for (int i = 0; i < 3; i++)
+  {
+    windowMin[i] = min[i] - _tileWindowMargin;
+    windowMax[i] = max[i] + _tileWindowMargin;
+    aheadMin[i] = windowMin[i] + velocity[i] * _tilePrefetchTime;
+    aheadMax[i] = windowMax[i] + velocity[i] * _tilePrefetchTime;
+  }
+  if (window)
+  {
+    _tiles->setWindow(*window, windowMin, windowMax);
+    _tiles->prefetch(*window, aheadMin, aheadMax);
+  }
+  else
+  {
+    _tiles->setWindow(windowMin, windowMax);
+    _tiles->prefetch(aheadMin, aheadMax);
+  }
+}
+
+bool MapModel::loadCache(ros::NodeHandle* nh, const std::string& mapFile, bool build)
+{
+  bool enabled, verify;
+  double maxDistance;
+  nh->param<bool>("/map_cache/enabled", enabled, true);
+  nh->param<bool>("/map_cache/verify", verify, false);
+  nh->param<double>("/map_cache/max_distance", maxDistance, 2.0);
+  if (!enabled)
+    return false;
+
+  ros::WallTime start = ros::WallTime::now();
+  std::shared_ptr<MapCache> cache(new MapCache());
+
+  std::string cachePath;
+  uint64_t sourceChecksum = 0;
+  std::string error;
+  if (!mapFile.empty() && MapCache::checksumFile(mapFile, sourceChecksum))
+  {
+    cachePath = MapCache::cachePathFor(mapFile);
+    if (cache->open(cachePath, sourceChecksum, maxDistance, verify, error))
+    {
+      ROS_INFO("Map cache %s mapped in %f s", cachePath.c_str(), (ros::WallTime::now() - start).toSec());
+      _cache = cache;
+      _writableCache = cache;
+      return true;
+    }
+    if (!build)
+      ROS_INFO("Map cache not usable (%s)", error.c_str());
+  }
+  if (!build)
+    return false;
+
+  ROS_INFO("Building the map cache...");
+  if (!cache->build(*_map, sourceChecksum, maxDistance, cachePath, error))
+    ROS_WARN("Map cache kept in memory only: %s", error.c_str());
+  _cache = cache;
+  _writableCache = cache;
+
+  ROS_INFO("Map cache with %u x %u x %u cells built in %f s", cache->sizeX(), cache->sizeY(), cache->sizeZ(),
+           (ros::WallTime::now() - start).toSec());
+  return true;
+}
+
+bool MapModel::loadTiles(ros::NodeHandle* nh, const std::string& mapFile, bool build)
+{
+  bool enabled;
+  int tileCells, maxTiles;
+  double maxDistance, maxRange;
+  nh->param<bool>("/map_tiles/enabled", enabled, false);
+  nh->param<int>("/map_tiles/tile_cells", tileCells, 32);
+  nh->param<int>("/map_tiles/max_tiles", maxTiles, 1024);
+  nh->param<double>("/map_cache/max_distance", maxDistance, 2.0);
+  nh->param<double>("/max_range", maxRange, 14);
+  nh->param<double>("/map_tiles/window_margin", _tileWindowMargin, maxRange);
+  nh->param<double>("/map_tiles/prefetch_time", _tilePrefetchTime, 2.0);
+  if (!enabled)
+    return false;
+  if (mapFile.empty())
+  {
+    ROS_WARN("Map tiles are only built from /map_file, using the map cache");
+    return false;
+  }
+
+  uint32_t tileBits = 0;
+  while (tileBits < 8 && (2 << tileBits) <= tileCells)
+    tileBits++;
+  if ((1 << tileBits) != tileCells)
+    ROS_WARN("/map_tiles/tile_cells must be a power of two, using %d", 1 << tileBits);
+
+  ros::WallTime start = ros::WallTime::now();
+  std::shared_ptr<TiledMap> tiles(new TiledMap());
+  std::string tilesPath = TiledMap::tilesPathFor(mapFile);
+  uint64_t sourceChecksum = 0;
+  std::string error;
+  if (!MapCache::checksumFile(mapFile, sourceChecksum))
+  {
+    ROS_WARN("Cannot read %s, map tiles not used", mapFile.c_str());
+    return false;
+  }
+  if (!tiles->open(tilesPath, sourceChecksum, maxDistance, tileBits, maxTiles, error))
+  {
+    if (!build)
+    {
+      ROS_INFO("Map tiles not usable (%s)", error.c_str());
+      return false;
+    }
+
+    ROS_INFO("Building the map tiles...");
+    if (!TiledMap::build(*_map, sourceChecksum, maxDistance, tileBits, tilesPath, error) ||
+        !tiles->open(tilesPath, sourceChecksum, maxDistance, tileBits, maxTiles, error))
+    {
+      ROS_ERROR("Map tiles not available (%s), using the map cache", error.c_str());
+      return false;
+    }
+  }
+
+  ROS_INFO("Map tiles %s opened in %f s", tilesPath.c_str(), (ros::WallTime::now() - start).toSec());
+  _tiles = tiles;
+  return true;
+}
+
+void MapModel::queueMapChanges(const pcl::PointCloud<pcl::PointXYZI>& changes)
+{
+  double occupancyThreshold = octomap::probability(_occupancyThresholdLog);
+  std::lock_guard<std::mutex> lock(_changesMutex);
+  for (std::size_t i = 0; i < changes.points.size(); i++)
+  {
+    const pcl::PointXYZI& point = changes.points[i];
+    MapChange change;
+    change.point = octomap::point3d(point.x, point.y, point.z);
+    change.state = point.intensity >= occupancyThreshold ? MapCache::OCCUPIED : MapCache::FREE;
+    _pendingChanges.push_back(change);
+  }
+}
+
+template <class TREE>
+void MapModel::applyToTree(TREE& tree, const std::vector<MapChange>& changes)
+{
+  for (std::size_t i = 0; i < changes.size(); i++)
+  {
+    if (changes[i].state == MapCache::UNKNOWN)
+      tree.deleteNode(changes[i].point);
+    else
+      tree.setNodeValue(changes[i].point, changes[i].state == MapCache::OCCUPIED ? tree.getClampingThresMaxLog() :
+                                                                                  tree.getClampingThresMinLog(),
+                        true);
+  }
+  tree.updateInnerOccupancy();
+}
+
+bool MapModel::applyMapUpdates()
+{
+  // The publisher of the shared map applies the changes, a new generation replaces the whole cache
+  if (_sharedMap)
+  {
+    {
+      std::lock_guard<std::mutex> lock(_changesMutex);
+      _pendingChanges.clear();
+    }
+    if (!_sharedMap->updateAvailable())
+      return false;
+
+    std::shared_ptr<SharedMap> sharedMap(new SharedMap());
+    std::string error;
+    if (!sharedMap->attach(_sharedMapName, error))
+    {
+      ROS_WARN_THROTTLE(5, "Cannot switch to the new shared map: %s", error.c_str());
+      return false;
+    }
+    _sharedMap = sharedMap;
+    _cache = std::shared_ptr<const MapCache>(sharedMap, &sharedMap->cache());
+    _freeSpace.reset();
+    _heights.reset();
+    _relocalizer.reset();
+    ROS_INFO("Switched to generation %lu of %s", (unsigned long)sharedMap->generation(), _sharedMapName.c_str());
+    _version++;
+    return true;
+  }
+
+  std::vector<MapChange> changes;
+  {
+    std::lock_guard<std::mutex> lock(_changesMutex);
+    changes.swap(_pendingChanges);
+  }
+  if (changes.empty())
+    return false;
+
+  if (_tiles)
+  {
+    ROS_WARN_ONCE("Map changes are not applied to map tiles, rebuild them from the updated map file");
+    return false;
+  }
+
+  ros::WallTime start = ros::WallTime::now();
+  std::size_t changed = changes.size(), outside = 0;
+  if (_writableCache)
+  {
+    std::vector<MapCache::CellChange> cells;
+    cells.reserve(changes.size());
+    for (std::size_t i = 0; i < changes.size(); i++)
+    {
+      uint32_t ix, iy, iz;
+      if (!_writableCache->worldToCell(changes[i].point.x(), changes[i].point.y(), changes[i].point.z(), ix, iy, iz))
+      {
+        // The grid does not grow
+        outside++;
+        continue;
+      }
+      MapCache::CellChange cell = { _writableCache->index(ix, iy, iz), changes[i].state };
+      cells.push_back(cell);
+    }
+    changed = _writableCache->applyChanges(cells);
+  }
+  else if (_octree)
+  {
+    applyToTree(*_octree, changes);
+  }
+
+  // The color tree, when it is kept, follows (e.g. for the shared map)
+  if (_map)
+    applyToTree(*_map, changes);
+
+  ROS_INFO("Map updated: %zu cells changed (%zu outside of the map) in %f ms", changed, outside,
+           (ros::WallTime::now() - start).toSec() * 1000.0);
+  if (changed > 0)
+  {
+    _freeSpace.reset();
+    _heights.reset();
+    _relocalizer.reset();
+    _version++;
+  }
+  return changed > 0;
+}
+
+bool MapModel::updatePending()
+{
+  if (_sharedMap)
+    return _sharedMap->updateAvailable();
+  std::lock_guard<std::mutex> lock(_changesMutex);
+  return !_pendingChanges.empty();
 }
 
 /* Occupancy Grid Map */
-OccupancyMap::OccupancyMap(ros::NodeHandle* nh) : MapModel(nh)
+OccupancyMap::OccupancyMap(ros::NodeHandle* nh, bool useSharedMap, bool keepColorTree) : MapModel(nh)
+{
+  // A map file is read directly, without waiting for octomap_server
+  std::string mapFile;
+  nh->param<std::string>("/map_file", mapFile, "");
+  bool sharedMap, tiles;
+  nh->param<bool>("/shared_map/enabled", sharedMap, false);
+  nh->param<bool>("/map_tiles/enabled", tiles, false);
+
+  ros::WallTime start = ros::WallTime::now();
+  if (useSharedMap && sharedMap)
+  {
+    attachSharedMap(nh);
+    mapFile.clear();
+  }
+  else if (mapFile.empty())
+  {
+    requestMap(nh);
+  }
+  else if (!keepColorTree && (tiles ? loadTiles(nh, mapFile, false) : loadCache(nh, mapFile, false)))
+  {
+    // Already built from this map file, the octree itself is not needed
+  }
+  else if (!readMapFile(mapFile))
+  {
+    ROS_ERROR("Could not read the map from %s, exiting", mapFile.c_str());
+    exit(-1);
+  }
+
+  if (!_cache && !_tiles && (!_map || (_map->size() <= 1)))
+  {
+    ROS_ERROR("Map didn't retrieved,exiting");
+    exit(-1);
+  }
+
+  std::size_t colorTreeBytes = 0;
+  if (_map)
+  {
+    double x, y, z;
+    _map->getMetricSize(x, y, z);
+    ROS_INFO("Occupancy map initialized with %zd nodes (%.2f x %.2f x %.2f m), %f m res. in %f s", _map->size(), x,
+             y, z, _map->getResolution(), (ros::WallTime::now() - start).toSec());
+    _occupancyThresholdLog = _map->getOccupancyThresLog();
+    colorTreeBytes = _map->memoryUsage();
+  }
+
+  if (!_cache && !_tiles && !loadTiles(nh, mapFile, true))
+    loadCache(nh, mapFile, true);
+
+  // Localization only needs occupancy: the tiles, the flat grid, or a colorless octree without them
+  if (_tiles)
+  {
+    const TiledMap::Header& header = _tiles->header();
+    ROS_INFO("Localization map: %u x %u x %u grid in tiles of %u cells, paged in from disk (ColorOcTree %.2f MB)",
+             header.size[0], header.size[1], header.size[2], 1u << header.tileBits, colorTreeBytes / 1048576.0);
+  }
+  else if (!_cache)
+  {
+    _octree.reset(stripColor(*_map));
+    ROS_INFO("Localization map: OcTree, %.2f MB (ColorOcTree %.2f MB)", _octree->memoryUsage() / 1048576.0,
+             colorTreeBytes / 1048576.0);
+  }
+  else
+  {
+    ROS_INFO("Localization map: %u x %u x %u grid, %.2f MB%s (ColorOcTree %.2f MB)", _cache->sizeX(),
+             _cache->sizeY(), _cache->sizeZ(), _cache->byteSize() / 1048576.0,
+             _cache->isMapped() || (useSharedMap && sharedMap) ? " mapped" : "", colorTreeBytes / 1048576.0);
+  }
+
+  if (!keepColorTree)
+    _map.reset();
+}
+
+bool OccupancyMap::readMapFile(const std::string& mapFile)
+{
+  ROS_INFO("Reading the map from %s...", mapFile.c_str());
+
+  octomap::AbstractOcTree* tree = MapCache::readMapFile(mapFile);
+  octomap::ColorOcTree* colorTree = dynamic_cast<octomap::ColorOcTree*>(tree);
+  if (!colorTree)
+  {
+    if (tree)
+      ROS_ERROR("%s contains a %s, a ColorOcTree is needed", mapFile.c_str(), tree->getTreeType().c_str());
+    delete tree;
+    return false;
+  }
+  _map.reset(colorTree);
+  return true;
+}
+
+void OccupancyMap::attachSharedMap(ros::NodeHandle* nh)
+{
+  std::string name;
+  nh->param<std::string>("/shared_map/name", name, "/drone_map");
+  ROS_INFO("Attaching to the shared map %s...", name.c_str());
+
+  std::shared_ptr<SharedMap> sharedMap(new SharedMap());
+  std::string error;
+  while (nh->ok() && !sharedMap->attach(name, error))
+  {
+    ROS_WARN_THROTTLE(5, "Shared map not available (%s); trying again...", error.c_str());
+    usleep(100000);
+  }
+  if (!sharedMap->cache().isValid())
+    return;
+
+  // The cache is used in place, there is no octree to keep
+  _cache = std::shared_ptr<const MapCache>(sharedMap, &sharedMap->cache());
+  _sharedMap = sharedMap;
+  _sharedMapName = name;
+  ROS_INFO("Attached to generation %lu of %s (%zu bytes shared)", (unsigned long)sharedMap->generation(),
+           name.c_str(), sharedMap->cache().byteSize());
+}
+
+void OccupancyMap::requestMap(ros::NodeHandle* nh)
 {
   std::string srvName = "octomap_full";
   ROS_INFO("Requesting the map from %s...", nh->resolveName(srvName).c_str());
@@ -66,15 +578,6 @@ OccupancyMap::OccupancyMap(ros::NodeHandle* nh) : MapModel(nh)
   octomap::ColorOcTree* colorTree = dynamic_cast<octomap::ColorOcTree*>(octomap_msgs::fullMsgToMap(resp.map));
 
   _map.reset(colorTree);
-  if (!_map && (_map->size() <= 1))
-  {
-    ROS_ERROR("Map didn't retrieved,exiting");
-    exit(-1);
-  }
-  double x, y, z;
-  _map->getMetricSize(x, y, z);
-  ROS_INFO("Occupancy map initialized with %zd nodes (%.2f x %.2f x %.2f m), %f m res.", _map->size(), x, y, z,
-           _map->getResolution());
 }
 
 OccupancyMap::~OccupancyMap()
@@ -83,11 +586,14 @@ OccupancyMap::~OccupancyMap()
 
 bool OccupancyMap::isOccupied(octomap::OcTreeNode* node) const
 {
-  return _map->isNodeOccupied(node);
+  return MapModel::isOccupied(node);
 }
 
 pcl::PointCloud<pcl::PointXYZRGBA> OccupancyMap::toPCL()
 {
+  if (!_map)
+    return pcl::PointCloud<pcl::PointXYZRGBA>();
+
   octomap::ColorOcTree::leaf_iterator itleaf = _map->begin_leafs();
   octomap::ColorOcTree::leaf_iterator endleaf = _map->end_leafs();
   pcl::PointCloud<pcl::PointXYZRGBA> octoMapFullPointCloud;
@@ -0,0 +1,182 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+#include "particle_filter/Metrics.h"
+
+namespace pf
+{
+namespace
+{
+// Seconds, from a fraction of a scan period to a stalled pipeline
+const std::initializer_list<double> latencyBounds = { 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1.0, 2.0, 5.0 };
+
+template <class T>
+std::string toString(T value)
+{
+  std::ostringstream out;
+  out << value;
+  return out.str();
+}
+
+template <class T>
+void writeMetric(std::ostream& out, const std::string& name, const std::string& type, const std::string& help,
+                 const std::string& labels, T value)
+{
+  out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n" << name
+      << (labels.empty() ? "" : "{" + labels + "}") << " " << value << "\n";
+}
+}  // namespace
+
+Histogram::Histogram(std::initializer_list<double> bounds) : _numBounds(0), _count(0), _sumMicro(0)
+{
+  for (std::initializer_list<double>::const_iterator it = bounds.begin();
+       it != bounds.end() && _numBounds < MAX_BUCKETS; ++it)
+    _bounds[_numBounds++] = *it;
+  for (unsigned int i = 0; i <= MAX_BUCKETS; i++)
+    _buckets[i] = 0;
+}
+
+void Histogram::observe(double value)
+{
+  unsigned int bucket = std::lower_bound(_bounds, _bounds + _numBounds, value) - _bounds;
+  _buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  _count.fetch_add(1, std::memory_order_relaxed);
+  _sumMicro.fetch_add(uint64_t(std::max(value, 0.0) * 1e6), std::memory_order_relaxed);
+}
+
+double Histogram::quantile(double q) const
+{
+  uint64_t total = count();
+  if (total == 0)
+    return 0.0;
+  uint64_t rank = uint64_t(std::ceil(q * total));
+  uint64_t cumulative = 0;
+  for (unsigned int i = 0; i < _numBounds; i++)
+  {
+    cumulative += _buckets[i].load(std::memory_order_relaxed);
+    if (cumulative >= rank)
+      return _bounds[i];
+  }
+  return INFINITY;
+}
+
+void Histogram::writePrometheus(std::ostream& out, const std::string& name, const std::string& help,
+                                const std::string& labels) const
+{
+  std::string bucketLabels = labels.empty() ? "" : labels + ",";
+  std::string sampleLabels = labels.empty() ? "" : "{" + labels + "}";
+  out << "# HELP " << name << " " << help << "\n# TYPE " << name << " histogram\n";
+  uint64_t cumulative = 0;
+  for (unsigned int i = 0; i < _numBounds; i++)
+  {
+    cumulative += _buckets[i].load(std::memory_order_relaxed);
+    out << name << "_bucket{" << bucketLabels << "le=\"" << _bounds[i] << "\"} " << cumulative << "\n";
+  }
+  cumulative += _buckets[_numBounds].load(std::memory_order_relaxed);
+  out << name << "_bucket{" << bucketLabels << "le=\"+Inf\"} " << cumulative << "\n";
+  out << name << "_sum" << sampleLabels << " " << sum() << "\n"
+      << name << "_count" << sampleLabels << " " << cumulative << "\n";
+}
+
+Metrics::Metrics()
+  : scansReceived(0)
+  , scansDropped(0)
+  , preparedScansDropped(0)
+  , scansFiltered(0)
+  , raycasts(0)
+  , relocalizations(0)
+  , particlesInjected(0)
+  , estimatesRefined(0)
+  , refinementsRejected(0)
+  , deadlineMisses(0)
+  , effectiveParticles(0.0)
+  , particles(0.0)
+  , beamsUsed(0.0)
+  , mapBytes(0.0)
+  , queueLatency(latencyBounds)
+  , poseLatency(latencyBounds)
+  , filterStepTime(latencyBounds)
+{
+}
+
+std::vector<std::pair<std::string, std::string> > Metrics::values(double raycastsPerSecond) const
+{
+  std::vector<std::pair<std::string, std::string> > values;
+  values.push_back(std::make_pair("scans received", toString(scansReceived.load())));
+  values.push_back(std::make_pair("scans dropped", toString(scansDropped.load() + preparedScansDropped.load())));
+  values.push_back(std::make_pair("scans filtered", toString(scansFiltered.load())));
+  values.push_back(std::make_pair("relocalizations", toString(relocalizations.load())));
+  values.push_back(std::make_pair("particles injected", toString(particlesInjected.load())));
+  values.push_back(std::make_pair("estimates refined", toString(estimatesRefined.load())));
+  values.push_back(std::make_pair("refinements rejected", toString(refinementsRejected.load())));
+  values.push_back(std::make_pair("deadline misses", toString(deadlineMisses.load())));
+  values.push_back(std::make_pair("particles", toString(particles.load())));
+  values.push_back(std::make_pair("effective particles", toString(effectiveParticles.load())));
+  values.push_back(std::make_pair("beams used", toString(beamsUsed.load())));
+  values.push_back(std::make_pair("raycasts per second", toString(raycastsPerSecond)));
+  values.push_back(std::make_pair("map memory (MB)", toString(mapBytes.load() / 1048576.0)));
+  values.push_back(std::make_pair("pose latency p50 (s)", toString(poseLatency.quantile(0.5))));
+  values.push_back(std::make_pair("pose latency p99 (s)", toString(poseLatency.quantile(0.99))));
+  values.push_back(std::make_pair("queue latency p99 (s)", toString(queueLatency.quantile(0.99))));
+  values.push_back(std::make_pair("filter step p50 (s)", toString(filterStepTime.quantile(0.5))));
+  values.push_back(std::make_pair("filter step p99 (s)", toString(filterStepTime.quantile(0.99))));
+  return values;
+}
+
+void Metrics::writePrometheus(std::ostream& out, double raycastsPerSecond, const std::string& labels) const
+{
+  writeMetric(out, "particle_filter_scans_received_total", "counter", "Scans received", labels,
+              scansReceived.load());
+  writeMetric(out, "particle_filter_scans_dropped_total", "counter",
+              "Scans replaced by a newer one before they were prepared", labels, scansDropped.load());
+  writeMetric(out, "particle_filter_prepared_scans_dropped_total", "counter",
+              "Prepared scans replaced by a newer one before they were filtered", labels,
+              preparedScansDropped.load());
+  writeMetric(out, "particle_filter_scans_filtered_total", "counter", "Filter steps", labels, scansFiltered.load());
+  writeMetric(out, "particle_filter_raycasts_total", "counter", "Raycasts of the observation model", labels,
+              raycasts.load());
+  writeMetric(out, "particle_filter_relocalizations_total", "counter", "Relocalizations", labels,
+              relocalizations.load());
+  writeMetric(out, "particle_filter_particles_injected_total", "counter", "Particles drawn by the recovery", labels,
+              particlesInjected.load());
+  writeMetric(out, "particle_filter_estimates_refined_total", "counter", "Estimates refined by scan registration",
+              labels, estimatesRefined.load());
+  writeMetric(out, "particle_filter_refinements_rejected_total", "counter", "Scan registrations rejected", labels,
+              refinementsRejected.load());
+  writeMetric(out, "particle_filter_deadline_misses_total", "counter", "Filter steps longer than the deadline",
+              labels, deadlineMisses.load());
+  writeMetric(out, "particle_filter_raycasts_per_second", "gauge", "Raycasts per second since the last export",
+              labels, raycastsPerSecond);
+  writeMetric(out, "particle_filter_particles", "gauge", "Particles", labels, particles.load());
+  writeMetric(out, "particle_filter_effective_particles", "gauge", "Effective particles after the last step", labels,
+              effectiveParticles.load());
+  writeMetric(out, "particle_filter_beams_used", "gauge", "Beams of the last observation", labels, beamsUsed.load());
+  writeMetric(out, "particle_filter_map_bytes", "gauge", "Memory of the localization map", labels, mapBytes.load());
+  queueLatency.writePrometheus(out, "particle_filter_queue_latency_seconds",
+                               "Reception of a scan to the start of its filter step", labels);
+  poseLatency.writePrometheus(out, "particle_filter_pose_latency_seconds",
+                              "Scan stamp to the publication of its pose estimate", labels);
+  filterStepTime.writePrometheus(out, "particle_filter_step_seconds", "Duration of a filter step", labels);
+}
+
+}  // namespace pf
@@ -0,0 +1,258 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+
+#include "particle_filter/Relocalizer.h"
+
+Relocalizer::Relocalizer(const std::shared_ptr<const MapCache>& cache, double sigma, unsigned int levels)
+  : _cache(cache)
+{
+  _size[0] = cache->sizeX();
+  _size[1] = cache->sizeY();
+  _size[2] = cache->sizeZ();
+  std::size_t numCells = cache->numCells();
+
+  // Level 0: likelihood of a point in the cell, from its distance to the nearest obstacle
+  _levels.resize(levels + 1);
+  _levels[0].resize(numCells);
+  const uint16_t* distance = cache->distanceField();
+  double invTwoSigmaSq = 1.0 / (2.0 * sigma * sigma);
+  for (std::size_t idx = 0; idx < numCells; idx++)
+  {
+    double d = distance[idx] * 0.001;
+    _levels[0][idx] = uint8_t(std::lround(255.0 * std::exp(-d * d * invTwoSigmaSq)));
+  }
+
+  // Level k: maximum over [c, c + 2^k) along every axis, one axis at a time
+  const std::size_t stride[3] = { 1, std::size_t(_size[0]), std::size_t(_size[0]) * _size[1] };
+  for (unsigned int level = 1; level <= levels; level++)
+  {
+    int shift = 1 << (level - 1);
+    _levels[level] = _levels[level - 1];
+    std::vector<uint8_t>& grid = _levels[level];
+    for (int axis = 0; axis < 3; axis++)
+    {
+      std::size_t idx = 0;
+      for (int z = 0; z < _size[2]; z++)
+        for (int y = 0; y < _size[1]; y++)
+          for (int x = 0; x < _size[0]; x++, idx++)
+          {
+            int c[3] = { x, y, z };
+            if (c[axis] + shift < _size[axis])
+              grid[idx] = std::max(grid[idx], grid[idx + shift * stride[axis]]);
+          }
+    }
+  }
+}
+
+std::size_t Relocalizer::byteSize() const
+{
+  return _levels.size() * _levels[0].size();
+}
+
+unsigned int Relocalizer::score(unsigned int level, const int cell[3], const std::vector<int>& offsets) const
+{
+  const uint8_t* grid = &_levels[level][0];
+  int blockSize = 1 << level;
+  unsigned int sum = 0;
+  for (std::size_t i = 0; i < offsets.size(); i += 3)
+  {
+    int c[3];
+    bool inside = true;
+    for (int axis = 0; axis < 3; axis++)
+    {
+      c[axis] = cell[axis] + offsets[i + axis];
+      // A block that starts before the grid is bounded by the block at its start
+      if (c[axis] < 0 && c[axis] + blockSize > 0)
+        c[axis] = 0;
+      if (c[axis] < 0 || c[axis] >= _size[axis])
+        inside = false;
+    }
+    if (inside)
+      sum += grid[(std::size_t(c[2]) * _size[1] + c[1]) * _size[0] + c[0]];
+  }
+  return sum;
+}
+
+unsigned int Relocalizer::threshold(const std::vector<Candidate>& best, unsigned int minScore,
+                                    const Parameters& params) const
+{
+  if (best.size() < params.maxHypotheses)
+    return minScore;
+  return std::max(minScore, best.back().score + 1);
+}
+
+void Relocalizer::insert(const Candidate& candidate, const Parameters& params, std::vector<Candidate>& best) const
+{
+  double resolution = _cache->resolution();
+  unsigned int numYaws = std::max(1, int(std::lround(2 * M_PI / params.yawStep)));
+  for (std::size_t i = 0; i < best.size(); i++)
+  {
+    double dx = (best[i].cell[0] - candidate.cell[0]) * resolution;
+    double dy = (best[i].cell[1] - candidate.cell[1]) * resolution;
+    double dz = (best[i].cell[2] - candidate.cell[2]) * resolution;
+    unsigned int yawDiff = std::abs(int(best[i].yaw) - int(candidate.yaw));
+    yawDiff = std::min(yawDiff, numYaws - yawDiff);
+    if (std::sqrt(dx * dx + dy * dy + dz * dz) < params.minSeparation &&
+        yawDiff * params.yawStep < params.minYawSeparation)
+    {
+      // The same hypothesis, keep the better one
+      if (candidate.score <= best[i].score)
+        return;
+      best.erase(best.begin() + i);
+      break;
+    }
+  }
+
+  std::vector<Candidate>::iterator pos =
+      std::upper_bound(best.begin(), best.end(), candidate,
+                       [](const Candidate& a, const Candidate& b) { return a.score > b.score; });
+  best.insert(pos, candidate);
+  if (best.size() > params.maxHypotheses)
+    best.pop_back();
+}
+
+void Relocalizer::descend(unsigned int level, const Candidate& candidate, const std::vector<int>& offsets,
+                          unsigned int minScore, const Parameters& params, std::vector<Candidate>& best) const
+{
+  if (candidate.score < threshold(best, minScore, params))
+    return;
+
+  if (level == 0)
+  {
+    // The drone can only be in free space
+    std::size_t idx = _cache->index(candidate.cell[0], candidate.cell[1], candidate.cell[2]);
+    if (_cache->cellState(idx) == MapCache::FREE)
+      insert(candidate, params, best);
+    return;
+  }
+
+  // The 8 sub-blocks, best bound first
+  int half = 1 << (level - 1);
+  Candidate children[8];
+  unsigned int numChildren = 0;
+  for (int i = 0; i < 8; i++)
+  {
+    Candidate child = candidate;
+    child.cell[0] += (i & 1) ? half : 0;
+    child.cell[1] += (i & 2) ? half : 0;
+    child.cell[2] += (i & 4) ? half : 0;
+    if (child.cell[0] >= _size[0] || child.cell[1] >= _size[1] || child.cell[2] >= _size[2])
+      continue;
+    child.score = score(level - 1, child.cell, offsets);
+    children[numChildren++] = child;
+  }
+  std::sort(children, children + numChildren,
+            [](const Candidate& a, const Candidate& b) { return a.score > b.score; });
+
+  for (unsigned int i = 0; i < numChildren; i++)
+    descend(level - 1, children[i], offsets, minScore, params, best);
+}
+
+std::vector<Relocalizer::Hypothesis> Relocalizer::search(const std::vector<Observation::Point>& points,
+                                                         const Parameters& params) const
+{
+  std::vector<Hypothesis> hypotheses;
+  if (points.empty() || params.maxHypotheses == 0)
+    return hypotheses;
+
+  double resolution = _cache->resolution();
+  unsigned int numYaws = std::max(1, int(std::lround(2 * M_PI / params.yawStep)));
+  unsigned int topLevel = _levels.size() - 1;
+  int blockSize = 1 << topLevel;
+  unsigned int minScore = unsigned(std::ceil(params.minScore * 255.0 * points.size()));
+
+  // Roll and pitch are known, only the yaw is searched
+  double cr = std::cos(params.roll), sr = std::sin(params.roll);
+  double cp = std::cos(params.pitch), sp = std::sin(params.pitch);
+  std::vector<double> levelled(points.size() * 3);
+  for (std::size_t i = 0; i < points.size(); i++)
+  {
+    double y = cr * points[i].y - sr * points[i].z;
+    double z = sr * points[i].y + cr * points[i].z;
+    levelled[3 * i] = cp * points[i].x + sp * z;
+    levelled[3 * i + 1] = y;
+    levelled[3 * i + 2] = -sp * points[i].x + cp * z;
+  }
+
+  // Points in cells from the translation, for every yaw
+  std::vector<std::vector<int> > offsets(numYaws, std::vector<int>(points.size() * 3));
+  for (unsigned int yaw = 0; yaw < numYaws; yaw++)
+  {
+    double cy = std::cos(yaw * params.yawStep), sy = std::sin(yaw * params.yawStep);
+    for (std::size_t i = 0; i < points.size(); i++)
+    {
+      double x = levelled[3 * i], y = levelled[3 * i + 1], z = levelled[3 * i + 2];
+      offsets[yaw][3 * i] = int(std::lround((cy * x - sy * y) / resolution));
+      offsets[yaw][3 * i + 1] = int(std::lround((sy * x + cy * y) / resolution));
+      offsets[yaw][3 * i + 2] = int(std::lround(z / resolution));
+    }
+  }
+
+  // Top level blocks worth exploring, best first
+  std::vector<Candidate> roots;
+  for (unsigned int yaw = 0; yaw < numYaws; yaw++)
+    for (int z = 0; z < _size[2]; z += blockSize)
+      for (int y = 0; y < _size[1]; y += blockSize)
+        for (int x = 0; x < _size[0]; x += blockSize)
+        {
+          Candidate root = { { x, y, z }, yaw, 0 };
+          root.score = score(topLevel, root.cell, offsets[yaw]);
+          if (root.score >= minScore)
+            roots.push_back(root);
+        }
+  std::sort(roots.begin(), roots.end(), [](const Candidate& a, const Candidate& b) { return a.score > b.score; });
+
+  unsigned int numThreads = params.numThreads > 0 ? params.numThreads : std::thread::hardware_concurrency();
+  numThreads = std::max(1u, std::min<unsigned int>(numThreads, roots.size()));
+  std::vector<std::vector<Candidate> > best(numThreads);
+  std::atomic<std::size_t> nextRoot(0);
+  std::vector<std::thread> threads;
+  for (unsigned int t = 0; t < numThreads; t++)
+  {
+    threads.push_back(std::thread([&, t]() {
+      for (std::size_t r = nextRoot++; r < roots.size(); r = nextRoot++)
+        descend(topLevel, roots[r], offsets[roots[r].yaw], minScore, params, best[t]);
+    }));
+  }
+  for (std::size_t t = 0; t < threads.size(); t++)
+    threads[t].join();
+
+  std::vector<Candidate> merged;
+  for (unsigned int t = 0; t < numThreads; t++)
+    for (std::size_t i = 0; i < best[t].size(); i++)
+      insert(best[t][i], params, merged);
+
+  for (std::size_t i = 0; i < merged.size(); i++)
+  {
+    Hypothesis hypothesis;
+    _cache->cellToWorld(merged[i].cell[0], merged[i].cell[1], merged[i].cell[2], hypothesis.x, hypothesis.y,
+                        hypothesis.z);
+    hypothesis.yaw = merged[i].yaw * params.yawStep;
+    if (hypothesis.yaw > M_PI)
+      hypothesis.yaw -= 2 * M_PI;
+    hypothesis.score = merged[i].score / (255.0f * points.size());
+    hypotheses.push_back(hypothesis);
+  }
+  return hypotheses;
+}
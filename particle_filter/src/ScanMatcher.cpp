@@ -0,0 +1,196 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <Eigen/Cholesky>
+#include <Eigen/Geometry>
+
+#include "particle_filter/ScanMatcher.h"
+
+ScanMatcher::Parameters::Parameters()
+  : maxIterations(5)
+  , refineHeight(false)
+  , sigma(0.05)
+  , huberDistance(0.1)
+  , maxDistance(0.5)
+  , priorXYZStdDev(0.2)
+  , priorYawStdDev(0.1)
+  , minInlierRatio(0.5)
+  , maxCorrection(0.5)
+  , maxYawCorrection(0.2)
+{
+}
+
+ScanMatcher::ScanMatcher(const std::shared_ptr<const MapCache>& cache) : _cache(cache)
+{
+  // As computed by MapCache::computeDistanceField
+  float maxMillimeters =
+      std::min(cache->header().maxDistance * 1000.0f, float(std::numeric_limits<uint16_t>::max()));
+  _truncated = uint16_t(maxMillimeters + 0.5f);
+}
+
+bool ScanMatcher::distance(double x, double y, double z, double& d, double gradient[3]) const
+{
+  // Trilinear interpolation between the centers of the 8 cells around the point
+  double invResolution = 1.0 / _cache->resolution();
+  double f[3] = { (x - _cache->origin(0)) * invResolution - 0.5, (y - _cache->origin(1)) * invResolution - 0.5,
+                  (z - _cache->origin(2)) * invResolution - 0.5 };
+  int cell[3];
+  double t[3];
+  for (int axis = 0; axis < 3; axis++)
+  {
+    double low = std::floor(f[axis]);
+    if (low < 0 || low + 1 >= _cache->size(axis))
+      return false;
+    cell[axis] = int(low);
+    t[axis] = f[axis] - low;
+  }
+
+  const uint16_t* field = _cache->distanceField();
+  std::size_t strideY = _cache->sizeX();
+  std::size_t strideZ = strideY * _cache->sizeY();
+  std::size_t base = _cache->index(cell[0], cell[1], cell[2]);
+  double v[2][2][2];
+  for (int k = 0; k < 2; k++)
+    for (int j = 0; j < 2; j++)
+      for (int i = 0; i < 2; i++)
+      {
+        uint16_t mm = field[base + k * strideZ + j * strideY + i];
+        // Beyond the truncation the field is flat and says nothing about the direction of the obstacles
+        if (mm >= _truncated)
+          return false;
+        v[k][j][i] = mm * 0.001;
+      }
+
+  // Along x, then y, then z
+  double x00 = v[0][0][0] + t[0] * (v[0][0][1] - v[0][0][0]);
+  double x10 = v[0][1][0] + t[0] * (v[0][1][1] - v[0][1][0]);
+  double x01 = v[1][0][0] + t[0] * (v[1][0][1] - v[1][0][0]);
+  double x11 = v[1][1][0] + t[0] * (v[1][1][1] - v[1][1][0]);
+  double y0 = x00 + t[1] * (x10 - x00);
+  double y1 = x01 + t[1] * (x11 - x01);
+  d = y0 + t[2] * (y1 - y0);
+
+  double dx00 = v[0][0][1] - v[0][0][0], dx10 = v[0][1][1] - v[0][1][0];
+  double dx01 = v[1][0][1] - v[1][0][0], dx11 = v[1][1][1] - v[1][1][0];
+  double dx0 = dx00 + t[1] * (dx10 - dx00);
+  double dx1 = dx01 + t[1] * (dx11 - dx01);
+  gradient[0] = (dx0 + t[2] * (dx1 - dx0)) * invResolution;
+  gradient[1] = ((x10 - x00) + t[2] * ((x11 - x01) - (x10 - x00))) * invResolution;
+  gradient[2] = (y1 - y0) * invResolution;
+  return true;
+}
+
+bool ScanMatcher::refine(const std::vector<Observation::Point>& points, double roll, double pitch, const Pose& initial,
+                         const Parameters& params, Result& result) const
+{
+  // Endpoints rotated by roll and pitch, only the yaw changes below
+  Eigen::Matrix3d attitude =
+      (Eigen::AngleAxisd(pitch, Eigen::Vector3d::UnitY()) * Eigen::AngleAxisd(roll, Eigen::Vector3d::UnitX()))
+          .toRotationMatrix();
+  std::vector<Eigen::Vector3d> leveled(points.size());
+  for (std::size_t i = 0; i < points.size(); i++)
+    leveled[i] = attitude * Eigen::Vector3d(points[i].x, points[i].y, points[i].z);
+
+  typedef Eigen::Matrix<double, 4, 1> Vector4;
+  typedef Eigen::Matrix<double, 4, 4> Matrix4;
+  Vector4 prior(1.0 / (params.priorXYZStdDev * params.priorXYZStdDev),
+                1.0 / (params.priorXYZStdDev * params.priorXYZStdDev),
+                1.0 / (params.priorXYZStdDev * params.priorXYZStdDev),
+                1.0 / (params.priorYawStdDev * params.priorYawStdDev));
+  double invSigmaSq = 1.0 / (params.sigma * params.sigma);
+  double huber = params.huberDistance;
+
+  Vector4 start(initial.x, initial.y, initial.z, initial.yaw);
+  Vector4 pose = start;
+  Vector4 previousPose = start;
+  double previousCost = std::numeric_limits<double>::max();
+  result.iterations = 0;
+  result.inliers = 0;
+  result.rmsDistance = 0.0;
+  result.converged = false;
+
+  // Every step is kept only once the next pass has checked its cost, the last one included
+  for (unsigned int iteration = 0;; iteration++)
+  {
+    Vector4 offset = pose - start;
+    Matrix4 H = prior.asDiagonal();
+    Vector4 g = prior.cwiseProduct(offset);
+    double cost = offset.dot(g);
+
+    double cosYaw = std::cos(pose[3]), sinYaw = std::sin(pose[3]);
+    unsigned int inliers = 0;
+    double squaredSum = 0.0;
+    for (std::size_t i = 0; i < leveled.size(); i++)
+    {
+      const Eigen::Vector3d& c = leveled[i];
+      // Endpoint in the map, and its derivative with respect to the yaw
+      double rx = cosYaw * c.x() - sinYaw * c.y();
+      double ry = sinYaw * c.x() + cosYaw * c.y();
+      double dwx = -ry, dwy = rx;
+      double d, gradient[3];
+      if (!distance(pose[0] + rx, pose[1] + ry, pose[2] + c.z(), d, gradient) || d > params.maxDistance)
+        continue;
+
+      double weight = invSigmaSq;
+      if (d > huber)
+      {
+        weight *= huber / d;
+        cost += invSigmaSq * huber * (2.0 * d - huber);
+      }
+      else
+        cost += invSigmaSq * d * d;
+
+      Vector4 J(gradient[0], gradient[1], params.refineHeight ? gradient[2] : 0.0,
+                gradient[0] * dwx + gradient[1] * dwy);
+      H.noalias() += weight * J * J.transpose();
+      g += weight * d * J;
+      inliers++;
+      squaredSum += d * d;
+    }
+    // The step left the map or overshot: keep the previous pose
+    if (inliers == 0 || cost > previousCost)
+    {
+      pose = previousPose;
+      break;
+    }
+    previousCost = cost;
+    previousPose = pose;
+    result.inliers = inliers;
+    result.rmsDistance = std::sqrt(squaredSum / inliers);
+    if (result.converged || iteration == params.maxIterations)
+      break;
+
+    Vector4 step = -H.ldlt().solve(g);
+    pose += step;
+    result.iterations++;
+    result.converged = step.head<3>().norm() < 1e-3 && std::abs(step[3]) < 1e-3;
+  }
+  result.pose.x = pose[0];
+  result.pose.y = pose[1];
+  result.pose.z = pose[2];
+  result.pose.yaw = std::atan2(std::sin(pose[3]), std::cos(pose[3]));
+
+  Vector4 correction = pose - start;
+  return result.inliers > 0 && result.inliers >= params.minInlierRatio * points.size() &&
+         correction.head<3>().norm() <= params.maxCorrection && std::abs(correction[3]) <= params.maxYawCorrection;
+}
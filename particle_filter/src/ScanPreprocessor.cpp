@@ -0,0 +1,138 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "particle_filter/ScanPreprocessor.h"
+
+ScanPreprocessor::ScanPreprocessor(const Parameters& params)
+  : _params(params), _beamTableAngleMin(0.0), _beamTableIncrement(0.0)
+{
+}
+
+unsigned int ScanPreprocessor::prepareLaserScan(const LaserScan& scan, Observation& observation)
+{
+  unsigned int numBeams = scan.numRanges;
+  float laserMin = std::max(double(scan.rangeMin), _params.minRange);
+
+  // The beam directions only change with the sensor configuration
+  if (_beamCos.size() != numBeams || _beamTableAngleMin != scan.angleMin ||
+      _beamTableIncrement != scan.angleIncrement)
+  {
+    _beamCos.resize(numBeams);
+    _beamSin.resize(numBeams);
+    for (unsigned int beamId = 0; beamId < numBeams; beamId++)
+    {
+      double laserAngle = scan.angleMin + beamId * scan.angleIncrement;
+      _beamCos[beamId] = std::cos(laserAngle);
+      _beamSin[beamId] = std::sin(laserAngle);
+    }
+    _beamTableAngleMin = scan.angleMin;
+    _beamTableIncrement = scan.angleIncrement;
+  }
+
+  // Collect all the valid beams, the selection below picks the ones to use
+  _validBeams.resize(numBeams);
+  _validRanges.resize(numBeams);
+  unsigned int numValid = 0;
+
+  for (unsigned int beamId = 0; beamId < numBeams; beamId++)
+  {
+    float range = scan.ranges[beamId];
+    if (range >= laserMin && range <= _params.maxRange)
+    {
+      Observation::Point& pt = _validBeams[numValid];
+      pt.x = range * _beamCos[beamId];
+      pt.y = range * _beamSin[beamId];
+      pt.z = 0.0f;
+      _validRanges[numValid] = range;
+      numValid++;
+    }
+  }
+
+  _validBeams.resize(numValid);
+  _validRanges.resize(numValid);
+
+  observation.clear();
+  selectBeams(observation);
+  return numValid;
+}
+
+bool ScanPreprocessor::addRange(float range, float rangeMin, float rangeMax, unsigned int sensor,
+                                Observation& observation) const
+{
+  if (range < std::max(double(rangeMin), _params.minRange) || range > std::min(double(rangeMax), _params.maxRange))
+    return false;
+
+  Observation::Point pt = { range, 0.0f, 0.0f };
+  observation.points.push_back(pt);
+  observation.ranges.push_back(range);
+  observation.sensors.push_back(sensor);
+  return true;
+}
+
+void ScanPreprocessor::selectBeams(Observation& observation)
+{
+  // Greedy farthest point selection over the beam endpoints: every new beam is the one farthest from all the
+  // selected ones, so the selection covers the surroundings as evenly as possible for any budget.
+  // Selection stops at the beam budget or when the remaining endpoints are closer than sampleDistance
+  // to a selected one, which thins the scan like a uniform sampling of that size.
+  unsigned int numValid = _validRanges.size();
+  unsigned int budget = numValid;
+  if (_params.maxBeams > 0 && _params.maxBeams < budget)
+    budget = _params.maxBeams;
+
+  observation.points.reserve(budget);
+  observation.ranges.reserve(budget);
+
+  if (numValid == 0)
+    return;
+
+  _beamMinSqDist.assign(numValid, std::numeric_limits<float>::max());
+  float minSqDist = _params.sampleDistance * _params.sampleDistance;
+
+  // Start with the shortest reading, the most accurate one and the cheapest to raycast
+  unsigned int next = std::min_element(_validRanges.begin(), _validRanges.end()) - _validRanges.begin();
+
+  while (observation.ranges.size() < budget)
+  {
+    const Observation::Point selected = _validBeams[next];
+    observation.points.push_back(selected);
+    observation.ranges.push_back(_validRanges[next]);
+
+    float farthestSqDist = -1.0;
+    for (unsigned int i = 0; i < numValid; i++)
+    {
+      float dx = _validBeams[i].x - selected.x;
+      float dy = _validBeams[i].y - selected.y;
+      float dz = _validBeams[i].z - selected.z;
+      _beamMinSqDist[i] = std::min(_beamMinSqDist[i], dx * dx + dy * dy + dz * dz);
+      if (_beamMinSqDist[i] > farthestSqDist)
+      {
+        farthestSqDist = _beamMinSqDist[i];
+        next = i;
+      }
+    }
+
+    if (farthestSqDist < minSqDist)
+      break;
+  }
+}
@@ -0,0 +1,262 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "particle_filter/SharedMap.h"
+
+namespace
+{
+const char CONTROL_MAGIC[8] = { 'P', 'F', 'S', 'H', 'M', 'C', 'T', 'L' };
+const char SEGMENT_MAGIC[8] = { 'P', 'F', 'S', 'H', 'M', 'M', 'A', 'P' };
+
+std::string systemError(const std::string& what)
+{
+  return what + ": " + std::strerror(errno);
+}
+}  // namespace
+
+std::string shared_map::segmentName(const std::string& name, uint64_t generation)
+{
+  return name + "." + std::to_string(generation);
+}
+
+/* Publisher */
+SharedMapPublisher::SharedMapPublisher(const std::string& name) : _name(name), _control(NULL), _generation(0)
+{
+}
+
+SharedMapPublisher::~SharedMapPublisher()
+{
+  if (!_control)
+    return;
+
+  // The control segment stays, so that clients see the next publisher of the same name
+  _control->generation.store(0);
+  if (_generation)
+    shm_unlink(shared_map::segmentName(_name, _generation).c_str());
+  munmap(_control, sizeof(shared_map::Control));
+}
+
+bool SharedMapPublisher::createControl(std::string& error)
+{
+  int fd = shm_open(_name.c_str(), O_CREAT | O_RDWR, 0644);
+  if (fd < 0)
+  {
+    error = systemError("cannot open " + _name);
+    return false;
+  }
+
+  struct stat st;
+  bool reuse = fstat(fd, &st) == 0 && std::size_t(st.st_size) == sizeof(shared_map::Control);
+  if (!reuse && ftruncate(fd, sizeof(shared_map::Control)) != 0)
+  {
+    error = systemError("cannot resize " + _name);
+    ::close(fd);
+    return false;
+  }
+
+  void* mapped = mmap(NULL, sizeof(shared_map::Control), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED)
+  {
+    error = systemError("cannot map " + _name);
+    return false;
+  }
+
+  _control = static_cast<shared_map::Control*>(mapped);
+  if (reuse && std::memcmp(_control->magic, CONTROL_MAGIC, sizeof(CONTROL_MAGIC)) == 0)
+  {
+    // A previous publisher of this name, keep counting from its last generation
+    _generation = _control->lastGeneration.load();
+  }
+  else
+  {
+    new (_control) shared_map::Control();
+    _control->generation.store(0);
+    _control->lastGeneration.store(0);
+    std::memcpy(_control->magic, CONTROL_MAGIC, sizeof(CONTROL_MAGIC));
+  }
+  return true;
+}
+
+bool SharedMapPublisher::publish(const MapCache& cache, std::string& error)
+{
+  if (!_control && !createControl(error))
+    return false;
+
+  shared_map::SegmentHeader header;
+  std::memcpy(header.magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+  header.generation = _generation + 1;
+  header.cacheOffset = (sizeof(header) + 63) & ~std::size_t(63);
+  header.cacheSize = cache.byteSize();
+  header.size = header.cacheOffset + header.cacheSize;
+
+  std::string segment = shared_map::segmentName(_name, header.generation);
+  // A segment left by a crashed publisher is replaced
+  shm_unlink(segment.c_str());
+  int fd = shm_open(segment.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0)
+  {
+    error = systemError("cannot create " + segment);
+    return false;
+  }
+  if (ftruncate(fd, header.size) != 0)
+  {
+    error = systemError("cannot resize " + segment);
+    ::close(fd);
+    shm_unlink(segment.c_str());
+    return false;
+  }
+  void* mapped = mmap(NULL, header.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED)
+  {
+    error = systemError("cannot map " + segment);
+    shm_unlink(segment.c_str());
+    return false;
+  }
+
+  uint8_t* bytes = static_cast<uint8_t*>(mapped);
+  std::memcpy(bytes, &header, sizeof(header));
+  if (header.cacheSize)
+    std::memcpy(bytes + header.cacheOffset, cache.data(), header.cacheSize);
+  munmap(mapped, header.size);
+
+  // Advertise the complete segment, then drop the name of the previous one (its clients keep their mapping)
+  _control->lastGeneration.store(header.generation);
+  _control->generation.store(header.generation, std::memory_order_release);
+  if (_generation)
+    shm_unlink(shared_map::segmentName(_name, _generation).c_str());
+  _generation = header.generation;
+  return true;
+}
+
+/* Client */
+SharedMap::SharedMap() : _control(NULL), _segment(NULL), _segmentSize(0), _generation(0)
+{
+}
+
+SharedMap::~SharedMap()
+{
+  detach();
+  if (_control)
+    munmap(const_cast<shared_map::Control*>(_control), sizeof(shared_map::Control));
+}
+
+void SharedMap::detach()
+{
+  _cache.release();
+  if (_segment)
+    munmap(_segment, _segmentSize);
+  _segment = NULL;
+  _segmentSize = 0;
+  _generation = 0;
+}
+
+bool SharedMap::attach(const std::string& name, std::string& error)
+{
+  if (!_control)
+  {
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+    {
+      error = systemError("no map published as " + name);
+      return false;
+    }
+    struct stat st;
+    void* mapped = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && std::size_t(st.st_size) == sizeof(shared_map::Control))
+      mapped = mmap(NULL, sizeof(shared_map::Control), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED ||
+        std::memcmp(static_cast<shared_map::Control*>(mapped)->magic, CONTROL_MAGIC, sizeof(CONTROL_MAGIC)) != 0)
+    {
+      if (mapped != MAP_FAILED)
+        munmap(mapped, sizeof(shared_map::Control));
+      error = name + " is not a shared map";
+      return false;
+    }
+    _control = static_cast<const shared_map::Control*>(mapped);
+  }
+
+  // The publisher may replace the generation between reading it and opening its segment
+  for (int attempt = 0; attempt < 3; attempt++)
+  {
+    uint64_t generation = _control->generation.load(std::memory_order_acquire);
+    if (generation == 0)
+    {
+      error = "no map published as " + name;
+      return false;
+    }
+
+    std::string segment = shared_map::segmentName(name, generation);
+    int fd = shm_open(segment.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+      continue;
+    struct stat st;
+    void* mapped = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && std::size_t(st.st_size) >= sizeof(shared_map::SegmentHeader))
+      mapped = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+    {
+      error = systemError("cannot map " + segment);
+      return false;
+    }
+
+    const shared_map::SegmentHeader* header = static_cast<const shared_map::SegmentHeader*>(mapped);
+    MapCache cache;
+    if (std::memcmp(header->magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0 || header->generation != generation ||
+        header->size != std::size_t(st.st_size) || header->cacheOffset > header->size ||
+        header->cacheSize > header->size - header->cacheOffset ||
+        !cache.attach(static_cast<const uint8_t*>(mapped) + header->cacheOffset, header->cacheSize, false, error))
+    {
+      munmap(mapped, st.st_size);
+      error = segment + " is not a valid map segment";
+      return false;
+    }
+
+    detach();
+    _segment = mapped;
+    _segmentSize = st.st_size;
+    _generation = generation;
+    _cache.attach(static_cast<const uint8_t*>(mapped) + header->cacheOffset, header->cacheSize, false, error);
+    return true;
+  }
+
+  error = "the map published as " + name + " keeps changing";
+  return false;
+}
+
+bool SharedMap::updateAvailable() const
+{
+  if (!_control)
+    return false;
+  uint64_t generation = _control->generation.load(std::memory_order_acquire);
+  return generation != 0 && generation != _generation;
+}
@@ -0,0 +1,73 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <cmath>
+
+#include "particle_filter/StateEstimate.h"
+
+DroneState estimateFourDof(const libPF::ParticleFilter<DroneState>& pf, double percentage)
+{
+  DroneState estimate = pf.getState(0);
+  unsigned int numToConsider = pf.numParticles() / 100.0 * percentage;
+  if (numToConsider <= 1)
+    return estimate;
+
+  double x = 0.0, y = 0.0, z = 0.0, yawCos = 0.0, yawSin = 0.0, weightSum = 0.0;
+  for (unsigned int i = 0; i < numToConsider; i++)
+  {
+    const DroneState& state = pf.getState(i);
+    double weight = pf.getWeight(i);
+    x += weight * state.getXPos();
+    y += weight * state.getYPos();
+    z += weight * state.getZPos();
+    yawCos += weight * std::cos(state.getYaw());
+    yawSin += weight * std::sin(state.getYaw());
+    weightSum += weight;
+  }
+  if (weightSum <= 0.0)
+    return estimate;
+
+  estimate.setXPos(x / weightSum);
+  estimate.setYPos(y / weightSum);
+  estimate.setZPos(z / weightSum);
+  estimate.setYaw(std::atan2(yawSin, yawCos));
+  return estimate;
+}
+
+void moveParticles(libPF::ParticleFilter<DroneState>& pf, const DroneState& estimate, const DroneState& corrected,
+                   double gain)
+{
+  double dx = gain * (corrected.getXPos() - estimate.getXPos());
+  double dy = gain * (corrected.getYPos() - estimate.getYPos());
+  double dz = gain * (corrected.getZPos() - estimate.getZPos());
+  double dyaw = gain * std::atan2(std::sin(corrected.getYaw() - estimate.getYaw()),
+                                  std::cos(corrected.getYaw() - estimate.getYaw()));
+  double c = std::cos(dyaw), s = std::sin(dyaw);
+  for (unsigned int i = 0; i < pf.numParticles(); i++)
+  {
+    DroneState state = pf.getState(i);
+    double rx = state.getXPos() - estimate.getXPos();
+    double ry = state.getYPos() - estimate.getYPos();
+    state.setXPos(estimate.getXPos() + c * rx - s * ry + dx);
+    state.setYPos(estimate.getYPos() + s * rx + c * ry + dy);
+    state.setZPos(state.getZPos() + dz);
+    state.setYaw(std::atan2(std::sin(state.getYaw() + dyaw), std::cos(state.getYaw() + dyaw)));
+    pf.setState(i, state);
+  }
+}
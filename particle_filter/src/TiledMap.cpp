@@ -0,0 +1,569 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "particle_filter/TiledMap.h"
+#include "particle_filter/GridRaycast.h"
+
+namespace
+{
+const char MAGIC[8] = { 'P', 'F', 'M', 'A', 'P', 'T', 'I', 'L' };
+
+std::size_t align(std::size_t offset)
+{
+  return (offset + 63) & ~std::size_t(63);
+}
+
+bool readAt(int fd, void* data, std::size_t size, uint64_t offset)
+{
+  uint8_t* bytes = static_cast<uint8_t*>(data);
+  while (size > 0)
+  {
+    ssize_t n = pread(fd, bytes, size, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    bytes += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+}  // namespace
+
+TiledMap::TiledMap() : _fd(-1), _tileCells(0), _maxTiles(0), _lastPrefetched(NULL), _stopPrefetch(false)
+{
+  std::memset(&_header, 0, sizeof(_header));
+  std::memset(&_stats, 0, sizeof(_stats));
+}
+
+TiledMap::~TiledMap()
+{
+  close();
+}
+
+void TiledMap::close()
+{
+  if (_prefetchThread.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopPrefetch = true;
+    }
+    _prefetchCondition.notify_all();
+    _prefetchThread.join();
+  }
+  _stopPrefetch = false;
+  _prefetchRequests.clear();
+  _lastPrefetched = NULL;
+
+  _window = Window();
+  _lru.clear();
+  _resident.clear();
+  _index.clear();
+  if (_fd >= 0)
+    ::close(_fd);
+  _fd = -1;
+}
+
+std::string TiledMap::tilesPathFor(const std::string& mapFile)
+{
+  return mapFile + ".tiles";
+}
+
+bool TiledMap::open(const std::string& tilesPath, uint64_t sourceChecksum, float maxDistance, uint32_t tileBits,
+                    unsigned int maxTiles, std::string& error)
+{
+  close();
+  error.clear();
+
+  int fd = ::open(tilesPath.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    error = "cannot open " + tilesPath + ": " + std::strerror(errno);
+    return false;
+  }
+
+  struct stat st;
+  Header header;
+  if (fstat(fd, &st) != 0 || !readAt(fd, &header, sizeof(header), 0) ||
+      std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION ||
+      header.headerSize != sizeof(Header) || header.fileSize != uint64_t(st.st_size))
+    error = tilesPath + " is not a map tiles file of version " + std::to_string(VERSION);
+  else if (header.sourceChecksum != sourceChecksum)
+    error = tilesPath + " was built from another map";
+  else if (header.maxDistance != maxDistance || header.tileBits != tileBits)
+    error = tilesPath + " was built with other parameters";
+
+  std::vector<TileEntry> index;
+  if (error.empty())
+  {
+    index.resize(std::size_t(header.numTiles[0]) * header.numTiles[1] * header.numTiles[2]);
+    if (!readAt(fd, &index[0], index.size() * sizeof(TileEntry), header.indexOffset) ||
+        MapCache::checksum(&index[0], index.size() * sizeof(TileEntry)) != header.indexChecksum)
+      error = tilesPath + ": corrupted index";
+  }
+
+  if (!error.empty())
+  {
+    ::close(fd);
+    return false;
+  }
+
+  _fd = fd;
+  _header = header;
+  _index.swap(index);
+  _tileCells = std::size_t(1) << (3 * tileBits);
+  _maxTiles = std::max(1u, maxTiles);
+  // Started here rather than on the first request, which several drones may make at once
+  _prefetchThread = std::thread(&TiledMap::prefetchLoop, this);
+  return true;
+}
+
+bool TiledMap::build(const octomap::OcTree& tree, uint64_t sourceChecksum, float maxDistance, uint32_t tileBits,
+                     const std::string& tilesPath, std::string& error)
+{
+  return buildFromTree(tree, sourceChecksum, maxDistance, tileBits, tilesPath, error);
+}
+
+bool TiledMap::build(const octomap::ColorOcTree& tree, uint64_t sourceChecksum, float maxDistance, uint32_t tileBits,
+                     const std::string& tilesPath, std::string& error)
+{
+  return buildFromTree(tree, sourceChecksum, maxDistance, tileBits, tilesPath, error);
+}
+
+template <class TREE>
+bool TiledMap::buildFromTree(const TREE& tree, uint64_t sourceChecksum, float maxDistance, uint32_t tileBits,
+                             const std::string& tilesPath, std::string& error)
+{
+  Header header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.headerSize = sizeof(Header);
+  header.sourceChecksum = sourceChecksum;
+  header.resolution = tree.getResolution();
+  MapCache::gridOf(tree, header.origin, header.size);
+  header.tileBits = tileBits;
+
+  const int tile = 1 << tileBits;
+  const int pad = tile / 2;
+  const std::size_t tileCells = std::size_t(tile) * tile * tile;
+  for (int i = 0; i < 3; i++)
+    header.numTiles[i] = (header.size[i] + tile - 1) / tile;
+  header.maxDistance = maxDistance;
+  header.tileMaxDistance = std::min(maxDistance, float(pad * header.resolution));
+  header.indexOffset = align(sizeof(Header));
+
+  std::vector<TileEntry> index(std::size_t(header.numTiles[0]) * header.numTiles[1] * header.numTiles[2]);
+  uint64_t offset = align(header.indexOffset + index.size() * sizeof(TileEntry));
+
+  // Write to a temporary file and rename it, as MapCache does
+  std::string tmpPath = tilesPath + ".tmp" + std::to_string(getpid());
+  FILE* file = std::fopen(tmpPath.c_str(), "wb");
+  if (!file)
+  {
+    error = "cannot write " + tmpPath + ": " + std::strerror(errno);
+    return false;
+  }
+
+  // Every tile is rasterized with a margin of pad cells, for its distance field
+  const uint32_t blockSize[3] = { uint32_t(tile + 2 * pad), uint32_t(tile + 2 * pad), uint32_t(tile + 2 * pad) };
+  std::vector<uint8_t> block;
+  std::vector<uint16_t> blockDistance(std::size_t(blockSize[0]) * blockSize[1] * blockSize[2]);
+  std::vector<uint8_t> bytes(3 * tileCells);
+  bool ok = std::fseek(file, offset, SEEK_SET) == 0;
+  for (uint32_t tz = 0; ok && tz < header.numTiles[2]; tz++)
+    for (uint32_t ty = 0; ok && ty < header.numTiles[1]; ty++)
+      for (uint32_t tx = 0; ok && tx < header.numTiles[0]; tx++)
+      {
+        TileEntry& entry = index[(std::size_t(tz) * header.numTiles[1] + ty) * header.numTiles[0] + tx];
+        const int first[3] = { int(tx) * tile - pad, int(ty) * tile - pad, int(tz) * tile - pad };
+        MapCache::rasterize(tree, header.origin, header.resolution, first, blockSize, block);
+
+        uint8_t* occupancy = &bytes[0];
+        bool uniform = true, blockOccupied = false;
+        for (int z = 0; z < tile; z++)
+          for (int y = 0; y < tile; y++)
+          {
+            const uint8_t* row = &block[((std::size_t(z + pad) * blockSize[1]) + y + pad) * blockSize[0] + pad];
+            std::memcpy(occupancy + (std::size_t(z) * tile + y) * tile, row, tile);
+          }
+        for (std::size_t i = 0; i < tileCells; i++)
+          uniform = uniform && occupancy[i] == occupancy[0] && occupancy[0] != MapCache::OCCUPIED;
+        entry.state = occupancy[0];
+        if (uniform)
+          continue;
+
+        for (std::size_t i = 0; i < block.size() && !blockOccupied; i++)
+          blockOccupied = block[i] == MapCache::OCCUPIED;
+
+        uint16_t* distance = reinterpret_cast<uint16_t*>(&bytes[tileCells]);
+        if (blockOccupied)
+        {
+          MapCache::computeDistanceField(&block[0], blockSize, header.resolution, header.tileMaxDistance,
+                                         &blockDistance[0]);
+          for (int z = 0; z < tile; z++)
+            for (int y = 0; y < tile; y++)
+              std::memcpy(distance + (std::size_t(z) * tile + y) * tile,
+                          &blockDistance[((std::size_t(z + pad) * blockSize[1]) + y + pad) * blockSize[0] + pad],
+                          tile * sizeof(uint16_t));
+        }
+        else
+        {
+          uint16_t far = uint16_t(std::min(header.tileMaxDistance * 1000.0f + 0.5f, 65535.0f));
+          std::fill(distance, distance + tileCells, far);
+        }
+
+        entry.state = TILE_STORED;
+        entry.offset = offset;
+        entry.checksum = uint32_t(MapCache::checksum(&bytes[0], bytes.size()));
+        ok = std::fwrite(&bytes[0], 1, bytes.size(), file) == bytes.size();
+        offset += bytes.size();
+      }
+
+  header.fileSize = offset;
+  header.indexChecksum = MapCache::checksum(&index[0], index.size() * sizeof(TileEntry));
+  ok = ok && std::fseek(file, 0, SEEK_SET) == 0 && std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+       std::fseek(file, header.indexOffset, SEEK_SET) == 0 &&
+       std::fwrite(&index[0], sizeof(TileEntry), index.size(), file) == index.size();
+  ok = (std::fclose(file) == 0) && ok;
+  if (!ok || std::rename(tmpPath.c_str(), tilesPath.c_str()) != 0)
+  {
+    error = "cannot write " + tilesPath + ": " + std::strerror(errno);
+    std::remove(tmpPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+TiledMap::TilePtr TiledMap::readTile(uint32_t index) const
+{
+  const TileEntry& entry = _index[index];
+  std::shared_ptr<Tile> tile(new Tile());
+  tile->index = index;
+  tile->bytes.resize(3 * _tileCells);
+  if (!readAt(_fd, &tile->bytes[0], tile->bytes.size(), entry.offset) ||
+      uint32_t(MapCache::checksum(&tile->bytes[0], tile->bytes.size())) != entry.checksum)
+    return TilePtr();
+  return tile;
+}
+
+void TiledMap::insertTile(uint32_t index, const TilePtr& tile) const
+{
+  _lru.push_front(index);
+  _resident[index] = std::make_pair(tile, _lru.begin());
+  while (_lru.size() > _maxTiles)
+  {
+    // A tile of the window stays alive through its pin
+    _resident.erase(_lru.back());
+    _lru.pop_back();
+    _stats.evictions++;
+  }
+}
+
+TiledMap::TilePtr TiledMap::getTile(uint32_t index, bool prefetching) const
+{
+  if (_index[index].state != TILE_STORED)
+    return TilePtr();
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _resident.find(index);
+    if (it != _resident.end())
+    {
+      _lru.splice(_lru.begin(), _lru, it->second.second);
+      if (!prefetching)
+        _stats.hits++;
+      return it->second.first;
+    }
+  }
+
+  // The file is read without holding the lock, the prefetch thread may be reading the same tile
+  TilePtr tile = readTile(index);
+
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (!tile)
+  {
+    // Seen as unknown space
+    _stats.checksumErrors++;
+    return tile;
+  }
+  auto it = _resident.find(index);
+  if (it != _resident.end())
+    return it->second.first;
+  if (prefetching)
+    _stats.prefetched++;
+  else
+    _stats.loads++;
+  insertTile(index, tile);
+  return tile;
+}
+
+bool TiledMap::tileRange(const double min[3], const double max[3], uint32_t first[3], uint32_t last[3]) const
+{
+  const double tileSize = _header.resolution * (1 << _header.tileBits);
+  for (int i = 0; i < 3; i++)
+  {
+    double low = std::floor((min[i] - _header.origin[i]) / tileSize);
+    double high = std::floor((max[i] - _header.origin[i]) / tileSize);
+    if (high < 0 || low >= _header.numTiles[i] || high < low)
+      return false;
+    first[i] = uint32_t(std::max(low, 0.0));
+    last[i] = uint32_t(std::min(high, double(_header.numTiles[i] - 1)));
+  }
+  return true;
+}
+
+void TiledMap::setWindow(const double min[3], const double max[3])
+{
+  // Loaded aside: getStats() and residentBytes() read the window of the map under the lock
+  Window window;
+  if (!loadWindow(_window, min, max, window))
+    return;
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::swap(_window, window);
+}
+
+void TiledMap::setWindow(Window& window, const double min[3], const double max[3]) const
+{
+  Window loaded;
+  if (loadWindow(window, min, max, loaded))
+    std::swap(window, loaded);
+}
+
+bool TiledMap::loadWindow(const Window& current, const double min[3], const double max[3], Window& window) const
+{
+  uint32_t first[3], last[3];
+  if (!tileRange(min, max, first, last))
+    return true;
+
+  uint32_t size[3] = { last[0] - first[0] + 1, last[1] - first[1] + 1, last[2] - first[2] + 1 };
+  if (std::equal(first, first + 3, current._first) && std::equal(size, size + 3, current._size))
+    return false;
+
+  std::vector<const Tile*> tiles;
+  std::vector<TilePtr> pins;
+  tiles.reserve(std::size_t(size[0]) * size[1] * size[2]);
+  for (uint32_t tz = first[2]; tz <= last[2]; tz++)
+    for (uint32_t ty = first[1]; ty <= last[1]; ty++)
+      for (uint32_t tx = first[0]; tx <= last[0]; tx++)
+      {
+        TilePtr tile = getTile(tileIndex(tx, ty, tz), false);
+        tiles.push_back(tile.get());
+        if (tile)
+          pins.push_back(tile);
+      }
+
+  window._tiles.swap(tiles);
+  window._pins.swap(pins);
+  std::copy(first, first + 3, window._first);
+  std::copy(size, size + 3, window._size);
+  return true;
+}
+
+void TiledMap::prefetch(const double min[3], const double max[3])
+{
+  prefetch(_window, min, max);
+}
+
+void TiledMap::prefetch(const Window& window, const double min[3], const double max[3])
+{
+  std::deque<uint32_t> queue;
+  uint32_t first[3], last[3];
+  if (tileRange(min, max, first, last))
+  {
+    for (uint32_t tz = first[2]; tz <= last[2]; tz++)
+      for (uint32_t ty = first[1]; ty <= last[1]; ty++)
+        for (uint32_t tx = first[0]; tx <= last[0]; tx++)
+        {
+          uint32_t index = tileIndex(tx, ty, tz);
+          if (_index[index].state == TILE_STORED)
+            queue.push_back(index);
+        }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    // Do not let the prefetched tiles evict each other, those of the other windows included
+    std::size_t windows = _prefetchRequests.size() + (_prefetchRequests.count(&window) ? 0 : 1);
+    std::size_t limit = std::max<std::size_t>(1, _maxTiles / 2 / windows);
+    if (queue.size() > limit)
+      queue.resize(limit);
+    if (queue.empty())
+      _prefetchRequests.erase(&window);
+    else
+      _prefetchRequests[&window].swap(queue);
+  }
+  _prefetchCondition.notify_one();
+}
+
+void TiledMap::prefetchLoop()
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (true)
+  {
+    _prefetchCondition.wait(lock, [this] { return _stopPrefetch || !_prefetchRequests.empty(); });
+    if (_stopPrefetch)
+      return;
+
+    // One tile for every window in turn. A window is only a key here, it may be gone already.
+    auto request = _prefetchRequests.upper_bound(_lastPrefetched);
+    if (request == _prefetchRequests.end())
+      request = _prefetchRequests.begin();
+    _lastPrefetched = request->first;
+    uint32_t index = request->second.front();
+    request->second.pop_front();
+    if (request->second.empty())
+      _prefetchRequests.erase(request);
+    if (_resident.count(index))
+      continue;
+
+    lock.unlock();
+    getTile(index, true);
+    lock.lock();
+  }
+}
+
+struct TiledMap::WindowGrid
+{
+  const TiledMap& map;
+  const Window& window;
+
+  double resolution() const
+  {
+    return map.resolution();
+  }
+  double origin(int axis) const
+  {
+    return map.origin(axis);
+  }
+  uint32_t size(int axis) const
+  {
+    return map.size(axis);
+  }
+  bool probe(const int cell[3], double& freeCells, int& emptyBlockBits) const
+  {
+    return map.probe(window, cell, freeCells, emptyBlockBits);
+  }
+};
+
+bool TiledMap::probe(const int cell[3], double& freeCells, int& emptyBlockBits) const
+{
+  return probe(_window, cell, freeCells, emptyBlockBits);
+}
+
+bool TiledMap::probe(const Window& window, const int cell[3], double& freeCells, int& emptyBlockBits) const
+{
+  const int bits = _header.tileBits;
+  uint32_t t[3] = { uint32_t(cell[0]) >> bits, uint32_t(cell[1]) >> bits, uint32_t(cell[2]) >> bits };
+
+  const Tile* tile;
+  TilePtr loaded;
+  if (t[0] - window._first[0] < window._size[0] && t[1] - window._first[1] < window._size[1] &&
+      t[2] - window._first[2] < window._size[2])
+  {
+    tile = window._tiles[((t[2] - window._first[2]) * window._size[1] + t[1] - window._first[1]) * window._size[0] +
+                         t[0] - window._first[0]];
+  }
+  else
+  {
+    loaded = getTile(tileIndex(t[0], t[1], t[2]), false);
+    tile = loaded.get();
+  }
+
+  if (!tile)
+  {
+    // Uniform tile: nothing to hit in it
+    emptyBlockBits = bits;
+    return false;
+  }
+
+  const uint32_t mask = (1u << bits) - 1;
+  std::size_t idx = ((std::size_t(cell[2] & mask) << bits) + (cell[1] & mask)) * (mask + 1) + (cell[0] & mask);
+  if (tile->occupancy()[idx] == MapCache::OCCUPIED)
+    return true;
+  freeCells = tile->distance(_tileCells)[idx] * 0.001 / _header.resolution;
+  return false;
+}
+
+bool TiledMap::castRay(float originX, float originY, float originZ, float directionX, float directionY,
+                       float directionZ, float maxRange, float& range, const Window* window) const
+{
+  if (!window)
+    return grid_raycast::castRay(*this, originX, originY, originZ, directionX, directionY, directionZ, maxRange,
+                                 range);
+  WindowGrid grid = { *this, *window };
+  return grid_raycast::castRay(grid, originX, originY, originZ, directionX, directionY, directionZ, maxRange, range);
+}
+
+uint8_t TiledMap::cellState(double x, double y, double z) const
+{
+  double point[3] = { x, y, z };
+  int cell[3];
+  for (int i = 0; i < 3; i++)
+  {
+    double f = (point[i] - _header.origin[i]) / _header.resolution;
+    if (f < 0 || f >= _header.size[i])
+      return MapCache::UNKNOWN;
+    cell[i] = int(f);
+  }
+
+  const int bits = _header.tileBits;
+  uint32_t index = tileIndex(cell[0] >> bits, cell[1] >> bits, cell[2] >> bits);
+  TilePtr tile = getTile(index, false);
+  if (!tile)
+    return _index[index].state == TILE_STORED ? uint8_t(MapCache::UNKNOWN) : uint8_t(_index[index].state);
+
+  const uint32_t mask = (1u << bits) - 1;
+  return tile->occupancy()[((std::size_t(cell[2] & mask) << bits) + (cell[1] & mask)) * (mask + 1) + (cell[0] & mask)];
+}
+
+TiledMap::Stats TiledMap::getStats() const
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  Stats stats = _stats;
+  stats.residentTiles = _resident.size();
+  stats.windowTiles = _window._pins.size();
+  return stats;
+}
+
+std::size_t TiledMap::residentBytes() const
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  // Pinned tiles that were evicted from the cache are still in memory
+  std::size_t tiles = _resident.size();
+  for (std::size_t i = 0; i < _window._pins.size(); i++)
+  {
+    auto it = _resident.find(_window._pins[i]->index);
+    if (it == _resident.end() || it->second.first != _window._pins[i])
+      tiles++;
+  }
+  return tiles * 3 * _tileCells + _index.size() * sizeof(TileEntry);
+}
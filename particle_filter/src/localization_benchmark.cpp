@@ -0,0 +1,639 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Headless localization benchmark: flies a scripted trajectory through a map, generates noisy scans and
+ * odometry by raycasting, runs the particle filter on them as fast as possible and reports the step latency
+ * and the pose error. No ROS master or simulator is needed.
+ *
+ *   localization_benchmark experiments/maps/box.ot --trajectory meander
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <octomap/ColorOcTree.h>
+#include <octomap/OcTree.h>
+
+#include <libPF/ParticleFilter.h>
+
+#include "particle_filter/DeadlineController.h"
+#include "particle_filter/DroneMovementModel.h"
+#include "particle_filter/DroneObservationModel.h"
+#include "particle_filter/DroneStateDistribution.h"
+#include "particle_filter/FreeSpaceIndex.h"
+#include "particle_filter/HeightField.h"
+#include "particle_filter/MapCache.h"
+#include "particle_filter/ScanMatcher.h"
+#include "particle_filter/ScanPreprocessor.h"
+#include "particle_filter/StateEstimate.h"
+
+namespace
+{
+struct Options
+{
+  std::string mapFile;
+  std::string trajectory;
+  double speed;
+  double rate;
+  // Synthetic laser: beams over the field of view, in the plane of the base
+  unsigned int beams;
+  double fovDeg;
+  double maxRange;
+  double rangeNoise;
+  // Odometry error, as a fraction of the motion
+  double odomNoise;
+  int particles;
+  double initialStdDev;
+  unsigned int maxBeams;
+  double sampleDistance;
+  bool earlyTermination;
+  bool weightCache;
+  bool fourDof;
+  // Start over the free space of the map instead of around the true pose
+  bool global;
+  // Height sensor, its noise (m) and the gate of the observation model
+  bool heightGating;
+  double heightNoise;
+  // Augmented MCL recovery, and the step at which the drone is carried elsewhere (0 : never)
+  bool recovery;
+  int kidnapStep;
+  // Refine the estimate by registration to the distance field, and move the particles by this part of the correction
+  bool refine;
+  double refineFeedback;
+  // Adapt the beams and the particles to this step time (s, 0 : fixed)
+  double deadline;
+  unsigned int seed;
+  // Exit with an error when the error is larger (0 : no check)
+  double maxPositionRmse;
+  double maxYawRmse;
+  std::string csvFile;
+};
+
+struct Waypoint
+{
+  double x, y, z;
+};
+
+void usage()
+{
+  std::fprintf(stderr,
+               "usage: localization_benchmark <map.ot|map.bt> [options]\n"
+               "  --trajectory line|meander|spiral   scripted trajectory (default line)\n"
+               "  --speed <m/s>                      flight speed (default 0.5)\n"
+               "  --rate <Hz>                        scan rate (default 10)\n"
+               "  --beams <n> --fov <deg>            synthetic laser (default 360 over 360)\n"
+               "  --max-range <m>                    laser range (default 14)\n"
+               "  --range-noise <m>                  range noise standard deviation (default 0.02)\n"
+               "  --odom-noise <ratio>               odometry error per unit of motion (default 0.05)\n"
+               "  --particles <n>                    (default 500)\n"
+               "  --initial-std-dev <m>              spread of the initial particles (default 0.2)\n"
+               "  --max-beams <n> --sample-distance <m>  beam selection (default 0 and 0.2)\n"
+               "  --early-termination --weight-cache enable these optimizations\n"
+               "  --four-dof                         estimate x, y, z and yaw only, attitude from the odometry\n"
+               "  --global                           start with the particles over the whole free space\n"
+               "  --height-gating                    weight with a height sensor before raycasting\n"
+               "  --height-noise <m>                 height noise standard deviation (default 0.02)\n"
+               "  --recovery                         inject particles over the free space when the likelihood drops\n"
+               "  --kidnap <step>                    carry the drone further along the trajectory, without odometry\n"
+               "  --refine                           refine the estimate by registration of the scan to the map\n"
+               "  --refine-feedback <gain>           move the particles by this part of the refinement (default 0)\n"
+               "  --deadline <ms>                    adapt the beams and the particles to this step time\n"
+               "  --seed <n>                         random seed (default 1)\n"
+               "  --max-position-rmse <m> --max-yaw-rmse <rad>  fail when the error is larger\n"
+               "  --csv <file>                       write the true and estimated pose of every step\n");
+}
+
+bool parseOptions(int argc, char** argv, Options& options)
+{
+  options.trajectory = "line";
+  options.speed = 0.5;
+  options.rate = 10.0;
+  options.beams = 360;
+  options.fovDeg = 360.0;
+  options.maxRange = 14.0;
+  options.rangeNoise = 0.02;
+  options.odomNoise = 0.05;
+  options.particles = 500;
+  options.initialStdDev = 0.2;
+  options.maxBeams = 0;
+  options.sampleDistance = 0.2;
+  options.earlyTermination = false;
+  options.weightCache = false;
+  options.fourDof = false;
+  options.global = false;
+  options.heightGating = false;
+  options.heightNoise = 0.02;
+  options.recovery = false;
+  options.kidnapStep = 0;
+  options.refine = false;
+  options.refineFeedback = 0.0;
+  options.deadline = 0.0;
+  options.seed = 1;
+  options.maxPositionRmse = 0.0;
+  options.maxYawRmse = 0.0;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--early-termination")
+      options.earlyTermination = true;
+    else if (arg == "--weight-cache")
+      options.weightCache = true;
+    else if (arg == "--four-dof")
+      options.fourDof = true;
+    else if (arg == "--global")
+      options.global = true;
+    else if (arg == "--height-gating")
+      options.heightGating = true;
+    else if (arg == "--recovery")
+      options.recovery = true;
+    else if (arg == "--refine")
+      options.refine = true;
+    else if (arg.compare(0, 2, "--") != 0)
+      options.mapFile = arg;
+    else if (i + 1 >= argc)
+      return false;
+    else if (arg == "--trajectory")
+      options.trajectory = argv[++i];
+    else if (arg == "--speed")
+      options.speed = std::atof(argv[++i]);
+    else if (arg == "--rate")
+      options.rate = std::atof(argv[++i]);
+    else if (arg == "--beams")
+      options.beams = std::atoi(argv[++i]);
+    else if (arg == "--fov")
+      options.fovDeg = std::atof(argv[++i]);
+    else if (arg == "--max-range")
+      options.maxRange = std::atof(argv[++i]);
+    else if (arg == "--range-noise")
+      options.rangeNoise = std::atof(argv[++i]);
+    else if (arg == "--odom-noise")
+      options.odomNoise = std::atof(argv[++i]);
+    else if (arg == "--particles")
+      options.particles = std::atoi(argv[++i]);
+    else if (arg == "--initial-std-dev")
+      options.initialStdDev = std::atof(argv[++i]);
+    else if (arg == "--max-beams")
+      options.maxBeams = std::atoi(argv[++i]);
+    else if (arg == "--sample-distance")
+      options.sampleDistance = std::atof(argv[++i]);
+    else if (arg == "--height-noise")
+      options.heightNoise = std::atof(argv[++i]);
+    else if (arg == "--kidnap")
+      options.kidnapStep = std::atoi(argv[++i]);
+    else if (arg == "--refine-feedback")
+      options.refineFeedback = std::atof(argv[++i]);
+    else if (arg == "--deadline")
+      options.deadline = std::atof(argv[++i]) / 1000.0;
+    else if (arg == "--seed")
+      options.seed = std::atoi(argv[++i]);
+    else if (arg == "--max-position-rmse")
+      options.maxPositionRmse = std::atof(argv[++i]);
+    else if (arg == "--max-yaw-rmse")
+      options.maxYawRmse = std::atof(argv[++i]);
+    else if (arg == "--csv")
+      options.csvFile = argv[++i];
+    else
+      return false;
+  }
+  return !options.mapFile.empty() && options.speed > 0 && options.rate > 0 && options.beams > 0 &&
+         options.particles > 0;
+}
+
+// Waypoints of drone_3d_nav/produce_trajectory, with its variants for the warehouse world
+bool makeWaypoints(const std::string& type, bool warehouse, std::vector<Waypoint>& waypoints)
+{
+  waypoints.clear();
+  if (type == "line")
+  {
+    Waypoint line[] = { { 0, 0, 1.2 }, { 4.5, 0, 1.2 }, { 9, 0, 1.2 } };
+    waypoints.assign(line, line + 3);
+  }
+  else if (type == "meander" && !warehouse)
+  {
+    Waypoint meander[] = { { 0, 0, 0.5 }, { 0, -3, 0.5 }, { 5, -3, 0.5 }, { 5, 3, 0.5 }, { 1, 3, 0.5 }, { 1, -2, 1 },
+                           { 3, -2, 1 },  { 3, 2, 1 },    { 2, 2, 1 },    { 2, 0, 2 },   { 2.5, 0, 2 } };
+    waypoints.assign(meander, meander + 11);
+  }
+  else if (type == "meander")
+  {
+    Waypoint meander[] = { { 2, -0.5, 0.5 }, { 2, 5.5, 0.5 }, { -1.5, 5.5, 0.5 }, { -1.5, 1.0, 0.5 },
+                           { 1.6, 1.0, 0.5 }, { 1.6, 4.5, 1 }, { -1.0, 4.5, 1 },   { -1.0, 2.0, 1 },
+                           { 1.3, 2.0, 1.5 }, { 1.6, 3.3, 1.5 } };
+    waypoints.assign(meander, meander + 10);
+  }
+  else if (type == "spiral")
+  {
+    // Archimedean spiral climbing by 1.5 m
+    static const int numPoints = 25;
+    double a = warehouse ? 1.5 : 1.0;
+    double cx = warehouse ? 0.2 : 0.0, cy = warehouse ? 3.75 : 0.0;
+    Waypoint start = { warehouse ? 1.6 : 0.0, cy, 0.5 };
+    waypoints.push_back(start);
+    for (int i = warehouse ? 3 : 0; i < numPoints; i += 3)
+    {
+      double angle = 0.05 * i;
+      Waypoint p = { cx + (a + a * angle) * std::cos(angle * M_PI * 2), cy + (a + a * angle) * std::sin(angle * M_PI * 2),
+                     0.5 + double(i) / numPoints * 1.5 };
+      waypoints.push_back(p);
+    }
+  }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+// Poses along the waypoints at a constant speed, facing the direction of travel
+void samplePoses(const std::vector<Waypoint>& waypoints, double step, std::vector<DroneState>& poses)
+{
+  double yaw = 0.0;
+  for (std::size_t w = 0; w + 1 < waypoints.size(); w++)
+  {
+    const Waypoint& a = waypoints[w];
+    const Waypoint& b = waypoints[w + 1];
+    double dx = b.x - a.x, dy = b.y - a.y, dz = b.z - a.z;
+    double length = std::sqrt(dx * dx + dy * dy + dz * dz);
+    if (std::hypot(dx, dy) > 1e-6)
+      yaw = std::atan2(dy, dx);
+    for (double s = 0.0; s < length; s += step)
+    {
+      DroneState pose;
+      pose.setXPos(a.x + dx * s / length);
+      pose.setYPos(a.y + dy * s / length);
+      pose.setZPos(a.z + dz * s / length);
+      pose.setRoll(0.0);
+      pose.setPitch(0.0);
+      pose.setYaw(yaw);
+      poses.push_back(pose);
+    }
+  }
+}
+
+bool loadMap(const std::string& mapFile, double maxDistance, std::shared_ptr<MapCache>& cache)
+{
+  std::unique_ptr<octomap::AbstractOcTree> tree(MapCache::readMapFile(mapFile));
+  if (!tree)
+    return false;
+
+  cache.reset(new MapCache());
+  std::string error;
+  if (octomap::ColorOcTree* colorTree = dynamic_cast<octomap::ColorOcTree*>(tree.get()))
+    return cache->build(*colorTree, 0, maxDistance, "", error);
+  if (octomap::OcTree* occupancyTree = dynamic_cast<octomap::OcTree*>(tree.get()))
+    return cache->build(*occupancyTree, 0, maxDistance, "", error);
+  return false;
+}
+
+double wrapAngle(double angle)
+{
+  return std::atan2(std::sin(angle), std::cos(angle));
+}
+
+double percentile(const std::vector<double>& sorted, double q)
+{
+  if (sorted.empty())
+    return 0.0;
+  std::size_t i = std::min(sorted.size() - 1, std::size_t(q * sorted.size()));
+  return sorted[i];
+}
+}  // namespace
+
+int main(int argc, char** argv)
+{
+  Options options;
+  if (!parseOptions(argc, argv, options))
+  {
+    usage();
+    return 2;
+  }
+
+  std::vector<Waypoint> waypoints;
+  bool warehouse = options.mapFile.find("warehouse") != std::string::npos;
+  if (!makeWaypoints(options.trajectory, warehouse, waypoints))
+  {
+    std::fprintf(stderr, "Unknown trajectory '%s'\n", options.trajectory.c_str());
+    return 2;
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::shared_ptr<MapCache> cache;
+  if (!loadMap(options.mapFile, 1.0, cache))
+  {
+    std::fprintf(stderr, "Could not load the map %s\n", options.mapFile.c_str());
+    return 2;
+  }
+  std::printf("Map %s: %u x %u x %u cells of %.2f m, built in %.2f s\n", options.mapFile.c_str(), cache->sizeX(),
+              cache->sizeY(), cache->sizeZ(), cache->resolution(),
+              std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+  double dt = 1.0 / options.rate;
+  std::vector<DroneState> truth;
+  samplePoses(waypoints, options.speed * dt, truth);
+
+  MapView map;
+  map.grid = cache;
+  std::shared_ptr<const HeightField> heights(new HeightField(*cache));
+  if (options.heightGating)
+    map.heights = heights;
+
+  DroneMovementModel::Parameters movementParams;
+  movementParams.xStdDev = movementParams.yStdDev = movementParams.zStdDev = 0.2;
+  movementParams.rollStdDev = movementParams.pitchStdDev = movementParams.yawStdDev = 0.2;
+  movementParams.fourDof = options.fourDof;
+  DroneMovementModel movementModel(movementParams);
+
+  DroneObservationModel::Parameters observationParams;
+  observationParams.maxRange = options.maxRange;
+  observationParams.earlyTermination = options.earlyTermination;
+  observationParams.weightCache = options.weightCache;
+  observationParams.heightGating = options.heightGating;
+  DroneObservationModel observationModel(observationParams, map);
+
+  ScanPreprocessor::Parameters scanParams;
+  scanParams.minRange = 0.05;
+  scanParams.maxRange = options.maxRange;
+  scanParams.maxBeams = options.maxBeams;
+  scanParams.sampleDistance = options.sampleDistance;
+  ScanPreprocessor preprocessor(scanParams);
+
+  ScanMatcher scanMatcher(cache);
+  ScanMatcher::Parameters matcherParams;
+  std::vector<Observation::Point> endpoints;
+
+  libPF::ParticleFilter<DroneState> pf(options.particles, &observationModel, &movementModel);
+  const DroneState& first = truth.front();
+  std::shared_ptr<const FreeSpaceIndex> freeSpace;
+  double mapMin[3], mapMax[3];
+  if (options.global || options.recovery)
+  {
+    freeSpace.reset(new FreeSpaceIndex(*cache, 0.3, 0.3, 3.0));
+    for (int i = 0; i < 3; i++)
+    {
+      mapMin[i] = cache->header().origin[i];
+      mapMax[i] = mapMin[i] + cache->header().size[i] * cache->resolution();
+    }
+  }
+  std::unique_ptr<DroneStateDistribution> distribution;
+  if (options.global)
+  {
+    distribution.reset(new DroneStateDistribution(freeSpace, mapMin, mapMax));
+    distribution->setAttitude(-0.02, 0.02, -0.02, 0.02);
+  }
+  else
+  {
+    distribution.reset(new DroneStateDistribution(
+        options.initialStdDev, options.initialStdDev, options.initialStdDev, 0.02, 0.02, 0.05, first.getXPos(),
+        first.getYPos(), first.getZPos(), first.getRoll(), first.getPitch(), first.getYaw(), true));
+  }
+  if (options.fourDof)
+    distribution->fixAttitude(first.getRoll(), first.getPitch());
+  std::unique_ptr<DroneStateDistribution> recoveryDistribution;
+  if (options.recovery)
+  {
+    recoveryDistribution.reset(new DroneStateDistribution(freeSpace, mapMin, mapMax));
+    recoveryDistribution->setUniform(true);
+    recoveryDistribution->setAttitude(-0.02, 0.02, -0.02, 0.02);
+    pf.setRecovery(0.001, 0.1, recoveryDistribution.get());
+  }
+  // The random number generators of libPF seed rand() with the time when they are created
+  std::srand(options.seed);
+  pf.drawAllFromDistribution(*distribution);
+
+  // Indices of the true poses of the steps, a kidnapping skips half of the rest of the trajectory
+  std::vector<std::size_t> path;
+  for (std::size_t i = 0; i < truth.size(); i++)
+  {
+    if (options.kidnapStep > 0 && path.size() == std::size_t(options.kidnapStep))
+      i += (truth.size() - i) / 2;
+    path.push_back(i);
+  }
+
+  std::mt19937 rng(options.seed);
+  std::normal_distribution<double> gaussian(0.0, 1.0);
+
+  std::vector<float> ranges(options.beams);
+  double fov = options.fovDeg * M_PI / 180.0;
+  double angleMin = -0.5 * fov;
+  double increment = options.fovDeg >= 360.0 ? fov / options.beams : fov / std::max(options.beams - 1, 1u);
+  Observation observation;
+  observation.baseToSensor.assign(1, Eigen::Isometry3d::Identity());
+
+  std::ofstream csv;
+  if (!options.csvFile.empty())
+  {
+    csv.open(options.csvFile.c_str());
+    csv << "step,x,y,z,yaw,estimated_x,estimated_y,estimated_z,estimated_yaw,step_time\n";
+  }
+
+  Eigen::Isometry3d odomPose = first.getPose();
+  std::vector<double> stepTimes;
+  stepTimes.reserve(truth.size());
+  double positionSqSum = 0.0, yawSqSum = 0.0, maxPositionError = 0.0;
+  uint64_t raycasts = 0, gated = 0, injected = 0, refined = 0, refineIterations = 0, particleSteps = 0, beamSteps = 0,
+           adjustments = 0;
+  std::unique_ptr<DeadlineController> deadlineController;
+  unsigned int minParticles = options.particles, minBeams = options.beams;
+  if (options.deadline > 0)
+  {
+    DeadlineController::Parameters deadlineParams;
+    deadlineParams.deadline = options.deadline;
+    deadlineParams.maxParticles = options.particles;
+    deadlineController.reset(new DeadlineController(deadlineParams));
+  }
+  // Last step of the kidnapping far from the true pose
+  std::size_t lastLostStep = options.kidnapStep > 0 ? options.kidnapStep - 1 : 0;
+  start = std::chrono::steady_clock::now();
+  for (std::size_t k = 1; k < path.size(); k++)
+  {
+    const DroneState& pose = truth[path[k]];
+
+    // Noisy odometry of the motion since the last scan, in the base frame. It does not see the kidnapping
+    const DroneState& previous = truth[path[k - 1]];
+    const DroneState& next = truth[path[k - 1] + 1];
+    Eigen::Isometry3d motion = previous.getPose().inverse() * next.getPose();
+    double distance = motion.translation().norm();
+    double rotation = std::abs(wrapAngle(next.getYaw() - previous.getYaw()));
+    Eigen::Isometry3d odometry = motion;
+    odometry.translation() +=
+        options.odomNoise * distance * Eigen::Vector3d(gaussian(rng), gaussian(rng), gaussian(rng));
+    odometry.rotate(Eigen::AngleAxisd(options.odomNoise * (rotation + 0.1 * distance) * gaussian(rng),
+                                      Eigen::Vector3d::UnitZ()));
+
+    // Scan and height from the true pose
+    Eigen::Isometry3d sensor = pose.getPose();
+    for (unsigned int b = 0; b < options.beams; b++)
+    {
+      double angle = angleMin + b * increment;
+      Eigen::Vector3d direction = sensor.linear() * Eigen::Vector3d(std::cos(angle), std::sin(angle), 0.0);
+      float range;
+      if (cache->castRay(sensor.translation().x(), sensor.translation().y(), sensor.translation().z(), direction.x(),
+                         direction.y(), direction.z(), options.maxRange, range))
+        ranges[b] = std::max(0.0, range + options.rangeNoise * gaussian(rng));
+      else
+        ranges[b] = options.maxRange;
+    }
+
+    std::chrono::steady_clock::time_point stepStart = std::chrono::steady_clock::now();
+    ScanPreprocessor::LaserScan scan;
+    scan.angleMin = angleMin;
+    scan.angleIncrement = increment;
+    scan.rangeMin = 0.05;
+    scan.ranges = ranges.data();
+    scan.numRanges = options.beams;
+    preprocessor.prepareLaserScan(scan, observation);
+    double height;
+    if (options.heightGating && heights->heightAt(pose.getXPos(), pose.getYPos(), pose.getZPos(), height))
+      observation.height = std::max(0.0, height + options.heightNoise * gaussian(rng));
+    observationModel.setObservedMeasurements(observation);
+    Eigen::Isometry3d lastOdomPose = odomPose;
+    odomPose = odomPose * odometry;
+    if (options.fourDof)
+      movementModel.setOdomPoses(lastOdomPose, odomPose);
+    else
+      movementModel.setOdomTransform(odometry);
+    if (options.recovery && options.fourDof)
+      recoveryDistribution->fixAttitude(pose.getRoll(), pose.getPitch());
+    pf.filter(dt);
+    DroneState estimate = options.fourDof ? estimateFourDof(pf, 50) : pf.getBestXPercentEstimate(50);
+    if (options.refine)
+    {
+      observation.endpointsInBase(options.maxRange, endpoints);
+      ScanMatcher::Pose initial = { estimate.getXPos(), estimate.getYPos(), estimate.getZPos(), estimate.getYaw() };
+      ScanMatcher::Result result;
+      bool accepted = scanMatcher.refine(endpoints, estimate.getRoll(), estimate.getPitch(), initial, matcherParams,
+                                         result);
+      refineIterations += result.iterations;
+      if (accepted)
+      {
+        DroneState corrected = estimate;
+        corrected.setXPos(result.pose.x);
+        corrected.setYPos(result.pose.y);
+        corrected.setZPos(result.pose.z);
+        corrected.setYaw(result.pose.yaw);
+        if (options.refineFeedback > 0)
+          moveParticles(pf, estimate, corrected, options.refineFeedback);
+        estimate = corrected;
+        refined++;
+      }
+    }
+    double stepTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - stepStart).count();
+    stepTimes.push_back(stepTime);
+    const ObservationStats& stats = observationModel.getStats();
+    raycasts += stats.raycastsPerformed;
+    gated += stats.particlesGated;
+    injected += pf.getNumInjectedParticles();
+    particleSteps += pf.numParticles();
+    beamSteps += stats.beamsObserved;
+    minParticles = std::min(minParticles, pf.numParticles());
+    minBeams = std::min(minBeams, stats.beamsObserved);
+    if (deadlineController)
+    {
+      DeadlineController::Step step = { stepTime, pf.getMeasureTime(), pf.getResampleTime() + pf.getMotionTime(),
+                                        pf.numParticles(), stats.beamsObserved, unsigned(observation.points.size()) };
+      if (deadlineController->update(step))
+      {
+        adjustments++;
+        observationModel.setMaxBeams(deadlineController->beams());
+        if (deadlineController->particles() != pf.numParticles())
+          pf.setNumParticles(deadlineController->particles());
+      }
+    }
+
+    double ex = estimate.getXPos() - pose.getXPos();
+    double ey = estimate.getYPos() - pose.getYPos();
+    double ez = estimate.getZPos() - pose.getZPos();
+    double positionError = std::sqrt(ex * ex + ey * ey + ez * ez);
+    double yawError = wrapAngle(estimate.getYaw() - pose.getYaw());
+    positionSqSum += positionError * positionError;
+    yawSqSum += yawError * yawError;
+    maxPositionError = std::max(maxPositionError, positionError);
+    if (options.kidnapStep > 0 && k >= std::size_t(options.kidnapStep) && positionError > 0.5)
+      lastLostStep = k;
+
+    if (csv.is_open())
+      csv << k << "," << pose.getXPos() << "," << pose.getYPos() << "," << pose.getZPos() << "," << pose.getYaw() << ","
+          << estimate.getXPos() << "," << estimate.getYPos() << "," << estimate.getZPos() << "," << estimate.getYaw()
+          << "," << stepTime << "\n";
+  }
+  double wallTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::size_t steps = stepTimes.size();
+  if (steps == 0)
+  {
+    std::fprintf(stderr, "The trajectory is too short\n");
+    return 2;
+  }
+  double filterTime = 0.0;
+  for (std::size_t i = 0; i < steps; i++)
+    filterTime += stepTimes[i];
+  std::sort(stepTimes.begin(), stepTimes.end());
+  double positionRmse = std::sqrt(positionSqSum / steps);
+  double yawRmse = std::sqrt(yawSqSum / steps);
+
+  std::printf("Trajectory %s: %zu steps, %.1f s of flight at %.2f m/s, %d particles, %u beams\n",
+              options.trajectory.c_str(), steps, steps * dt, options.speed, options.particles, options.beams);
+  std::printf("Filter step (ms): mean %.2f  p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n", 1000.0 * filterTime / steps,
+              1000.0 * percentile(stepTimes, 0.5), 1000.0 * percentile(stepTimes, 0.9),
+              1000.0 * percentile(stepTimes, 0.99), 1000.0 * stepTimes.back());
+  std::printf("Throughput: %.0f raycasts/s, %.1fx real time (%.2f s including scan synthesis)\n",
+              raycasts / filterTime, steps * dt / filterTime, wallTime);
+  if (options.heightGating)
+    std::printf("Height gating: %.1f%% of the particles not raycasted\n", 100.0 * gated / particleSteps);
+  std::printf("Error: position RMSE %.3f m (max %.3f m), yaw RMSE %.3f rad\n", positionRmse, maxPositionError,
+              yawRmse);
+  if (options.recovery)
+    std::printf("Recovery: %lu particles injected\n", (unsigned long)injected);
+  if (options.refine)
+    std::printf("Refinement: %.1f%% of the estimates refined, %.1f iterations per step\n", 100.0 * refined / steps,
+                double(refineIterations) / steps);
+  if (deadlineController)
+    std::printf("Deadline %.1f ms: %lu steps missed it, %lu adjustments, %.0f particles and %.0f beams on average "
+                "(min %u and %u)\n",
+                1000.0 * options.deadline, (unsigned long)deadlineController->misses(), (unsigned long)adjustments,
+                double(particleSteps) / steps, double(beamSteps) / steps, minParticles, minBeams);
+  if (options.kidnapStep > 0 && lastLostStep >= steps)
+    std::printf("Kidnapping at step %d: not recovered\n", options.kidnapStep);
+  else if (options.kidnapStep > 0)
+    std::printf("Kidnapping at step %d: within 0.5 m after %zu steps\n", options.kidnapStep,
+                lastLostStep + 1 - options.kidnapStep);
+
+  bool failed = false;
+  if (options.maxPositionRmse > 0 && positionRmse > options.maxPositionRmse)
+  {
+    std::printf("FAIL: position RMSE above %.3f m\n", options.maxPositionRmse);
+    failed = true;
+  }
+  if (options.maxYawRmse > 0 && yawRmse > options.maxYawRmse)
+  {
+    std::printf("FAIL: yaw RMSE above %.3f rad\n", options.maxYawRmse);
+    failed = true;
+  }
+  return failed ? 1 : 0;
+}
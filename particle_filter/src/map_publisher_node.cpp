@@ -0,0 +1,117 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <memory>
+
+#include <pcl_conversions/pcl_conversions.h>
+#include <ros/ros.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <std_srvs/Empty.h>
+
+#include "particle_filter/MapModel.h"
+#include "particle_filter/SharedMap.h"
+
+/**
+ * Loads the map once (/map_file or octomap_server) and publishes it in shared memory for particle_filter,
+ * drone_coverage and online_coverage_node. /shared_map/reload publishes a new generation from the current map.
+ * With /map_updates/enabled, the changes received on /map_changes are applied to the map and published as a
+ * new generation.
+ */
+class MapPublisher
+{
+public:
+  MapPublisher() : _nh(), _publisher(sharedMapName())
+  {
+    reload();
+    _reloadService = _nh.advertiseService("/shared_map/reload", &MapPublisher::reloadCallback, this);
+
+    bool mapUpdates;
+    _nh.param<bool>("/map_updates/enabled", mapUpdates, false);
+    if (mapUpdates)
+      _mapChangesSub = _nh.subscribe("/map_changes", 10, &MapPublisher::mapChangesCallback, this);
+  }
+
+private:
+  std::string sharedMapName()
+  {
+    std::string name;
+    _nh.param<std::string>("/shared_map/name", name, "/drone_map");
+    return name;
+  }
+
+  bool reload()
+  {
+    // Only the cache is published, the octree is not needed
+    _map.reset(new OccupancyMap(&_nh, false));
+    if (!_map->getCache())
+    {
+      ROS_ERROR("The shared map needs the map cache, enable /map_cache/enabled");
+      return false;
+    }
+    return publish();
+  }
+
+  bool publish()
+  {
+    ros::WallTime start = ros::WallTime::now();
+    std::string error;
+    if (!_publisher.publish(*_map->getCache(), error))
+    {
+      ROS_ERROR("Could not publish the shared map: %s", error.c_str());
+      return false;
+    }
+    ROS_INFO("Shared map generation %lu published in %f s", (unsigned long)_publisher.generation(),
+             (ros::WallTime::now() - start).toSec());
+    return true;
+  }
+
+  bool reloadCallback(std_srvs::Empty::Request& req, std_srvs::Empty::Response& res)
+  {
+    return reload();
+  }
+
+  void mapChangesCallback(const sensor_msgs::PointCloud2ConstPtr& msg)
+  {
+    if (!_map || !_map->getCache())
+      return;
+
+    pcl::PointCloud<pcl::PointXYZI> changes;
+    pcl::fromROSMsg(*msg, changes);
+    _map->queueMapChanges(changes);
+    if (_map->applyMapUpdates())
+      publish();
+  }
+
+  ros::NodeHandle _nh;
+  ros::ServiceServer _reloadService;
+  ros::Subscriber _mapChangesSub;
+  std::unique_ptr<OccupancyMap> _map;
+  SharedMapPublisher _publisher;
+};
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "map_publisher_node");
+
+  MapPublisher publisher;
+
+  ros::spin();
+
+  return 0;
+}
@@ -26,103 +26,409 @@ namespace pf
 /*        Constructor         */
 /******************************/
 
-Particles::Particles() : _tfBuffer(ros::Duration(10), false)
+Particles::Particles(const std::string& ns, const SharedResources& shared, unsigned int index)
+  : _index(index), _scheduler(shared.scheduler), _stepScheduled(false), _stopping(false), _stepsInFlight(0)
 {
+  // "drone1" and "/drone1/" are "/drone1"
+  _ns = ns;
+  if (!_ns.empty() && _ns[0] != '/')
+    _ns = "/" + _ns;
+  while (!_ns.empty() && _ns[_ns.size() - 1] == '/')
+    _ns.erase(_ns.size() - 1);
+
   _initialized = 0;  // System has not been initialized yet
   _receivedSensorData = 0;
   _firstRun = 1;
+  _publishUpdated = false;
+  _lastRaycasts = 0;
 
   // Get the parameters from Parameter Server
-  _nh.param<int>("/particles", _numParticles, 500);
-
-  _nh.param<std::string>("/mapFrame", _mapFrameID, "map");
-  _nh.param<std::string>("/worldFrame", _worldFrameID, "world");
-  _nh.param<std::string>("/baseFootprintFrame", _baseFootprintFrameID, "base_footprint");
-  _nh.param<std::string>("/baseLinkFrame", _baseLinkFrameID, "base_link");
-
-  _nh.param<double>("/max_range", _filterMaxRange, 14);
-  _nh.param<double>("/min_range", _filterMinRange, 0.05);
-  _nh.param<double>("/observation_threshold_trans", _observationThresholdTranslation, 0.3);
-  _nh.param<double>("/observation_threshold_rot", _observationThresholdRotation, 0.4);
-  _nh.param<double>("/sensor_sample_distance", _sensorSampleDist, 0.2);
-  _nh.param<double>("/transform_tolerance_time", _transformTolerance, 1.0);
+  param<int>("/particles", _numParticles, 500);
+
+  param<std::string>("/mapFrame", _mapFrameID, "map");
+  param<std::string>("/worldFrame", _worldFrameID, "world");
+  param<std::string>("/baseFootprintFrame", _baseFootprintFrameID, "base_footprint");
+  param<std::string>("/baseLinkFrame", _baseLinkFrameID, "base_link");
+  // The map is common to all the drones
+  _worldFrameID = resolveFrame(_worldFrameID);
+  _baseFootprintFrameID = resolveFrame(_baseFootprintFrameID);
+  _baseLinkFrameID = resolveFrame(_baseLinkFrameID);
+
+  param<double>("/max_range", _filterMaxRange, 14);
+  param<double>("/min_range", _filterMinRange, 0.05);
+  param<double>("/observation_threshold_trans", _observationThresholdTranslation, 0.3);
+  param<double>("/observation_threshold_rot", _observationThresholdRotation, 0.4);
+  param<double>("/sensor_sample_distance", _sensorSampleDist, 0.2);
+  param<int>("/max_beams_per_scan", _maxBeamsPerScan, 0);
+  param<bool>("/publish_filtered_cloud", _publishFilteredCloud, true);
+  param<double>("/transform_tolerance_time", _transformTolerance, 1.0);
 
   // Initial std deviations
-  _nh.param<double>("/movement/x_std_dev", _XStdDev, 0.2);
-  _nh.param<double>("/movement/y_std_dev", _YStdDev, 0.2);
-  _nh.param<double>("/movement/z_std_dev", _ZStdDev, 0.2);
-
-  _nh.param<double>("/movement/roll_std_dev", _RollStdDev, 0.2);
-  _nh.param<double>("/movement/pitch_std_dev", _PitchStdDev, 0.2);
-  _nh.param<double>("/movement/yaw_std_dev", _YawStdDev, 0.2);
+  param<double>("/movement/x_std_dev", _XStdDev, 0.2);
+  param<double>("/movement/y_std_dev", _YStdDev, 0.2);
+  param<double>("/movement/z_std_dev", _ZStdDev, 0.2);
+
+  param<double>("/movement/roll_std_dev", _RollStdDev, 0.2);
+  param<double>("/movement/pitch_std_dev", _PitchStdDev, 0.2);
+  param<double>("/movement/yaw_std_dev", _YawStdDev, 0.2);
+
+  param<int>("/percentage_of_particles_to_use", _percentage_of_particles, 50);
+
+  // 4-DOF state: roll and pitch from the odometry (or the IMU) at every scan
+  std::string attitudeSource;
+  param<bool>("/four_dof/enabled", _fourDof, false);
+  param<std::string>("/four_dof/attitude_source", attitudeSource, "odometry");
+  _attitudeFromImu = attitudeSource == "imu";
+  if (attitudeSource != "odometry" && attitudeSource != "imu")
+    ROS_WARN("Unknown four_dof/attitude_source '%s', using odometry", attitudeSource.c_str());
+
+  std::string particleCloudDecimation;
+  param<double>("/particle_cloud/rate", _particleCloudRate, 0.0);
+  param<int>("/particle_cloud/max_particles", _particleCloudMaxParticles, 0);
+  param<std::string>("/particle_cloud/decimation", particleCloudDecimation, "top_k");
+  param<bool>("/particle_cloud/compact", _compactParticleCloud, false);
+  _particleCloudTopK = particleCloudDecimation != "random";
+  if (particleCloudDecimation != "top_k" && particleCloudDecimation != "random")
+    ROS_WARN("Unknown particle cloud decimation '%s', using top_k", particleCloudDecimation.c_str());
+
+  // Metrics export: rate (Hz, 0 : disabled) and Prometheus text file (empty : disabled)
+  param<double>("/metrics/rate", _metricsRate, 1.0);
+  param<std::string>("/metrics/prometheus_file", _prometheusFile, "");
+  // Unless set in its namespace, each drone writes its own file next to the common one (drone1 : metrics_drone1.prom)
+  if (!_ns.empty() && !_prometheusFile.empty() && !_nh.hasParam(_ns + "/metrics/prometheus_file"))
+  {
+    std::string::size_type slash = _prometheusFile.rfind('/');
+    std::string::size_type dot = _prometheusFile.rfind('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+      dot = _prometheusFile.size();
+    std::string suffix = "_" + _ns.substr(1);
+    std::replace(suffix.begin(), suffix.end(), '/', '_');
+    _prometheusFile.insert(dot, suffix);
+  }
 
-  _nh.param<int>("/percentage_of_particles_to_use", _percentage_of_particles, 50);
+  param<double>("/scheduler/deadline", _stepDeadline, 0.1);
+
+  // High-rate pose: every odometry message corrected by the last estimate, between the filter steps
+  bool highRatePose;
+  std::string odomTopic, highRatePoseTopic;
+  param<bool>("/high_rate_pose/enabled", highRatePose, false);
+  param<std::string>("/high_rate_pose/odom_topic", odomTopic, "/odom");
+  param<std::string>("/high_rate_pose/topic", highRatePoseTopic, "/amcl_pose_high_rate");
+
+  // Scans waiting to be prepared, and prepared scans waiting for the filter (1 : only the latest one)
+  int scanQueueSize, preparedQueueSize;
+  param<int>("/pipeline/scan_queue_size", scanQueueSize, 1);
+  param<int>("/pipeline/prepared_queue_size", preparedQueueSize, 1);
+  _scanQueue.reset(new BoundedQueue<ReceivedScan>(scanQueueSize));
+  _preparedQueue.reset(new BoundedQueue<std::shared_ptr<PreparedScan> >(preparedQueueSize));
+  // An estimate is superseded by the next one
+  _estimateQueue.reset(new BoundedQueue<std::shared_ptr<PoseEstimate> >(1));
+  // Enough for the scans in the queue, the one being filtered and the one being prepared
+  _recycledScans.reset(new BoundedQueue<std::shared_ptr<PreparedScan> >(preparedQueueSize + 2));
+
+  ScanPreprocessor::Parameters scanParams;
+  scanParams.minRange = _filterMinRange;
+  scanParams.maxRange = _filterMaxRange;
+  scanParams.maxBeams = std::max(_maxBeamsPerScan, 0);
+  scanParams.sampleDistance = _sensorSampleDist;
+  _scanPreprocessor.reset(new ScanPreprocessor(scanParams));
+  _odometryReceived = false;
 
   // Initialize Models
   // Movement model
-  _mm = new DroneMovementModel(&_nh, &_tfBuffer, _worldFrameID, _baseFootprintFrameID, _baseLinkFrameID);
-
-  _mapModel = std::shared_ptr<MapModel>(new OccupancyMap(&_nh));
+  DroneMovementModel::Parameters movementParams;
+  movementParams.xStdDev = _XStdDev;
+  movementParams.yStdDev = _YStdDev;
+  movementParams.zStdDev = _ZStdDev;
+  movementParams.rollStdDev = _RollStdDev;
+  movementParams.pitchStdDev = _PitchStdDev;
+  movementParams.yawStdDev = _YawStdDev;
+  movementParams.fourDof = _fourDof;
+  _mm = new DroneMovementModel(movementParams);
+
+  _ownsMap = !shared.map;
+  if (_ownsMap)
+    _mapModel = std::shared_ptr<MapModel>(new OccupancyMap(&_nh));
+  else
+    _mapModel = shared.map;
+  _mapMutex = shared.mapMutex;
+  if (!_mapMutex)
+    _mapMutex.reset(new boost::shared_mutex());
+  _mapVersion = _mapModel->getVersion();
+  if (!_ownsMap && _mapModel->getTiledMap())
+    _tileWindow.reset(new TiledMap::Window());
   // octomap_server must have already provided the map to proceed
 
-  _om = std::shared_ptr<libPF::ObservationModel<DroneState> >(new DroneObservationModel(&_nh, _mapModel));
+  // Observation model, the defaults are those of DroneObservationModel::Parameters
+  DroneObservationModel::Parameters observationParams;
+  param<double>("/laser_z_hit", observationParams.zHit, observationParams.zHit);
+  param<double>("/laser_z_short", observationParams.zShort, observationParams.zShort);
+  param<double>("/laser_z_rand", observationParams.zRand, observationParams.zRand);
+  param<double>("/laser_z_max", observationParams.zMax, observationParams.zMax);
+  param<double>("/laser_sigma_hit", observationParams.sigmaHit, observationParams.sigmaHit);
+  param<double>("/laser_lambda_short", observationParams.lambdaShort, observationParams.lambdaShort);
+  observationParams.minRange = _filterMinRange;
+  observationParams.maxRange = _filterMaxRange;
+
+  param<bool>("/early_termination/enabled", observationParams.earlyTermination,
+                  observationParams.earlyTermination);
+  param<double>("/early_termination/max_weight_ratio", observationParams.earlyTerminationRatio,
+                    observationParams.earlyTerminationRatio);
+  if (observationParams.earlyTermination &&
+      (observationParams.earlyTerminationRatio <= 0.0 || observationParams.earlyTerminationRatio >= 1.0))
+    ROS_WARN("early_termination/max_weight_ratio must be in (0, 1), disabling early termination");
+
+  double angleBinDeg = observationParams.cacheAngleBin * 180.0 / M_PI;
+  param<bool>("/weight_cache/enabled", observationParams.weightCache, observationParams.weightCache);
+  param<double>("/weight_cache/xyz_bin", observationParams.cacheXYZBin, observationParams.cacheXYZBin);
+  param<double>("/weight_cache/angle_bin_deg", angleBinDeg, angleBinDeg);
+  observationParams.cacheAngleBin = angleBinDeg * M_PI / 180.0;
+  if (observationParams.weightCache && (observationParams.cacheXYZBin <= 0.0 || observationParams.cacheAngleBin <= 0.0))
+    ROS_WARN("weight_cache bin sizes must be positive, disabling the weight cache");
+
+  // Height gating: the /height measurement of each scan is compared with the height field before raycasting
+  std::string heightTopic;
+  param<bool>("/height_gating/enabled", observationParams.heightGating, observationParams.heightGating);
+  param<std::string>("/height_gating/topic", heightTopic, "/height");
+  param<double>("/height_gating/sigma", observationParams.heightSigma, observationParams.heightSigma);
+  param<double>("/height_gating/gate", observationParams.heightGate, observationParams.heightGate);
+  param<double>("/height_gating/max_delay", _heightMaxDelay, 0.1);
+  if (observationParams.heightGating && (observationParams.heightSigma <= 0.0 || observationParams.heightGate <= 0.0))
+  {
+    ROS_WARN("height_gating sigma and gate must be positive, disabling height gating");
+    observationParams.heightGating = false;
+  }
+  if (observationParams.heightGating && !_mapModel->getCache())
+  {
+    ROS_WARN("Height gating needs the map cache, disabling it");
+    observationParams.heightGating = false;
+  }
+  _heightGating = observationParams.heightGating;
+
+  _om = std::shared_ptr<libPF::ObservationModel<DroneState> >(
+      new DroneObservationModel(observationParams, getMapView()));
 
   _pf = new libPF::ParticleFilter<DroneState>(_numParticles, _om.get(), _mm);
 
   // TF listener / Broadcaster
-  // tf2_ros::Buffer _tfBuffer(ros::Duration(10), false);
-  _tfBuffer.clear();
-  _tfListener = new tf2_ros::TransformListener(_tfBuffer);
+  _tfBuffer = shared.tfBuffer;
+  if (!_tfBuffer)
+  {
+    _tfBuffer.reset(new tf2_ros::Buffer(ros::Duration(10), false));
+    _tfListener.reset(new tf2_ros::TransformListener(*_tfBuffer));
+  }
   _tfBroadcaster = new tf2_ros::TransformBroadcaster();
 
   // set to identity the map to world transform
   _latestTransform.setIdentity();
 
-  // Init PoseArray
-  _poseArray.header.frame_id = _mapFrameID;
-  _poseArray.poses.resize(_numParticles);
-
   // publishers can be advertised first, before needed:
-  _posePublisher = _nh.advertise<geometry_msgs::PoseStamped>("/amcl_pose", 10);
-  _poseArrayPublisher = _nh.advertise<geometry_msgs::PoseArray>("/amcl/particlecloud", 10);
-  _filteredPointCloudPublisher = _nh.advertise<sensor_msgs::PointCloud2>("/amcl/filtered_cloud", 1);
-  _init_pose_pub = _nh.advertise<geometry_msgs::PoseWithCovarianceStamped>("/amcl/initial_pose", 10);
+  _posePublisher = _nh.advertise<geometry_msgs::PoseStamped>(resolveTopic("/amcl_pose"), 10);
+  if (highRatePose)
+    _highRatePosePublisher = _nh.advertise<geometry_msgs::PoseStamped>(resolveTopic(highRatePoseTopic), 10);
+  _poseArrayPublisher = _nh.advertise<geometry_msgs::PoseArray>(resolveTopic("/amcl/particlecloud"), 10);
+  if (_compactParticleCloud)
+    _compactCloudPublisher =
+        _nh.advertise<particle_filter::ParticleCloud>(resolveTopic("/amcl/particlecloud_compact"), 10);
+  _filteredPointCloudPublisher =
+      _nh.advertise<sensor_msgs::PointCloud2>(resolveTopic("/amcl/filtered_cloud"), 1);
+  _init_pose_pub =
+      _nh.advertise<geometry_msgs::PoseWithCovarianceStamped>(resolveTopic("/amcl/initial_pose"), 10);
+  if (_metricsRate > 0)
+    _diagnosticsPublisher = _nh.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 10);
 
   // ROS subscriptions last:
   _globalLocalizationService =
-      _nh.advertiseService("/global_localization", &Particles::globalLocalizationCallback, this);
+      _nh.advertiseService(resolveTopic("/global_localization"), &Particles::globalLocalizationCallback, this);
 
-  _initPoseService = _nh.advertiseService("/initialize_pose", &Particles::initialPoseSrvCallback, this);
+  _relocalizeService = _nh.advertiseService(resolveTopic("/relocalize"), &Particles::relocalizeSrvCallback, this);
 
-  _repairPoseService = _nh.advertiseService("/repair_pose", &Particles::repairPoseSrvCallback, this);
+  _initPoseService =
+      _nh.advertiseService(resolveTopic("/initialize_pose"), &Particles::initialPoseSrvCallback, this);
+
+  _repairPoseService = _nh.advertiseService(resolveTopic("/repair_pose"), &Particles::repairPoseSrvCallback, this);
 
   // Timer for sending the latest transform
   _latestTransformTimer =
       _nh.createTimer(ros::Duration(_transformTolerance), &Particles::latestTransformTimerCallback, this);
 
-  // subscribe to the ground_truth for repair pose service
-  _truth_sub = _nh.subscribe<nav_msgs::Odometry>("/ground_truth/state", 1, &Particles::truePoseCallback, this);
+  // Timer for the particle cloud, decoupled from the filter steps
+  if (_particleCloudRate > 0)
+    _particleCloudTimer =
+        _nh.createTimer(ros::Duration(1.0 / _particleCloudRate), &Particles::particleCloudTimerCallback, this);
 
-  // subscription on laser, tf message filter
-  _scanListener = new message_filters::Subscriber<sensor_msgs::LaserScan>(_nh, "/scan", 100);
+  // Timer for the metrics
+  if (_metricsRate > 0)
+  {
+    _lastMetricsTime = ros::WallTime::now();
+    _metricsTimer = _nh.createTimer(ros::Duration(1.0 / _metricsRate), &Particles::metricsTimerCallback, this);
+  }
 
-  // Use tf2_ros::MessageFilter to take a subscription to LaserScan msg and cache it until it is possible to transform
-  // it into the target frame.
-  _scanFilter = new tf2_ros::MessageFilter<sensor_msgs::LaserScan>(*_scanListener, _tfBuffer, _worldFrameID, 100, _nh);
-  _scanFilter->registerCallback(boost::bind(&Particles::scanCallback, this, _1));
+  // subscribe to the ground_truth for repair pose service
+  _truth_sub =
+      _nh.subscribe<nav_msgs::Odometry>(resolveTopic("/ground_truth/state"), 1, &Particles::truePoseCallback, this);
+
+  if (_heightGating)
+    _heightSub = _nh.subscribe(resolveTopic(heightTopic), 10, &Particles::heightCallback, this);
+
+  if (highRatePose)
+    _odomSub = _nh.subscribe(resolveTopic(odomTopic), 10, &Particles::odomCallback, this,
+                             ros::TransportHints().tcpNoDelay());
+
+  // Attitude of the particles drawn by global localization
+  std::string imuTopic;
+  param<double>("/global_localization/max_roll", _globalMaxRoll, 0.2);
+  param<double>("/global_localization/max_pitch", _globalMaxPitch, 0.2);
+  param<bool>("/global_localization/use_imu", _globalUseImu, false);
+  param<double>("/global_localization/imu_tolerance", _imuAttitudeTolerance, 0.05);
+  param<std::string>("/global_localization/imu_topic", imuTopic, "/raw_imu");
+  _imuReceived = false;
+  _imuRoll = 0.0;
+  _imuPitch = 0.0;
+  if (_globalUseImu || (_fourDof && _attitudeFromImu))
+    _imuSub = _nh.subscribe(resolveTopic(imuTopic), 10, &Particles::imuCallback, this);
+
+  // Relocalization
+  int relocalizationThreads, maxHypotheses;
+  double yawStepDeg;
+  param<double>("/relocalization/sigma", _relocalizationSigma, 0.1);
+  param<int>("/relocalization/levels", _relocalizationLevels, 5);
+  param<double>("/relocalization/yaw_step_deg", yawStepDeg, 2.0);
+  param<double>("/relocalization/min_score", _relocalizationParams.minScore, 0.5);
+  param<int>("/relocalization/max_hypotheses", maxHypotheses, 5);
+  param<double>("/relocalization/min_separation", _relocalizationParams.minSeparation, 1.0);
+  param<double>("/relocalization/min_yaw_separation", _relocalizationParams.minYawSeparation, 0.5);
+  param<int>("/relocalization/threads", relocalizationThreads, 0);
+  param<double>("/relocalization/xyz_std_dev", _relocalizationXYZStdDev, 0.1);
+  param<double>("/relocalization/yaw_std_dev", _relocalizationYawStdDev, 0.05);
+  param<bool>("/relocalization/auto", _autoRelocalization, false);
+  param<double>("/relocalization/min_neff_ratio", _minNeffRatio, 0.01);
+  param<double>("/relocalization/min_beam_likelihood", _minBeamLikelihood, 0.05);
+  param<int>("/relocalization/lost_steps", _lostSteps, 5);
+  _relocalizationParams.yawStep = yawStepDeg * M_PI / 180.0;
+  _relocalizationParams.maxHypotheses = std::max(maxHypotheses, 1);
+  _relocalizationParams.numThreads = std::max(relocalizationThreads, 0);
+  _relocalizeRequested = false;
+  _lowQualitySteps = 0;
+
+  // Recovery: fast and slow averages of the likelihood per beam, particles are injected when the fast one drops
+  param<bool>("/recovery/enabled", _recovery, false);
+  param<double>("/recovery/alpha_slow", _recoveryAlphaSlow, 0.001);
+  param<double>("/recovery/alpha_fast", _recoveryAlphaFast, 0.1);
+  if (_recovery && !(_recoveryAlphaSlow > 0.0 && _recoveryAlphaSlow < _recoveryAlphaFast && _recoveryAlphaFast <= 1.0))
+  {
+    ROS_WARN("recovery needs 0 < alpha_slow < alpha_fast <= 1, disabling it");
+    _recovery = false;
+  }
+  if (_recovery && !_mapModel->getCache())
+    ROS_WARN("Recovery without the map cache draws the particles over the whole map");
+
+  // Refinement: Gauss-Newton registration of the scan endpoints to the distance field, from the filter estimate
+  int refinementIterations;
+  param<bool>("/refinement/enabled", _refinement, false);
+  param<double>("/refinement/feedback", _refinementFeedback, 0.0);
+  param<int>("/refinement/max_iterations", refinementIterations, 5);
+  param<bool>("/refinement/refine_height", _refinementParams.refineHeight, false);
+  param<double>("/refinement/sigma", _refinementParams.sigma, 0.05);
+  param<double>("/refinement/huber_distance", _refinementParams.huberDistance, 0.1);
+  param<double>("/refinement/max_distance", _refinementParams.maxDistance, 0.5);
+  param<double>("/refinement/prior_xyz_std_dev", _refinementParams.priorXYZStdDev, 0.2);
+  param<double>("/refinement/prior_yaw_std_dev", _refinementParams.priorYawStdDev, 0.1);
+  param<double>("/refinement/min_inlier_ratio", _refinementParams.minInlierRatio, 0.5);
+  param<double>("/refinement/max_correction", _refinementParams.maxCorrection, 0.5);
+  param<double>("/refinement/max_yaw_correction", _refinementParams.maxYawCorrection, 0.2);
+  _refinementParams.maxIterations = std::max(refinementIterations, 1);
+  _refinementFeedback = std::min(std::max(_refinementFeedback, 0.0), 1.0);
+  std::fill(_refinementOffset, _refinementOffset + 4, 0.0);
+  if (_refinement && !_mapModel->getCache())
+  {
+    ROS_WARN("Refinement needs the map cache, disabling it");
+    _refinement = false;
+  }
+  else if (_refinement && !(_refinementParams.sigma > 0.0 && _refinementParams.priorXYZStdDev > 0.0 &&
+                            _refinementParams.priorYawStdDev > 0.0))
+  {
+    ROS_WARN("refinement needs positive sigma and prior standard deviations, disabling it");
+    _refinement = false;
+  }
+
+  // Real-time mode: the beams evaluated, then the particles, are reduced so that the steps end within the deadline
+  bool realTime;
+  int minBeams, minParticles, maxParticles;
+  DeadlineController::Parameters deadlineParams;
+  param<bool>("/real_time/enabled", realTime, false);
+  param<double>("/real_time/deadline", deadlineParams.deadline, 0.05);
+  param<double>("/real_time/target_ratio", deadlineParams.targetRatio, 0.8);
+  param<double>("/real_time/smoothing", deadlineParams.smoothing, 0.2);
+  param<int>("/real_time/min_beams", minBeams, 16);
+  param<int>("/real_time/min_particles", minParticles, 100);
+  param<int>("/real_time/max_particles", maxParticles, _numParticles);
+  deadlineParams.minBeams = std::max(minBeams, 1);
+  deadlineParams.minParticles = std::max(minParticles, 1);
+  deadlineParams.maxParticles = std::max(maxParticles, 1);
+  if (realTime && !(deadlineParams.deadline > 0.0 && deadlineParams.targetRatio > 0.0))
+    ROS_WARN("real_time needs a positive deadline and target_ratio, disabling it");
+  else if (realTime)
+    _deadlineController.reset(new DeadlineController(deadlineParams));
+
+  // Changed voxels of the map (octomap_server with track_changes), applied between filter steps. A map shared by
+  // several drones receives them once, through the first drone.
+  bool mapUpdates;
+  param<bool>("/map_updates/enabled", mapUpdates, false);
+  if (mapUpdates && (_ownsMap || _index == 0))
+    _mapChangesSub = _nh.subscribe("/map_changes", 10, &Particles::mapChangesCallback, this);
+
+  // Single beam range sensors, fused in one observation instead of the laser scan
+  std::vector<std::string> rangeTopics;
+  param<std::vector<std::string> >("/range_topics", rangeTopics, std::vector<std::string>());
+  param<double>("/range_batch_window", _rangeBatchWindow, 0.05);
+  _scanListener = NULL;
+  _scanFilter = NULL;
+  if (!rangeTopics.empty())
+  {
+    _rangeSensors.resize(rangeTopics.size());
+    for (unsigned int i = 0; i < rangeTopics.size(); i++)
+    {
+      _rangeSensors[i].topic = rangeTopics[i];
+      _rangeSensors[i].hasTransform = false;
+      _rangeSubs.push_back(_nh.subscribe<sensor_msgs::Range>(
+          resolveTopic(rangeTopics[i]), 10, boost::bind(&Particles::rangeCallback, this, _1, i)));
+    }
+    ROS_INFO("Localizing with %zu range sensors", rangeTopics.size());
+  }
+  else
+  {
+    // subscription on laser, tf message filter
+    _scanListener = new message_filters::Subscriber<sensor_msgs::LaserScan>(_nh, resolveTopic("/scan"), 100);
+
+    // Use tf2_ros::MessageFilter to take a subscription to LaserScan msg and cache it until it is possible to
+    // transform it into the target frame.
+    _scanFilter =
+        new tf2_ros::MessageFilter<sensor_msgs::LaserScan>(*_scanListener, *_tfBuffer, _worldFrameID, 100, _nh);
+    _scanFilter->registerCallback(boost::bind(&Particles::scanCallback, this, _1));
+  }
 
   // subscription on init pose, tf message filter
   _initialPoseListener =
-      new message_filters::Subscriber<geometry_msgs::PoseWithCovarianceStamped>(_nh, "/amcl/initial_pose", 2);
+      new message_filters::Subscriber<geometry_msgs::PoseWithCovarianceStamped>(_nh, resolveTopic("/amcl/initial_pose"),
+                                                                                2);
 
   _initialPoseFilter = new tf2_ros::MessageFilter<geometry_msgs::PoseWithCovarianceStamped>(
-      *_initialPoseListener, _tfBuffer, _mapFrameID, 5, _nh);
+      *_initialPoseListener, *_tfBuffer, _mapFrameID, 5, _nh);
 
   _initialPoseFilter->registerCallback(boost::bind(&Particles::initialPoseCallback, this, _1));
 
   pcl::console::setVerbosityLevel(pcl::console::L_ALWAYS);
 
-  ROS_INFO("Particle filter created with %d particles!\n", _pf->numParticles());
+  if (!_scheduler)
+  {
+    _prepareThread = std::thread(&Particles::prepareLoop, this);
+    _filterThread = std::thread(&Particles::filterLoop, this);
+    _publishThread = std::thread(&Particles::publishLoop, this);
+  }
+
+  ROS_INFO("Particle filter%s%s created with %d particles!\n", _ns.empty() ? "" : " of ", _ns.c_str(),
+           _pf->numParticles());
 }
 
 /******************************/
@@ -131,6 +437,24 @@ Particles::Particles() : _tfBuffer(ros::Duration(10), false)
 
 Particles::~Particles()
 {
+  if (_scheduler)
+  {
+    // The step being run (or waiting) does not submit another one, and must have returned before the members go
+    std::unique_lock<std::mutex> lock(_stepMutex);
+    _stopping = true;
+    _stepFinished.wait(lock, [this] { return _stepsInFlight == 0; });
+  }
+
+  _scanQueue->close();
+  _preparedQueue->close();
+  _estimateQueue->close();
+  if (!_scheduler)
+  {
+    _prepareThread.join();
+    _filterThread.join();
+    _publishThread.join();
+  }
+
   delete _scanFilter;
   delete _scanListener;
   delete _initialPoseFilter;
@@ -153,57 +477,347 @@ void Particles::scanCallback(const sensor_msgs::LaserScanConstPtr& msg)
     return;
   }
 
-  double timediff = (msg->header.stamp - _lastLaserTime).toSec();
-  if (_receivedSensorData && timediff < 0)
+  ReceivedScan scan;
+  scan.msg = msg;
+  scan.received = ros::WallTime::now();
+  bool dropped = !_scanQueue->push(scan);
+  if (_scheduler)
+    scheduleStep();
+
+  uint64_t received = _metrics.scansReceived.fetch_add(1, std::memory_order_relaxed) + 1;
+  if (dropped)
   {
-    ROS_WARN("Ignoring received laser data that is %f s older than previous data!", timediff);
+    uint64_t droppedScans = _metrics.scansDropped.fetch_add(1, std::memory_order_relaxed) + 1;
+    ROS_WARN_THROTTLE(10, "Localization is slower than the laser: %lu of %lu scans dropped before preparation",
+                      (unsigned long)droppedScans, (unsigned long)received);
+  }
+}
+
+/******************************/
+/*       rangeCallback        */
+/******************************/
+
+void Particles::rangeCallback(const sensor_msgs::RangeConstPtr& msg, unsigned int sensor)
+{
+  if (!_initialized)
+  {
+    ROS_WARN_ONCE("Localization not initialized yet, skipping range callback.");
+    ROS_INFO_ONCE("Call /initialize_pose service to initialize it.");
     return;
   }
 
-  geometry_msgs::PoseStamped odomPose;
+  // A reading outside of the window, or a second one of the same sensor, starts the next observation
+  if (_rangeBatch &&
+      ((msg->header.stamp - _rangeBatch->first).toSec() > _rangeBatchWindow || _rangeBatch->readings[sensor]))
+    flushRangeBatch();
+
+  if (!_rangeBatch)
+  {
+    _rangeBatch.reset(new RangeBatch());
+    _rangeBatch->first = msg->header.stamp;
+    _rangeBatch->last = msg->header.stamp;
+    _rangeBatch->numReadings = 0;
+    _rangeBatch->readings.resize(_rangeSensors.size());
+  }
+
+  _rangeBatch->readings[sensor] = msg;
+  _rangeBatch->numReadings++;
+  _rangeBatch->first = std::min(_rangeBatch->first, msg->header.stamp);
+  _rangeBatch->last = std::max(_rangeBatch->last, msg->header.stamp);
+
+  if (_rangeBatch->numReadings == _rangeSensors.size())
+    flushRangeBatch();
+}
+
+void Particles::flushRangeBatch()
+{
+  ReceivedScan scan;
+  scan.batch = _rangeBatch;
+  scan.received = ros::WallTime::now();
+  _rangeBatch.reset();
+  bool dropped = !_scanQueue->push(scan);
+  if (_scheduler)
+    scheduleStep();
+
+  _metrics.scansReceived.fetch_add(1, std::memory_order_relaxed);
+  if (dropped)
+    _metrics.scansDropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+/******************************/
+/*     Pipeline threads       */
+/******************************/
+
+void Particles::prepareLoop()
+{
+  ReceivedScan received;
+  while (_scanQueue->pop(received))
+  {
+    std::shared_ptr<PreparedScan> scan;
+    if (!_recycledScans->tryPop(scan))
+      scan.reset(new PreparedScan());
+    if (!prepareScan(received, *scan))
+      continue;
+
+    if (!_preparedQueue->push(scan))
+      _metrics.preparedScansDropped.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+bool Particles::prepareScan(const ReceivedScan& received, PreparedScan& scan)
+{
+  // A batch is localized at its latest reading
+  scan.stamp = received.batch ? received.batch->last : received.msg->header.stamp;
+  scan.received = received.received;
+
   // check if odometry available, skip scan if not.
-  if (!_mm->lookupOdomPose(msg->header.stamp, odomPose))
+  if (!lookupOdomPose(scan.stamp, scan.odomPose))
   {
     ROS_WARN("Odometry not available, skipping scan.\n");
+    return false;
+  }
+
+  if (received.batch)
+  {
+    scan.hasSensorTransform = prepareRangeBatch(*received.batch, scan);
+  }
+  else
+  {
+    const sensor_msgs::LaserScanConstPtr& msg = received.msg;
+    ScanPreprocessor::LaserScan laserScan;
+    laserScan.angleMin = msg->angle_min;
+    laserScan.angleIncrement = msg->angle_increment;
+    laserScan.rangeMin = msg->range_min;
+    laserScan.ranges = msg->ranges.data();
+    laserScan.numRanges = msg->ranges.size();
+    unsigned int numValid = _scanPreprocessor->prepareLaserScan(laserScan, scan.observation);
+    scan.frame = msg->header.frame_id;
+    ROS_DEBUG("Laser scan: %zu of %u valid beams used (%u out of valid range)", scan.observation.ranges.size(),
+              numValid, laserScan.numRanges - numValid);
+
+    geometry_msgs::TransformStamped sensorToBase;
+    scan.hasSensorTransform = lookupTargetToBaseTransform(scan.frame, msg->header.stamp, sensorToBase);
+    scan.observation.baseToSensor.resize(1);
+    if (scan.hasSensorTransform)
+    {
+      tf2::Transform baseToSensor;
+      tf2::convert(sensorToBase.transform, baseToSensor);
+      scan.observation.baseToSensor[0] = toEigen(baseToSensor.inverse());
+    }
+  }
+
+  if (_heightGating)
+    scan.observation.height = lookupHeight(scan.stamp);
+  return true;
+}
+
+void Particles::filterLoop()
+{
+  std::shared_ptr<PreparedScan> scan;
+  while (_preparedQueue->pop(scan))
+  {
+    updateMap();
+    {
+      boost::shared_lock<boost::shared_mutex> mapLock(*_mapMutex);
+      std::lock_guard<std::mutex> lock(_filterMutex);
+      filterScan(*scan);
+    }
+    _recycledScans->push(scan);
+    scan.reset();
+  }
+}
+
+void Particles::publishLoop()
+{
+  std::shared_ptr<PoseEstimate> estimate;
+  while (_estimateQueue->pop(estimate))
+    publishPoseEstimate(*estimate);
+}
+
+void Particles::scheduleStep()
+{
+  {
+    std::lock_guard<std::mutex> lock(_stepMutex);
+    if (_stopping || _stepScheduled.exchange(true))
+      return;
+    _stepsInFlight++;
+  }
+  FilterScheduler::Clock::time_point deadline =
+      FilterScheduler::Clock::now() + std::chrono::microseconds(int64_t(_stepDeadline * 1e6));
+  _scheduler->submit(std::bind(&Particles::runScheduledStep, this), deadline, _index);
+}
+
+void Particles::runScheduledStep()
+{
+  // One scan per step, the steps of the other drones run in between
+  ReceivedScan received;
+  if (_scanQueue->tryPop(received))
+  {
+    std::shared_ptr<PreparedScan> scan;
+    if (!_recycledScans->tryPop(scan))
+      scan.reset(new PreparedScan());
+    if (prepareScan(received, *scan))
+    {
+      updateMap();
+      boost::shared_lock<boost::shared_mutex> mapLock(*_mapMutex);
+      std::lock_guard<std::mutex> lock(_filterMutex);
+      filterScan(*scan);
+    }
+    _recycledScans->push(scan);
+  }
+
+  std::shared_ptr<PoseEstimate> estimate;
+  while (_estimateQueue->tryPop(estimate))
+    publishPoseEstimate(*estimate);
+
+  // A scan or an estimate queued during the step was not scheduled, since this step was still running
+  _stepScheduled = false;
+  if (_scanQueue->size() > 0 || _estimateQueue->size() > 0)
+    scheduleStep();
+
+  // Nothing of this object is touched after the count drops, the destructor may return right away
+  std::lock_guard<std::mutex> lock(_stepMutex);
+  _stepsInFlight--;
+  _stepFinished.notify_all();
+}
+
+void Particles::updateMap()
+{
+  {
+    boost::shared_lock<boost::shared_mutex> mapLock(*_mapMutex);
+    if (!_mapModel->updatePending())
+      return;
+  }
+
+  // Waits for the steps of the other drones, the first one to get here applies the update for all of them
+  boost::unique_lock<boost::shared_mutex> mapLock(*_mapMutex);
+  _mapModel->applyMapUpdates();
+}
+
+/******************************/
+/*        filterScan          */
+/******************************/
+
+void Particles::filterScan(const PreparedScan& scan)
+{
+  // The particles may have been reset since the scan was received
+  if (!_initialized)
+    return;
+
+  // The motion model, the relocalization and the recovery all use the same attitude
+  readImu();
+
+  double timediff = (scan.stamp - _lastLaserTime).toSec();
+  if (_receivedSensorData && timediff < 0)
+  {
+    ROS_WARN("Ignoring received laser data that is %f s older than previous data!", timediff);
     return;
   }
 
+  geometry_msgs::PoseStamped odomPose = scan.odomPose;
+
+  // The filter is reset around the poses that explain this scan, and weighted with it below
+  if (scan.hasSensorTransform && _relocalizeRequested.exchange(false) && relocalize(scan))
+    _receivedSensorData = false;
+
   if (!_firstRun)
   {
     ros::Time start = ros::Time::now();
-    double dt = (odomPose.header.stamp - _mm->getLastOdomPose().header.stamp).toSec();
+    ros::WallTime wallStart = ros::WallTime::now();
+    double dt = (odomPose.header.stamp - _lastOdomPose.header.stamp).toSec();
+    if (_fourDof)
+    {
+      Eigen::Isometry3d currentOdomPose = toEigen(odomPose.pose);
+      _mm->setOdomPoses(_odometryReceived ? toEigen(_lastOdomPose.pose) : currentOdomPose, currentOdomPose);
+      if (_attitudeFromImu && _imuReceived)
+        _mm->setAttitude(_imuRoll, _imuPitch);
+    }
+    else
+    {
+      _mm->setOdomTransform(computeOdomTransform(odomPose));
+    }
     if (!_receivedSensorData || isAboveMotionThreshold(odomPose))
     {
-      pcl::PointCloud<pcl::PointXYZ> pcFiltered;
-      std::vector<float> laserRanges;
-      prepareLaserPointCloud(msg, pcFiltered, laserRanges);
-
-      ros::Time t = msg->header.stamp;
-      geometry_msgs::TransformStamped sensorToBase;
-
-      if (!_mm->lookupTargetToBaseTransform(pcFiltered.header.frame_id, t, sensorToBase))
+      if (!scan.hasSensorTransform)
       {
         return;
       }
-      tf2::Transform baseToSensor;
-      tf2::convert(sensorToBase.transform, baseToSensor);
-      baseToSensor = baseToSensor.inverse();
 
-      _filteredPointCloudPublisher.publish(pcFiltered);
+      _metrics.scansFiltered.fetch_add(1, std::memory_order_relaxed);
+      _metrics.queueLatency.observe((ros::WallTime::now() - scan.received).toSec());
+
+      // The points of range sensors are each in their own frame
+      if (_publishFilteredCloud && scan.observation.sensors.empty() &&
+          _filteredPointCloudPublisher.getNumSubscribers() > 0)
+        publishFilteredCloud(scan);
 
       DroneObservationModel* laser = (DroneObservationModel*)_om.get();
-      laser->setBaseToSensorTransform(baseToSensor);
-      laser->setObservedMeasurements(pcFiltered, laserRanges);
+
+      // The map only changes between two filter steps (updateMap), possibly in the step of another drone
+      if (_mapModel->getVersion() != _mapVersion)
+      {
+        _mapVersion = _mapModel->getVersion();
+        laser->setMap(getMapView());
+        _recoveryDistribution.reset();
+        _scanMatcher.reset();
+      }
+      updateRecoveryDistribution();
+
+      laser->setObservedMeasurements(scan.observation);
 
       _pf->setObservationModel(laser);
 
+      // Page in the map where the particles will be measured
+      focusMap(odomPose, dt);
+
       // run one filter step
       _pf->filter(dt);
       double tdiff = (ros::Time::now() - start).toSec();
       ROS_DEBUG("Laser filter done in %f s", tdiff);
 
+      const ObservationStats& stats = laser->getStats();
+      _metrics.filterStepTime.observe(tdiff);
+      if (_pf->getNumInjectedParticles() > 0)
+      {
+        ROS_DEBUG("Recovery: %u particles drawn over the map (likelihood per beam %g, long-term %g)",
+                  _pf->getNumInjectedParticles(), _pf->getFastLikelihoodAverage(), _pf->getSlowLikelihoodAverage());
+        _metrics.particlesInjected.fetch_add(_pf->getNumInjectedParticles(), std::memory_order_relaxed);
+      }
+      _metrics.raycasts.fetch_add(stats.raycastsPerformed, std::memory_order_relaxed);
+      _metrics.beamsUsed = stats.beamsObserved;
+      _metrics.particles = _pf->numParticles();
+      _metrics.effectiveParticles = _pf->getNumEffectiveParticles();
+      _metrics.mapBytes = _mapModel->memoryUsage();
+      ROS_DEBUG("Observation: %u particles, %u terminated early, %u gated by height, %u raycasts (%u skipped), "
+                "discarded weight ratio max %g / sum %g, weight cache hit rate %.1f%%",
+                stats.particlesMeasured, stats.particlesTerminated, stats.particlesGated, stats.raycastsPerformed,
+                stats.raycastsSkipped,
+                stats.maxDiscardedWeightRatio, stats.discardedWeightBound,
+                stats.particlesMeasured ? 100.0 * stats.cacheHits / stats.particlesMeasured : 0.0);
+      if (_mapModel->getTiledMap())
+      {
+        TiledMap::Stats tileStats = _mapModel->getTiledMap()->getStats();
+        if (_tileWindow)
+          tileStats.windowTiles = _tileWindow->numTiles();
+        ROS_DEBUG("Map tiles: %u in the window, %u cached, %lu loaded, %lu prefetched, %lu evicted",
+                  tileStats.windowTiles, tileStats.residentTiles, (unsigned long)tileStats.loads,
+                  (unsigned long)tileStats.prefetched, (unsigned long)tileStats.evictions);
+      }
+
+      if (_autoRelocalization && isLost(stats))
+      {
+        ROS_WARN("Localization lost for %d steps, relocalizing", _lowQualitySteps);
+        _lowQualitySteps = 0;
+        _relocalizeRequested = true;
+      }
+
+      if (_refinement)
+        refineEstimate(scan);
+
       if (_publishUpdated)
-        publishPoseEstimate(msg->header.stamp);
+        queuePoseEstimate(scan.stamp, scan.received);
+      if (_deadlineController)
+        adaptToDeadline((ros::WallTime::now() - wallStart).toSec(), stats, scan.observation.points.size());
       _lastLocalizedPose = odomPose.pose;
       _receivedSensorData = true;
     }
@@ -217,12 +831,12 @@ void Particles::scanCallback(const sensor_msgs::LaserScanConstPtr& msg)
     _lastLocalizedPose = odomPose.pose;
   }
 
-  _mm->setLastOdomPose(odomPose);
+  setLastOdomPose(odomPose);
   _firstRun = false;
-  _lastLaserTime = msg->header.stamp;
+  _lastLaserTime = scan.stamp;
   if (!_publishUpdated)
   {
-    publishPoseEstimate(_lastLaserTime);
+    queuePoseEstimate(_lastLaserTime, scan.received);
   }
 }
 
@@ -236,7 +850,10 @@ void Particles::latestTransformTimerCallback(const ros::TimerEvent& timer_event)
   transform.header.frame_id = _mapFrameID;
   transform.header.stamp = timer_event.current_real + ros::Duration(_transformTolerance);
   transform.child_frame_id = _worldFrameID;
-  transform.transform = tf2::toMsg(_latestTransform.inverse());
+  {
+    std::lock_guard<std::mutex> lock(_transformMutex);
+    transform.transform = tf2::toMsg(_latestTransform.inverse());
+  }
   _tfBroadcaster->sendTransform(transform);
 }
 
@@ -266,7 +883,10 @@ void Particles::initialPoseCallback(const geometry_msgs::PoseWithCovarianceStamp
   DroneStateDistribution distribution(_XStdDev, _YStdDev, _ZStdDev, _RollStdDev, _PitchStdDev, _YawStdDev,
                                       transform.getOrigin().getX(), transform.getOrigin().getY(),
                                       transform.getOrigin().getZ(), roll, pitch, yaw, 1);
+  if (_fourDof)
+    distribution.fixAttitude(roll, pitch);
 
+  std::lock_guard<std::mutex> lock(_filterMutex);
   _pf->drawAllFromDistribution(distribution);
 
   /*
@@ -280,13 +900,15 @@ void Particles::initialPoseCallback(const geometry_msgs::PoseWithCovarianceStamp
   */
   _pf->setResamplingMode(libPF::RESAMPLE_NEFF);
   _pf->resetTimer();
-  _mm->reset();
+  _odometryReceived = false;
+
+  std::fill(_refinementOffset, _refinementOffset + 4, 0.0);
 
   _initialized = true;
   _receivedSensorData = false;
   _firstRun = true;
 
-  publishPoseEstimate(msg->header.stamp);
+  queuePoseEstimate(msg->header.stamp, ros::WallTime());
 }
 
 /******************************/
@@ -297,22 +919,162 @@ bool Particles::globalLocalizationCallback(std_srvs::Empty::Request& req, std_sr
 {
   ROS_INFO("Global Localization with Uniform Distribution");
 
-  DroneStateDistribution distribution(_mapModel);
+  boost::shared_lock<boost::shared_mutex> mapLock(*_mapMutex);
+  std::lock_guard<std::mutex> lock(_filterMutex);
+  readImu();
+  std::shared_ptr<const FreeSpaceIndex> freeSpace = _mapModel->getFreeSpace();
+  if (freeSpace && freeSpace->size() == 0)
+    ROS_WARN("No free space for the drone in the map, sampling over the whole map");
+  double mapMin[3], mapMax[3];
+  _mapModel->getMetricMin(mapMin[0], mapMin[1], mapMin[2]);
+  _mapModel->getMetricMax(mapMax[0], mapMax[1], mapMax[2]);
+  DroneStateDistribution distribution(freeSpace, mapMin, mapMax);
   distribution.setUniform(true);
+  setGlobalAttitude(distribution);
   _pf->drawAllFromDistribution(distribution);
   _pf->setResamplingMode(libPF::RESAMPLE_NEFF);
   _pf->resetTimer();
-  _mm->reset();
+  _odometryReceived = false;
+  std::fill(_refinementOffset, _refinementOffset + 4, 0.0);
 
   // Do not integrate measurements until moved(??)
   _receivedSensorData = true;
   _initialized = true;
   _firstRun = true;
-  publishPoseEstimate(ros::Time::now());
+  queuePoseEstimate(ros::Time::now(), ros::WallTime());
+
+  return true;
+}
+
+/******************************/
+/*   relocalizeSrvCallback    */
+/******************************/
 
+bool Particles::relocalizeSrvCallback(std_srvs::Empty::Request& req, std_srvs::Empty::Response& res)
+{
+  ROS_INFO("Relocalizing with the next scan");
+  _relocalizeRequested = true;
+  return true;
+}
+
+/******************************/
+/*         relocalize         */
+/******************************/
+
+bool Particles::relocalize(const PreparedScan& scan)
+{
+  // Built once for all the drones that share the map
+  std::shared_ptr<const Relocalizer> relocalizer =
+      _mapModel->getRelocalizer(_relocalizationSigma, _relocalizationLevels);
+  if (!relocalizer)
+  {
+    ROS_WARN("Relocalization needs the map cache");
+    return false;
+  }
+
+  ros::WallTime start = ros::WallTime::now();
+
+  std::vector<Observation::Point> points;
+  scan.observation.endpointsInBase(_filterMaxRange, points);
+
+  // Roll and pitch from the IMU snapshot of this step, the one the motion model uses, else from the current estimate
+  if (_imuReceived)
+  {
+    _relocalizationParams.roll = _imuRoll;
+    _relocalizationParams.pitch = _imuPitch;
+  }
+  else
+  {
+    const DroneState& best = _pf->getBestState();
+    _relocalizationParams.roll = best.getRoll();
+    _relocalizationParams.pitch = best.getPitch();
+  }
+
+  std::vector<Relocalizer::Hypothesis> hypotheses = relocalizer->search(points, _relocalizationParams);
+  double tdiff = (ros::WallTime::now() - start).toSec();
+  if (hypotheses.empty())
+  {
+    ROS_WARN("Relocalization: no pose explains the scan (%zu points, %.1f ms)", points.size(), tdiff * 1000.0);
+    return false;
+  }
+
+  std::vector<DroneState> means(hypotheses.size());
+  std::vector<double> weights(hypotheses.size());
+  for (std::size_t i = 0; i < hypotheses.size(); i++)
+  {
+    means[i].setXPos(hypotheses[i].x);
+    means[i].setYPos(hypotheses[i].y);
+    means[i].setZPos(hypotheses[i].z);
+    means[i].setRoll(_relocalizationParams.roll);
+    means[i].setPitch(_relocalizationParams.pitch);
+    means[i].setYaw(hypotheses[i].yaw);
+    weights[i] = hypotheses[i].score;
+  }
+  ROS_INFO("Relocalization: %zu hypotheses in %.1f ms, best (%.2f, %.2f, %.2f, yaw %.2f) score %.2f",
+           hypotheses.size(), tdiff * 1000.0, hypotheses[0].x, hypotheses[0].y, hypotheses[0].z, hypotheses[0].yaw,
+           hypotheses[0].score);
+
+  DroneStateDistribution distribution(_relocalizationXYZStdDev, _relocalizationXYZStdDev, _relocalizationXYZStdDev,
+                                      0.02, 0.02, _relocalizationYawStdDev, 0, 0, 0, 0, 0, 0, 1);
+  distribution.setMeans(means, weights);
+  if (_fourDof)
+    distribution.fixAttitude(_relocalizationParams.roll, _relocalizationParams.pitch);
+  _pf->drawAllFromDistribution(distribution);
+  _pf->setResamplingMode(libPF::RESAMPLE_NEFF);
+  _lowQualitySteps = 0;
+  std::fill(_refinementOffset, _refinementOffset + 4, 0.0);
+  _metrics.relocalizations.fetch_add(1, std::memory_order_relaxed);
   return true;
 }
 
+void Particles::setGlobalAttitude(DroneStateDistribution& distribution) const
+{
+  if (_fourDof)
+  {
+    double roll, pitch;
+    getAttitude(roll, pitch);
+    distribution.fixAttitude(roll, pitch);
+  }
+  else if (_globalUseImu && _imuReceived)
+    distribution.setAttitude(_imuRoll - _imuAttitudeTolerance, _imuRoll + _imuAttitudeTolerance,
+                             _imuPitch - _imuAttitudeTolerance, _imuPitch + _imuAttitudeTolerance);
+  else
+    distribution.setAttitude(-_globalMaxRoll, _globalMaxRoll, -_globalMaxPitch, _globalMaxPitch);
+}
+
+void Particles::updateRecoveryDistribution()
+{
+  if (!_recovery)
+    return;
+
+  if (!_recoveryDistribution)
+  {
+    double mapMin[3], mapMax[3];
+    _mapModel->getMetricMin(mapMin[0], mapMin[1], mapMin[2]);
+    _mapModel->getMetricMax(mapMax[0], mapMax[1], mapMax[2]);
+    _recoveryDistribution.reset(new DroneStateDistribution(_mapModel->getFreeSpace(), mapMin, mapMax));
+    _recoveryDistribution->setUniform(true);
+    _pf->setRecovery(_recoveryAlphaSlow, _recoveryAlphaFast, _recoveryDistribution.get());
+  }
+  // The attitude follows the odometry or the IMU
+  setGlobalAttitude(*_recoveryDistribution);
+}
+
+bool Particles::isLost(const ObservationStats& stats)
+{
+  if (stats.particlesMeasured == 0 || stats.beamsObserved == 0)
+    return false;
+
+  double neffRatio = double(_pf->getNumEffectiveParticles()) / _pf->numParticles();
+  // Geometric mean of the beam likelihoods over all the particles
+  double beamLikelihood = std::exp(stats.logLikelihoodSum / stats.particlesMeasured / stats.beamsObserved);
+  if (neffRatio < _minNeffRatio || beamLikelihood < _minBeamLikelihood)
+    _lowQualitySteps++;
+  else
+    _lowQualitySteps = 0;
+  return _lowQualitySteps >= _lostSteps;
+}
+
 /******************************/
 /*  initialPoseSrvCallback    */
 /******************************/
@@ -324,13 +1086,13 @@ bool Particles::initialPoseSrvCallback(std_srvs::Empty::Request& req, std_srvs::
 
   double x_pos, y_pos, z_pos, roll, pitch, yaw;
 
-  _nh.param<double>("/x_pos", x_pos, 0);
-  _nh.param<double>("/y_pos", y_pos, 0);
-  _nh.param<double>("/z_pos", z_pos, 0.18);
+  param<double>("/x_pos", x_pos, 0);
+  param<double>("/y_pos", y_pos, 0);
+  param<double>("/z_pos", z_pos, 0.18);
 
-  _nh.param<double>("/roll", roll, 0);
-  _nh.param<double>("/pitch", pitch, 0);
-  _nh.param<double>("/yaw", yaw, 0);
+  param<double>("/roll", roll, 0);
+  param<double>("/pitch", pitch, 0);
+  param<double>("/yaw", yaw, 0);
 
   geometry_msgs::PoseWithCovarianceStamped init_pose;
   init_pose.header.stamp = ros::Time::now();
@@ -362,47 +1124,212 @@ bool Particles::repairPoseSrvCallback(std_srvs::Empty::Request& req, std_srvs::E
   return true;
 }
 
+void Particles::imuCallback(const sensor_msgs::ImuConstPtr& msg)
+{
+  tf2::Quaternion orientation;
+  tf2::fromMsg(msg->orientation, orientation);
+  double yaw, pitch, roll;
+  tf2::getEulerYPR(orientation, yaw, pitch, roll);
+  _imuAttitude.write(std::make_pair(roll, pitch));
+}
+
+void Particles::odomCallback(const nav_msgs::OdometryConstPtr& msg)
+{
+  // Nothing to correct the odometry with before the first estimate
+  tf2::Transform mapToWorld;
+  if (!_odomCorrection.read(mapToWorld))
+    return;
+  if (msg->header.frame_id != _worldFrameID)
+    ROS_WARN_ONCE("Frame of the odometry (%s) is not the world frame %s", msg->header.frame_id.c_str(),
+                  _worldFrameID.c_str());
+
+  tf2::Transform odomPose;
+  tf2::fromMsg(msg->pose.pose, odomPose);
+  geometry_msgs::PoseStamped pose;
+  pose.header.frame_id = _mapFrameID;
+  pose.header.stamp = msg->header.stamp;
+  tf2::toMsg(mapToWorld * odomPose, pose.pose);
+  _highRatePosePublisher.publish(pose);
+}
+
+void Particles::heightCallback(const drone_gazebo::Float64StampedConstPtr& msg)
+{
+  // The height sensor reports the mean of its ranges, infinite when it sees nothing
+  if (!std::isfinite(msg->data) || msg->data < 0.0)
+    return;
+
+  std::lock_guard<std::mutex> lock(_heightMutex);
+  _heights.push_back(std::make_pair(msg->header.stamp, msg->data));
+  while (_heights.size() > 1 && _heights.front().first < msg->header.stamp - ros::Duration(1.0))
+    _heights.pop_front();
+}
+
+float Particles::lookupHeight(const ros::Time& t)
+{
+  std::lock_guard<std::mutex> lock(_heightMutex);
+  double bestDelay = _heightMaxDelay;
+  float height = -1.0f;
+  for (std::size_t i = 0; i < _heights.size(); i++)
+  {
+    double delay = std::abs((_heights[i].first - t).toSec());
+    if (delay <= bestDelay)
+    {
+      bestDelay = delay;
+      height = _heights[i].second;
+    }
+  }
+  return height;
+}
+
+MapView Particles::getMapView()
+{
+  MapView view = _mapModel->getView();
+  view.tileWindow = _tileWindow;
+  if (_heightGating)
+    view.heights = _mapModel->getHeightField();
+  return view;
+}
+
 void Particles::truePoseCallback(const nav_msgs::OdometryConstPtr& msg)
 {
   _true_pose.header = msg->header;
   _true_pose.pose = msg->pose;
 }
 
+void Particles::mapChangesCallback(const sensor_msgs::PointCloud2ConstPtr& msg)
+{
+  pcl::PointCloud<pcl::PointXYZI> changes;
+  pcl::fromROSMsg(*msg, changes);
+  _mapModel->queueMapChanges(changes);
+}
+
 /******************************/
 /*       publishPoses         */
 /******************************/
 
-void Particles::publishPoseEstimate(const ros::Time& t)
+DroneState Particles::filterEstimate() const
 {
-  _poseArray.header.stamp = t;
-  if (_poseArray.poses.size() != _pf->numParticles())
+  if (_fourDof)
+    return estimateFourDof(*_pf, _percentage_of_particles);
+  return _pf->getBestXPercentEstimate(_percentage_of_particles);
+}
+
+void Particles::refineEstimate(const PreparedScan& scan)
+{
+  if (!_scanMatcher)
+    _scanMatcher.reset(new ScanMatcher(_mapModel->getCache()));
+
+  ros::WallTime start = ros::WallTime::now();
+
+  scan.observation.endpointsInBase(_filterMaxRange, _refinementPoints);
+
+  DroneState estimate = filterEstimate();
+  ScanMatcher::Pose initial = { estimate.getXPos(), estimate.getYPos(), estimate.getZPos(), estimate.getYaw() };
+  ScanMatcher::Result result;
+  bool accepted = _scanMatcher->refine(_refinementPoints, estimate.getRoll(), estimate.getPitch(), initial,
+                                       _refinementParams, result);
+  double yawCorrection = result.pose.yaw - initial.yaw;
+  double correction[4] = { result.pose.x - initial.x, result.pose.y - initial.y, result.pose.z - initial.z,
+                           std::atan2(std::sin(yawCorrection), std::cos(yawCorrection)) };
+  ROS_DEBUG("Refinement %s in %.2f ms: %u iterations, %u of %zu endpoints at %.3f m RMS, correction (%.3f, %.3f, "
+            "%.3f, yaw %.3f)",
+            accepted ? "accepted" : "rejected", (ros::WallTime::now() - start).toSec() * 1000.0, result.iterations,
+            result.inliers, _refinementPoints.size(), result.rmsDistance, correction[0], correction[1],
+            correction[2], correction[3]);
+  if (!accepted)
   {
-    _poseArray.poses.resize(_pf->numParticles());
+    // The filter estimate is published as it is
+    std::fill(_refinementOffset, _refinementOffset + 4, 0.0);
+    _metrics.refinementsRejected.fetch_add(1, std::memory_order_relaxed);
+    return;
   }
 
-// Fill in the pose array
-#pragma omp parallel for
-  for (unsigned i = 0; i < _pf->numParticles(); i++)
+  if (_refinementFeedback > 0.0)
   {
-    // Create a Pose object, fill it with x,y,z,r,p,y and then pass it on
-    geometry_msgs::Pose temp_pose;
-    temp_pose.position.x = _pf->getState(i).getXPos();
-    temp_pose.position.y = _pf->getState(i).getYPos();
-    temp_pose.position.z = _pf->getState(i).getZPos();
+    DroneState refined = estimate;
+    refined.setXPos(result.pose.x);
+    refined.setYPos(result.pose.y);
+    refined.setZPos(result.pose.z);
+    refined.setYaw(result.pose.yaw);
+    moveParticles(*_pf, estimate, refined, _refinementFeedback);
+  }
+  for (int i = 0; i < 4; i++)
+    _refinementOffset[i] = (1.0 - _refinementFeedback) * correction[i];
+  _metrics.estimatesRefined.fetch_add(1, std::memory_order_relaxed);
+}
 
-    tf2::Quaternion temp_pose_orien;
-    temp_pose_orien.setRPY(_pf->getState(i).getRoll(), _pf->getState(i).getPitch(), _pf->getState(i).getYaw());
-    // Convert tf2::quaternion to std_msgs::quaternion to be accepted in the odom msg
-    temp_pose.orientation = tf2::toMsg(temp_pose_orien.normalize());
+void Particles::adaptToDeadline(double stepTime, const ObservationStats& stats, unsigned int availableBeams)
+{
+  DeadlineController::Step step;
+  step.stepTime = stepTime;
+  step.measureTime = _pf->getMeasureTime();
+  step.particleTime = _pf->getResampleTime() + _pf->getMotionTime();
+  step.particles = _pf->numParticles();
+  step.beams = stats.beamsObserved;
+  step.availableBeams = availableBeams;
+  bool changed = _deadlineController->update(step);
+  double deadline = _deadlineController->getParameters().deadline;
+  if (stepTime > deadline)
+  {
+    _metrics.deadlineMisses.fetch_add(1, std::memory_order_relaxed);
+    ROS_WARN_THROTTLE(10, "Filter step took %.1f ms, over the %.1f ms deadline (%lu of %lu steps missed it)",
+                      stepTime * 1000.0, deadline * 1000.0, (unsigned long)_deadlineController->misses(),
+                      (unsigned long)_deadlineController->steps());
+  }
+  if (!changed)
+    return;
 
-    _poseArray.poses[i] = temp_pose;
+  unsigned int beams = _deadlineController->beams();
+  unsigned int particles = _deadlineController->particles();
+  ((DroneObservationModel*)_om.get())->setMaxBeams(beams);
+  // The beams change often, the particles only when the beams are not enough
+  if (particles == _pf->numParticles())
+  {
+    ROS_DEBUG("Real-time: %u of %u beams for the next steps, predicted step time %.1f ms (last %.1f ms)",
+              beams ? beams : availableBeams, availableBeams, _deadlineController->predictedStepTime() * 1000.0,
+              stepTime * 1000.0);
+    return;
   }
+  ROS_INFO("Real-time: %u particles (were %u) and %u of %u beams for the next steps, predicted step time %.1f ms "
+           "(last %.1f ms, %.1f ms measuring)",
+           particles, _pf->numParticles(), beams ? beams : availableBeams, availableBeams,
+           _deadlineController->predictedStepTime() * 1000.0, stepTime * 1000.0, step.measureTime * 1000.0);
+  _pf->setNumParticles(particles);
+}
 
-  // Publish
-  _poseArrayPublisher.publish(_poseArray);
+void Particles::queuePoseEstimate(const ros::Time& t, const ros::WallTime& received)
+{
+  std::shared_ptr<PoseEstimate> estimate(new PoseEstimate());
+  estimate->stamp = t;
+  estimate->received = received;
+
+  // Without a timer, the cloud goes with every estimate
+  if (_particleCloudRate <= 0 && hasParticleCloudSubscribers())
+    sampleParticleCloud(estimate->particles, estimate->weights);
+
+  // Between two refinements, the filter estimate is corrected like the last one
+  DroneState& bestState = estimate->bestState;
+  bestState = filterEstimate();
+  bestState.setXPos(bestState.getXPos() + _refinementOffset[0]);
+  bestState.setYPos(bestState.getYPos() + _refinementOffset[1]);
+  bestState.setZPos(bestState.getZPos() + _refinementOffset[2]);
+  bestState.setYaw(std::atan2(std::sin(bestState.getYaw() + _refinementOffset[3]),
+                              std::cos(bestState.getYaw() + _refinementOffset[3])));
+
+  _estimateQueue->push(estimate);
+  if (_scheduler)
+    scheduleStep();
+}
+
+void Particles::publishPoseEstimate(const PoseEstimate& estimate)
+{
+  const ros::Time& t = estimate.stamp;
+
+  if (!estimate.particles.empty())
+    publishParticleCloud(t, estimate.particles, estimate.weights);
 
   // Send best particle as pose and one array
-  DroneState bestState = _pf->getBestXPercentEstimate(_percentage_of_particles);
+  const DroneState& bestState = estimate.bestState;
 
   geometry_msgs::PoseStamped bestPose;
   bestPose.header.frame_id = _mapFrameID;
@@ -443,7 +1370,7 @@ void Particles::publishPoseEstimate(const ros::Time& t)
     temp_poseStamped.header.stamp = t;
     tf2::toMsg(temp_tf2Transform.inverse(), temp_poseStamped.pose);
 
-    _tfBuffer.transform(temp_poseStamped, worldToMap, _worldFrameID);
+    _tfBuffer->transform(temp_poseStamped, worldToMap, _worldFrameID);
   }
   catch (const tf2::TransformException& e)
   {
@@ -451,7 +1378,13 @@ void Particles::publishPoseEstimate(const ros::Time& t)
     return;
   }
 
-  tf2::convert(worldToMap.pose, _latestTransform);
+  tf2::Transform latestTransform;
+  tf2::convert(worldToMap.pose, latestTransform);
+  {
+    std::lock_guard<std::mutex> lock(_transformMutex);
+    _latestTransform = latestTransform;
+  }
+  _odomCorrection.write(latestTransform.inverse());
 
   // We want to send a transform that is good up until a tolerance time so that odom can be used
   ros::Time transform_expiration = (t + ros::Duration(_transformTolerance));
@@ -459,77 +1392,356 @@ void Particles::publishPoseEstimate(const ros::Time& t)
   tmp_tf_stamped.header.frame_id = _mapFrameID;
   tmp_tf_stamped.header.stamp = transform_expiration;
   tmp_tf_stamped.child_frame_id = _worldFrameID;
-  tf2::convert(_latestTransform.inverse(), tmp_tf_stamped.transform);
+  tf2::convert(latestTransform.inverse(), tmp_tf_stamped.transform);
 
   _tfBroadcaster->sendTransform(tmp_tf_stamped);
+
+  if (!estimate.received.isZero())
+    _metrics.poseLatency.observe((ros::Time::now() - t).toSec());
 }
 
 /******************************/
-/*   prepareLaserPointCloud   */
+/*    publishParticleCloud    */
 /******************************/
 
-void Particles::prepareLaserPointCloud(const sensor_msgs::LaserScanConstPtr& scan, pcl::PointCloud<pcl::PointXYZ>& pc,
-                                       std::vector<float>& ranges) const
+bool Particles::hasParticleCloudSubscribers() const
 {
-  unsigned int numBeams = scan->ranges.size();
-  // Get every n-th scan;
-  unsigned int step = 1;
+  return _poseArrayPublisher.getNumSubscribers() > 0 ||
+         (_compactParticleCloud && _compactCloudPublisher.getNumSubscribers() > 0);
+}
 
-  // Prepare Laser Message
-  unsigned int numBeamsSkipped = 0;
+void Particles::sampleParticleCloud(std::vector<DroneState>& states, std::vector<double>& weights)
+{
+  unsigned int numParticles = _pf->numParticles();
+  unsigned int count = numParticles;
+  if (_particleCloudMaxParticles > 0 && unsigned(_particleCloudMaxParticles) < count)
+    count = _particleCloudMaxParticles;
 
-  double laserMin = std::max(double(scan->range_min), _filterMinRange);
+  _particleCloudIndices.resize(numParticles);
+  for (unsigned int i = 0; i < numParticles; i++)
+    _particleCloudIndices[i] = i;
 
-  pcl_conversions::toPCL(scan->header, pc.header);
+  if (count < numParticles)
+  {
+    if (_particleCloudTopK)
+    {
+      // Heaviest particles first
+      std::nth_element(_particleCloudIndices.begin(), _particleCloudIndices.begin() + count,
+                       _particleCloudIndices.end(),
+                       [this](unsigned int a, unsigned int b) { return _pf->getWeight(a) > _pf->getWeight(b); });
+    }
+    else
+    {
+      // Partial Fisher-Yates shuffle: the first count indices are a uniform subsample
+      for (unsigned int i = 0; i < count; i++)
+        std::swap(_particleCloudIndices[i], _particleCloudIndices[i + rand() % (numParticles - i)]);
+    }
+  }
 
-  // Allocate some capacity for vector
-  ranges.reserve(50);
-  pc.points.reserve(50);
+  states.resize(count);
+  weights.resize(count);
+  for (unsigned int i = 0; i < count; i++)
+  {
+    states[i] = _pf->getState(_particleCloudIndices[i]);
+    weights[i] = _pf->getWeight(_particleCloudIndices[i]);
+  }
+}
 
-  for (int beamId = 0; beamId < numBeams; beamId += step)
+void Particles::publishParticleCloud(const ros::Time& t, const std::vector<DroneState>& states,
+                                     const std::vector<double>& weights)
+{
+  if (_poseArrayPublisher.getNumSubscribers() > 0)
   {
-    double range = scan->ranges[beamId];
-    if (range >= laserMin && range <= _filterMaxRange)
+    geometry_msgs::PoseArray poseArray;
+    poseArray.header.frame_id = _mapFrameID;
+    poseArray.header.stamp = t;
+    poseArray.poses.resize(states.size());
+
+// Fill in the pose array
+#pragma omp parallel for
+    for (unsigned i = 0; i < states.size(); i++)
     {
-      double laserAngle = scan->angle_min + beamId * scan->angle_increment;
+      // Create a Pose object, fill it with x,y,z,r,p,y and then pass it on
+      geometry_msgs::Pose temp_pose;
+      temp_pose.position.x = states[i].getXPos();
+      temp_pose.position.y = states[i].getYPos();
+      temp_pose.position.z = states[i].getZPos();
+
+      tf2::Quaternion temp_pose_orien;
+      temp_pose_orien.setRPY(states[i].getRoll(), states[i].getPitch(), states[i].getYaw());
+      // Convert tf2::quaternion to std_msgs::quaternion to be accepted in the odom msg
+      temp_pose.orientation = tf2::toMsg(temp_pose_orien.normalize());
+
+      poseArray.poses[i] = temp_pose;
+    }
 
-      tf2::Transform laserAngleRotation(tf2::Quaternion(tf2::Vector3(0.0, 0.0, 1.0), laserAngle));
-      tf2::Vector3 laserEndpointTransform(range, 0.0, 0.0);
-      tf2::Vector3 pt(laserAngleRotation * laserEndpointTransform);
+    _poseArrayPublisher.publish(poseArray);
+  }
 
-      pc.points.push_back(pcl::PointXYZ(pt.x(), pt.y(), pt.z()));
-      ranges.push_back(range);
+  if (_compactParticleCloud && _compactCloudPublisher.getNumSubscribers() > 0)
+  {
+    particle_filter::ParticleCloud cloud;
+    cloud.header.frame_id = _mapFrameID;
+    cloud.header.stamp = t;
+    cloud.x.resize(states.size());
+    cloud.y.resize(states.size());
+    cloud.z.resize(states.size());
+    cloud.yaw.resize(states.size());
+    cloud.weight.resize(states.size());
+    for (unsigned i = 0; i < states.size(); i++)
+    {
+      cloud.x[i] = states[i].getXPos();
+      cloud.y[i] = states[i].getYPos();
+      cloud.z[i] = states[i].getZPos();
+      cloud.yaw[i] = states[i].getYaw();
+      cloud.weight[i] = weights[i];
     }
-    else
+
+    _compactCloudPublisher.publish(cloud);
+  }
+}
+
+void Particles::particleCloudTimerCallback(const ros::TimerEvent& timer_event)
+{
+  if (!_initialized || !hasParticleCloudSubscribers())
+    return;
+
+  std::vector<DroneState> states;
+  std::vector<double> weights;
+  ros::Time stamp;
+  {
+    std::lock_guard<std::mutex> lock(_filterMutex);
+    sampleParticleCloud(states, weights);
+    stamp = _lastLaserTime;
+  }
+
+  publishParticleCloud(stamp, states, weights);
+}
+
+/******************************/
+/*    metricsTimerCallback    */
+/******************************/
+
+void Particles::metricsTimerCallback(const ros::TimerEvent& timer_event)
+{
+  ros::WallTime now = ros::WallTime::now();
+  uint64_t raycasts = _metrics.raycasts.load(std::memory_order_relaxed);
+  double elapsed = (now - _lastMetricsTime).toSec();
+  double raycastsPerSecond = elapsed > 0 ? (raycasts - _lastRaycasts) / elapsed : 0.0;
+  _lastRaycasts = raycasts;
+  _lastMetricsTime = now;
+
+  diagnostic_msgs::DiagnosticArray diagnostics;
+  diagnostics.header.stamp = ros::Time::now();
+  diagnostic_msgs::DiagnosticStatus status;
+  status.name = "particle_filter: localization" + (_ns.empty() ? "" : " " + _ns);
+  status.hardware_id = _mapFrameID;
+  status.level = _initialized ? diagnostic_msgs::DiagnosticStatus::OK : diagnostic_msgs::DiagnosticStatus::WARN;
+  status.message = _initialized ? "Localizing" : "Not initialized";
+  std::vector<std::pair<std::string, std::string> > values = _metrics.values(raycastsPerSecond);
+  for (unsigned int i = 0; i < values.size(); i++)
+  {
+    diagnostic_msgs::KeyValue keyValue;
+    keyValue.key = values[i].first;
+    keyValue.value = values[i].second;
+    status.values.push_back(keyValue);
+  }
+  diagnostics.status.push_back(status);
+  _diagnosticsPublisher.publish(diagnostics);
+
+  if (_prometheusFile.empty())
+    return;
+
+  // Written aside and renamed, so that a scraper never reads a partial file
+  std::string tmpFile = _prometheusFile + ".tmp";
+  std::ofstream out(tmpFile.c_str());
+  _metrics.writePrometheus(out, raycastsPerSecond, _ns.empty() ? "" : "drone=\"" + _ns.substr(1) + "\"");
+  out.close();
+  if (!out || std::rename(tmpFile.c_str(), _prometheusFile.c_str()) != 0)
+    ROS_WARN_THROTTLE(60, "Could not write the metrics to %s", _prometheusFile.c_str());
+}
+
+/******************************/
+/*    publishFilteredCloud    */
+/******************************/
+
+void Particles::publishFilteredCloud(const PreparedScan& scan)
+{
+  pcl::PointCloud<pcl::PointXYZ> cloud;
+  cloud.header.frame_id = scan.frame;
+  pcl_conversions::toPCL(scan.stamp, cloud.header.stamp);
+  cloud.points.resize(scan.observation.points.size());
+  for (std::size_t i = 0; i < cloud.points.size(); i++)
+  {
+    const Observation::Point& pt = scan.observation.points[i];
+    cloud.points[i] = pcl::PointXYZ(pt.x, pt.y, pt.z);
+  }
+  cloud.width = cloud.points.size();
+  cloud.height = 1;
+  cloud.is_dense = false;
+  _filteredPointCloudPublisher.publish(cloud);
+}
+
+/******************************/
+/*     prepareRangeBatch      */
+/******************************/
+
+bool Particles::prepareRangeBatch(const RangeBatch& batch, PreparedScan& scan)
+{
+  Observation& observation = scan.observation;
+  observation.clear();
+  observation.baseToSensor.assign(_rangeSensors.size(), Eigen::Isometry3d::Identity());
+  scan.frame = _baseLinkFrameID;
+
+  bool hasTransforms = true;
+  for (unsigned int i = 0; i < batch.readings.size(); i++)
+  {
+    const sensor_msgs::RangeConstPtr& reading = batch.readings[i];
+    if (!reading)
+      continue;
+
+    // The sensors are fixed on the drone, their transform is looked up once
+    RangeSensor& sensor = _rangeSensors[i];
+    if (!sensor.hasTransform)
     {
-      numBeamsSkipped++;
+      geometry_msgs::TransformStamped sensorToBase;
+      sensor.frame = reading->header.frame_id;
+      if (!lookupTargetToBaseTransform(sensor.frame, reading->header.stamp, sensorToBase))
+      {
+        hasTransforms = false;
+        continue;
+      }
+      tf2::convert(sensorToBase.transform, sensor.baseToSensor);
+      sensor.baseToSensor = sensor.baseToSensor.inverse();
+      sensor.hasTransform = true;
     }
+    observation.baseToSensor[i] = toEigen(sensor.baseToSensor);
+
+    _scanPreprocessor->addRange(reading->range, reading->min_range, reading->max_range, i, observation);
   }
 
-  pc.is_dense = false;
+  ROS_DEBUG("Range batch: %zu of %u readings used, %.3f s apart", observation.ranges.size(), batch.numReadings,
+            (batch.last - batch.first).toSec());
+  return hasTransforms;
+}
 
-  // Uniform Sampling
-  pcl::UniformSampling<pcl::PointXYZ> uniformSampling;
-  pcl::PointCloud<pcl::PointXYZ>::Ptr cloudPtr;
-  cloudPtr.reset(new pcl::PointCloud<pcl::PointXYZ>(pc));
-  uniformSampling.setInputCloud(cloudPtr);
+/******************************/
+/*          Odometry          */
+/******************************/
 
-  uniformSampling.setRadiusSearch(_sensorSampleDist);
-  pcl::PointCloud<int> sampledIndices;
-  uniformSampling.compute(sampledIndices);
+bool Particles::lookupOdomPose(const ros::Time& t, geometry_msgs::PoseStamped& odomPose) const
+{
+  geometry_msgs::PoseStamped identity;
+  identity.header.frame_id = _baseFootprintFrameID;
+  identity.header.stamp = t;
 
-  pcl::copyPointCloud(*cloudPtr, sampledIndices.points, pc);
+  tf2::toMsg(tf2::Transform::getIdentity(), identity.pose);
+  try
+  {
+    _tfBuffer->transform(identity, odomPose, _worldFrameID, ros::Duration(0.1));
+  }
+  catch (tf2::TransformException& e)
+  {
+    ROS_WARN("Failed to compute odom pose, skipping scan (%s)", e.what());
+    return false;
+  }
+  return true;
+}
 
-  // Adjust "ranges" to contain the same points
-  std::vector<float> rangesSparse;
-  rangesSparse.resize(sampledIndices.size());
-  for (unsigned int i = 0; i < rangesSparse.size(); i++)
+bool Particles::lookupTargetToBaseTransform(const std::string& targetFrame, const ros::Time& t,
+                                            geometry_msgs::TransformStamped& localTransform) const
+{
+  try
+  {
+    localTransform = _tfBuffer->lookupTransform(targetFrame, _baseLinkFrameID, t);
+  }
+  catch (tf2::TransformException& e)
+  {
+    ROS_WARN("Failed to lookup local transform %s ", e.what());
+    return false;
+  }
+  return true;
+}
+
+void Particles::setLastOdomPose(const geometry_msgs::PoseStamped& odomPose)
+{
+  _odometryReceived = true;
+  if (odomPose.header.stamp < _lastOdomPose.header.stamp)
+    ROS_WARN("Trying to store an OdomPose that is older than the current one, ignoring!");
+  else
+    _lastOdomPose = odomPose;
+}
+
+Eigen::Isometry3d Particles::computeOdomTransform(const geometry_msgs::PoseStamped& odomPose) const
+{
+  if (!_odometryReceived)
+    return Eigen::Isometry3d::Identity();
+
+  tf2::Transform lastOdom, currentOdom;
+  tf2::fromMsg(_lastOdomPose.pose, lastOdom);
+  tf2::fromMsg(odomPose.pose, currentOdom);
+  return toEigen(lastOdom.inverseTimes(currentOdom));
+}
+
+Eigen::Isometry3d Particles::toEigen(const tf2::Transform& transform)
+{
+  tf2::Quaternion q = transform.getRotation();
+  Eigen::Isometry3d result = Eigen::Isometry3d::Identity();
+  result.linear() = Eigen::Quaterniond(q.w(), q.x(), q.y(), q.z()).toRotationMatrix();
+  result.translation() =
+      Eigen::Vector3d(transform.getOrigin().x(), transform.getOrigin().y(), transform.getOrigin().z());
+  return result;
+}
+
+Eigen::Isometry3d Particles::toEigen(const geometry_msgs::Pose& pose)
+{
+  tf2::Transform transform;
+  tf2::fromMsg(pose, transform);
+  return toEigen(transform);
+}
+
+void Particles::readImu()
+{
+  std::pair<double, double> attitude;
+  if (!_imuAttitude.read(attitude))
+    return;
+  _imuReceived = true;
+  _imuRoll = attitude.first;
+  _imuPitch = attitude.second;
+}
+
+void Particles::getAttitude(double& roll, double& pitch) const
+{
+  roll = 0.0;
+  pitch = 0.0;
+  if (_attitudeFromImu && _imuReceived)
+  {
+    roll = _imuRoll;
+    pitch = _imuPitch;
+  }
+  else if (_odometryReceived)
   {
-    rangesSparse[i] = ranges[sampledIndices.points[i]];
+    DroneState odomState;
+    odomState.setPose(toEigen(_lastOdomPose.pose));
+    roll = odomState.getRoll();
+    pitch = odomState.getPitch();
   }
-  ranges = rangesSparse;
+}
+
+std::string Particles::resolveTopic(const std::string& name) const
+{
+  if (_ns.empty())
+    return name;
+  return name[0] == '/' ? _ns + name : _ns + "/" + name;
+}
 
-  ROS_DEBUG("Laser PointCloud: (%u out of valid range)", numBeamsSkipped);
+std::string Particles::resolveFrame(const std::string& frame) const
+{
+  if (_ns.empty())
+    return frame;
+  // tf2 frames have no leading slash
+  std::string prefix = _ns.substr(1) + "/";
+  return frame.compare(0, prefix.size(), prefix) == 0 ? frame : prefix + frame;
 }
 
 /******************************/
@@ -557,4 +1769,45 @@ bool Particles::isAboveMotionThreshold(const geometry_msgs::PoseStamped& odom_po
   return isAbove;
 }
 
+void Particles::focusMap(const geometry_msgs::PoseStamped& odomPose, double dt)
+{
+  if (!_mapModel->getTiledMap())
+    return;
+
+  // Odometry motion since the last step, in the base frame, then in the map frame of the best particle
+  tf2::Transform lastOdomPose, currentOdomPose;
+  tf2::convert(_lastOdomPose.pose, lastOdomPose);
+  tf2::convert(odomPose.pose, currentOdomPose);
+  tf2::Vector3 motion = lastOdomPose.getBasis().transpose() * (currentOdomPose.getOrigin() - lastOdomPose.getOrigin());
+  const DroneState& best = _pf->getBestState();
+  tf2::Quaternion rotation;
+  rotation.setRPY(best.getRoll(), best.getPitch(), best.getYaw());
+  motion = tf2::quatRotate(rotation, motion);
+
+  double min[3], max[3];
+  std::fill(min, min + 3, std::numeric_limits<double>::max());
+  std::fill(max, max + 3, -std::numeric_limits<double>::max());
+  for (unsigned int i = 0; i < _pf->numParticles(); i++)
+  {
+    const DroneState& state = _pf->getState(i);
+    double position[3] = { state.getXPos(), state.getYPos(), state.getZPos() };
+    for (int j = 0; j < 3; j++)
+    {
+      min[j] = std::min(min[j], position[j]);
+      max[j] = std::max(max[j], position[j]);
+    }
+  }
+
+  // The particles are moved by the motion before they are measured
+  double velocity[3];
+  for (int j = 0; j < 3; j++)
+  {
+    min[j] -= motion.length();
+    max[j] += motion.length();
+    velocity[j] = dt > 0 ? motion[j] / dt : 0.0;
+  }
+  // A shared map gets the window of this drone, the other drones keep looking theirs up while it is loaded
+  _mapModel->focus(min, max, velocity, _tileWindow.get());
+}
+
 }  // namespace pf
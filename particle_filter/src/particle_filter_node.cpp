@@ -24,9 +24,39 @@ int main(int argc, char** argv)
 {
   ros::init(argc, argv, "particle_filter_node");
 
-  pf::Particles particles;
+  // Several drones (/drones: their namespaces) are localized by one process, with one map and one thread pool
+  ros::NodeHandle nh;
+  std::vector<std::string> drones;
+  nh.getParam("/drones", drones);
+  if (drones.empty())
+  {
+    pf::Particles particles;
+
+    ros::spin();
+
+    return 0;
+  }
+
+  int numThreads;
+  nh.param<int>("/scheduler/threads", numThreads, 0);
+  pf::Particles::SharedResources shared;
+  shared.map.reset(new OccupancyMap(&nh));
+  shared.mapMutex.reset(new boost::shared_mutex());
+  shared.tfBuffer.reset(new tf2_ros::Buffer(ros::Duration(10), false));
+  tf2_ros::TransformListener tfListener(*shared.tfBuffer);
+  shared.scheduler.reset(new FilterScheduler(std::max(numThreads, 0)));
+  ROS_INFO("Localizing %zu drones with %u threads", drones.size(), shared.scheduler->numThreads());
+
+  std::vector<std::unique_ptr<pf::Particles> > filters;
+  for (unsigned int i = 0; i < drones.size(); i++)
+    filters.push_back(std::unique_ptr<pf::Particles>(new pf::Particles(drones[i], shared, i)));
 
   ros::spin();
 
+  FilterScheduler::Stats stats = shared.scheduler->getStats();
+  ROS_INFO("Scheduler: %lu steps, %lu stolen, %lu started after their deadline", (unsigned long)stats.executed,
+           (unsigned long)stats.stolen, (unsigned long)stats.missedDeadlines);
+  filters.clear();
+
   return 0;
 }
@@ -0,0 +1,79 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Stress check of LatestValue without ROS: one thread writes numbered values as fast as it can while another
+ * reads them. The reader must never see a torn value, never go back to an older one, and end with the last one.
+ *
+ *   latest_value_test
+ */
+#include <cstdio>
+#include <thread>
+
+#include "particle_filter/LatestValue.h"
+
+namespace
+{
+const long NUM_WRITES = 5000000;
+
+// Larger than a word, so that a torn copy shows as fields that differ
+struct Value
+{
+  long fields[8];
+};
+}  // namespace
+
+int main()
+{
+  LatestValue<Value> latest;
+  std::thread writer([&latest] {
+    Value value;
+    for (long i = 0; i < NUM_WRITES; i++)
+    {
+      for (int j = 0; j < 8; j++)
+        value.fields[j] = i;
+      latest.write(value);
+    }
+  });
+
+  long reads = 0, torn = 0, backwards = 0, last = -1;
+  Value value;
+  while (last < NUM_WRITES - 1)
+  {
+    if (!latest.read(value))
+      continue;
+    reads++;
+    for (int j = 1; j < 8; j++)
+    {
+      if (value.fields[j] != value.fields[0])
+      {
+        torn++;
+        break;
+      }
+    }
+    if (value.fields[0] < last)
+      backwards++;
+    last = value.fields[0];
+  }
+  writer.join();
+
+  std::printf("%ld reads of %ld writes: %ld torn, %ld older than the previous one\n", reads, NUM_WRITES, torn,
+              backwards);
+  return torn == 0 && backwards == 0 ? 0 : 1;
+}
@@ -0,0 +1,182 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Check of MapCache::applyChanges without ROS: random changes are applied in place to a cache in memory and to a
+ * memory mapped one, and to the octree they were built from. After every round, both caches must match a full
+ * rebuild of the octree with MapCache::build: cell states and distance field.
+ *
+ *   map_cache_update_test
+ */
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <octomap/OcTree.h>
+
+#include "particle_filter/MapCache.h"
+
+namespace
+{
+const double RESOLUTION = 0.1;
+// Cells of the test grid, whose first cell is at the origin
+const uint32_t GRID_SIZE[3] = { 60, 50, 20 };
+const float MAX_DISTANCE = 1.0f;
+const uint64_t SOURCE_CHECKSUM = 1;
+const unsigned int ROUNDS = 30;
+
+octomap::point3d cellCenter(uint32_t x, uint32_t y, uint32_t z)
+{
+  return octomap::point3d((x + 0.5) * RESOLUTION, (y + 0.5) * RESOLUTION, (z + 0.5) * RESOLUTION);
+}
+
+// Same as the map updates of the node
+void setCell(octomap::OcTree& tree, const octomap::point3d& point, uint8_t state)
+{
+  if (state == MapCache::UNKNOWN)
+    tree.deleteNode(point);
+  else
+    tree.setNodeValue(point, state == MapCache::OCCUPIED ? tree.getClampingThresMaxLog() :
+                                                           tree.getClampingThresMinLog(),
+                      true);
+}
+
+// The first and the last cell of the grid never change, so that the bounding box of the tree stays the same
+bool isPinned(uint32_t x, uint32_t y, uint32_t z)
+{
+  return (x == 0 && y == 0 && z == 0) ||
+         (x == GRID_SIZE[0] - 1 && y == GRID_SIZE[1] - 1 && z == GRID_SIZE[2] - 1);
+}
+
+uint8_t randomState(std::mt19937& rng)
+{
+  // Mostly free, like a real map
+  unsigned int r = rng() % 100;
+  return r < 5 ? MapCache::OCCUPIED : r < 20 ? MapCache::UNKNOWN : MapCache::FREE;
+}
+
+// First difference between an updated cache and the rebuilt one, empty if there is none
+std::string compare(const MapCache& updated, const MapCache& rebuilt)
+{
+  char text[256];
+  for (int axis = 0; axis < 3; axis++)
+  {
+    if (updated.size(axis) != rebuilt.size(axis))
+      return "grid size";
+  }
+  for (std::size_t i = 0; i < rebuilt.numCells(); i++)
+  {
+    if (updated.occupancy()[i] != rebuilt.occupancy()[i] || updated.distanceField()[i] != rebuilt.distanceField()[i])
+    {
+      std::snprintf(text, sizeof(text), "cell %zu: state %d distance %d, rebuilt state %d distance %d", i,
+                    updated.occupancy()[i], updated.distanceField()[i], rebuilt.occupancy()[i],
+                    rebuilt.distanceField()[i]);
+      return text;
+    }
+  }
+  return "";
+}
+}  // namespace
+
+int main()
+{
+  std::mt19937 rng(1);
+  octomap::OcTree tree(RESOLUTION);
+  for (uint32_t z = 0; z < GRID_SIZE[2]; z++)
+    for (uint32_t y = 0; y < GRID_SIZE[1]; y++)
+      for (uint32_t x = 0; x < GRID_SIZE[0]; x++)
+        setCell(tree, cellCenter(x, y, z), isPinned(x, y, z) ? uint8_t(MapCache::OCCUPIED) : randomState(rng));
+  tree.updateInnerOccupancy();
+
+  const std::string cachePath = "map_cache_update_test.cache";
+  std::string error;
+  MapCache inMemory, mapped, written;
+  if (!inMemory.build(tree, SOURCE_CHECKSUM, MAX_DISTANCE, "", error) ||
+      !written.build(tree, SOURCE_CHECKSUM, MAX_DISTANCE, cachePath, error) ||
+      !mapped.open(cachePath, SOURCE_CHECKSUM, MAX_DISTANCE, true, error))
+  {
+    std::fprintf(stderr, "Cannot build the cache: %s\n", error.c_str());
+    return 1;
+  }
+  std::remove(cachePath.c_str());
+
+  int failures = 0;
+  for (unsigned int round = 0; round < ROUNDS; round++)
+  {
+    // A few clustered changes, like a scan of an octomap server, and from time to time many scattered ones
+    bool scattered = round % 5 == 4;
+    unsigned int numChanges = scattered ? 2000 : 60;
+    uint32_t corner[3];
+    for (int axis = 0; axis < 3; axis++)
+      corner[axis] = rng() % GRID_SIZE[axis];
+
+    std::vector<MapCache::CellChange> changes;
+    for (unsigned int i = 0; i < numChanges; i++)
+    {
+      uint32_t cell[3];
+      for (int axis = 0; axis < 3; axis++)
+      {
+        cell[axis] = scattered ? rng() % GRID_SIZE[axis] :
+                                 std::min<uint32_t>(GRID_SIZE[axis] - 1, corner[axis] + rng() % 6);
+      }
+      if (isPinned(cell[0], cell[1], cell[2]))
+        continue;
+
+      // The cells of the cache are looked up like the node does, from the point of the change
+      octomap::point3d point = cellCenter(cell[0], cell[1], cell[2]);
+      uint32_t ix, iy, iz;
+      if (!inMemory.worldToCell(point.x(), point.y(), point.z(), ix, iy, iz))
+      {
+        std::fprintf(stderr, "Cell %u %u %u is outside of the cache\n", cell[0], cell[1], cell[2]);
+        return 1;
+      }
+      MapCache::CellChange change = { inMemory.index(ix, iy, iz), randomState(rng) };
+      changes.push_back(change);
+      setCell(tree, point, change.state);
+    }
+    tree.updateInnerOccupancy();
+
+    inMemory.applyChanges(changes);
+    mapped.applyChanges(changes);
+    MapCache rebuilt;
+    if (!rebuilt.build(tree, SOURCE_CHECKSUM, MAX_DISTANCE, "", error))
+    {
+      std::fprintf(stderr, "Cannot rebuild the cache: %s\n", error.c_str());
+      return 1;
+    }
+
+    std::string difference = compare(inMemory, rebuilt);
+    if (!difference.empty())
+    {
+      std::fprintf(stderr, "Round %u, cache in memory: %s\n", round, difference.c_str());
+      failures++;
+    }
+    difference = compare(mapped, rebuilt);
+    if (!difference.empty())
+    {
+      std::fprintf(stderr, "Round %u, mapped cache: %s\n", round, difference.c_str());
+      failures++;
+    }
+  }
+
+  std::printf("%u rounds of changes, %d mismatches with the rebuilt cache\n", ROUNDS, failures);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,180 @@
+/*
+* Copyright (c) 2019 Kosmas Tsiakas
+*
+* GNU GENERAL PUBLIC LICENSE
+*    Version 3, 29 June 2007
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Check of a tiled map shared by several drones, without ROS: two threads step at the same time over the same
+ * TiledMap, one with the window of the map and one with its own window, each with its look-ahead request, while a
+ * third one reads the statistics like the metrics do. Every ray must give the range of the same ray in a MapCache
+ * built from the same octree, however the tiles were loaded.
+ *
+ *   shared_tiles_test
+ */
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <octomap/OcTree.h>
+
+#include "particle_filter/MapCache.h"
+#include "particle_filter/TiledMap.h"
+
+namespace
+{
+const double RESOLUTION = 0.1;
+// Cells of the room, whose first cell is at the origin
+const uint32_t ROOM_SIZE[3] = { 128, 96, 24 };
+const float MAX_DISTANCE = 1.0f;
+const uint64_t SOURCE_CHECKSUM = 1;
+// Tiles of 8 cells, few enough in the cache that the drones evict each other's tiles
+const uint32_t TILE_BITS = 3;
+const unsigned int MAX_TILES = 200;
+const unsigned int STEPS = 400;
+const unsigned int RAYS = 32;
+const float MAX_RANGE = 6.0f;
+
+// Walls around the room and random pillars, free inside
+void buildRoom(octomap::OcTree& tree)
+{
+  std::mt19937 rng(1);
+  std::vector<bool> pillar(ROOM_SIZE[0] * ROOM_SIZE[1], false);
+  for (int i = 0; i < 40; i++)
+  {
+    uint32_t x = 4 + rng() % (ROOM_SIZE[0] - 8), y = 4 + rng() % (ROOM_SIZE[1] - 8);
+    for (uint32_t dy = 0; dy < 3; dy++)
+      for (uint32_t dx = 0; dx < 3; dx++)
+        pillar[(y + dy) * ROOM_SIZE[0] + x + dx] = true;
+  }
+
+  for (uint32_t z = 0; z < ROOM_SIZE[2]; z++)
+    for (uint32_t y = 0; y < ROOM_SIZE[1]; y++)
+      for (uint32_t x = 0; x < ROOM_SIZE[0]; x++)
+      {
+        bool wall = x == 0 || y == 0 || z == 0 || x == ROOM_SIZE[0] - 1 || y == ROOM_SIZE[1] - 1 ||
+                    z == ROOM_SIZE[2] - 1;
+        octomap::point3d point((x + 0.5) * RESOLUTION, (y + 0.5) * RESOLUTION, (z + 0.5) * RESOLUTION);
+        tree.setNodeValue(point, wall || pillar[y * ROOM_SIZE[0] + x] ? tree.getClampingThresMaxLog() :
+                                                                          tree.getClampingThresMinLog(),
+                          true);
+      }
+  tree.updateInnerOccupancy();
+}
+
+// One drone: flies a loop around the room, focusing a window on its position (the one of the map if mapWindow)
+void fly(TiledMap& tiles, const MapCache& reference, double phase, bool mapWindow, std::atomic<long>& rays,
+         std::atomic<long>& mismatches)
+{
+  TiledMap::Window window;
+  const TiledMap::Window* rayWindow = mapWindow ? NULL : &window;
+  const double center[2] = { 0.5 * ROOM_SIZE[0] * RESOLUTION, 0.5 * ROOM_SIZE[1] * RESOLUTION };
+  const double radius[2] = { 0.35 * ROOM_SIZE[0] * RESOLUTION, 0.35 * ROOM_SIZE[1] * RESOLUTION };
+  const double margin = 1.0, ahead = 1.5;
+  for (unsigned int step = 0; step < STEPS; step++)
+  {
+    double angle = phase + 2.0 * M_PI * step / STEPS;
+    double position[3] = { center[0] + radius[0] * std::cos(angle), center[1] + radius[1] * std::sin(angle),
+                           0.5 * ROOM_SIZE[2] * RESOLUTION };
+    double velocity[2] = { -std::sin(angle), std::cos(angle) };
+
+    double min[3], max[3], aheadMin[3], aheadMax[3];
+    for (int i = 0; i < 3; i++)
+    {
+      min[i] = position[i] - margin;
+      max[i] = position[i] + margin;
+      aheadMin[i] = min[i] + (i < 2 ? velocity[i] * ahead : 0.0);
+      aheadMax[i] = max[i] + (i < 2 ? velocity[i] * ahead : 0.0);
+    }
+    if (mapWindow)
+    {
+      tiles.setWindow(min, max);
+      tiles.prefetch(aheadMin, aheadMax);
+    }
+    else
+    {
+      tiles.setWindow(window, min, max);
+      tiles.prefetch(window, aheadMin, aheadMax);
+    }
+
+    for (unsigned int i = 0; i < RAYS; i++)
+    {
+      double yaw = 2.0 * M_PI * i / RAYS, pitch = 0.3 * std::sin(3.0 * yaw);
+      float direction[3] = { float(std::cos(pitch) * std::cos(yaw)), float(std::cos(pitch) * std::sin(yaw)),
+                             float(std::sin(pitch)) };
+      float range = 0.0f, expected = 0.0f;
+      bool hit = tiles.castRay(position[0], position[1], position[2], direction[0], direction[1], direction[2],
+                               MAX_RANGE, range, rayWindow);
+      bool expectedHit = reference.castRay(position[0], position[1], position[2], direction[0], direction[1],
+                                           direction[2], MAX_RANGE, expected);
+      rays++;
+      if (hit != expectedHit || (hit && std::fabs(range - expected) > 0.5 * RESOLUTION))
+        mismatches++;
+    }
+  }
+}
+}  // namespace
+
+int main()
+{
+  octomap::OcTree tree(RESOLUTION);
+  buildRoom(tree);
+
+  const std::string tilesPath = "shared_tiles_test.tiles";
+  std::string error;
+  MapCache reference;
+  TiledMap tiles;
+  if (!reference.build(tree, SOURCE_CHECKSUM, MAX_DISTANCE, "", error) ||
+      !TiledMap::build(tree, SOURCE_CHECKSUM, MAX_DISTANCE, TILE_BITS, tilesPath, error) ||
+      !tiles.open(tilesPath, SOURCE_CHECKSUM, MAX_DISTANCE, TILE_BITS, MAX_TILES, error))
+  {
+    std::fprintf(stderr, "Cannot build the map: %s\n", error.c_str());
+    return 1;
+  }
+  std::remove(tilesPath.c_str());
+
+  // Both drones take their first step together, like two filters sharing the map
+  std::atomic<long> rays(0), mismatches(0);
+  std::atomic<bool> flying(true);
+  std::thread first(fly, std::ref(tiles), std::cref(reference), 0.0, true, std::ref(rays), std::ref(mismatches));
+  std::thread second(fly, std::ref(tiles), std::cref(reference), M_PI, false, std::ref(rays),
+                     std::ref(mismatches));
+  std::size_t maxBytes = 0;
+  unsigned int maxWindowTiles = 0;
+  std::thread metrics([&] {
+    while (flying)
+    {
+      maxWindowTiles = std::max(maxWindowTiles, tiles.getStats().windowTiles);
+      maxBytes = std::max(maxBytes, tiles.residentBytes());
+    }
+  });
+  first.join();
+  second.join();
+  flying = false;
+  metrics.join();
+
+  TiledMap::Stats stats = tiles.getStats();
+  std::printf("%ld rays by 2 drones, %ld mismatches with the map cache; tiles: %lu loaded, %lu prefetched, "
+              "%lu evicted, up to %u in the window of the map and %zu bytes in memory\n",
+              rays.load(), mismatches.load(), (unsigned long)stats.loads, (unsigned long)stats.prefetched,
+              (unsigned long)stats.evictions, maxWindowTiles, maxBytes);
+  return mismatches == 0 ? 0 : 1;
+}